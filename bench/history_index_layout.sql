@@ -0,0 +1,92 @@
+--
+-- Compare the insert and range lookup cost of the two history indexes
+-- layouts supported by powa_history_index_layout().
+--
+-- Usage: psql -X -f bench/history_index_layout.sql <scratch database>
+--
+-- The data mimics powa_statements_history: every aggregation inserts one row
+-- per query, in time order.  Everything is done in temporary tables, so powa
+-- doesn't need to be installed.
+--
+
+\set nqueries 2000
+\set naggs 300
+\set nlookups 2000
+
+SET client_min_messages = notice;
+
+-- btree_gist is needed for the scalar column of the GiST index
+CREATE EXTENSION IF NOT EXISTS btree_gist;
+
+CREATE TEMP TABLE bench_params AS
+    SELECT :nqueries AS nqueries, :naggs AS naggs, :nlookups AS nlookups,
+        now() - interval '8 hours' * :naggs AS start_ts,
+        interval '8 hours' AS agg_interval;
+
+CREATE TEMP TABLE bench_gist (
+    queryid bigint NOT NULL,
+    coalesce_range tstzrange NOT NULL,
+    payload text NOT NULL
+);
+CREATE INDEX ON bench_gist USING gist (queryid, coalesce_range);
+
+CREATE TEMP TABLE bench_brin (LIKE bench_gist);
+CREATE INDEX ON bench_brin USING brin (lower(coalesce_range), upper(coalesce_range));
+CREATE INDEX ON bench_brin (queryid, upper(coalesce_range));
+
+DO $$
+DECLARE
+    p       record;
+    v_rel   text;
+    v_start timestamp with time zone;
+    v_from  timestamp with time zone;
+    v_n     bigint;
+    i       int;
+BEGIN
+    SELECT * INTO p FROM bench_params;
+
+    FOREACH v_rel IN ARRAY ARRAY['bench_gist', 'bench_brin'] LOOP
+        v_start := clock_timestamp();
+        FOR i IN 0 .. p.naggs - 1 LOOP
+            EXECUTE format('INSERT INTO %I
+                SELECT q, tstzrange($1, $2, ''[]''), repeat(''x'', 200)
+                FROM generate_series(1, $3) q', v_rel)
+            USING p.start_ts + p.agg_interval * i,
+                p.start_ts + p.agg_interval * (i + 1),
+                p.nqueries;
+        END LOOP;
+        RAISE NOTICE '% - insert of % rows: % ms', v_rel,
+            p.nqueries * p.naggs,
+            round(extract(epoch FROM clock_timestamp() - v_start)::numeric * 1000, 1);
+
+        EXECUTE format('ANALYZE %I', v_rel);
+        RAISE NOTICE '% - indexes size: %', v_rel,
+            pg_size_pretty(pg_indexes_size(v_rel::regclass));
+    END LOOP;
+
+    -- look up the last day of random queries, as the UI would do
+    FOREACH v_rel IN ARRAY ARRAY['bench_gist', 'bench_brin'] LOOP
+        PERFORM setseed(0.42);
+        v_start := clock_timestamp();
+        FOR i IN 1 .. p.nlookups LOOP
+            v_from := p.start_ts + p.agg_interval * (p.naggs - 3);
+            IF v_rel = 'bench_gist' THEN
+                EXECUTE 'SELECT count(*) FROM bench_gist
+                    WHERE queryid = $1
+                    AND coalesce_range && tstzrange($2, $3, ''[]'')'
+                INTO v_n
+                USING (random() * (p.nqueries - 1))::bigint + 1, v_from, now();
+            ELSE
+                EXECUTE 'SELECT count(*) FROM bench_brin
+                    WHERE queryid = $1
+                    AND upper(coalesce_range) >= $2
+                    AND lower(coalesce_range) <= $3'
+                INTO v_n
+                USING (random() * (p.nqueries - 1))::bigint + 1, v_from, now();
+            END IF;
+        END LOOP;
+        RAISE NOTICE '% - % range lookups: % ms', v_rel, p.nlookups,
+            round(extract(epoch FROM clock_timestamp() - v_start)::numeric * 1000, 1);
+    END LOOP;
+END;
+$$;
@@ -0,0 +1,128 @@
+#!/bin/sh
+#
+# Measure the cost of powa itself: the snapshots, aggregates, rollups and
+# purges, and the range queries done by the UI, on a synthetic
+# pg_stat_statements workload.
+#
+# Usage: make bench, or sh bench/run.sh
+#
+# The server must have powa and pg_stat_statements in
+# shared_preload_libraries, and pg_stat_statements.max must be at least
+# BENCH_STATEMENTS.  The usual libpq environment variables are used to
+# connect, as a superuser.
+#
+# BENCH_DATABASES scratch databases of BENCH_RELATIONS relations each are
+# created, and BENCH_STATEMENTS distinct statements are spread over them.
+# pgbench then keeps running these statements in the background, while
+# bench/snapshot.sql times powa in the BENCH_DB database.  powa is dropped
+# and created again in BENCH_DB, so it can't be the powa.database one.
+#
+
+set -e
+
+PSQL=${PSQL:-psql}
+PGBENCH=${PGBENCH:-pgbench}
+BENCH_DB=${BENCH_DB:-powa_bench}
+BENCH_STATEMENTS=${BENCH_STATEMENTS:-5000}
+BENCH_DATABASES=${BENCH_DATABASES:-10}
+BENCH_RELATIONS=${BENCH_RELATIONS:-100}
+BENCH_CLIENTS=${BENCH_CLIENTS:-1}
+BENCH_ROUNDS=${BENCH_ROUNDS:-5}
+BENCH_SNAPSHOTS=${BENCH_SNAPSHOTS:-20}
+BENCH_LOOKUPS=${BENCH_LOOKUPS:-50}
+
+BENCH_DIR=$(dirname "$0")
+SCRIPT=$(mktemp)
+PIDS=
+
+run_psql()
+{
+	$PSQL -X -q -v ON_ERROR_STOP=1 "$@"
+}
+
+cleanup()
+{
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	rm -f "$SCRIPT"
+}
+trap cleanup EXIT INT TERM
+
+create_db()
+{
+	if [ -z "$(run_psql -At -d postgres -c "SELECT 1 FROM pg_database WHERE datname = '$1'")" ]; then
+		run_psql -d postgres -c "CREATE DATABASE \"$1\""
+	fi
+}
+
+preload=$(run_psql -At -d postgres -c "SHOW shared_preload_libraries")
+for lib in powa pg_stat_statements; do
+	case ",$(echo "$preload" | tr -d ' ')," in
+		*,$lib,*) ;;
+		*) echo "$lib must be in shared_preload_libraries" >&2; exit 1 ;;
+	esac
+done
+
+if [ "$(run_psql -At -d postgres -c "SHOW powa.database")" = "$BENCH_DB" ]; then
+	echo "BENCH_DB can't be the powa.database one" >&2
+	exit 1
+fi
+
+# each database gets its share of the statements, up to 100 per relation
+nstatements=$(( (BENCH_STATEMENTS + BENCH_DATABASES - 1) / BENCH_DATABASES ))
+if [ $nstatements -gt $(( BENCH_RELATIONS * 100 )) ]; then
+	nstatements=$(( BENCH_RELATIONS * 100 ))
+fi
+
+echo "setting up $BENCH_DATABASES databases of $BENCH_RELATIONS relations, $nstatements statements each"
+
+create_db "$BENCH_DB"
+run_psql -d "$BENCH_DB" <<EOF
+SET client_min_messages = warning;
+DROP EXTENSION IF EXISTS powa;
+CREATE EXTENSION IF NOT EXISTS pg_stat_statements;
+CREATE EXTENSION IF NOT EXISTS btree_gist;
+CREATE EXTENSION powa;
+SELECT pg_stat_statements_reset();
+EOF
+
+# distinct statements only differ by the relation and the columns they use,
+# as the constants are normalized by pg_stat_statements
+cat > "$SCRIPT" <<EOF
+\set k random(0, $nstatements - 1)
+\set r :k % $BENCH_RELATIONS + 1
+\set x :k / $BENCH_RELATIONS % 10 + 1
+\set y :k / ($BENCH_RELATIONS * 10) % 10 + 1
+SELECT c:x FROM bench_rel_:r WHERE c:y = :k;
+EOF
+
+i=1
+while [ $i -le $BENCH_DATABASES ]; do
+	db="${BENCH_DB}_$i"
+	create_db "$db"
+	run_psql -d "$db" -v nrelations=$BENCH_RELATIONS -v nstatements=$nstatements >/dev/null <<'EOF'
+SELECT set_config('bench.nrelations', :'nrelations', false);
+
+DO $$
+BEGIN
+    FOR r IN 1 .. current_setting('bench.nrelations')::int LOOP
+        EXECUTE format('CREATE TABLE IF NOT EXISTS bench_rel_%s AS
+            SELECT %s FROM generate_series(1, 100) i', r,
+            (SELECT string_agg(format('i %% %s AS c%s', c, c), ', ')
+             FROM generate_series(1, 10) c));
+    END LOOP;
+END;
+$$;
+
+SELECT format('SELECT c%s FROM bench_rel_%s WHERE c%s = 1',
+        k / :nrelations % 10 + 1, k % :nrelations + 1,
+        k / (:nrelations * 10) % 10 + 1)
+FROM generate_series(0, :nstatements - 1) k \gexec
+EOF
+	$PGBENCH -n -c $BENCH_CLIENTS -T 86400 -f "$SCRIPT" "$db" >/dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	i=$(( i + 1 ))
+done
+
+run_psql -d "$BENCH_DB" -v nrounds=$BENCH_ROUNDS \
+	-v nsnapshots=$BENCH_SNAPSHOTS -v nlookups=$BENCH_LOOKUPS \
+	-f "$BENCH_DIR/snapshot.sql"
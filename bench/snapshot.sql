@@ -0,0 +1,201 @@
+--
+-- Time the snapshots, aggregates, rollups, purges and the UI range queries,
+-- and report for each of them the throughput, the latency percentiles, and
+-- the WAL generated and the growth of the powa tables per call.
+--
+-- Usage: psql -X -f bench/snapshot.sql <database with powa installed>
+--
+-- bench/run.sh sets up the workload this script expects, see there.  Each
+-- round takes nsnapshots snapshots, as if powa.coalesce was nsnapshots, then
+-- calls all the aggregate, rollup and purge functions, and runs nlookups of
+-- each UI query.  Every call is done in its own transaction.
+--
+-- It then checks that the double precision counters take less space in the
+-- history blocks than their raw 8 bytes.
+--
+
+\if :{?nrounds}
+\else
+\set nrounds 5
+\endif
+\if :{?nsnapshots}
+\else
+\set nsnapshots 20
+\endif
+\if :{?nlookups}
+\else
+\set nlookups 50
+\endif
+
+SET client_min_messages = warning;
+
+-- the aggregates and purges are timed on their own
+SET powa.coalesce = 2147483647;
+
+-- the first snapshot after CREATE EXTENSION would otherwise run the purges
+SELECT setval('powa_coalesce_sequence', greatest(last_value, 1))
+FROM powa_coalesce_sequence \gset
+
+CREATE TEMP TABLE bench_results (
+    kind text NOT NULL,
+    name text NOT NULL,
+    duration double precision NOT NULL,
+    wal numeric NOT NULL,
+    growth bigint NOT NULL
+);
+
+-- durations of each snapshot function, as reported by powa_take_snapshot()
+CREATE TEMP TABLE bench_steps (
+    name text NOT NULL,
+    duration double precision NOT NULL
+);
+
+CREATE FUNCTION pg_temp.bench_wal_lsn() RETURNS pg_lsn AS $$
+DECLARE
+    v_lsn pg_lsn;
+BEGIN
+    IF current_setting('server_version_num')::int >= 100000 THEN
+        EXECUTE 'SELECT pg_current_wal_insert_lsn()' INTO v_lsn;
+    ELSE
+        EXECUTE 'SELECT pg_current_xlog_insert_location()' INTO v_lsn;
+    END IF;
+    RETURN v_lsn;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION pg_temp.bench_size() RETURNS bigint AS $$
+    SELECT coalesce(sum(pg_total_relation_size(c.oid)), 0)::bigint
+    FROM pg_class c
+    WHERE c.relname LIKE 'powa\_%'
+    AND c.relkind = 'r'
+    AND c.relpersistence != 't';
+$$ LANGUAGE sql;
+
+CREATE FUNCTION pg_temp.bench_run(_kind text, _name text, _query text)
+RETURNS void AS $$
+DECLARE
+    v_lsn   pg_lsn;
+    v_size  bigint;
+    v_start timestamp with time zone;
+BEGIN
+    v_lsn := pg_temp.bench_wal_lsn();
+    v_size := pg_temp.bench_size();
+    v_start := clock_timestamp();
+
+    EXECUTE _query;
+
+    INSERT INTO bench_results VALUES (_kind, _name,
+        extract(epoch FROM clock_timestamp() - v_start) * 1000,
+        pg_temp.bench_wal_lsn() - v_lsn,
+        pg_temp.bench_size() - v_size);
+END;
+$$ LANGUAGE plpgsql;
+
+-- the range queries done by the UI, for the last hour
+CREATE TEMP TABLE bench_lookups AS
+    SELECT 'powa_statements_history_range' AS name,
+        'SELECT count(*) FROM powa_statements_history_range(
+            ARRAY(SELECT queryid FROM powa_statements
+                  ORDER BY random() LIMIT 10),
+            tstzrange(now() - interval ''1 hour'', now(), ''[]''),
+            interval ''1 minute'')' AS query
+    UNION ALL
+    SELECT 'database history',
+        format('SELECT count(*) FROM (SELECT oid FROM powa_databases
+                ORDER BY random() LIMIT 1) d,
+            LATERAL (SELECT 1 FROM powa_statements_history_db h
+                WHERE h.dbid = d.oid AND %s
+                UNION ALL
+                SELECT 1 FROM powa_statements_history_current_db c
+                WHERE c.dbid = d.oid
+                AND (c.record).ts >= now() - interval ''1 hour'') s',
+            -- the brin layout needs explicit bound predicates
+            CASE WHEN EXISTS (SELECT 1
+                FROM pg_index i
+                JOIN pg_class c ON c.oid = i.indexrelid
+                JOIN pg_am am ON am.oid = c.relam
+                WHERE i.indrelid = 'powa_statements_history_db'::regclass
+                AND am.amname = 'brin')
+            THEN 'upper(h.coalesce_range) >= now() - interval ''1 hour''
+                AND lower(h.coalesce_range) <= now()'
+            ELSE 'h.coalesce_range && tstzrange(now() - interval ''1 hour'',
+                now(), ''[]'')'
+            END);
+
+SELECT format('SELECT pg_temp.bench_run(%L, %L, %L)', kind, name, query)
+FROM (
+    SELECT r, 1 AS ord, i AS sub, 'snapshot' AS kind,
+        'powa_take_snapshot' AS name,
+        'INSERT INTO bench_steps
+            SELECT function_name, duration
+            FROM powa_take_snapshot(NULL::text[])' AS query
+    FROM generate_series(1, :nrounds) r, generate_series(1, :nsnapshots) i
+    UNION ALL
+    SELECT r, 2,
+        CASE f.operation WHEN 'aggregate' THEN 1 WHEN 'rollup' THEN 2 ELSE 3 END,
+        f.operation, f.function_name, format('SELECT %I()', f.function_name)
+    FROM generate_series(1, :nrounds) r, powa_functions f
+    WHERE f.enabled
+    AND f.operation IN ('aggregate', 'rollup', 'purge')
+    UNION ALL
+    SELECT r, 3, i, 'lookup', l.name, l.query
+    FROM generate_series(1, :nrounds) r, generate_series(1, :nlookups) i,
+        bench_lookups l
+) s
+ORDER BY r, ord, sub, name \gexec
+
+\echo
+\echo pg_stat_statements entries
+SELECT count(*) AS entries FROM pg_stat_statements;
+
+\echo
+\echo per call cost, durations in ms, WAL and growth of the powa tables in bytes
+SELECT kind, name, count(*) AS calls,
+    round((count(*) / (sum(duration) / 1000))::numeric, 1) AS calls_per_s,
+    round(percentile_cont(0.5) WITHIN GROUP (ORDER BY duration)::numeric, 2) AS p50,
+    round(percentile_cont(0.9) WITHIN GROUP (ORDER BY duration)::numeric, 2) AS p90,
+    round(percentile_cont(0.99) WITHIN GROUP (ORDER BY duration)::numeric, 2) AS p99,
+    round(max(duration)::numeric, 2) AS max,
+    round(avg(wal)) AS wal,
+    round(avg(growth)) AS growth
+FROM bench_results
+GROUP BY kind, name
+ORDER BY min(CASE kind WHEN 'snapshot' THEN 1 WHEN 'aggregate' THEN 2
+    WHEN 'rollup' THEN 3 WHEN 'purge' THEN 4 ELSE 5 END), name;
+
+\echo
+\echo snapshot functions, durations in ms
+SELECT name, count(*) AS calls,
+    round(percentile_cont(0.5) WITHIN GROUP (ORDER BY duration)::numeric, 2) AS p50,
+    round(percentile_cont(0.9) WITHIN GROUP (ORDER BY duration)::numeric, 2) AS p90,
+    round(percentile_cont(0.99) WITHIN GROUP (ORDER BY duration)::numeric, 2) AS p99,
+    round(max(duration)::numeric, 2) AS max
+FROM bench_steps
+GROUP BY name
+ORDER BY name;
+
+\echo
+\echo powa tables size
+SELECT pg_size_pretty(pg_temp.bench_size()) AS size;
+
+\echo
+\echo history blocks of the timestamps and double precision counters, in bytes
+CREATE TEMP TABLE bench_floats AS
+    SELECT sum(powa_statements_history_block_count(h.records)) * 4 * 8 AS raw,
+        sum(pg_column_size(powa_statements_history_block(ARRAY(
+            SELECT ROW(r.ts, NULL, r.total_time, NULL, NULL, NULL, NULL, NULL,
+                NULL, NULL, NULL, NULL, NULL, NULL, r.blk_read_time,
+                r.blk_write_time)::powa_statements_history_record
+            FROM unnest(h.records) r)))) AS encoded
+    FROM powa_statements_history h;
+
+SELECT raw, encoded, round(encoded::numeric / nullif(raw, 0), 3) AS ratio
+FROM bench_floats;
+
+DO $$
+BEGIN
+    IF (SELECT encoded >= raw FROM bench_floats) THEN
+        RAISE EXCEPTION 'the double precision counters are not compressed';
+    END IF;
+END;
+$$;
@@ -0,0 +1,2593 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+--\echo Use "ALTER EXTENSION powa" to load this file. \quit
+
+SET statement_timeout = 0;
+SET client_encoding = 'UTF8';
+SET standard_conforming_strings = on;
+SET client_min_messages = warning;
+SET escape_string_warning = off;
+SET search_path = public, pg_catalog;
+
+/* native implementation of the - and / operators */
+CREATE OR REPLACE FUNCTION powa_statements_history_mi(
+    a powa_statements_history_record,
+    b powa_statements_history_record)
+RETURNS powa_statements_history_diff
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_mi';
+
+CREATE OR REPLACE FUNCTION powa_statements_history_div(
+    a powa_statements_history_record,
+    b powa_statements_history_record)
+RETURNS powa_statements_history_rate
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_div';
+
+CREATE OR REPLACE FUNCTION powa_user_functions_history_mi(
+    a powa_user_functions_history_record,
+    b powa_user_functions_history_record)
+RETURNS powa_user_functions_history_diff
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_user_functions_history_mi';
+
+CREATE OR REPLACE FUNCTION powa_user_functions_history_div(
+    a powa_user_functions_history_record,
+    b powa_user_functions_history_record)
+RETURNS powa_user_functions_history_rate
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_user_functions_history_div';
+
+CREATE OR REPLACE FUNCTION powa_all_relations_history_mi(
+    a powa_all_relations_history_record,
+    b powa_all_relations_history_record)
+RETURNS powa_all_relations_history_diff
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_all_relations_history_mi';
+
+CREATE OR REPLACE FUNCTION powa_all_relations_history_div(
+    a powa_all_relations_history_record,
+    b powa_all_relations_history_record)
+RETURNS powa_all_relations_history_rate
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_all_relations_history_div';
+
+CREATE OR REPLACE FUNCTION powa_kcache_mi(
+    a kcache_type,
+    b kcache_type)
+RETURNS powa_kcache_diff
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_kcache_mi';
+
+CREATE OR REPLACE FUNCTION powa_kcache_div(
+    a kcache_type,
+    b kcache_type)
+RETURNS powa_kcache_rate
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_kcache_div';
+
+CREATE OR REPLACE FUNCTION powa_qualstats_history_mi(
+    a powa_qualstats_history_item,
+    b powa_qualstats_history_item)
+RETURNS powa_qualstats_history_diff
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_qualstats_history_mi';
+
+CREATE OR REPLACE FUNCTION powa_qualstats_history_div(
+    a powa_qualstats_history_item,
+    b powa_qualstats_history_item)
+RETURNS powa_qualstats_history_rate
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_qualstats_history_div';
+
+/* pg_stat_statements columnar history storage */
+CREATE TYPE powa_statements_history_block;
+
+CREATE FUNCTION powa_statements_history_block_in(cstring)
+RETURNS powa_statements_history_block
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_in';
+
+CREATE FUNCTION powa_statements_history_block_out(powa_statements_history_block)
+RETURNS cstring
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_out';
+
+CREATE FUNCTION powa_statements_history_block_recv(internal)
+RETURNS powa_statements_history_block
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_recv';
+
+CREATE FUNCTION powa_statements_history_block_send(powa_statements_history_block)
+RETURNS bytea
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_send';
+
+CREATE TYPE powa_statements_history_block (
+    INPUT = powa_statements_history_block_in,
+    OUTPUT = powa_statements_history_block_out,
+    RECEIVE = powa_statements_history_block_recv,
+    SEND = powa_statements_history_block_send,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = int4,
+    STORAGE = extended
+);
+
+CREATE FUNCTION powa_statements_history_block(
+    records powa_statements_history_record[])
+RETURNS powa_statements_history_block
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block';
+
+CREATE FUNCTION powa_statements_history_block_records(
+    block powa_statements_history_block)
+RETURNS powa_statements_history_record[]
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_records';
+
+CREATE CAST (powa_statements_history_record[] AS powa_statements_history_block)
+    WITH FUNCTION powa_statements_history_block(powa_statements_history_record[])
+    AS ASSIGNMENT;
+
+CREATE CAST (powa_statements_history_block AS powa_statements_history_record[])
+    WITH FUNCTION powa_statements_history_block_records(powa_statements_history_block);
+
+CREATE FUNCTION unnest(block powa_statements_history_block)
+RETURNS SETOF powa_statements_history_record
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_unnest';
+
+CREATE FUNCTION powa_statements_history_block_count(
+    block powa_statements_history_block)
+RETURNS integer
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_count';
+
+CREATE FUNCTION powa_statements_history_block_first(
+    block powa_statements_history_block)
+RETURNS powa_statements_history_record
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_first';
+
+CREATE FUNCTION powa_statements_history_block_last(
+    block powa_statements_history_block)
+RETURNS powa_statements_history_record
+LANGUAGE c IMMUTABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_block_last';
+
+/*
+ * Aggregates used by the aggregate functions: powa_statements_history_block_agg()
+ * builds a block from a set of records, and powa_records_agg() is an
+ * array_agg() that can run in parallel even before PostgreSQL 16.  Both can
+ * run in parallel on PostgreSQL 9.6 and above.
+ */
+DO $_$
+DECLARE
+    v_fparallel text := '';
+    v_bparallel text := '';
+    v_rparallel text := '';
+BEGIN
+    IF current_setting('server_version_num')::int >= 90600 THEN
+        v_fparallel := ' PARALLEL SAFE';
+        v_bparallel := ', COMBINEFUNC = powa_statements_history_block_agg_combine,'
+            ' SERIALFUNC = powa_statements_history_block_agg_serialize,'
+            ' DESERIALFUNC = powa_statements_history_block_agg_deserialize,'
+            ' PARALLEL = SAFE';
+        v_rparallel := ', COMBINEFUNC = powa_records_agg_combine,'
+            ' SERIALFUNC = powa_records_agg_serialize,'
+            ' DESERIALFUNC = powa_records_agg_deserialize,'
+            ' PARALLEL = SAFE';
+    END IF;
+
+    EXECUTE format('CREATE FUNCTION powa_statements_history_block_agg_trans(
+            internal, powa_statements_history_record)
+        RETURNS internal LANGUAGE c IMMUTABLE%s
+        AS %L, %L', v_fparallel,
+        '$libdir/powa', 'powa_statements_history_block_agg_trans');
+    EXECUTE format('CREATE FUNCTION powa_statements_history_block_agg_final(internal)
+        RETURNS powa_statements_history_block LANGUAGE c IMMUTABLE%s
+        AS %L, %L', v_fparallel,
+        '$libdir/powa', 'powa_statements_history_block_agg_final');
+    EXECUTE format('CREATE FUNCTION powa_statements_history_block_agg_combine(internal, internal)
+        RETURNS internal LANGUAGE c IMMUTABLE%s
+        AS %L, %L', v_fparallel,
+        '$libdir/powa', 'powa_statements_history_block_agg_combine');
+    EXECUTE format('CREATE FUNCTION powa_statements_history_block_agg_serialize(internal)
+        RETURNS bytea LANGUAGE c IMMUTABLE STRICT%s
+        AS %L, %L', v_fparallel,
+        '$libdir/powa', 'powa_statements_history_block_agg_serialize');
+    EXECUTE format('CREATE FUNCTION powa_statements_history_block_agg_deserialize(bytea, internal)
+        RETURNS internal LANGUAGE c IMMUTABLE STRICT%s
+        AS %L, %L', v_fparallel,
+        '$libdir/powa', 'powa_statements_history_block_agg_deserialize');
+
+    EXECUTE format('CREATE AGGREGATE powa_statements_history_block_agg(powa_statements_history_record) (
+            SFUNC = powa_statements_history_block_agg_trans,
+            STYPE = internal,
+            FINALFUNC = powa_statements_history_block_agg_final%s
+        )', v_bparallel);
+
+    -- the transition and final functions are the ones of array_agg()
+    EXECUTE format('CREATE FUNCTION powa_records_agg_trans(internal, anynonarray)
+        RETURNS internal LANGUAGE internal IMMUTABLE%s
+        AS %L', v_fparallel, 'array_agg_transfn');
+    EXECUTE format('CREATE FUNCTION powa_records_agg_final(internal, anynonarray)
+        RETURNS anyarray LANGUAGE internal IMMUTABLE%s
+        AS %L', v_fparallel, 'array_agg_finalfn');
+    EXECUTE format('CREATE FUNCTION powa_records_agg_combine(internal, internal)
+        RETURNS internal LANGUAGE c IMMUTABLE%s
+        AS %L, %L', v_fparallel, '$libdir/powa', 'powa_records_agg_combine');
+    EXECUTE format('CREATE FUNCTION powa_records_agg_serialize(internal)
+        RETURNS bytea LANGUAGE c IMMUTABLE STRICT%s
+        AS %L, %L', v_fparallel, '$libdir/powa', 'powa_records_agg_serialize');
+    EXECUTE format('CREATE FUNCTION powa_records_agg_deserialize(bytea, internal)
+        RETURNS internal LANGUAGE c IMMUTABLE STRICT%s
+        AS %L, %L', v_fparallel, '$libdir/powa', 'powa_records_agg_deserialize');
+
+    EXECUTE format('CREATE AGGREGATE powa_records_agg(anynonarray) (
+            SFUNC = powa_records_agg_trans,
+            STYPE = internal,
+            FINALFUNC = powa_records_agg_final,
+            FINALFUNC_EXTRA%s
+        )', v_rparallel);
+END;
+$_$;
+/* end of pg_stat_statements columnar history storage */
+
+ALTER TABLE powa_statements_history
+    ALTER COLUMN records TYPE powa_statements_history_block
+    USING powa_statements_history_block(records);
+
+ALTER TABLE powa_statements_history_db
+    ALTER COLUMN records TYPE powa_statements_history_block
+    USING powa_statements_history_block(records);
+
+CREATE FUNCTION powa_statements_aggregate_native()
+    RETURNS bigint
+    LANGUAGE c
+AS '$libdir/powa', 'powa_statements_aggregate_native';
+
+CREATE FUNCTION powa_statements_stream_reset()
+    RETURNS void
+    LANGUAGE c
+AS '$libdir/powa', 'powa_statements_stream_reset';
+
+CREATE FUNCTION powa_statements_stream_invalidate()
+    RETURNS void
+    LANGUAGE c
+AS '$libdir/powa', 'powa_statements_stream_invalidate';
+
+CREATE OR REPLACE FUNCTION powa_statements_aggregate() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_statements_aggregate';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- flush the running aggregates of the native snapshot if they can be
+    -- used, otherwise aggregate the whole *_current tables
+    IF current_setting('powa.streaming_aggregate')::boolean THEN
+        v_rowcount := powa_statements_aggregate_native();
+
+        IF v_rowcount >= 0 THEN
+            perform powa_log(format('%I (streaming) - rowcount: %s',
+                    v_funcname, v_rowcount));
+
+            RETURN;
+        END IF;
+    END IF;
+
+    -- aggregate statements table
+    LOCK TABLE powa_statements_history_current IN SHARE MODE; -- prevent any other update
+
+    v_rowcount := powa_aggregate_history('powa_statements_history',
+        'SELECT queryid, dbid, userid,
+            tstzrange(min((record).ts), max((record).ts), ''[]''),
+            powa_statements_history_block_agg(record),
+            powa_statements_history_record_min(record),
+            powa_statements_history_record_max(record)
+        FROM powa_statements_history_current
+        GROUP BY queryid, dbid, userid');
+
+    perform powa_log(format('%I (powa_statements_history) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_statements_history_current;
+
+    -- aggregate db table
+    LOCK TABLE powa_statements_history_current_db IN SHARE MODE; -- prevent any other update
+
+    v_rowcount := powa_aggregate_history('powa_statements_history_db',
+        'SELECT dbid,
+            tstzrange(min((record).ts), max((record).ts), ''[]''),
+            powa_statements_history_block_agg(record),
+            powa_statements_history_record_min(record),
+            powa_statements_history_record_max(record)
+        FROM powa_statements_history_current_db
+        GROUP BY dbid');
+
+    perform powa_log(format('%I (powa_statements_history_db) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_statements_history_current_db;
+
+    -- the running aggregates can be trusted again
+    PERFORM powa_statements_stream_reset();
+ END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_statements_aggregate */
+
+/* native snapshot */
+/* keys already stored in powa_statements and powa_qualstats_quals */
+CREATE FUNCTION powa_statements_known(queryid bigint, dbid oid, userid oid)
+    RETURNS boolean
+    LANGUAGE c VOLATILE STRICT COST 1
+AS '$libdir/powa', 'powa_statements_known';
+
+CREATE FUNCTION powa_qualstats_quals_known(qualid bigint, queryid bigint,
+    dbid oid, userid oid)
+    RETURNS boolean
+    LANGUAGE c VOLATILE STRICT COST 1
+AS '$libdir/powa', 'powa_qualstats_quals_known';
+
+CREATE FUNCTION powa_qualstats_sketch_add(qualid bigint, queryid bigint,
+    dbid oid, userid oid, constvalues text[], occurences bigint,
+    execution_count bigint, nbfiltered bigint)
+    RETURNS boolean
+    LANGUAGE c VOLATILE COST 1
+AS '$libdir/powa', 'powa_qualstats_sketch_add';
+
+CREATE FUNCTION powa_qualstats_constvalues_sketch(OUT qualid bigint,
+    OUT queryid bigint,
+    OUT dbid oid,
+    OUT userid oid,
+    OUT coalesce_range tstzrange,
+    OUT most_used qual_values[],
+    OUT most_filtering qual_values[],
+    OUT least_filtering qual_values[],
+    OUT most_executed qual_values[])
+    RETURNS SETOF record
+    LANGUAGE c
+AS '$libdir/powa', 'powa_qualstats_constvalues_sketch';
+
+CREATE FUNCTION powa_qualstats_sketch_reset()
+    RETURNS void
+    LANGUAGE c
+AS '$libdir/powa', 'powa_qualstats_sketch_reset';
+
+CREATE FUNCTION powa_statements_snapshot_native(ignore_regexp text)
+    RETURNS bigint
+    LANGUAGE c
+AS '$libdir/powa', 'powa_statements_snapshot_native';
+
+CREATE OR REPLACE FUNCTION powa_statements_snapshot() RETURNS void AS $PROC$
+DECLARE
+    result boolean;
+    ignore_regexp text :='^[[:space:]]*(DEALLOCATE|BEGIN|PREPARE TRANSACTION|COMMIT PREPARED|ROLLBACK PREPARED)';
+    v_funcname    text := 'powa_statements_snapshot';
+    v_rowcount    bigint;
+BEGIN
+    -- In this function, we capture statements, and also aggregate counters by database
+    -- so that the first screens of powa stay reactive even though there may be thousands
+    -- of different statements
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    IF current_setting('powa.native_snapshot')::boolean THEN
+        v_rowcount := powa_statements_snapshot_native(ignore_regexp);
+
+        perform powa_log(format('%I (native) - rowcount: %s',
+                v_funcname, v_rowcount));
+
+        RETURN;
+    END IF;
+
+    WITH capture AS(
+        SELECT pgss.*
+        FROM pg_stat_statements pgss
+        WHERE pgss.query !~* ignore_regexp
+        AND NOT powa_is_ignored_user(pgss.userid)
+    ),
+
+    -- only the statements missing from the known statements cache of this
+    -- backend are looked up
+    missing AS(
+        SELECT queryid, dbid, userid, query, md5(query)::uuid AS query_md5
+            FROM capture c
+            WHERE NOT powa_statements_known(c.queryid, c.dbid, c.userid)
+            AND NOT EXISTS (SELECT 1
+                              FROM powa_statements_base ps
+                              WHERE ps.queryid = c.queryid
+                              AND ps.dbid = c.dbid
+                              AND ps.userid = c.userid
+            )
+    ),
+
+    missing_texts AS(
+        INSERT INTO powa_statements_texts (query_md5, query)
+            SELECT DISTINCT query_md5, query
+            FROM missing m
+            WHERE NOT EXISTS (SELECT 1
+                              FROM powa_statements_texts pt
+                              WHERE pt.query_md5 = m.query_md5
+            )
+    ),
+
+    missing_statements AS(
+        INSERT INTO powa_statements_base (queryid, dbid, userid, query_md5)
+            SELECT queryid, dbid, userid, query_md5
+            FROM missing
+    ),
+
+    by_query AS (
+        INSERT INTO powa_statements_history_current
+            SELECT queryid, dbid, userid,
+            ROW(
+                now(), calls, total_time, rows, shared_blks_hit, shared_blks_read,
+                shared_blks_dirtied, shared_blks_written, local_blks_hit, local_blks_read,
+                local_blks_dirtied, local_blks_written, temp_blks_read, temp_blks_written,
+                blk_read_time, blk_write_time
+            )::powa_statements_history_record AS record
+            FROM capture
+    ),
+
+    by_database AS (
+        INSERT INTO powa_statements_history_current_db
+            SELECT dbid,
+            ROW(
+                now(), sum(calls), sum(total_time), sum(rows), sum(shared_blks_hit), sum(shared_blks_read),
+                sum(shared_blks_dirtied), sum(shared_blks_written), sum(local_blks_hit), sum(local_blks_read),
+                sum(local_blks_dirtied), sum(local_blks_written), sum(temp_blks_read), sum(temp_blks_written),
+                sum(blk_read_time), sum(blk_write_time)
+            )::powa_statements_history_record AS record
+            FROM capture
+            GROUP BY dbid
+    )
+
+    SELECT count(*) INTO v_rowcount
+    FROM capture;
+
+    -- the running aggregates of the native snapshot didn't see those records
+    PERFORM powa_statements_stream_invalidate();
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    result := true; -- For now we don't care. What could we do on error except crash anyway?
+END;
+$PROC$ language plpgsql; /* end of powa_statements_snapshot */
+
+CREATE FUNCTION powa_kcache_snapshot_native()
+    RETURNS bigint
+    LANGUAGE c
+AS '$libdir/powa', 'powa_kcache_snapshot_native';
+
+CREATE OR REPLACE FUNCTION powa_kcache_snapshot() RETURNS void as $PROC$
+DECLARE
+  result bool;
+    v_funcname    text := 'powa_kcache_snapshot';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    IF current_setting('powa.native_snapshot')::boolean THEN
+        v_rowcount := powa_kcache_snapshot_native();
+
+        perform powa_log(format('%I (native) - rowcount: %s',
+                v_funcname, v_rowcount));
+
+        RETURN;
+    END IF;
+
+    WITH capture AS (
+        SELECT *
+        FROM pg_stat_kcache() k
+        WHERE NOT powa_is_ignored_user(k.userid)
+    ),
+
+    by_query AS (
+        INSERT INTO powa_kcache_metrics_current (queryid, dbid, userid, metrics)
+            SELECT queryid, dbid, userid, (now(), reads, writes, user_time, system_time)::kcache_type
+            FROM capture
+    ),
+
+    by_database AS (
+        INSERT INTO powa_kcache_metrics_current_db (dbid, metrics)
+            SELECT dbid, (now(), sum(reads), sum(writes), sum(user_time), sum(system_time))::kcache_type
+            FROM capture
+            GROUP BY dbid
+    )
+
+    SELECT COUNT(*) into v_rowcount
+    FROM capture;
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    result := true;
+END
+$PROC$ language plpgsql; /* end of powa_kcache_unregister */
+
+CREATE FUNCTION powa_all_relations_snapshot_native()
+    RETURNS bigint
+    LANGUAGE c
+AS '$libdir/powa', 'powa_all_relations_snapshot_native';
+
+CREATE OR REPLACE FUNCTION powa_all_relations_snapshot() RETURNS void AS $PROC$
+DECLARE
+    result boolean;
+    v_funcname    text := 'powa_all_relations_snapshot';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    IF current_setting('powa.native_snapshot')::boolean THEN
+        v_rowcount := powa_all_relations_snapshot_native();
+
+        perform powa_log(format('%I (native) - rowcount: %s',
+                v_funcname, v_rowcount));
+
+        RETURN;
+    END IF;
+
+    -- Insert cluster-wide relation statistics
+    IF current_setting('powa.stat_collection') = 'parallel' THEN
+        INSERT INTO powa_all_relations_history_current
+            SELECT dbid, relid,
+            ROW(now(), numscan, tup_returned, tup_fetched,
+                n_tup_ins, n_tup_upd, n_tup_del, n_tup_hot_upd,
+                n_liv_tup, n_dead_tup, n_mod_since_analyze,
+                blks_read, blks_hit, last_vacuum, vacuum_count,
+                last_autovacuum, autovacuum_count, last_analyze,
+                analyze_count, last_autoanalyze,
+                autoanalyze_count)::powa_all_relations_history_record AS record
+            FROM powa_stat_all_rel_parallel();
+    ELSIF current_setting('powa.stat_collection') = 'cluster' THEN
+        INSERT INTO powa_all_relations_history_current
+            SELECT dbid, relid,
+            ROW(now(), numscan, tup_returned, tup_fetched,
+                n_tup_ins, n_tup_upd, n_tup_del, n_tup_hot_upd,
+                n_liv_tup, n_dead_tup, n_mod_since_analyze,
+                blks_read, blks_hit, last_vacuum, vacuum_count,
+                last_autovacuum, autovacuum_count, last_analyze,
+                analyze_count, last_autoanalyze,
+                autoanalyze_count)::powa_all_relations_history_record AS record
+            FROM powa_stat_all_rel_cluster();
+    ELSE
+        WITH rel(dbid, r) AS (
+            SELECT oid,
+                powa_stat_all_rel(oid)
+            FROM pg_database
+        )
+        INSERT INTO powa_all_relations_history_current
+            SELECT dbid, (r).relid,
+            ROW(now(),(r).numscan, (r).tup_returned, (r).tup_fetched,
+                (r).n_tup_ins, (r).n_tup_upd, (r).n_tup_del, (r).n_tup_hot_upd,
+                (r).n_liv_tup, (r).n_dead_tup, (r).n_mod_since_analyze,
+                (r).blks_read, (r).blks_hit, (r).last_vacuum, (r).vacuum_count,
+            (r).last_autovacuum, (r).autovacuum_count, (r).last_analyze,
+                (r).analyze_count, (r).last_autoanalyze,
+                (r).autoanalyze_count)::powa_all_relations_history_record AS record
+            FROM rel;
+    END IF;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    result := true;
+END;
+$PROC$ language plpgsql; /* end of powa_all_relations_snapshot */
+
+/* recent pg_stat_statements samples kept in shared memory */
+CREATE FUNCTION powa_recent_samples(IN dbid oid,
+    OUT queryid bigint,
+    OUT userid oid,
+    OUT record powa_statements_history_record)
+    RETURNS SETOF record
+    LANGUAGE c COST 100
+AS '$libdir/powa', 'powa_recent_samples';
+
+CREATE FUNCTION powa_recent_samples_db(
+    OUT dbid oid,
+    OUT record powa_statements_history_record)
+    RETURNS SETOF record
+    LANGUAGE c COST 100
+AS '$libdir/powa', 'powa_recent_samples_db';
+
+/* parallel stats collection */
+CREATE FUNCTION powa_stat_user_functions_parallel(OUT dbid oid,
+    OUT funcid oid,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT self_time double precision)
+    RETURNS SETOF record
+    LANGUAGE c COST 1000
+AS '$libdir/powa', 'powa_stat_user_functions_parallel';
+
+CREATE FUNCTION powa_stat_all_rel_parallel(OUT dbid oid,
+    OUT relid oid,
+    OUT numscan bigint,
+    OUT tup_returned bigint,
+    OUT tup_fetched bigint,
+    OUT n_tup_ins bigint,
+    OUT n_tup_upd bigint,
+    OUT n_tup_del bigint,
+    OUT n_tup_hot_upd bigint,
+    OUT n_liv_tup bigint,
+    OUT n_dead_tup bigint,
+    OUT n_mod_since_analyze bigint,
+    OUT blks_read bigint,
+    OUT blks_hit bigint,
+    OUT last_vacuum timestamp with time zone,
+    OUT vacuum_count bigint,
+    OUT last_autovacuum timestamp with time zone,
+    OUT autovacuum_count bigint,
+    OUT last_analyze timestamp with time zone,
+    OUT analyze_count bigint,
+    OUT last_autoanalyze timestamp with time zone,
+    OUT autoanalyze_count bigint)
+    RETURNS SETOF record
+    LANGUAGE c COST 1000
+AS '$libdir/powa', 'powa_stat_all_rel_parallel';
+
+CREATE FUNCTION powa_stat_user_functions_cluster(OUT dbid oid,
+    OUT funcid oid,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT self_time double precision)
+    RETURNS SETOF record
+    LANGUAGE c COST 100
+AS '$libdir/powa', 'powa_stat_user_functions_cluster';
+
+CREATE FUNCTION powa_stat_all_rel_cluster(OUT dbid oid,
+    OUT relid oid,
+    OUT numscan bigint,
+    OUT tup_returned bigint,
+    OUT tup_fetched bigint,
+    OUT n_tup_ins bigint,
+    OUT n_tup_upd bigint,
+    OUT n_tup_del bigint,
+    OUT n_tup_hot_upd bigint,
+    OUT n_liv_tup bigint,
+    OUT n_dead_tup bigint,
+    OUT n_mod_since_analyze bigint,
+    OUT blks_read bigint,
+    OUT blks_hit bigint,
+    OUT last_vacuum timestamp with time zone,
+    OUT vacuum_count bigint,
+    OUT last_autovacuum timestamp with time zone,
+    OUT autovacuum_count bigint,
+    OUT last_analyze timestamp with time zone,
+    OUT analyze_count bigint,
+    OUT last_autoanalyze timestamp with time zone,
+    OUT autoanalyze_count bigint)
+    RETURNS SETOF record
+    LANGUAGE c COST 100
+AS '$libdir/powa', 'powa_stat_all_rel_cluster';
+
+CREATE OR REPLACE FUNCTION powa_user_functions_snapshot() RETURNS void AS $PROC$
+DECLARE
+    result boolean;
+    v_funcname    text := 'powa_user_functions_snapshot';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- Insert cluster-wide user function statistics
+    IF current_setting('powa.stat_collection') = 'parallel' THEN
+        INSERT INTO powa_user_functions_history_current
+            SELECT dbid, funcid,
+            ROW(now(), calls,
+                total_time,
+                self_time)::powa_user_functions_history_record AS record
+            FROM powa_stat_user_functions_parallel();
+    ELSIF current_setting('powa.stat_collection') = 'cluster' THEN
+        INSERT INTO powa_user_functions_history_current
+            SELECT dbid, funcid,
+            ROW(now(), calls,
+                total_time,
+                self_time)::powa_user_functions_history_record AS record
+            FROM powa_stat_user_functions_cluster();
+    ELSE
+        WITH func(dbid, r) AS (
+            SELECT oid,
+                powa_stat_user_functions(oid)
+            FROM pg_database
+        )
+        INSERT INTO powa_user_functions_history_current
+            SELECT dbid, (r).funcid,
+            ROW(now(), (r).calls,
+                (r).total_time,
+                (r).self_time)::powa_user_functions_history_record AS record
+            FROM func;
+    END IF;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    result := true;
+END;
+$PROC$ language plpgsql; /* end of powa_user_functions_snapshot */
+
+ALTER TABLE powa_functions
+    ADD COLUMN frequency integer NOT NULL default 1,
+    ADD CHECK (frequency > 0);
+COMMENT ON COLUMN powa_functions.frequency IS
+    'For snapshot functions, number of powa.frequency intervals between two snapshots of the module';
+
+/* Keep track of the existing, renamed and dropped databases */
+CREATE OR REPLACE FUNCTION powa_databases_maintain() RETURNS void AS $PROC$
+DECLARE
+  v_rowcount bigint;
+BEGIN
+    PERFORM powa_log('Maintaining database list...');
+
+    WITH missing AS (
+        SELECT d.oid, d.datname
+        FROM pg_database d
+        LEFT JOIN powa_databases p ON d.oid = p.oid
+        WHERE p.oid IS NULL
+    )
+    INSERT INTO powa_databases
+    SELECT * FROM missing;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('missing db: %s', v_rowcount));
+
+    -- Keep track of renamed databases
+    WITH renamed AS (
+        SELECT d.oid, d.datname
+        FROM pg_database AS d
+        JOIN powa_databases AS p ON d.oid = p.oid
+        WHERE d.datname != p.datname
+    )
+    UPDATE powa_databases AS p
+    SET datname = r.datname
+    FROM renamed AS r
+    WHERE p.oid = r.oid;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('renamed db: %s', v_rowcount));
+
+    -- Keep track of when databases are dropped
+    WITH dropped AS (
+        SELECT p.oid
+        FROM powa_databases p
+        LEFT JOIN pg_database d ON p.oid = d.oid
+        WHERE d.oid IS NULL
+        AND p.dropped IS NULL)
+    UPDATE powa_databases p
+    SET dropped = now()
+    FROM dropped d
+    WHERE p.oid = d.oid;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('dropped db: %s', v_rowcount));
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_databases_maintain */
+
+CREATE OR REPLACE FUNCTION powa_aggregate_finish() RETURNS void AS $PROC$
+BEGIN
+    UPDATE powa_last_aggregation SET aggts = now();
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_aggregate_finish */
+
+CREATE OR REPLACE FUNCTION powa_purge_finish() RETURNS void AS $PROC$
+BEGIN
+    UPDATE powa_last_purge SET purgets = now();
+
+    DELETE FROM powa_collector_stats_history
+    WHERE ts < now() - current_setting('powa.retention')::interval;
+
+    DELETE FROM powa_db_samples_history
+    WHERE ts < now() - current_setting('powa.retention')::interval;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_purge_finish */
+
+CREATE OR REPLACE FUNCTION powa_collector_stats_store() RETURNS void AS $PROC$
+BEGIN
+    INSERT INTO powa_collector_stats_history
+        SELECT now(), * FROM powa_collector_stats();
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_collector_stats_store */
+
+/*
+ * Tell whether this snapshot has to be followed by an aggregate or a purge,
+ * according to powa.coalesce.
+ */
+CREATE OR REPLACE FUNCTION powa_maintenance_due(OUT aggregate boolean,
+    OUT purge boolean) AS $PROC$
+DECLARE
+  purge_seq  bigint;
+BEGIN
+    SELECT nextval('powa_coalesce_sequence'::regclass) INTO purge_seq;
+    PERFORM powa_log(format('powa_coalesce_sequence: %s', purge_seq));
+
+    aggregate := (  purge_seq
+            % current_setting('powa.coalesce')::bigint ) = 0;
+    IF aggregate THEN
+      PERFORM powa_log(format('coalesce needed, seq: %s coalesce seq: %s',
+            purge_seq, current_setting('powa.coalesce')::bigint ));
+    END IF;
+
+    -- We also purge, at next pass
+    purge := (  purge_seq
+            % (current_setting('powa.coalesce')::bigint ) ) = 1;
+    IF purge THEN
+      PERFORM powa_log(format('purge needed, seq: %s coalesce seq: %s',
+        purge_seq, current_setting('powa.coalesce')));
+    END IF;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_maintenance_due */
+
+/*
+ * Return the aggregate and rollup functions if _aggregate, and the purge
+ * functions if _purge, in order, along with the "maintenance" bookkeeping
+ * done around them.  The order is defined in C, and shared with the
+ * background workers.
+ */
+CREATE OR REPLACE FUNCTION powa_maintenance_steps(_aggregate boolean,
+    _purge boolean,
+    OUT operation text,
+    OUT module text,
+    OUT function_name text)
+RETURNS SETOF record
+LANGUAGE c
+AS '$libdir/powa', 'powa_maintenance_steps';
+
+/*
+ * Return the functions to call for a snapshot, in order: the snapshot
+ * functions of the given modules (all of them if NULL), then the aggregate
+ * and rollup functions or the purge functions if they're due and
+ * _maintenance is true.  The "maintenance" steps are the bookkeeping done
+ * around them.  powa_take_snapshot() calls all of them in a single
+ * transaction, while the background worker builds the same list and calls
+ * each of them in its own transaction.
+ */
+CREATE OR REPLACE FUNCTION powa_snapshot_steps(_modules text[],
+    _maintenance boolean DEFAULT true,
+    OUT operation text,
+    OUT module text,
+    OUT function_name text)
+RETURNS SETOF record
+LANGUAGE c
+AS '$libdir/powa', 'powa_snapshot_steps';
+
+CREATE OR REPLACE FUNCTION powa_take_snapshot(_modules text[],
+    OUT module text,
+    OUT function_name text,
+    OUT duration double precision)
+RETURNS SETOF record AS $PROC$
+DECLARE
+  v_step     record;
+  v_state    text;
+  v_msg      text;
+  v_detail   text;
+  v_hint     text;
+  v_context  text;
+  v_title    text = 'PoWA - ';
+  v_start    timestamp with time zone;
+
+BEGIN
+    PERFORM powa_log('start of powa_take_snapshot');
+
+    FOR v_step IN SELECT * FROM powa_snapshot_steps(_modules) LOOP
+      -- Call all of them, with no parameter, and report how long the
+      -- snapshot functions took
+      v_start := clock_timestamp();
+      IF v_step.operation != 'maintenance' THEN
+        PERFORM powa_collector_stats_begin();
+      END IF;
+      BEGIN
+        PERFORM powa_log(format('calling %s function: %I',
+            v_step.operation, v_step.function_name));
+        PERFORM set_config('application_name',
+            v_title || quote_ident(v_step.function_name) || '()',
+            false);
+
+        EXECUTE 'SELECT ' || quote_ident(v_step.function_name)||'()';
+      EXCEPTION
+        WHEN OTHERS THEN
+          GET STACKED DIAGNOSTICS
+              v_state   = RETURNED_SQLSTATE,
+              v_msg     = MESSAGE_TEXT,
+              v_detail  = PG_EXCEPTION_DETAIL,
+              v_hint    = PG_EXCEPTION_HINT,
+              v_context = PG_EXCEPTION_CONTEXT;
+          RAISE warning 'powa_take_snapshot(): function "%" failed:
+              state  : %
+              message: %
+              detail : %
+              hint   : %
+              context: %', v_step.function_name, v_state, v_msg, v_detail, v_hint, v_context;
+
+      END;
+      IF v_step.operation != 'maintenance' THEN
+        PERFORM powa_collector_stats_end(v_step.operation, v_step.function_name);
+      END IF;
+      IF v_step.operation = 'snapshot' THEN
+        module := v_step.module;
+        function_name := v_step.function_name;
+        duration := extract(epoch FROM clock_timestamp() - v_start) * 1000;
+        RETURN NEXT;
+      END IF;
+    END LOOP;
+
+    PERFORM powa_log('end of powa_take_snapshot');
+    PERFORM set_config('application_name',
+        v_title || 'snapshot finished',
+        false);
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_take_snapshot */
+
+CREATE OR REPLACE FUNCTION powa_take_snapshot() RETURNS void AS $PROC$
+BEGIN
+    PERFORM * FROM powa_take_snapshot(NULL::text[]);
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_take_snapshot */
+
+CREATE FUNCTION powa_collector_stats_begin()
+    RETURNS void
+    LANGUAGE c
+AS '$libdir/powa', 'powa_collector_stats_begin';
+
+CREATE FUNCTION powa_collector_stats_end(phase text, function_name text)
+    RETURNS void
+    LANGUAGE c
+AS '$libdir/powa', 'powa_collector_stats_end';
+
+CREATE FUNCTION powa_collector_stats(OUT phase text,
+    OUT function_name text,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT last_time double precision,
+    OUT user_time double precision,
+    OUT system_time double precision,
+    OUT rows bigint,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint,
+    OUT shared_blks_dirtied bigint,
+    OUT shared_blks_written bigint,
+    OUT wal_records bigint,
+    OUT wal_bytes bigint,
+    OUT last_run timestamp with time zone)
+    RETURNS SETOF record
+    LANGUAGE c
+AS '$libdir/powa', 'powa_collector_stats';
+
+CREATE FUNCTION powa_collector_stats_reset()
+    RETURNS void
+    LANGUAGE c
+AS '$libdir/powa', 'powa_collector_stats_reset';
+
+CREATE TABLE powa_collector_stats_history (
+    ts timestamp with time zone NOT NULL,
+    phase text NOT NULL,
+    function_name text NOT NULL,
+    calls bigint NOT NULL,
+    total_time double precision NOT NULL,
+    last_time double precision NOT NULL,
+    user_time double precision NOT NULL,
+    system_time double precision NOT NULL,
+    rows bigint NOT NULL,
+    shared_blks_hit bigint NOT NULL,
+    shared_blks_read bigint NOT NULL,
+    shared_blks_dirtied bigint NOT NULL,
+    shared_blks_written bigint NOT NULL,
+    wal_records bigint,
+    wal_bytes bigint,
+    last_run timestamp with time zone NOT NULL
+);
+
+CREATE INDEX powa_collector_stats_history_ts_idx
+    ON powa_collector_stats_history (ts);
+SELECT pg_catalog.pg_extension_config_dump('powa_collector_stats_history','');
+
+/* high frequency samples, downsampled at each snapshot */
+CREATE TABLE powa_db_samples_history (
+    ts timestamp with time zone NOT NULL,
+    dbid oid NOT NULL,
+    nsamples integer NOT NULL,
+    max_backends integer NOT NULL,
+    max_active integer NOT NULL,
+    max_idle_in_xact integer NOT NULL,
+    max_waiting integer,
+    max_xact_commit_rate double precision,
+    max_xact_rollback_rate double precision,
+    max_blks_read_rate double precision,
+    max_blks_hit_rate double precision,
+    max_tup_returned_rate double precision,
+    max_tup_fetched_rate double precision,
+    max_tup_inserted_rate double precision,
+    max_tup_updated_rate double precision,
+    max_tup_deleted_rate double precision
+);
+
+CREATE INDEX powa_db_samples_history_ts_idx
+    ON powa_db_samples_history (ts);
+SELECT pg_catalog.pg_extension_config_dump('powa_db_samples_history','');
+
+CREATE FUNCTION powa_db_samples(OUT ts timestamp with time zone,
+    OUT dbid oid,
+    OUT backends integer,
+    OUT active integer,
+    OUT idle_in_xact integer,
+    OUT waiting integer,
+    OUT xact_commit bigint,
+    OUT xact_rollback bigint,
+    OUT blks_read bigint,
+    OUT blks_hit bigint,
+    OUT tup_returned bigint,
+    OUT tup_fetched bigint,
+    OUT tup_inserted bigint,
+    OUT tup_updated bigint,
+    OUT tup_deleted bigint)
+    RETURNS SETOF record
+    LANGUAGE c
+AS '$libdir/powa', 'powa_db_samples';
+
+/*
+ * Downsample the high frequency samples taken since the last call: for each
+ * database, the peak number of backends of each state, and the peak rates
+ * per second of its counters.
+ */
+CREATE OR REPLACE FUNCTION powa_db_samples_store() RETURNS void AS $PROC$
+DECLARE
+    v_funcname text := 'powa_db_samples_store';
+    v_rowcount bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    WITH samples AS (
+        SELECT s.ts, s.dbid, s.backends, s.active, s.idle_in_xact, s.waiting,
+            nullif(extract(epoch FROM s.ts - lag(s.ts) OVER w), 0) AS secs,
+            s.xact_commit - lag(s.xact_commit) OVER w AS xact_commit,
+            s.xact_rollback - lag(s.xact_rollback) OVER w AS xact_rollback,
+            s.blks_read - lag(s.blks_read) OVER w AS blks_read,
+            s.blks_hit - lag(s.blks_hit) OVER w AS blks_hit,
+            s.tup_returned - lag(s.tup_returned) OVER w AS tup_returned,
+            s.tup_fetched - lag(s.tup_fetched) OVER w AS tup_fetched,
+            s.tup_inserted - lag(s.tup_inserted) OVER w AS tup_inserted,
+            s.tup_updated - lag(s.tup_updated) OVER w AS tup_updated,
+            s.tup_deleted - lag(s.tup_deleted) OVER w AS tup_deleted
+        FROM powa_db_samples() s
+        WINDOW w AS (PARTITION BY s.dbid ORDER BY s.ts)
+    ),
+    last AS (
+        SELECT max(ts) AS ts FROM powa_db_samples_history
+    )
+    INSERT INTO powa_db_samples_history
+        SELECT (SELECT max(ts) FROM samples), s.dbid, count(*),
+            max(s.backends), max(s.active), max(s.idle_in_xact),
+            max(s.waiting),
+            max(s.xact_commit / s.secs),
+            max(s.xact_rollback / s.secs),
+            max(s.blks_read / s.secs),
+            max(s.blks_hit / s.secs),
+            max(s.tup_returned / s.secs),
+            max(s.tup_fetched / s.secs),
+            max(s.tup_inserted / s.secs),
+            max(s.tup_updated / s.secs),
+            max(s.tup_deleted / s.secs)
+        FROM samples s, last
+        WHERE last.ts IS NULL OR s.ts > last.ts
+        GROUP BY s.dbid;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_db_samples_store */
+
+/*
+ * Partitioned history tables support
+ */
+CREATE OR REPLACE FUNCTION powa_partitioned_history() RETURNS SETOF regclass AS $PROC$
+    SELECT c.oid::regclass
+    FROM pg_class c
+    JOIN pg_depend d ON d.classid = 'pg_class'::regclass AND d.objid = c.oid
+        AND d.deptype = 'e'
+    JOIN pg_extension e ON e.oid = d.refobjid AND e.extname = 'powa'
+    WHERE c.relkind = 'p';
+$PROC$ LANGUAGE sql; /* end of powa_partitioned_history */
+
+CREATE OR REPLACE FUNCTION powa_partitions(_relid regclass,
+    OUT partition regclass,
+    OUT lower_bound timestamp with time zone,
+    OUT upper_bound timestamp with time zone)
+RETURNS SETOF record AS $PROC$
+BEGIN
+    -- relpartbound only exists on PostgreSQL 10+, hence plpgsql
+    RETURN QUERY SELECT i.inhrelid::regclass,
+        substring(b.bound FROM 'FROM \(''([^'']+)''\)')::timestamptz,
+        substring(b.bound FROM 'TO \(''([^'']+)''\)')::timestamptz
+    FROM pg_inherits i
+    JOIN pg_class c ON c.oid = i.inhrelid,
+    LATERAL (SELECT pg_get_expr(c.relpartbound, c.oid) AS bound) b
+    WHERE i.inhparent = _relid
+    AND b.bound != 'DEFAULT';
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_partitions */
+
+/*
+ * Create the partitions of the partitioned history tables needed until the
+ * next powa.partition_interval.
+ */
+CREATE OR REPLACE FUNCTION powa_partitions_maintain() RETURNS void AS $PROC$
+DECLARE
+    v_funcname text := 'powa_partitions_maintain';
+    v_relid    regclass;
+    v_nspname  text;
+    v_relname  text;
+    v_interval interval;
+    v_secs     double precision;
+    v_floor    timestamp with time zone;
+    v_start    timestamp with time zone;
+    v_max      timestamp with time zone;
+BEGIN
+    v_interval := current_setting('powa.partition_interval')::interval;
+    IF v_interval = '0'::interval THEN
+        v_interval := '1 day';
+    END IF;
+    v_secs := extract(epoch FROM v_interval);
+    v_floor := to_timestamp(floor(extract(epoch FROM now()) / v_secs) * v_secs);
+
+    FOR v_relid IN SELECT * FROM powa_partitioned_history() LOOP
+        SELECT n.nspname, c.relname INTO v_nspname, v_relname
+        FROM pg_class c
+        JOIN pg_namespace n ON n.oid = c.relnamespace
+        WHERE c.oid = v_relid;
+
+        -- continue after the last partition, unless it's too old
+        SELECT max(upper_bound) INTO v_start FROM powa_partitions(v_relid);
+        IF v_start IS NULL OR v_start < v_floor THEN
+            v_start := v_floor;
+        END IF;
+
+        -- the new partitions must not overlap rows in the default partition
+        EXECUTE format('SELECT max(coalesce_upper) FROM %I.%I',
+            v_nspname, v_relname || '_default') INTO v_max;
+        IF v_max >= v_start THEN
+            v_start := v_max + '1 microsecond'::interval;
+        END IF;
+
+        WHILE v_start < now() + v_interval LOOP
+            PERFORM powa_log(format('%I - creating partition of %I from %s',
+                    v_funcname, v_relname, v_start));
+            EXECUTE format('CREATE TABLE %I.%I PARTITION OF %I.%I FOR VALUES FROM (%L) TO (%L)',
+                v_nspname, v_relname || '_' || to_char(v_start, 'YYYYMMDD_HH24MISS'),
+                v_nspname, v_relname, v_start, v_start + v_interval);
+            v_start := v_start + v_interval;
+        END LOOP;
+    END LOOP;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_partitions_maintain */
+
+/*
+ * Insert the result of an aggregate query in the given history table,
+ * optionally followed by a column list, and return the number of inserted
+ * rows.  INSERT ... SELECT never uses parallel workers, so if
+ * powa.aggregate_parallel_workers is set the query result is first
+ * materialized with a CREATE TABLE AS, which can, and the planner is allowed
+ * to use that many workers.
+ */
+CREATE OR REPLACE FUNCTION powa_aggregate_history(_target text, _query text) RETURNS bigint AS $PROC$
+DECLARE
+    v_workers   int;
+    v_old       text;
+    v_rowcount  bigint;
+BEGIN
+    v_workers := current_setting('powa.aggregate_parallel_workers')::int;
+
+    IF v_workers = 0 OR current_setting('server_version_num')::int < 110000 THEN
+        EXECUTE format('INSERT INTO %s %s', _target, _query);
+        GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+
+        RETURN v_rowcount;
+    END IF;
+
+    v_old := current_setting('max_parallel_workers_per_gather');
+    PERFORM set_config('max_parallel_workers_per_gather', v_workers::text, true);
+    EXECUTE format('CREATE TEMPORARY TABLE powa_aggregate_tmp AS %s', _query);
+    PERFORM set_config('max_parallel_workers_per_gather', v_old, true);
+
+    EXECUTE format('INSERT INTO %s SELECT * FROM pg_temp.powa_aggregate_tmp',
+        _target);
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+
+    DROP TABLE pg_temp.powa_aggregate_tmp;
+
+    RETURN v_rowcount;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_aggregate_history */
+
+/*
+ * Purge the given history table according to powa.retention, and return the
+ * number of deleted rows.  If the table is partitioned, the obsolete
+ * partitions are detached and dropped, which is much cheaper than deleting
+ * their rows, but means that rows can be kept for up to an additional
+ * partition interval.  The rows of the dropped partitions are counted too,
+ * using their planner estimate rather than scanning them.
+ */
+CREATE OR REPLACE FUNCTION powa_purge_history(_relid regclass) RETURNS bigint AS $PROC$
+DECLARE
+    v_funcname  text := 'powa_purge_history';
+    v_limit     timestamp with time zone;
+    v_partition regclass;
+    v_nspname   text;
+    v_relname   text;
+    v_relkind   "char";
+    v_dropped   bigint;
+    v_total     bigint := 0;
+    v_rowcount  bigint;
+BEGIN
+    v_limit := now() - current_setting('powa.retention')::interval;
+
+    SELECT n.nspname, c.relname, c.relkind
+        INTO v_nspname, v_relname, v_relkind
+    FROM pg_class c
+    JOIN pg_namespace n ON n.oid = c.relnamespace
+    WHERE c.oid = _relid;
+
+    IF v_relkind = 'p' THEN
+        FOR v_partition, v_dropped IN SELECT p.partition,
+                greatest(c.reltuples, 0)::bigint
+                FROM powa_partitions(_relid) p
+                JOIN pg_class c ON c.oid = p.partition
+                WHERE p.upper_bound <= v_limit LOOP
+            PERFORM powa_log(format('%I - dropping partition %s (about %s rows)',
+                    v_funcname, v_partition, v_dropped));
+            EXECUTE format('ALTER TABLE %s DETACH PARTITION %s',
+                _relid, v_partition);
+            EXECUTE format('DROP TABLE %s', v_partition);
+            v_total := v_total + v_dropped;
+        END LOOP;
+
+        -- the default partition is only expected to have a few rows
+        EXECUTE format('DELETE FROM %I.%I WHERE coalesce_upper < %L',
+            v_nspname, v_relname || '_default', v_limit);
+    ELSE
+        EXECUTE format('DELETE FROM %s WHERE upper(coalesce_range) < %L',
+            _relid, v_limit);
+    END IF;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    RETURN v_total + v_rowcount;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_purge_history */
+
+CREATE OR REPLACE FUNCTION powa_statements_purge() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_statements_purge';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- Delete obsolete datas. We only bother with already coalesced data
+    v_rowcount := powa_purge_history('powa_statements_history');
+
+    perform powa_log(format('%I (powa_statements_hitory) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    v_rowcount := powa_purge_history('powa_statements_history_db');
+
+    perform powa_log(format('%I (powa_statements_history_db) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    -- the hours not rolled up in the day tier yet are kept, so that it's
+    -- always built from complete days whatever powa.hourly_retention is
+    DELETE FROM powa_statements_history_rollup
+    WHERE (tier = 'hour'
+        AND upper(coalesce_range) < now() - current_setting('powa.hourly_retention')::interval
+        AND (current_setting('powa.daily_retention')::interval = '0'::interval
+            OR upper(coalesce_range) <= (SELECT max(upper(coalesce_range))
+                FROM powa_statements_history_rollup WHERE tier = 'day')))
+    OR (tier = 'day'
+        AND upper(coalesce_range) < now() - current_setting('powa.daily_retention')::interval);
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('%I (powa_statements_history_rollup) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    -- the hours not rolled up in the day tier yet are kept, so that it's
+    -- always built from complete days whatever powa.hourly_retention is
+    DELETE FROM powa_statements_history_db_rollup
+    WHERE (tier = 'hour'
+        AND upper(coalesce_range) < now() - current_setting('powa.hourly_retention')::interval
+        AND (current_setting('powa.daily_retention')::interval = '0'::interval
+            OR upper(coalesce_range) <= (SELECT max(upper(coalesce_range))
+                FROM powa_statements_history_db_rollup WHERE tier = 'day')))
+    OR (tier = 'day'
+        AND upper(coalesce_range) < now() - current_setting('powa.daily_retention')::interval);
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('%I (powa_statements_history_db_rollup) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    -- FIXME maybe we should cleanup the powa_*_history tables ? But it will take a while: unnest all records...
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_statements_purge */
+
+CREATE OR REPLACE FUNCTION powa_user_functions_purge() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_user_functions_purge';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- Delete obsolete datas. We only bother with already coalesced data
+    v_rowcount := powa_purge_history('powa_user_functions_history');
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    -- FIXME maybe we should cleanup the powa_*_history tables ? But it will take a while: unnest all records...
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_user_functions_purge */
+
+CREATE OR REPLACE FUNCTION powa_all_relations_purge() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_all_relations_purge';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- Delete obsolete datas. We only bother with already coalesced data
+    v_rowcount := powa_purge_history('powa_all_relations_history');
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    -- FIXME maybe we should cleanup the powa_*_history tables ? But it will take a while: unnest all records...
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_all_relations_purge */
+
+CREATE OR REPLACE FUNCTION powa_kcache_purge() RETURNS void as $PROC$
+DECLARE
+    v_funcname    text := 'powa_kcache_purge';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    v_rowcount := powa_purge_history('powa_kcache_metrics');
+    perform powa_log(format('%I (powa_kcache_metrics) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    v_rowcount := powa_purge_history('powa_kcache_metrics_db');
+    perform powa_log(format('%I (powa_kcache_metrics_db) - rowcount: %s',
+            v_funcname, v_rowcount));
+END;
+$PROC$ language plpgsql; /* end of powa_kcache_purge */
+
+CREATE OR REPLACE FUNCTION powa_qualstats_purge() RETURNS void as $PROC$
+BEGIN
+  PERFORM powa_log('running powa_qualstats_purge');
+  PERFORM powa_purge_history('powa_qualstats_constvalues_history');
+  PERFORM powa_purge_history('powa_qualstats_quals_history');
+END;
+$PROC$ language plpgsql; /* end of powa_qualstats_purge */
+
+/*
+ * Switch the indexes of the history tables between the original GiST layout
+ * on (key, coalesce_range), and a layout better suited for append-only time
+ * ordered data: a BRIN index on the range bounds and a B-tree on
+ * (key, upper(coalesce_range)).  With the latter, the queries need to use
+ * explicit bound predicates rather than the && operator, e.g.:
+ *
+ *   WHERE queryid = $1
+ *   AND upper(coalesce_range) >= $2 AND lower(coalesce_range) <= $3
+ */
+CREATE OR REPLACE FUNCTION powa_history_index_layout(_layout text) RETURNS void AS $PROC$
+DECLARE
+    v_funcname text := 'powa_history_index_layout';
+    v_relname  text;
+    v_keys     text;
+    v_gist     text;
+    v_index    text;
+BEGIN
+    IF _layout NOT IN ('gist', 'brin') THEN
+        RAISE EXCEPTION 'unknown index layout "%"', _layout
+            USING HINT = 'Valid layouts are "gist" and "brin".';
+    END IF;
+
+    IF _layout = 'brin' AND current_setting('server_version_num')::int < 90500 THEN
+        RAISE EXCEPTION 'the brin layout requires PostgreSQL 9.5 or above';
+    END IF;
+
+    FOR v_relname, v_keys, v_gist IN SELECT * FROM (VALUES
+            ('powa_statements_history', 'queryid', 'powa_statements_history_query_ts'),
+            ('powa_statements_history_db', 'dbid', 'powa_statements_history_db_ts'),
+            ('powa_user_functions_history', 'funcid', 'powa_user_functions_history_funcid_ts'),
+            ('powa_all_relations_history', 'relid', 'powa_all_relations_history_relid_ts'),
+            ('powa_qualstats_constvalues_history', 'queryid, qualid', 'powa_qualstats_constvalues_history_ts')
+        ) l LOOP
+        -- drop the indexes of both layouts
+        FOR v_index IN SELECT i.indexrelid::regclass::text
+                FROM pg_index i
+                JOIN pg_class c ON c.oid = i.indexrelid
+                JOIN pg_am am ON am.oid = c.relam
+                WHERE i.indrelid = v_relname::regclass
+                AND (am.amname IN ('gist', 'brin')
+                    OR c.relname = v_relname || '_key_upper') LOOP
+            PERFORM powa_log(format('%I - dropping index %s', v_funcname, v_index));
+            EXECUTE format('DROP INDEX %s', v_index);
+        END LOOP;
+
+        IF _layout = 'gist' THEN
+            EXECUTE format('CREATE INDEX %I ON %I USING gist (%s, coalesce_range)',
+                v_gist, v_relname, v_keys);
+        ELSE
+            EXECUTE format('CREATE INDEX %I ON %I USING brin (lower(coalesce_range), upper(coalesce_range))',
+                v_relname || '_ts_brin', v_relname);
+            EXECUTE format('CREATE INDEX %I ON %I (%s, upper(coalesce_range))',
+                v_relname || '_key_upper', v_relname, v_keys);
+        END IF;
+    END LOOP;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_history_index_layout */
+
+-- the GiST index of powa_qualstats_constvalues_history used to be unnamed, give
+-- it the name powa_history_index_layout() uses
+DO $_$
+DECLARE
+    v_index text;
+BEGIN
+    SELECT c.relname INTO v_index
+    FROM pg_index i
+    JOIN pg_class c ON c.oid = i.indexrelid
+    JOIN pg_am am ON am.oid = c.relam
+    WHERE i.indrelid = 'powa_qualstats_constvalues_history'::regclass
+    AND am.amname = 'gist';
+
+    IF v_index IS NOT NULL AND v_index <> 'powa_qualstats_constvalues_history_ts' THEN
+        EXECUTE format('ALTER INDEX %I RENAME TO powa_qualstats_constvalues_history_ts',
+            v_index);
+    END IF;
+END;
+$_$;
+
+ALTER TABLE powa_functions DROP CONSTRAINT powa_functions_operation_check;
+ALTER TABLE powa_functions ADD CONSTRAINT powa_functions_operation_check
+    CHECK (operation IN ('snapshot','aggregate','rollup','purge','unregister','reset'));
+INSERT INTO powa_functions (module, operation, function_name, added_manually, enabled) VALUES
+    ('pg_stat_statements', 'rollup', 'powa_statements_rollup', false, true);
+
+CREATE TABLE powa_statements_history_rollup (
+    tier text NOT NULL,
+    queryid bigint NOT NULL,
+    dbid oid NOT NULL,
+    userid oid NOT NULL,
+    coalesce_range tstzrange NOT NULL,
+    first_record powa_statements_history_record NOT NULL,
+    last_record powa_statements_history_record NOT NULL,
+    mins_in_range powa_statements_history_record NOT NULL,
+    maxs_in_range powa_statements_history_record NOT NULL,
+    PRIMARY KEY (tier, queryid, dbid, userid, coalesce_range),
+    CHECK (tier IN ('hour', 'day'))
+);
+
+CREATE TABLE powa_statements_history_db_rollup (
+    tier text NOT NULL,
+    dbid oid NOT NULL,
+    coalesce_range tstzrange NOT NULL,
+    first_record powa_statements_history_record NOT NULL,
+    last_record powa_statements_history_record NOT NULL,
+    mins_in_range powa_statements_history_record NOT NULL,
+    maxs_in_range powa_statements_history_record NOT NULL,
+    PRIMARY KEY (tier, dbid, coalesce_range),
+    CHECK (tier IN ('hour', 'day'))
+);
+
+SELECT pg_catalog.pg_extension_config_dump('powa_statements_history_rollup','');
+SELECT pg_catalog.pg_extension_config_dump('powa_statements_history_db_rollup','');
+
+/*
+ * Roll up the coalesced records of the given history table in the _tier
+ * windows of its _target rollup table, _keys being the columns identifying
+ * an object.  The hour tier is fed from the records of _source, and the day
+ * tier from the hour tier of _target.  Only the windows that are complete and
+ * not rolled up yet are processed.  Returns the number of inserted rows.
+ */
+CREATE OR REPLACE FUNCTION powa_rollup_history(_source text, _target text,
+    _keys text, _tier text) RETURNS bigint AS $PROC$
+DECLARE
+    v_record    text;
+    v_from      timestamp with time zone;
+    v_to        timestamp with time zone;
+    v_rowcount  bigint;
+BEGIN
+    -- the records min and max aggregates are named after their type
+    SELECT format_type(atttypid, NULL) INTO v_record
+    FROM pg_attribute
+    WHERE attrelid = _target::regclass AND attname = 'first_record';
+
+    EXECUTE format('SELECT max(upper(coalesce_range)) FROM %I WHERE tier = %L',
+        _target, _tier) INTO v_from;
+
+    IF _tier = 'hour' THEN
+        IF v_from IS NULL THEN
+            EXECUTE format('SELECT date_trunc(''hour'', min(lower(coalesce_range))) FROM %I',
+                _source) INTO v_from;
+        END IF;
+
+        -- records older than the last aggregation are all coalesced
+        SELECT date_trunc('hour', aggts) INTO v_to FROM powa_last_aggregation;
+
+        IF v_from IS NULL OR v_from >= v_to THEN
+            RETURN 0;
+        END IF;
+
+        EXECUTE format('INSERT INTO %I
+            SELECT ''hour'', %s,
+                tstzrange(w, w + interval ''1 hour'', ''[)''),
+                (array_agg(rec ORDER BY (rec).ts))[1],
+                (array_agg(rec ORDER BY (rec).ts DESC))[1],
+                %s_min(rec),
+                %s_max(rec)
+            FROM (
+                SELECT %s, date_trunc(''hour'', (r).ts) AS w, r AS rec
+                FROM %I h,
+                LATERAL unnest(h.records) AS r
+                WHERE h.coalesce_range && tstzrange($1, $2, ''[)'')
+                AND upper(h.coalesce_range) >= $1 AND lower(h.coalesce_range) < $2
+                AND (r).ts >= $1 AND (r).ts < $2
+            ) s
+            GROUP BY %s, w',
+            _target, _keys, v_record, v_record, _keys, _source, _keys)
+        USING v_from, v_to;
+    ELSE
+        IF v_from IS NULL THEN
+            EXECUTE format('SELECT date_trunc(%L, min(lower(coalesce_range))) FROM %I WHERE tier = ''hour''',
+                _tier, _target) INTO v_from;
+        END IF;
+
+        EXECUTE format('SELECT date_trunc(%L, max(upper(coalesce_range))) FROM %I WHERE tier = ''hour''',
+            _tier, _target) INTO v_to;
+
+        IF v_from IS NULL OR v_from >= v_to THEN
+            RETURN 0;
+        END IF;
+
+        EXECUTE format('INSERT INTO %I
+            SELECT %L, %s,
+                tstzrange(w, w + interval %L, ''[)''),
+                (array_agg(first_record ORDER BY lower(coalesce_range)))[1],
+                (array_agg(last_record ORDER BY lower(coalesce_range) DESC))[1],
+                %s_min(mins_in_range),
+                %s_max(maxs_in_range)
+            FROM (
+                SELECT *, date_trunc(%L, lower(coalesce_range)) AS w
+                FROM %I
+                WHERE tier = ''hour''
+                AND lower(coalesce_range) >= $1
+                AND upper(coalesce_range) <= $2
+            ) s
+            GROUP BY %s, w',
+            _target, _tier, _keys, '1 ' || _tier, v_record, v_record, _tier,
+            _target, _keys)
+        USING v_from, v_to;
+    END IF;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    RETURN v_rowcount;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_rollup_history */
+
+/*
+ * Feed the hour and day tiers of the pg_stat_statements history.  Each tier
+ * only keeps the first, last, min and max records of each window, and is fed
+ * incrementally from the tier below, see powa_rollup_history().
+ */
+CREATE OR REPLACE FUNCTION powa_statements_rollup() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_statements_rollup';
+    v_rowcount    bigint;
+    v_tier        text;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    IF current_setting('powa.hourly_retention')::interval = '0'::interval THEN
+        RETURN;
+    END IF;
+
+    FOREACH v_tier IN ARRAY ARRAY['hour', 'day'] LOOP
+        IF v_tier = 'day'
+            AND current_setting('powa.daily_retention')::interval = '0'::interval
+        THEN
+            EXIT;
+        END IF;
+
+        v_rowcount := powa_rollup_history('powa_statements_history',
+            'powa_statements_history_rollup', 'queryid, dbid, userid', v_tier);
+        perform powa_log(format('%I (powa_statements_history_rollup, %s) - rowcount: %s',
+                v_funcname, v_tier, v_rowcount));
+
+        v_rowcount := powa_rollup_history('powa_statements_history_db',
+            'powa_statements_history_db_rollup', 'dbid', v_tier);
+        perform powa_log(format('%I (powa_statements_history_db_rollup, %s) - rowcount: %s',
+                v_funcname, v_tier, v_rowcount));
+    END LOOP;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_statements_rollup */
+
+/*
+ * Return the tier of the history that should be used to display the given
+ * time range: the finest one providing at most _max_points points per
+ * object, and still covering the beginning of the range, or the coarsest
+ * enabled one otherwise.  The tiers are "raw" (the *_history tables), "hour"
+ * and "day" (the *_rollup tables).
+ */
+CREATE OR REPLACE FUNCTION powa_history_tier(_from timestamp with time zone,
+    _to timestamp with time zone,
+    _max_points integer DEFAULT 1000)
+RETURNS text AS $PROC$
+DECLARE
+    v_range       double precision;
+    v_hourly      interval;
+    v_daily       interval;
+BEGIN
+    v_range := extract(epoch FROM _to - _from);
+    v_hourly := current_setting('powa.hourly_retention')::interval;
+    v_daily := current_setting('powa.daily_retention')::interval;
+
+    IF v_range / extract(epoch FROM current_setting('powa.frequency')::interval) <= _max_points
+        AND _from >= now() - current_setting('powa.retention')::interval
+    THEN
+        RETURN 'raw';
+    END IF;
+
+    IF v_hourly > '0'::interval
+        AND (v_range / 3600 <= _max_points OR v_daily = '0'::interval)
+        AND (_from >= now() - v_hourly OR v_daily = '0'::interval)
+    THEN
+        RETURN 'hour';
+    END IF;
+
+    IF v_hourly > '0'::interval AND v_daily > '0'::interval THEN
+        RETURN 'day';
+    END IF;
+
+    RETURN 'raw';
+END;
+$PROC$ LANGUAGE plpgsql STABLE; /* end of powa_history_tier */
+
+CREATE OR REPLACE FUNCTION public.powa_statements_reset()
+ RETURNS boolean
+ LANGUAGE plpgsql
+AS $function$
+BEGIN
+    PERFORM powa_log('truncating powa_statements_history');
+    TRUNCATE TABLE powa_statements_history;
+
+    PERFORM powa_log('truncating powa_statements_history_current');
+    TRUNCATE TABLE powa_statements_history_current;
+
+    PERFORM powa_log('truncating powa_statements_history_db');
+    TRUNCATE TABLE powa_statements_history_db;
+
+    PERFORM powa_log('truncating powa_statements_history_current_db');
+    TRUNCATE TABLE powa_statements_history_current_db;
+
+    -- the running aggregates must not flush what they saw before
+    PERFORM powa_statements_stream_invalidate();
+
+    PERFORM powa_log('truncating powa_statements_history_rollup');
+    TRUNCATE TABLE powa_statements_history_rollup;
+
+    PERFORM powa_log('truncating powa_statements_history_db_rollup');
+    TRUNCATE TABLE powa_statements_history_db_rollup;
+
+    PERFORM powa_log('truncating powa_statements and powa_statements_texts');
+    -- if 3rd part datasource has FK on it, throw everything away
+    TRUNCATE TABLE powa_statements_base, powa_statements_texts CASCADE;
+    RETURN true;
+END;
+$function$; /* end of powa_statements_reset */
+
+/*
+ * The *_current tables only store transient data, waiting to be coalesced in
+ * the history tables, so they can be made unlogged to avoid generating WAL
+ * for them, at the price of losing their content after a crash.
+ */
+CREATE OR REPLACE FUNCTION powa_current_tables() RETURNS SETOF regclass AS $PROC$
+    SELECT c.oid::regclass
+    FROM pg_class c
+    JOIN pg_depend d ON d.classid = 'pg_class'::regclass AND d.objid = c.oid
+        AND d.deptype = 'e'
+    JOIN pg_extension e ON e.oid = d.refobjid AND e.extname = 'powa'
+    WHERE c.relkind = 'r'
+    AND (c.relname LIKE 'powa\_%\_current'
+        OR c.relname LIKE 'powa\_%\_current\_db');
+$PROC$ LANGUAGE sql; /* end of powa_current_tables */
+
+/*
+ * Make the *_current tables unlogged or logged, depending on _unlogged.
+ * Called by the bgworker according to powa.unlogged_current.
+ */
+CREATE OR REPLACE FUNCTION powa_current_persistence(_unlogged boolean) RETURNS void AS $PROC$
+DECLARE
+    v_funcname text := 'powa_current_persistence';
+    v_relid    regclass;
+BEGIN
+    IF current_setting('server_version_num')::int < 90500 THEN
+        IF _unlogged THEN
+            RAISE WARNING 'unlogged *_current tables require PostgreSQL 9.5 or above';
+        END IF;
+        RETURN;
+    END IF;
+
+    FOR v_relid IN SELECT r FROM powa_current_tables() r
+            JOIN pg_class c ON c.oid = r
+            WHERE (c.relpersistence = 'u') != _unlogged LOOP
+        PERFORM powa_log(format('%I - setting %s %s', v_funcname, v_relid,
+                CASE WHEN _unlogged THEN 'unlogged' ELSE 'logged' END));
+        EXECUTE format('ALTER TABLE %s SET %s', v_relid,
+            CASE WHEN _unlogged THEN 'UNLOGGED' ELSE 'LOGGED' END);
+    END LOOP;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_current_persistence */
+
+CREATE FUNCTION powa_shmem_startup_time()
+    RETURNS timestamp with time zone
+    LANGUAGE c
+AS '$libdir/powa', 'powa_shmem_startup_time';
+
+/*
+ * Check if the content of the unlogged *_current tables was lost during a
+ * crash, and if so, start a new coalesce window so that the next aggregate
+ * doesn't silently cover a partial window.  Called once by the bgworker when
+ * it starts.  The content is only considered lost if the statements current
+ * data is unlogged, the statements module is enabled, the server was
+ * restarted since the current coalesce window started, and the data is
+ * empty in the middle of that window, as crash recovery is the only way
+ * unlogged tables are emptied outside of an aggregate.
+ */
+CREATE OR REPLACE FUNCTION powa_current_check_lost() RETURNS boolean AS $PROC$
+DECLARE
+    v_funcname text := 'powa_current_check_lost';
+    v_seq      bigint;
+    v_coalesce bigint;
+BEGIN
+    IF (SELECT relpersistence FROM pg_class
+        WHERE oid = 'powa_statements_history_current_db'::regclass) != 'u'
+    THEN
+        RETURN false;
+    END IF;
+
+    IF NOT EXISTS (SELECT 1 FROM powa_functions
+            WHERE module = 'pg_stat_statements' AND operation = 'snapshot'
+            AND enabled) THEN
+        RETURN false;
+    END IF;
+
+    -- the window started after the restart, nothing could be lost.  A crash
+    -- restart doesn't change pg_postmaster_start_time(), but it reinitializes
+    -- the shared memory.
+    IF (SELECT aggts FROM powa_last_aggregation) >=
+        coalesce(powa_shmem_startup_time(), pg_postmaster_start_time()) THEN
+        RETURN false;
+    END IF;
+
+    IF EXISTS (SELECT 1 FROM powa_statements_history_current_db) THEN
+        RETURN false;
+    END IF;
+
+    SELECT last_value INTO v_seq FROM powa_coalesce_sequence;
+    v_coalesce := current_setting('powa.coalesce')::bigint;
+
+    IF v_seq % v_coalesce <= 1 THEN
+        RETURN false;
+    END IF;
+
+    RAISE LOG 'PoWA unlogged current tables content was lost, starting a new coalesce window';
+    -- the sequence starts at 1, so that's also the first value of a window
+    PERFORM setval('powa_coalesce_sequence', v_seq - v_seq % v_coalesce + 1, false);
+    RETURN true;
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_current_check_lost */
+
+DO $_$
+BEGIN
+    IF current_setting('powa.unlogged_current')::boolean THEN
+        PERFORM powa_current_persistence(true);
+    END IF;
+END;
+$_$;
+
+/*
+ * Field-wise min and max aggregates of the history records, used to compute
+ * the mins_in_range and maxs_in_range records.  They're created for each
+ * record type as <name>_min() and <name>_max(), and can run in parallel on
+ * PostgreSQL 9.6 and above.
+ */
+DO $_$
+DECLARE
+    v_type      text;
+    v_name      text;
+    v_fparallel text := '';
+    v_aparallel text := '';
+BEGIN
+    IF current_setting('server_version_num')::int >= 90600 THEN
+        v_fparallel := ' PARALLEL SAFE';
+        v_aparallel := ', COMBINEFUNC = powa_record_extrema_combine,'
+            ' SERIALFUNC = powa_record_extrema_serialize,'
+            ' DESERIALFUNC = powa_record_extrema_deserialize,'
+            ' PARALLEL = SAFE';
+    END IF;
+
+    EXECUTE format('CREATE FUNCTION powa_record_extrema_combine(internal, internal)
+        RETURNS internal LANGUAGE c IMMUTABLE%s
+        AS %L, %L', v_fparallel, '$libdir/powa', 'powa_record_extrema_combine');
+    EXECUTE format('CREATE FUNCTION powa_record_extrema_serialize(internal)
+        RETURNS bytea LANGUAGE c IMMUTABLE STRICT%s
+        AS %L, %L', v_fparallel, '$libdir/powa', 'powa_record_extrema_serialize');
+    EXECUTE format('CREATE FUNCTION powa_record_extrema_deserialize(bytea, internal)
+        RETURNS internal LANGUAGE c IMMUTABLE STRICT%s
+        AS %L, %L', v_fparallel, '$libdir/powa', 'powa_record_extrema_deserialize');
+
+    FOR v_type, v_name IN SELECT * FROM (VALUES
+        ('powa_statements_history_record', 'powa_statements_history_record'),
+        ('powa_user_functions_history_record', 'powa_user_functions_history_record'),
+        ('powa_all_relations_history_record', 'powa_all_relations_history_record'),
+        ('kcache_type', 'powa_kcache'),
+        ('powa_qualstats_history_item', 'powa_qualstats_history_item')
+    ) v LOOP
+        EXECUTE format('CREATE FUNCTION %s_min_trans(internal, %s)
+            RETURNS internal LANGUAGE c IMMUTABLE%s
+            AS %L, %L', v_name, v_type, v_fparallel,
+            '$libdir/powa', 'powa_record_min_trans');
+        EXECUTE format('CREATE FUNCTION %s_max_trans(internal, %s)
+            RETURNS internal LANGUAGE c IMMUTABLE%s
+            AS %L, %L', v_name, v_type, v_fparallel,
+            '$libdir/powa', 'powa_record_max_trans');
+        EXECUTE format('CREATE FUNCTION %s_extrema_final(internal)
+            RETURNS %s LANGUAGE c IMMUTABLE%s
+            AS %L, %L', v_name, v_type, v_fparallel,
+            '$libdir/powa', 'powa_record_extrema_final');
+
+        EXECUTE format('CREATE AGGREGATE %1$s_min(%2$s) (
+            SFUNC = %1$s_min_trans,
+            STYPE = internal,
+            FINALFUNC = %1$s_extrema_final%3$s
+        )', v_name, v_type, v_aparallel);
+        EXECUTE format('CREATE AGGREGATE %1$s_max(%2$s) (
+            SFUNC = %1$s_max_trans,
+            STYPE = internal,
+            FINALFUNC = %1$s_extrema_final%3$s
+        )', v_name, v_type, v_aparallel);
+    END LOOP;
+END;
+$_$;
+/* end of history records min and max aggregates */
+
+CREATE OR REPLACE FUNCTION powa_user_functions_aggregate() RETURNS void AS $PROC$
+BEGIN
+    PERFORM powa_log('running powa_user_functions_aggregate');
+
+    -- aggregate user_functions table
+    LOCK TABLE powa_user_functions_history_current IN SHARE MODE; -- prevent any other update
+
+    INSERT INTO powa_user_functions_history
+        SELECT dbid, funcid,
+            tstzrange(min((record).ts), max((record).ts),'[]'),
+            array_agg(record),
+            powa_user_functions_history_record_min(record),
+            powa_user_functions_history_record_max(record)
+        FROM powa_user_functions_history_current
+        GROUP BY dbid, funcid;
+
+    TRUNCATE powa_user_functions_history_current;
+ END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_user_functions_aggregate */
+
+CREATE OR REPLACE FUNCTION powa_all_relations_aggregate() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_all_relations_aggregate';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- aggregate all_relations table
+    LOCK TABLE powa_all_relations_history_current IN SHARE MODE; -- prevent any other update
+
+    v_rowcount := powa_aggregate_history('powa_all_relations_history',
+        'SELECT dbid, relid,
+            tstzrange(min((record).ts), max((record).ts), ''[]''),
+            powa_records_agg(record),
+            powa_all_relations_history_record_min(record),
+            powa_all_relations_history_record_max(record)
+        FROM powa_all_relations_history_current
+        GROUP BY dbid, relid');
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_all_relations_history_current;
+ END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_all_relations_aggregate */
+
+CREATE OR REPLACE FUNCTION powa_kcache_aggregate() RETURNS void AS $PROC$
+DECLARE
+    result     bool;
+    v_funcname text := 'powa_kcache_aggregate';
+    v_rowcount bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- aggregate metrics table
+    LOCK TABLE powa_kcache_metrics_current IN SHARE MODE; -- prevent any other update
+
+    v_rowcount := powa_aggregate_history('powa_kcache_metrics (coalesce_range, queryid, dbid, userid, metrics, mins_in_range, maxs_in_range)',
+        'SELECT tstzrange(min((metrics).ts), max((metrics).ts), ''[]''),
+        queryid, dbid, userid, powa_records_agg(metrics),
+        powa_kcache_min(metrics),
+        powa_kcache_max(metrics)
+        FROM powa_kcache_metrics_current
+        GROUP BY queryid, dbid, userid');
+
+    perform powa_log(format('%I (powa_kcache_metrics) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_kcache_metrics_current;
+
+    -- aggregate metrics_db table
+    LOCK TABLE powa_kcache_metrics_current_db IN SHARE MODE; -- prevent any other update
+
+    v_rowcount := powa_aggregate_history('powa_kcache_metrics_db (coalesce_range, dbid, metrics, mins_in_range, maxs_in_range)',
+        'SELECT tstzrange(min((metrics).ts), max((metrics).ts), ''[]''),
+        dbid, powa_records_agg(metrics),
+        powa_kcache_min(metrics),
+        powa_kcache_max(metrics)
+        FROM powa_kcache_metrics_current_db
+        GROUP BY dbid');
+
+    perform powa_log(format('%I (powa_kcache_metrics_db) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_kcache_metrics_current_db;
+END
+$PROC$ language plpgsql; /* end of powa_kcache_aggregate */
+
+CREATE OR REPLACE FUNCTION powa_qualstats_aggregate() RETURNS void AS $PROC$
+DECLARE
+  result bool;
+BEGIN
+  PERFORM powa_log('running powa_qualstats_aggregate');
+
+  LOCK TABLE powa_qualstats_constvalues_history_current IN SHARE MODE;
+  LOCK TABLE powa_qualstats_quals_history_current IN SHARE MODE;
+  INSERT INTO powa_qualstats_constvalues_history (
+    qualid, queryid, dbid, userid, coalesce_range, most_used, most_filtering, least_filtering, most_executed)
+    SELECT * FROM powa_qualstats_aggregate_constvalues_current;
+  -- the values kept by the collector sketches, if any
+  INSERT INTO powa_qualstats_constvalues_history (
+    qualid, queryid, dbid, userid, coalesce_range, most_used, most_filtering, least_filtering, most_executed)
+    SELECT s.*
+    FROM powa_qualstats_constvalues_sketch() s
+    WHERE EXISTS (
+      SELECT 1
+      FROM powa_qualstats_quals q
+      WHERE q.qualid = s.qualid AND q.queryid = s.queryid
+        AND q.dbid = s.dbid AND q.userid = s.userid
+    );
+  INSERT INTO powa_qualstats_quals_history (qualid, queryid, dbid, userid, coalesce_range, records, mins_in_range, maxs_in_range)
+    SELECT qualid, queryid, dbid, userid, tstzrange(min(ts), max(ts),'[]'), array_agg((ts, occurences, execution_count, nbfiltered)::powa_qualstats_history_item),
+    powa_qualstats_history_item_min((ts, occurences, execution_count, nbfiltered)::powa_qualstats_history_item),
+    powa_qualstats_history_item_max((ts, occurences, execution_count, nbfiltered)::powa_qualstats_history_item)
+    FROM powa_qualstats_quals_history_current
+    GROUP BY qualid, queryid, dbid, userid;
+  TRUNCATE powa_qualstats_constvalues_history_current;
+  TRUNCATE powa_qualstats_quals_history_current;
+  PERFORM powa_qualstats_sketch_reset();
+END
+$PROC$ language plpgsql; /* end of powa_qualstats_aggregate */
+
+/* each distinct query text is only stored once */
+CREATE TABLE powa_statements_texts (
+    query_md5 uuid PRIMARY KEY,
+    query text NOT NULL
+);
+
+INSERT INTO powa_statements_texts (query_md5, query)
+    SELECT DISTINCT md5(query)::uuid, query
+    FROM powa_statements;
+
+ALTER TABLE powa_statements ADD COLUMN query_md5 uuid;
+UPDATE powa_statements SET query_md5 = md5(query)::uuid;
+ALTER TABLE powa_statements
+    ALTER COLUMN query_md5 SET NOT NULL,
+    ADD FOREIGN KEY (query_md5) REFERENCES powa_statements_texts (query_md5),
+    DROP COLUMN query;
+
+ALTER TABLE powa_statements RENAME TO powa_statements_base;
+
+/*
+ * The texts are stored separately, this view gives the same columns as the
+ * former powa_statements table.
+ */
+CREATE VIEW powa_statements AS
+    SELECT s.queryid, s.dbid, s.userid, t.query, s.query_md5
+    FROM powa_statements_base s
+    JOIN powa_statements_texts t USING (query_md5);
+
+SELECT pg_catalog.pg_extension_config_dump('powa_statements_texts','');
+
+CREATE OR REPLACE FUNCTION powa_qualstats_snapshot() RETURNS void as $PROC$
+DECLARE
+    result     bool;
+    v_funcname text := 'powa_qualstats_snapshot';
+    v_rowcount bigint;
+BEGIN
+  PERFORM powa_log(format('running %I', v_funcname));
+
+  WITH capture AS (
+    SELECT pgqs.*
+    FROM pg_qualstats_by_query pgqs
+    JOIN powa_statements_base s USING(queryid, dbid, userid)
+    WHERE NOT powa_is_ignored_user(s.userid)
+  ),
+  missing_quals AS (
+      INSERT INTO powa_qualstats_quals (qualid, queryid, dbid, userid, quals)
+        SELECT DISTINCT qs.qualnodeid, qs.queryid, qs.dbid, qs.userid, array_agg(DISTINCT q::qual_type)
+        FROM (SELECT * FROM capture c
+              WHERE NOT powa_qualstats_quals_known(c.qualnodeid, c.queryid,
+                c.dbid, c.userid)
+        ) qs,
+        LATERAL (SELECT (unnest(quals)).*) as q
+        WHERE NOT EXISTS (
+          SELECT 1
+          FROM powa_qualstats_quals nh
+          WHERE nh.qualid = qs.qualnodeid AND nh.queryid = qs.queryid
+            AND nh.dbid = qs.dbid AND nh.userid = qs.userid
+        )
+        GROUP BY qualnodeid, queryid, dbid, userid
+      RETURNING *
+  ),
+  by_qual AS (
+      INSERT INTO powa_qualstats_quals_history_current (qualid, queryid, dbid, userid, ts, occurences, execution_count, nbfiltered)
+      SELECT qs.qualnodeid, qs.queryid, qs.dbid, qs.userid, now(), sum(occurences), sum(execution_count), sum(nbfiltered)
+        FROM capture as qs
+        GROUP BY qualnodeid, qs.queryid, qs.dbid, qs.userid
+      RETURNING *
+  ),
+  by_qual_with_const AS (
+      INSERT INTO powa_qualstats_constvalues_history_current(qualid, queryid, dbid, userid, ts, occurences, execution_count, nbfiltered, constvalues)
+      SELECT qualnodeid, qs.queryid, qs.dbid, qs.userid, now(), occurences, execution_count, nbfiltered, constvalues
+      FROM capture as qs
+      WHERE NOT powa_qualstats_sketch_add(qs.qualnodeid, qs.queryid, qs.dbid,
+        qs.userid, qs.constvalues, qs.occurences, qs.execution_count,
+        qs.nbfiltered)
+  )
+  SELECT COUNT(*) into v_rowcount
+  FROM capture;
+
+  perform powa_log(format('%I - rowcount: %s',
+        v_funcname, v_rowcount));
+
+  result := true;
+  PERFORM pg_qualstats_reset();
+END
+$PROC$ language plpgsql; /* end of powa_qualstats_snapshot */
+
+/* powa.ignored_users, resolved once to role oids */
+CREATE FUNCTION powa_is_ignored_user(userid oid)
+    RETURNS boolean
+    LANGUAGE c STABLE STRICT
+AS '$libdir/powa', 'powa_is_ignored_user';
+
+CREATE FUNCTION powa_ignored_users_oids()
+    RETURNS oid[]
+    LANGUAGE c STABLE
+AS '$libdir/powa', 'powa_ignored_users_oids';
+
+/* bucketed rates of many statements, for the UI */
+CREATE FUNCTION powa_statements_history_range(IN _queryids bigint[],
+    IN _range tstzrange,
+    IN _bucket interval,
+    OUT queryid bigint,
+    OUT dbid oid,
+    OUT userid oid,
+    OUT ts timestamp with time zone,
+    OUT rate powa_statements_history_rate)
+    RETURNS SETOF record
+    LANGUAGE c STABLE STRICT
+AS '$libdir/powa', 'powa_statements_history_range';
+
+/* remote servers collected by powa_remote_snapshot() */
+CREATE TABLE powa_servers (
+    id serial PRIMARY KEY,
+    hostname text NOT NULL,
+    port integer NOT NULL DEFAULT 5432,
+    username text NOT NULL DEFAULT 'powa',
+    dbname text NOT NULL DEFAULT 'powa',
+    service text,
+    passfile text,
+    relations_dbnames text[],
+    enabled boolean NOT NULL DEFAULT true,
+    last_snapshot timestamp with time zone,
+    UNIQUE (hostname, port)
+);
+COMMENT ON COLUMN powa_servers.service IS
+    'libpq service to use for the other connection parameters, if any';
+COMMENT ON COLUMN powa_servers.passfile IS
+    'password file to use rather than ~/.pgpass of the server, if any';
+COMMENT ON COLUMN powa_servers.relations_dbnames IS
+    'databases whose relations statistics are collected, if any';
+
+-- no password is stored here, but the table still describes how to connect
+REVOKE ALL ON powa_servers FROM PUBLIC;
+
+CREATE TABLE powa_remote_statements (
+    srvid integer NOT NULL REFERENCES powa_servers (id) ON DELETE CASCADE,
+    queryid bigint NOT NULL,
+    dbid oid NOT NULL,
+    userid oid NOT NULL,
+    query_md5 uuid NOT NULL REFERENCES powa_statements_texts (query_md5),
+    PRIMARY KEY (srvid, queryid, dbid, userid)
+);
+
+CREATE TABLE powa_remote_statements_history (
+    srvid integer NOT NULL REFERENCES powa_servers (id) ON DELETE CASCADE,
+    queryid bigint NOT NULL,
+    dbid oid NOT NULL,
+    userid oid NOT NULL,
+    coalesce_range tstzrange NOT NULL,
+    records powa_statements_history_block NOT NULL,
+    mins_in_range powa_statements_history_record NOT NULL,
+    maxs_in_range powa_statements_history_record NOT NULL
+);
+
+CREATE INDEX powa_remote_statements_history_query_ts ON powa_remote_statements_history USING gist (srvid, queryid, coalesce_range);
+
+CREATE TABLE powa_remote_statements_history_db (
+    srvid integer NOT NULL REFERENCES powa_servers (id) ON DELETE CASCADE,
+    dbid oid NOT NULL,
+    coalesce_range tstzrange NOT NULL,
+    records powa_statements_history_block NOT NULL,
+    mins_in_range powa_statements_history_record NOT NULL,
+    maxs_in_range powa_statements_history_record NOT NULL
+);
+
+CREATE INDEX powa_remote_statements_history_db_ts ON powa_remote_statements_history_db USING gist (srvid, dbid, coalesce_range);
+
+CREATE TABLE powa_remote_statements_history_current (
+    srvid integer NOT NULL,
+    queryid bigint NOT NULL,
+    dbid oid NOT NULL,
+    userid oid NOT NULL,
+    record powa_statements_history_record NOT NULL
+);
+
+CREATE TABLE powa_remote_statements_history_current_db (
+    srvid integer NOT NULL,
+    dbid oid NOT NULL,
+    record powa_statements_history_record NOT NULL
+);
+
+CREATE TABLE powa_remote_all_relations_history (
+    srvid integer NOT NULL REFERENCES powa_servers (id) ON DELETE CASCADE,
+    dbid oid NOT NULL,
+    relid oid NOT NULL,
+    coalesce_range tstzrange NOT NULL,
+    records powa_all_relations_history_record[] NOT NULL,
+    mins_in_range powa_all_relations_history_record NOT NULL,
+    maxs_in_range powa_all_relations_history_record NOT NULL
+);
+
+CREATE INDEX powa_remote_all_relations_history_relid_ts ON powa_remote_all_relations_history USING gist (srvid, relid, coalesce_range);
+
+CREATE TABLE powa_remote_all_relations_history_current (
+    srvid integer NOT NULL,
+    dbid oid NOT NULL,
+    relid oid NOT NULL,
+    record powa_all_relations_history_record NOT NULL
+);
+
+SELECT pg_catalog.pg_extension_config_dump('powa_servers','');
+SELECT pg_catalog.pg_extension_config_dump('powa_servers_id_seq','');
+SELECT pg_catalog.pg_extension_config_dump('powa_remote_statements','');
+SELECT pg_catalog.pg_extension_config_dump('powa_remote_statements_history','');
+SELECT pg_catalog.pg_extension_config_dump('powa_remote_statements_history_db','');
+SELECT pg_catalog.pg_extension_config_dump('powa_remote_statements_history_current','');
+SELECT pg_catalog.pg_extension_config_dump('powa_remote_statements_history_current_db','');
+SELECT pg_catalog.pg_extension_config_dump('powa_remote_all_relations_history','');
+SELECT pg_catalog.pg_extension_config_dump('powa_remote_all_relations_history_current','');
+
+INSERT INTO powa_functions (module, operation, function_name, added_manually, enabled) VALUES
+    ('powa_remote', 'snapshot', 'powa_remote_snapshot', false, true),
+    ('powa_remote', 'aggregate', 'powa_remote_aggregate', false, true),
+    ('powa_remote', 'purge', 'powa_remote_purge', false, true),
+    ('powa_remote', 'reset', 'powa_remote_reset', false, true);
+
+CREATE FUNCTION powa_remote_fetch_statements(IN ignore_regexp text,
+    OUT srvid integer,
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT query text,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT rows bigint,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint,
+    OUT shared_blks_dirtied bigint,
+    OUT shared_blks_written bigint,
+    OUT local_blks_hit bigint,
+    OUT local_blks_read bigint,
+    OUT local_blks_dirtied bigint,
+    OUT local_blks_written bigint,
+    OUT temp_blks_read bigint,
+    OUT temp_blks_written bigint,
+    OUT blk_read_time double precision,
+    OUT blk_write_time double precision)
+    RETURNS SETOF record
+    LANGUAGE c STRICT
+AS '$libdir/powa', 'powa_remote_fetch_statements';
+
+/* same as powa_stat_all_rel_cluster(), for the remote servers */
+CREATE FUNCTION powa_remote_fetch_relations(OUT srvid integer,
+    OUT dbid oid,
+    OUT relid oid,
+    OUT numscan bigint,
+    OUT tup_returned bigint,
+    OUT tup_fetched bigint,
+    OUT n_tup_ins bigint,
+    OUT n_tup_upd bigint,
+    OUT n_tup_del bigint,
+    OUT n_tup_hot_upd bigint,
+    OUT n_liv_tup bigint,
+    OUT n_dead_tup bigint,
+    OUT n_mod_since_analyze bigint,
+    OUT blks_read bigint,
+    OUT blks_hit bigint,
+    OUT last_vacuum timestamp with time zone,
+    OUT vacuum_count bigint,
+    OUT last_autovacuum timestamp with time zone,
+    OUT autovacuum_count bigint,
+    OUT last_analyze timestamp with time zone,
+    OUT analyze_count bigint,
+    OUT last_autoanalyze timestamp with time zone,
+    OUT autoanalyze_count bigint)
+    RETURNS SETOF record
+    LANGUAGE c
+AS '$libdir/powa', 'powa_remote_fetch_relations';
+
+/*
+ * Same as powa_statements_snapshot() and powa_all_relations_snapshot(), for
+ * all the servers of powa_servers.  The remote servers only need
+ * pg_stat_statements, and a role allowed to see all of its entries and to
+ * connect to the powa_servers.relations_dbnames databases.
+ */
+CREATE OR REPLACE FUNCTION powa_remote_snapshot() RETURNS void AS $PROC$
+DECLARE
+    ignore_regexp text :='^[[:space:]]*(DEALLOCATE|BEGIN|PREPARE TRANSACTION|COMMIT PREPARED|ROLLBACK PREPARED)';
+    v_funcname    text := 'powa_remote_snapshot';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    IF NOT EXISTS (SELECT 1 FROM powa_servers WHERE enabled) THEN
+        RETURN;
+    END IF;
+
+    WITH capture AS(
+        SELECT *
+        FROM powa_remote_fetch_statements(ignore_regexp)
+    ),
+
+    missing AS(
+        SELECT srvid, queryid, dbid, userid, query, md5(query)::uuid AS query_md5
+            FROM capture c
+            WHERE NOT EXISTS (SELECT 1
+                              FROM powa_remote_statements ps
+                              WHERE ps.srvid = c.srvid
+                              AND ps.queryid = c.queryid
+                              AND ps.dbid = c.dbid
+                              AND ps.userid = c.userid
+            )
+    ),
+
+    missing_texts AS(
+        INSERT INTO powa_statements_texts (query_md5, query)
+            SELECT DISTINCT query_md5, query
+            FROM missing m
+            WHERE NOT EXISTS (SELECT 1
+                              FROM powa_statements_texts pt
+                              WHERE pt.query_md5 = m.query_md5
+            )
+    ),
+
+    missing_statements AS(
+        INSERT INTO powa_remote_statements (srvid, queryid, dbid, userid, query_md5)
+            SELECT srvid, queryid, dbid, userid, query_md5
+            FROM missing
+    ),
+
+    by_query AS (
+        INSERT INTO powa_remote_statements_history_current
+            SELECT srvid, queryid, dbid, userid,
+            ROW(
+                now(), calls, total_time, rows, shared_blks_hit, shared_blks_read,
+                shared_blks_dirtied, shared_blks_written, local_blks_hit, local_blks_read,
+                local_blks_dirtied, local_blks_written, temp_blks_read, temp_blks_written,
+                blk_read_time, blk_write_time
+            )::powa_statements_history_record AS record
+            FROM capture
+    ),
+
+    by_database AS (
+        INSERT INTO powa_remote_statements_history_current_db
+            SELECT srvid, dbid,
+            ROW(
+                now(), sum(calls), sum(total_time), sum(rows), sum(shared_blks_hit), sum(shared_blks_read),
+                sum(shared_blks_dirtied), sum(shared_blks_written), sum(local_blks_hit), sum(local_blks_read),
+                sum(local_blks_dirtied), sum(local_blks_written), sum(temp_blks_read), sum(temp_blks_written),
+                sum(blk_read_time), sum(blk_write_time)
+            )::powa_statements_history_record AS record
+            FROM capture
+            GROUP BY srvid, dbid
+    ),
+
+    collected AS (
+        UPDATE powa_servers s SET last_snapshot = now()
+            WHERE s.id IN (SELECT srvid FROM capture)
+    )
+
+    SELECT count(*) INTO v_rowcount
+    FROM capture;
+
+    perform powa_log(format('%I - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    IF EXISTS (SELECT 1 FROM powa_servers
+               WHERE enabled AND relations_dbnames IS NOT NULL) THEN
+        INSERT INTO powa_remote_all_relations_history_current
+            SELECT srvid, dbid, relid,
+            ROW(now(), numscan, tup_returned, tup_fetched,
+                n_tup_ins, n_tup_upd, n_tup_del, n_tup_hot_upd,
+                n_liv_tup, n_dead_tup, n_mod_since_analyze,
+                blks_read, blks_hit, last_vacuum, vacuum_count,
+                last_autovacuum, autovacuum_count, last_analyze,
+                analyze_count, last_autoanalyze,
+                autoanalyze_count)::powa_all_relations_history_record AS record
+            FROM powa_remote_fetch_relations();
+
+        GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+        perform powa_log(format('%I (relations) - rowcount: %s',
+                v_funcname, v_rowcount));
+    END IF;
+END;
+$PROC$ language plpgsql; /* end of powa_remote_snapshot */
+
+CREATE OR REPLACE FUNCTION powa_remote_aggregate() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_remote_aggregate';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    -- aggregate statements table
+    LOCK TABLE powa_remote_statements_history_current IN SHARE MODE; -- prevent any other update
+
+    INSERT INTO powa_remote_statements_history
+        SELECT srvid, queryid, dbid, userid,
+            tstzrange(min((record).ts), max((record).ts),'[]'),
+            powa_statements_history_block_agg(record),
+            powa_statements_history_record_min(record),
+            powa_statements_history_record_max(record)
+        FROM powa_remote_statements_history_current
+        GROUP BY srvid, queryid, dbid, userid;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('%I (powa_remote_statements_history) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_remote_statements_history_current;
+
+    -- aggregate db table
+    LOCK TABLE powa_remote_statements_history_current_db IN SHARE MODE; -- prevent any other update
+
+    INSERT INTO powa_remote_statements_history_db
+        SELECT srvid, dbid,
+            tstzrange(min((record).ts), max((record).ts),'[]'),
+            powa_statements_history_block_agg(record),
+            powa_statements_history_record_min(record),
+            powa_statements_history_record_max(record)
+        FROM powa_remote_statements_history_current_db
+        GROUP BY srvid, dbid;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('%I (powa_remote_statements_history_db) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_remote_statements_history_current_db;
+
+    -- aggregate relations table
+    LOCK TABLE powa_remote_all_relations_history_current IN SHARE MODE; -- prevent any other update
+
+    INSERT INTO powa_remote_all_relations_history
+        SELECT srvid, dbid, relid,
+            tstzrange(min((record).ts), max((record).ts),'[]'),
+            powa_records_agg(record),
+            powa_all_relations_history_record_min(record),
+            powa_all_relations_history_record_max(record)
+        FROM powa_remote_all_relations_history_current
+        GROUP BY srvid, dbid, relid;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    perform powa_log(format('%I (powa_remote_all_relations_history) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    TRUNCATE powa_remote_all_relations_history_current;
+ END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_remote_aggregate */
+
+CREATE OR REPLACE FUNCTION powa_remote_purge() RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := 'powa_remote_purge';
+    v_rowcount    bigint;
+BEGIN
+    PERFORM powa_log(format('running %I', v_funcname));
+
+    v_rowcount := powa_purge_history('powa_remote_statements_history');
+
+    perform powa_log(format('%I (powa_remote_statements_history) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    v_rowcount := powa_purge_history('powa_remote_statements_history_db');
+
+    perform powa_log(format('%I (powa_remote_statements_history_db) - rowcount: %s',
+            v_funcname, v_rowcount));
+
+    v_rowcount := powa_purge_history('powa_remote_all_relations_history');
+
+    perform powa_log(format('%I (powa_remote_all_relations_history) - rowcount: %s',
+            v_funcname, v_rowcount));
+END;
+$PROC$ LANGUAGE plpgsql; /* end of powa_remote_purge */
+
+CREATE OR REPLACE FUNCTION public.powa_remote_reset()
+ RETURNS boolean
+ LANGUAGE plpgsql
+AS $function$
+BEGIN
+    PERFORM powa_log('truncating powa_remote_statements_history');
+    TRUNCATE TABLE powa_remote_statements_history;
+
+    PERFORM powa_log('truncating powa_remote_statements_history_current');
+    TRUNCATE TABLE powa_remote_statements_history_current;
+
+    PERFORM powa_log('truncating powa_remote_statements_history_db');
+    TRUNCATE TABLE powa_remote_statements_history_db;
+
+    PERFORM powa_log('truncating powa_remote_statements_history_current_db');
+    TRUNCATE TABLE powa_remote_statements_history_current_db;
+
+    PERFORM powa_log('truncating powa_remote_all_relations_history');
+    TRUNCATE TABLE powa_remote_all_relations_history;
+
+    PERFORM powa_log('truncating powa_remote_all_relations_history_current');
+    TRUNCATE TABLE powa_remote_all_relations_history_current;
+
+    PERFORM powa_log('truncating powa_remote_statements');
+    TRUNCATE TABLE powa_remote_statements;
+    RETURN true;
+END;
+$function$; /* end of powa_remote_reset */
+
+/* fix the least_filtering order and the qual_values fields order */
+CREATE OR REPLACE VIEW powa_qualstats_aggregate_constvalues_current AS
+WITH consts AS (
+  SELECT qualid, queryid, dbid, userid, min(ts) as mints, max(ts) as maxts,
+  sum(occurences) as occurences,
+  sum(nbfiltered) as nbfiltered,
+  sum(execution_count) as execution_count, constvalues
+  FROM powa_qualstats_constvalues_history_current
+  GROUP BY qualid, queryid, dbid, userid, constvalues
+),
+groups AS (
+  SELECT qualid, queryid, dbid, userid, tstzrange(min(mints), max(maxts),'[]')
+  FROM consts
+  GROUP BY qualid, queryid, dbid, userid
+)
+SELECT *
+FROM groups,
+LATERAL (
+  SELECT array_agg(constvalues) as mu
+  FROM (
+    SELECT (constvalues, occurences, execution_count, nbfiltered)::qual_values as constvalues
+    FROM consts
+    WHERE consts.qualid = groups.qualid AND consts.queryid = groups.queryid
+    AND consts.dbid = groups.dbid AND consts.userid = groups.userid
+    ORDER BY occurences desc
+    LIMIT 20
+  ) s
+) as mu,
+LATERAL (
+  SELECT array_agg(constvalues) as mf
+  FROM (
+    SELECT (constvalues, occurences, execution_count, nbfiltered)::qual_values as constvalues
+    FROM consts
+    WHERE consts.qualid = groups.qualid AND consts.queryid = groups.queryid
+    AND consts.dbid = groups.dbid AND consts.userid = groups.userid
+    ORDER BY CASE WHEN execution_count = 0 THEN 0 ELSE nbfiltered / execution_count::numeric END DESC
+    LIMIT 20
+  ) s
+) as mf,
+LATERAL (
+  SELECT array_agg(constvalues) as lf
+  FROM (
+    SELECT (constvalues, occurences, execution_count, nbfiltered)::qual_values as constvalues
+    FROM consts
+    WHERE consts.qualid = groups.qualid AND consts.queryid = groups.queryid
+    AND consts.dbid = groups.dbid AND consts.userid = groups.userid
+    ORDER BY CASE WHEN execution_count = 0 THEN 0 ELSE nbfiltered / execution_count::numeric END ASC
+    LIMIT 20
+  ) s
+) as lf,
+LATERAL (
+  SELECT array_agg(constvalues) as me
+  FROM (
+    SELECT (constvalues, occurences, execution_count, nbfiltered)::qual_values as constvalues
+    FROM consts
+    WHERE consts.qualid = groups.qualid AND consts.queryid = groups.queryid
+    AND consts.dbid = groups.dbid AND consts.userid = groups.userid
+    ORDER BY execution_count desc
+    LIMIT 20
+  ) s
+) as me;
+
+/*
+ * The values already aggregated have their execution_count and nbfiltered
+ * fields swapped, fix them so all the history has the same meaning.
+ */
+UPDATE powa_qualstats_constvalues_history SET
+    most_used = CASE WHEN most_used IS NOT NULL THEN ARRAY(
+        SELECT ((most_used[i]).constants, (most_used[i]).occurences,
+            (most_used[i]).nbfiltered, (most_used[i]).execution_count)::qual_values
+        FROM generate_subscripts(most_used, 1) i
+        ORDER BY i) END,
+    most_filtering = CASE WHEN most_filtering IS NOT NULL THEN ARRAY(
+        SELECT ((most_filtering[i]).constants, (most_filtering[i]).occurences,
+            (most_filtering[i]).nbfiltered, (most_filtering[i]).execution_count)::qual_values
+        FROM generate_subscripts(most_filtering, 1) i
+        ORDER BY i) END,
+    least_filtering = CASE WHEN least_filtering IS NOT NULL THEN ARRAY(
+        SELECT ((least_filtering[i]).constants, (least_filtering[i]).occurences,
+            (least_filtering[i]).nbfiltered, (least_filtering[i]).execution_count)::qual_values
+        FROM generate_subscripts(least_filtering, 1) i
+        ORDER BY i) END,
+    most_executed = CASE WHEN most_executed IS NOT NULL THEN ARRAY(
+        SELECT ((most_executed[i]).constants, (most_executed[i]).occurences,
+            (most_executed[i]).nbfiltered, (most_executed[i]).execution_count)::qual_values
+        FROM generate_subscripts(most_executed, 1) i
+        ORDER BY i) END;
+
+/*
+ * powa_qualstats_reset
+ */
+CREATE OR REPLACE FUNCTION powa_qualstats_reset() RETURNS void as $PROC$
+BEGIN
+  PERFORM powa_log('running powa_qualstats_reset');
+
+  PERFORM powa_log('truncating powa_qualstats_quals');
+  TRUNCATE TABLE powa_qualstats_quals CASCADE;
+  -- cascaded :
+  -- powa_qualstats_quals_history
+  -- powa_qualstats_quals_history_current
+  -- powa_qualstats_constvalues_history
+  -- powa_qualstats_constvalues_history_current
+  PERFORM powa_qualstats_sketch_reset();
+END;
+$PROC$ language plpgsql; /* end of powa_qualstats_reset */
+
+/* tell the background workers to reload their list of functions */
+CREATE FUNCTION powa_functions_changed()
+    RETURNS trigger
+    LANGUAGE c
+AS '$libdir/powa', 'powa_functions_changed';
+
+CREATE TRIGGER powa_functions_changed
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON powa_functions
+    FOR EACH STATEMENT EXECUTE PROCEDURE powa_functions_changed();
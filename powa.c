@@ -10,6 +10,10 @@
 
 #include "postgres.h"
 
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+
 /* For a bgworker */
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
@@ -17,7 +21,13 @@
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
 #include "storage/shmem.h"
+#if PG_VERSION_NUM >= 90500
+#include "port/atomics.h"
+#else
+#include "storage/barrier.h"
+#endif
 
 /* Access a database */
 #include "access/xact.h"
@@ -25,15 +35,50 @@
 #include "fmgr.h"
 #include "lib/stringinfo.h"
 #include "utils/builtins.h"
+#include "utils/memutils.h"
 #include "utils/snapmgr.h"
 
 /* Some catalog elements */
 #include "catalog/pg_type.h"
 #include "utils/timestamp.h"
 
+/* Composite types handling */
+#include "access/htup_details.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/rangetypes.h"
+#include "utils/typcache.h"
+#if PG_VERSION_NUM >= 110000
+#include "common/int.h"
+#endif
+
 /* There is a GUC */
 #include "utils/guc.h"
 
+/* Native snapshot */
+#include "access/heapam.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/table.h"
+#include "access/tableam.h"
+#include "executor/tuptable.h"
+#endif
+#include "catalog/namespace.h"
+#include "nodes/makefuncs.h"
+#include "utils/acl.h"
+#include "utils/inval.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+/* qualstats sketches */
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "access/hash.h"
+#endif
+
+/* powa_functions trigger */
+#include "commands/trigger.h"
+
 /* We use tuplestore */
 #include "funcapi.h"
 
@@ -43,11 +88,87 @@
 /* rename process */
 #include "utils/ps_status.h"
 
+/* Collector instrumentation */
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "utils/pg_rusage.h"
+
+/* Cluster-wide stats collection */
+#if PG_VERSION_NUM >= 150000
+#include "lib/dshash.h"
+#include "utils/pgstat_internal.h"
+#endif
+
+/* Parallel stats collection */
+#include "storage/dsm.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+
+/* Remote collection */
+#ifndef WIN32
+#include <poll.h>
+#endif
+#include "libpq-fe.h"
+#include "mb/pg_wchar.h"
+
 PG_MODULE_MAGIC;
 
 #define POWA_STAT_FUNC_COLS	4	/* # of cols for functions stat SRF */
 #define POWA_STAT_TAB_COLS	21	/* # of cols for relations stat SRF */
 #define MIN_POWA_FREQUENCY	5000 /* minimum ms between two snapshots */
+#define POWA_MAX_BACKOFF	16	/* maximum automatic frequency multiplier */
+
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+#if PG_VERSION_NUM < 120000
+#define table_open(r, l)	heap_open(r, l)
+#define table_close(r, l)	heap_close(r, l)
+#endif
+
+#if PG_VERSION_NUM >= 110000
+#define POWA_ACL_KIND_CLASS	OBJECT_TABLE
+#else
+#define POWA_ACL_KIND_CLASS	ACL_KIND_CLASS
+#endif
+
+#ifndef INT8ARRAYOID
+#define INT8ARRAYOID		1016
+#endif
+
+#if PG_VERSION_NUM < 110000
+#define PG_GETARG_RANGE_P(n)	PG_GETARG_RANGE(n)
+#define RangeTypePGetDatum(X)	RangeTypeGetDatum(X)
+
+#ifndef PG_INT64_MIN
+#define PG_INT64_MIN	(-INT64CONST(0x7FFFFFFFFFFFFFFF) - 1)
+#define PG_INT64_MAX	INT64CONST(0x7FFFFFFFFFFFFFFF)
+#endif
+
+static inline bool
+pg_sub_s64_overflow(int64 a, int64 b, int64 *result)
+{
+	if ((b > 0 && a < PG_INT64_MIN + b) ||
+		(b < 0 && a > PG_INT64_MAX + b))
+		return true;
+	*result = a - b;
+	return false;
+}
+#endif
+
+/* # of counters in a powa_statements_history_record, ts excluded */
+#define POWA_STATEMENTS_COUNTERS	15
+/* max # of counters summed per database by the native snapshot */
+#define POWA_DBSUMS_MAX_COUNTERS	POWA_STATEMENTS_COUNTERS
+/* max # of fields remembered for powa.store_unchanged, ts excluded */
+#define POWA_LAST_MAX_FIELDS		(POWA_STAT_TAB_COLS - 1)
+/* max # of fields of the records handled by the min and max aggregates */
+#define POWA_EXTREMA_MAX_FIELDS		32
+/* max # of fields of the records kept for powa.streaming_aggregate */
+#define POWA_STREAM_MAX_FIELDS		(POWA_STATEMENTS_COUNTERS + 1)
 
 typedef enum
 {
@@ -55,24 +176,1098 @@ typedef enum
 	POWA_STAT_TABLE
 }	PowaStatKind;
 
+/* callback for each entry retrieved by powa_stat_fetch() */
+typedef void (*PowaStatCallback) (Datum *values, bool *nulls, void *arg);
+
+/* same, for functions retrieving the stats of multiple databases */
+typedef void (*PowaStatDbCallback) (Oid dbid, Datum *values, bool *nulls,
+									void *arg);
+
+typedef enum
+{
+	POWA_STAT_COLLECTION_PER_DATABASE,
+	POWA_STAT_COLLECTION_PARALLEL,
+	POWA_STAT_COLLECTION_CLUSTER
+}	PowaStatCollection;
+
+static const struct config_enum_entry powa_stat_collection_options[] = {
+	{"per_database", POWA_STAT_COLLECTION_PER_DATABASE, false},
+	{"parallel", POWA_STAT_COLLECTION_PARALLEL, false},
+#if PG_VERSION_NUM >= 150000
+	/* older pgstat can't give fresh statistics of all databases at once */
+	{"cluster", POWA_STAT_COLLECTION_CLUSTER, false},
+#endif
+	{NULL, 0, false}
+};
+
+/*
+ * Parallel stats collection.
+ *
+ * The leader creates a DSM segment containing a PowaStatParallelHeader and
+ * one shm_mq per worker, and launches the dynamic background workers.  Each
+ * worker then picks the next database to process, and sends a PowaStatMsg
+ * per entry to the leader.
+ */
+#define POWA_STAT_MQ_MAGIC			0x504f5741	/* "POWA" */
+#define POWA_STAT_QUEUE_SIZE		65536
+#define POWA_MAX_PARALLEL_WORKERS	64
+
+#define POWA_COLLECTOR_MAX_ENTRIES	128	/* # of tracked collector functions */
+#define POWA_COLLECTOR_MAX_DEPTH	8	/* max # of nested measures */
+#define POWA_COLLECTOR_COLS			15	/* # of cols for powa_collector_stats() */
+
+typedef struct PowaStatParallelHeader
+{
+	slock_t		mutex;			/* protects nextdb and done */
+	Oid			leader_dbid;	/* database to connect to */
+	PowaStatKind kind;
+	int			nextdb;			/* next database to process */
+	bool		done[POWA_MAX_PARALLEL_WORKERS];	/* worker finished */
+	int			ndbs;
+	Oid			dbids[1];		/* VARIABLE LENGTH ARRAY */
+}	PowaStatParallelHeader;
+
+typedef struct PowaStatMsg
+{
+	Oid			dbid;
+	bool		nulls[POWA_STAT_TAB_COLS];
+	uint64		values[POWA_STAT_TAB_COLS];	/* raw 64 bits representation */
+}	PowaStatMsg;
+
+#if PG_VERSION_NUM >= 150000
+/* adapter to call a PowaStatCallback from powa_stat_fetch_cluster() */
+typedef struct PowaStatCallbackArg
+{
+	PowaStatCallback callback;
+	void	   *arg;
+}	PowaStatCallbackArg;
+#endif
+
+/* state of a parallel stats worker */
+typedef struct PowaStatWorkerState
+{
+	shm_mq_handle *mqh;
+	const Oid  *coltypes;
+	int			ncols;
+	PowaStatMsg msg;
+}	PowaStatWorkerState;
+
+/* adapter to call a PowaStatDbCallback from powa_stat_fetch() */
+typedef struct PowaStatDbCallbackArg
+{
+	Oid			dbid;
+	PowaStatDbCallback callback;
+	void	   *arg;
+}	PowaStatDbCallbackArg;
+
+typedef struct PowaStatTuplestore
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+}	PowaStatTuplestore;
+
+#if PG_VERSION_NUM >= 150000
+/* state of powa_stat_all_rel() in value-per-call mode */
+typedef struct PowaStatStream
+{
+	Oid			dbid;
+	Oid		   *relids;			/* relations to return */
+	int			nrelids;
+	int			next;			/* next relation to return */
+	Datum		values[POWA_STAT_TAB_COLS];
+	bool		nulls[POWA_STAT_TAB_COLS];
+}	PowaStatStream;
+#endif
+
+typedef enum
+{
+	POWA_RECORD_MI,				/* record - record, gives a *_diff */
+	POWA_RECORD_DIV				/* record / record, gives a *_rate */
+}	PowaRecordOpKind;
+
+/*
+ * Per-call-site cache for the - and / operators on the history records.
+ *
+ * All the history record types start with a timestamptz, followed by bigint
+ * and double precision counters, possibly interleaved with other timestamptz
+ * (last_vacuum and friends) that aren't part of the diff or rate types.  The
+ * layout is computed once and kept in fn_extra, so each call only has to
+ * deform the two records and form the result.
+ */
+typedef struct PowaRecordOpCache
+{
+	Oid			argtype;		/* composite type of the records */
+	int32		argtypmod;
+	TupleDesc	argdesc;		/* tupdesc of the records */
+	TupleDesc	resdesc;		/* blessed tupdesc of the result */
+	int			nfields;		/* number of counters */
+	int		   *attnums;		/* 0-based attnum of each counter */
+	Datum	   *avalues;		/* workspace to deform the records */
+	bool	   *anulls;
+	Datum	   *bvalues;
+	bool	   *bnulls;
+	Datum	   *rvalues;		/* workspace to form the result */
+	bool	   *rnulls;
+}	PowaRecordOpCache;
+
+/*
+ * Columnar storage of a set of history records.
+ *
+ * A block stores the records field by field rather than as an array of
+ * composites, so there's no per-record tuple header and each field can be
+ * encoded according to its nature:
+ *
+ * - the timestamps are delta-of-delta encoded, which is almost always 0 as
+ *	 snapshots are taken at a fixed frequency
+ * - the bigint counters are delta encoded
+ * - the double precision counters are XOR-ed with the previous value, which
+ *	 clears most of the high bits for slowly increasing counters, and
+ *	 written the Gorilla way: a 0 bit if the XOR is 0, otherwise 10 followed
+ *	 by the meaningful bits if they fit in the previous window of leading and
+ *	 trailing zeros and it's not much wider, or 11 followed by the number of
+ *	 leading zeros on 5 bits, the number of meaningful bits minus one on 6
+ *	 bits, and the meaningful bits
+ *
+ * The timestamps and bigints are written as zigzag varints, and the double
+ * precision values as a bit stream padded to a whole byte.  The on-disk
+ * layout is the PowaHistoryBlock header, followed by one kind
+ * (POWA_BLOCK_KIND_*) per field, followed for each field by a uint32 length
+ * and the field stream.  A field stream starts with a flag byte, optionally
+ * followed by a NULL bitmap, and then the encoded non-NULL values.
+ */
+#define POWA_BLOCK_VERSION		1
+
+#define POWA_BLOCK_KIND_TS		't'
+#define POWA_BLOCK_KIND_INT8	'i'
+#define POWA_BLOCK_KIND_FLOAT8	'f'
+
+#define POWA_BLOCK_HAS_NULLS	0x01	/* field stream has a NULL bitmap */
+
+#define POWA_ZIGZAG(v)		(((uint64) (v) << 1) ^ (uint64) ((int64) (v) >> 63))
+#define POWA_UNZIGZAG(v)	((uint64) (((v) >> 1) ^ (~((v) & 1) + 1)))
+
+typedef struct PowaHistoryBlock
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	uint8		version;		/* POWA_BLOCK_VERSION */
+	uint8		ncols;			/* number of fields of the records */
+	uint16		flags;			/* unused for now */
+	int32		nsamples;		/* number of records */
+	/* kinds and field streams follow */
+}	PowaHistoryBlock;
+
+#define POWA_BLOCK_DATA(b)	(((char *) (b)) + sizeof(PowaHistoryBlock))
+
+#define PG_GETARG_POWA_BLOCK_P(n) \
+	((PowaHistoryBlock *) PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+/*
+ * Uncompressed, column-wise, version of a block.  All values are kept as
+ * their raw 64 bits representation.
+ */
+typedef struct PowaBlockColumns
+{
+	TupleDesc	tupdesc;		/* tupdesc of the records, if known */
+	int			ncols;
+	char	   *kinds;			/* POWA_BLOCK_KIND_* of each field */
+	int			nsamples;
+	int			capacity;		/* allocated number of samples */
+	uint64	  **values;			/* values[field][sample] */
+	bool	  **nulls;			/* nulls[field][sample] */
+	Datum	   *workvalues;		/* workspace to (de)form records */
+	bool	   *worknulls;
+}	PowaBlockColumns;
+
+/* Bit streams of the double precision fields of a block, MSB first */
+typedef struct PowaBitWriter
+{
+	StringInfo	buf;
+	uint8		cur;			/* byte being filled */
+	int			nused;			/* # of bits used in cur */
+	int			lead;			/* current window, lead is -1 if none */
+	int			trail;
+}	PowaBitWriter;
+
+typedef struct PowaBitReader
+{
+	const char *p;
+	const char *end;
+	int			nused;			/* # of bits read in *p */
+	int			lead;			/* current window, lead is -1 if none */
+	int			trail;
+}	PowaBitReader;
+
+/*
+ * State of the field-wise min and max aggregates of history records.  Only
+ * the fields up to tupdesc are serialized.
+ */
+typedef struct PowaRecordExtrema
+{
+	Oid			typid;			/* composite type of the records */
+	int32		typmod;
+	bool		ismax;			/* max() rather than min() */
+	int			natts;
+	uint32		hasvalue;		/* bitmap of fields seen not NULL */
+	char		kinds[POWA_EXTREMA_MAX_FIELDS];	/* POWA_BLOCK_KIND_* */
+	uint64		values[POWA_EXTREMA_MAX_FIELDS];
+	TupleDesc	tupdesc;		/* cached tupdesc of typid, can be NULL */
+}	PowaRecordExtrema;
+
+#define POWA_EXTREMA_SERIALIZED_SIZE	offsetof(PowaRecordExtrema, tupdesc)
+
+/*
+ * Per-database sums of the counters, accumulated by the native snapshot while
+ * the per-query rows are emitted.
+ */
+typedef union PowaCounter
+{
+	int64		i;
+	double		f;
+}	PowaCounter;
+
+typedef struct PowaDbSumsEntry
+{
+	Oid			dbid;			/* hash key, must be first */
+	PowaCounter counters[POWA_DBSUMS_MAX_COUNTERS];
+	bool		hasvalue[POWA_DBSUMS_MAX_COUNTERS];	/* false if only NULLs */
+}	PowaDbSumsEntry;
+
+/*
+ * Last captured counters of each entry, used by the native snapshot to skip
+ * the unchanged entries when powa.store_unchanged is off.
+ *
+ * When an entry changes after having been skipped, its previous counters are
+ * stored again with the timestamp of the previous snapshot, so that
+ * consumers computing the difference between two adjacent records see the
+ * activity in the right interval.  The cache is local to the process (the
+ * background worker in practice), and is discarded on any error in a
+ * transaction that updated it, so we never skip a sample based on counters
+ * that weren't stored.
+ */
+typedef struct PowaLastKey
+{
+	uint64		id;				/* queryid or relid */
+	Oid			dbid;
+	Oid			userid;			/* InvalidOid for relations */
+}	PowaLastKey;
+
+typedef struct PowaLastEntry
+{
+	PowaLastKey key;			/* hash key, must be first */
+	uint32		generation;		/* generation of the last snapshot */
+	bool		skipped;		/* last sample wasn't stored */
+	uint64		values[POWA_LAST_MAX_FIELDS];
+	bool		nulls[POWA_LAST_MAX_FIELDS];
+}	PowaLastEntry;
+
+typedef struct PowaLastCache
+{
+	const char *name;
+	HTAB	   *htab;
+	uint32		generation;		/* current snapshot generation */
+	TimestampTz last_ts;		/* ts of the previous snapshot */
+	bool		modified;		/* updated in the current transaction */
+}	PowaLastCache;
+
+typedef enum
+{
+	POWA_LAST_STORE,			/* store the sample */
+	POWA_LAST_SKIP,				/* unchanged, skip the sample */
+	POWA_LAST_STORE_PREV		/* store the previous sample first */
+}	PowaLastAction;
+
+/*
+ * Top-K capture, for powa.top_k.
+ *
+ * The native snapshots then only store the powa.top_k entries whose
+ * powa.top_k_metric increased the most since the previous snapshot, and the
+ * ones whose increase reached powa.top_k_threshold.  The increase of all the
+ * counters of the other entries is accumulated in a per-database "other"
+ * entry, stored with a 0 queryid and userid for the statements and a 0 relid
+ * for the relations, so the activity of each database can still be computed
+ * from the stored entries.  As the "other" entries don't describe actual
+ * objects, their records are only meaningful as the difference between two
+ * of them.
+ *
+ * The previous counters of each entry are kept in a PowaLastCache, and like
+ * for powa.store_unchanged, the previous sample of an entry entering the top
+ * K is stored too, so that its increase is attributed to the right interval.
+ */
+typedef enum
+{
+	POWA_TOP_K_TOTAL_TIME,
+	POWA_TOP_K_CALLS,
+	POWA_TOP_K_BLOCKS
+}	PowaTopKMetric;
+
+static const struct config_enum_entry powa_top_k_metric_options[] = {
+	{"total_time", POWA_TOP_K_TOTAL_TIME, false},
+	{"calls", POWA_TOP_K_CALLS, false},
+	{"blocks", POWA_TOP_K_BLOCKS, false},
+	{NULL, 0, false}
+};
+
+/* accumulated increase of the entries not stored, for a database */
+typedef struct PowaTopKOther
+{
+	Oid			dbid;			/* hash key, must be first */
+	uint64		values[POWA_LAST_MAX_FIELDS];
+	bool		hasvalue[POWA_LAST_MAX_FIELDS];
+}	PowaTopKOther;
+
+typedef struct PowaTopKCache
+{
+	PowaLastCache last;			/* previous counters of every entry, and
+								 * whether the cache was updated */
+	HTAB	   *others;			/* PowaTopKOther of each database */
+}	PowaTopKCache;
+
+typedef struct PowaTopKCand
+{
+	double		delta;			/* increase of the metric */
+	int			idx;			/* index of the entry in the snapshot */
+}	PowaTopKCand;
+
+/* top-K selection of a single snapshot */
+typedef struct PowaTopK
+{
+	PowaTopKCache *cache;
+	TupleDesc	recdesc;
+	int			metric[2];		/* fields summed to compute the metric */
+	int			nmetric;
+	int			nentries;		/* max # of entries of the snapshot */
+	PowaLastEntry **entries;	/* cache entry of each entry, or NULL */
+	double	   *deltas;
+	bool	   *hasprev;		/* was the entry seen at the last snapshot? */
+	bool	   *kept;
+	PowaTopKCand *heap;			/* min-heap of the biggest increases */
+	int			nheap;
+}	PowaTopK;
+
+/* key of a statement whose text matches the snapshot ignore regexp */
+typedef struct PowaIgnoredQuery
+{
+	PowaLastKey key;			/* hash key, must be first */
+	uint32		generation;		/* last snapshot that saw it */
+}	PowaIgnoredQuery;
+
+/*
+ * Running aggregate of the records stored by the native statements snapshot,
+ * for powa.streaming_aggregate.
+ *
+ * Every record stored in a *_current table is also appended to the stream of
+ * its key, using a row-wise delta encoding, and the min and max of each field
+ * are kept up to date.  powa_statements_aggregate() can then build the
+ * history rows without grouping the whole *_current tables.  The streams are
+ * local to the process and discarded on any error in a transaction that
+ * updated them, like PowaLastCache, and are only used if they saw all the
+ * records stored since the table was last emptied.  To check it without
+ * reading the tables, every write to the statements *_current tables bumps
+ * the current_writes counter in shared memory, and each stream remembers the
+ * value it's in sync with.  Records inserted in those tables by hand aren't
+ * accounted.
+ */
+typedef struct PowaStreamEntry
+{
+	PowaLastKey key;			/* hash key, must be first */
+	int			nsamples;
+	StringInfoData buf;			/* encoded records */
+	uint64		prev[POWA_STREAM_MAX_FIELDS];	/* last non-NULL values */
+	uint64		mins[POWA_STREAM_MAX_FIELDS];
+	uint64		maxs[POWA_STREAM_MAX_FIELDS];
+	uint32		hasvalue;		/* bitmap of fields seen not NULL */
+}	PowaStreamEntry;
+
+typedef struct PowaStreamCache
+{
+	const char *name;
+	HTAB	   *htab;
+	MemoryContext cxt;
+	bool		valid;			/* saw all the records of the table */
+	int			natts;			/* # of fields of the records, 0 if unknown */
+	char		kinds[POWA_STREAM_MAX_FIELDS];
+	uint64		writes;			/* current_writes the stream is in sync with */
+	bool		modified;		/* updated in the current transaction */
+}	PowaStreamCache;
+
+/*
+ * Shared memory ring of the most recent pg_stat_statements samples, filled by
+ * the native snapshot when powa.recent_samples > 0.
+ *
+ * Each slot holds one snapshot: the per-database sums and the top
+ * powa.recent_top_queries statements of each database, ordered by total_time.
+ * There's a single writer at a time, serialized by the LWLock, while readers
+ * don't take any lock and rely on the seq counter of each slot: it's odd
+ * while the slot is being written, and readers retry if it's odd or changed
+ * while they were copying the slot.
+ */
+typedef struct PowaRecentEntry
+{
+	Oid			dbid;
+	Oid			userid;			/* InvalidOid for a database total */
+	int64		queryid;		/* 0 for a database total */
+	bool		isdb;			/* is it a database total? */
+	uint32		nulls;			/* bitmap of NULL counters */
+	PowaCounter counters[POWA_STATEMENTS_COUNTERS];
+}	PowaRecentEntry;
+
+typedef struct PowaRecentSlot
+{
+	uint32		seq;			/* seqlock counter */
+	TimestampTz ts;				/* 0 if never written */
+	int			nentries;
+	PowaRecentEntry entries[1];	/* VARIABLE LENGTH ARRAY */
+}	PowaRecentSlot;
+
+/*
+ * Shared memory ring of the high frequency samples, taken every
+ * powa.high_frequency_interval by the sampler background worker when
+ * powa.high_frequency_samples > 0.
+ *
+ * Only cheap sources are sampled, so that the interval can be much shorter
+ * than powa.frequency: the backend states read from the backends status
+ * array, and, on PostgreSQL 15 and above, the database counters from the
+ * shared memory statistics.  The slots use the same seqlock protocol as the
+ * recent samples, and are downsampled to powa_db_samples_history at each
+ * snapshot.
+ */
+#define POWA_SAMPLE_COUNTERS		9
+
+typedef struct PowaSampleEntry
+{
+	Oid			dbid;
+	int32		backends;
+	int32		active;
+	int32		idle_in_xact;
+	int32		waiting;		/* active and waiting for an event */
+	bool		hascounters;	/* are the database counters set? */
+	int64		counters[POWA_SAMPLE_COUNTERS];
+}	PowaSampleEntry;
+
+typedef struct PowaSampleSlot
+{
+	uint32		seq;			/* seqlock counter */
+	TimestampTz ts;				/* 0 if never written */
+	int			nentries;
+	PowaSampleEntry entries[1];	/* VARIABLE LENGTH ARRAY */
+}	PowaSampleSlot;
+
+/* cumulated resource usage of a collector function */
+typedef struct PowaCollectorEntry
+{
+	char		phase[NAMEDATALEN];
+	char		function_name[NAMEDATALEN];
+	int64		calls;
+	double		total_time;		/* in ms */
+	double		last_time;		/* in ms */
+	double		user_time;		/* in ms */
+	double		system_time;	/* in ms */
+	int64		rows;
+	int64		shared_blks_hit;
+	int64		shared_blks_read;
+	int64		shared_blks_dirtied;
+	int64		shared_blks_written;
+	int64		wal_records;
+	int64		wal_bytes;
+	TimestampTz last_run;
+}	PowaCollectorEntry;
+
+/* resource usage at the beginning of a collector measure */
+typedef struct PowaCollectorStart
+{
+	instr_time	start;
+	PGRUsage	rusage;
+	BufferUsage bufusage;
+#if PG_VERSION_NUM >= 130000
+	WalUsage	walusage;
+#endif
+	int64		rows;
+}	PowaCollectorStart;
+
+typedef struct PowaSharedState
+{
+	LWLock	   *lock;			/* serialize the writers */
+	int			nslots;
+	int			maxentries;		/* max # of entries per slot */
+	Size		slotsize;
+	int			head;			/* last written slot, -1 if none */
+	int			ncollector;		/* # of used collector entries */
+	PowaCollectorEntry collector[POWA_COLLECTOR_MAX_ENTRIES];
+	/* maintenance requested to the powa.maintenance_worker */
+	bool		aggregate_requested;
+	bool		purge_requested;
+	Latch	   *maintenance_latch;	/* NULL if the worker isn't running */
+	/* high frequency samples */
+	int			nsampleslots;
+	Size		sampleslotsize;
+	int			samplehead;		/* last written sample slot, -1 if none */
+	/* # of writes to the statements *_current tables, see PowaStreamCache */
+	uint64		current_writes;
+	/* when the shared memory was initialized, after a crash too */
+	TimestampTz startup_ts;
+	/* slots follow, and then the sample slots */
+}	PowaSharedState;
+
+#define POWA_RECENT_SLOT(state, i) \
+	((PowaRecentSlot *) (((char *) (state)) + MAXALIGN(sizeof(PowaSharedState)) \
+						 + (state)->slotsize * (i)))
+#define POWA_SAMPLE_SLOT(state, i) \
+	((PowaSampleSlot *) (((char *) POWA_RECENT_SLOT(state, (state)->nslots)) \
+						 + (state)->sampleslotsize * (i)))
+
+/*
+ * Keys known to be stored in powa_statements or powa_qualstats_quals, so the
+ * snapshots don't have to look them up in the table.  A cache is loaded from
+ * its table on first use and the stored keys are then added to it.  It's
+ * local to the process and discarded on any error in a transaction that
+ * updated it, like PowaLastCache, or when its table is truncated, which is
+ * the only way they're emptied.
+ */
+typedef struct PowaKnownKey
+{
+	uint64		id;				/* queryid */
+	uint64		qualid;			/* 0 for the statements */
+	Oid			dbid;
+	Oid			userid;
+}	PowaKnownKey;
+
+typedef struct PowaKnownCache
+{
+	const char *name;
+	const char *relname;
+	const char *query;			/* reads the keys of the table */
+	Oid			relid;			/* table the cache was loaded from */
+	HTAB	   *htab;			/* PowaKnownKey entries, NULL if not loaded */
+	bool		modified;		/* updated in the current transaction */
+}	PowaKnownCache;
+
+/*
+ * Space-Saving sketch of the constant values of each qual, for
+ * powa.qualstats_sketch_size.
+ *
+ * Rather than storing every constant value captured by the qualstats snapshot
+ * in powa_qualstats_constvalues_history_current, the collector keeps at most
+ * powa.qualstats_sketch_size values per qual until the next aggregate.  A new
+ * value that doesn't fit replaces the one with the lowest occurences and
+ * inherits them, so that the most used values are always kept, with an
+ * overestimated count.  The other lists are computed from the kept values.
+ * The sketches are local to the collector and discarded on any error in a
+ * transaction that updated them, and are only used if they saw all the values
+ * captured since the table was last emptied, like PowaStreamCache.
+ */
+typedef struct PowaSketchItem
+{
+	uint32		hash;			/* hash of constvalues */
+	ArrayType  *constvalues;	/* detoasted copy */
+	int64		occurences;
+	int64		execution_count;
+	int64		nbfiltered;
+}	PowaSketchItem;
+
+typedef struct PowaSketchEntry
+{
+	PowaKnownKey key;			/* hash key, must be first */
+	TimestampTz mints;
+	TimestampTz maxts;
+	int			nitems;
+	int			capacity;
+	PowaSketchItem *items;
+}	PowaSketchEntry;
+
+typedef struct PowaSketchCache
+{
+	HTAB	   *htab;			/* PowaSketchEntry of each qual */
+	MemoryContext cxt;
+	bool		valid;			/* saw all the values of the table */
+	bool		modified;		/* updated in the current transaction */
+}	PowaSketchCache;
+
+/* # of values of each list of powa_qualstats_constvalues_history */
+#define POWA_SKETCH_TOP_VALUES	20
+
+typedef enum PowaSketchOrder
+{
+	POWA_SKETCH_MOST_USED = 0,
+	POWA_SKETCH_MOST_FILTERING,
+	POWA_SKETCH_LEAST_FILTERING,
+	POWA_SKETCH_MOST_EXECUTED,
+	POWA_SKETCH_NB_ORDERS
+}	PowaSketchOrder;
+
+/* per-query keys of the rows stored by the native snapshot */
+typedef struct PowaQueryKeys
+{
+	int			nkeys;
+	Datum	   *queryids;
+	Datum	   *dbids;
+	Datum	   *userids;
+	Datum	   *queries;		/* may be NULL */
+}	PowaQueryKeys;
+
+/*
+ * Scheduling state of a module registered in powa_functions.  The due times
+ * are expressed in powa.frequency ticks, counted since the bgworker start.
+ */
+typedef struct PowaModuleSchedule
+{
+	char		module[NAMEDATALEN];
+	int			frequency;		/* powa_functions.frequency */
+	int			backoff;		/* automatic multiplier, see powa.backoff_threshold */
+	uint64		next_tick;		/* tick at which the module is due */
+	double		duration;		/* duration of the last run, in ms */
+	bool		seen;
+}	PowaModuleSchedule;
+
+/*
+ * a function to call during a snapshot, as returned by powa_dispatch_steps(),
+ * which is also exposed as powa_snapshot_steps() and powa_maintenance_steps()
+ */
+typedef struct PowaSnapshotStep
+{
+	char	   *operation;
+	char	   *module;			/* NULL for maintenance steps */
+	char	   *function_name;
+	char	   *query;			/* query calling the function */
+	int			frequency;		/* powa_functions.frequency */
+	SPIPlanPtr	plan;			/* kept plan of the query, once called */
+}	PowaSnapshotStep;
+
+/*
+ * Functions the background workers call, without having to read
+ * powa_functions at each snapshot.  The "maintenance" bookkeeping functions
+ * are fixed, while the enabled snapshot, aggregate, rollup and purge
+ * functions of powa_functions are loaded on first use, and reloaded when the
+ * powa_functions_changed() trigger signals that the table was modified with a
+ * relcache invalidation.  Each function is called through a plan prepared on
+ * its first call and kept across transactions.
+ */
+typedef enum PowaDispatchMaintenance
+{
+	POWA_DISPATCH_DATABASES = 0,
+	POWA_DISPATCH_PARTITIONS,
+	POWA_DISPATCH_AGGREGATE_FINISH,
+	POWA_DISPATCH_PURGE_FINISH,
+	POWA_DISPATCH_DB_SAMPLES,
+	POWA_DISPATCH_COLLECTOR_STATS,
+	POWA_DISPATCH_NB_MAINTENANCE
+}	PowaDispatchMaintenance;
+
+typedef struct PowaDispatchCache
+{
+	MemoryContext cxt;			/* functions of powa_functions */
+	bool		valid;
+	Oid			relid;			/* powa_functions */
+	int			nsteps;
+	PowaSnapshotStep *steps;	/* in powa_functions order */
+	PowaSnapshotStep maintenance[POWA_DISPATCH_NB_MAINTENANCE];
+}	PowaDispatchCache;
+
+/* progress of the collection of a remote server */
+typedef enum
+{
+	POWA_REMOTE_CONNECTING,		/* waiting for PQconnectPoll() */
+	POWA_REMOTE_QUERYING,		/* waiting for the query result */
+	POWA_REMOTE_DONE			/* finished, successfully or not */
+}	PowaRemoteStatus;
+
+/* what's collected on the remote servers */
+typedef enum
+{
+	POWA_REMOTE_STATEMENTS,		/* pg_stat_statements */
+	POWA_REMOTE_RELATIONS		/* relations of one database */
+}	PowaRemoteKind;
+
+/*
+ * a remote server collected by powa_remote_fetch_statements(), or one of its
+ * databases for powa_remote_fetch_relations()
+ */
+typedef struct PowaRemoteServer
+{
+	int			srvid;			/* powa_servers.id */
+	char	   *hostname;
+	char	   *port;
+	char	   *username;
+	char	   *dbname;
+	char	   *service;		/* NULL if not set */
+	char	   *passfile;		/* NULL if not set */
+	PGconn	   *conn;
+	PowaRemoteStatus status;
+	PostgresPollingStatusType polling;	/* last PQconnectPoll() result */
+	bool		flushing;		/* is the query not fully sent yet? */
+	PGresult   *res;			/* result being stored, if any */
+}	PowaRemoteServer;
+
+/* state of powa_remote_fetch_statements() and powa_remote_fetch_relations() */
+typedef struct PowaRemoteState
+{
+	PowaRemoteKind kind;
+	Tuplestorestate *tupstore;
+	AttInMetadata *attinmeta;
+	MemoryContext rowcxt;		/* reset after each stored row */
+	const char *ignore_regexp;
+	const char *ignored_users;
+}	PowaRemoteState;
+
 void		_PG_init(void);
 bool		powa_check_frequency_hook(int *newval, void **extra, GucSource source);
 void		compute_powa_frequency(void);
 void		die_on_too_small_frequency(void);
 int64		compute_next_wakeup(void);
+static void powa_schedule_refresh(void);
+static bool powa_schedule_is_due(const char *module);
+static void powa_schedule_update(void);
+static void powa_schedule_add_duration(const char *module, double duration);
+static int	powa_execute_kept(const char *query, SPIPlanPtr *plan,
+				  bool read_only);
+static void powa_dispatch_load(void);
+static void powa_dispatch_relcache_cb(Datum arg, Oid relid);
+static int	powa_dispatch_add(PowaSnapshotStep **steps, int n,
+				  const char *operation, bool dueonly, List *modules);
+static PowaSnapshotStep **powa_dispatch_steps(bool snapshot, bool dueonly,
+					List *modules, bool aggregate, bool purge,
+					MemoryContext cxt, int *nsteps);
+static void powa_dispatch_materialize(FunctionCallInfo fcinfo,
+						  PowaSnapshotStep **steps, int nsteps);
+Datum		powa_functions_changed(PG_FUNCTION_ARGS);
+Datum		powa_snapshot_steps(PG_FUNCTION_ARGS);
+Datum		powa_maintenance_steps(PG_FUNCTION_ARGS);
+static void powa_snapshot_run_step(PowaSnapshotStep * step);
+static uint64 powa_schedule_next_tick(void);
 
 Datum		powa_stat_user_functions(PG_FUNCTION_ARGS);
 Datum		powa_stat_all_rel(PG_FUNCTION_ARGS);
 static Datum powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind);
+static void powa_stat_tuplestore_callback(Datum *values, bool *nulls,
+							  void *arg);
+static void powa_stat_fetch(Oid dbid, PowaStatKind kind,
+				PowaStatCallback callback, void *arg);
+static void powa_stat_fetch_all(Oid *dbids, int ndbs, PowaStatKind kind,
+					PowaStatDbCallback callback, void *arg);
+static void powa_stat_fetch_serial(Oid *dbids, int ndbs, PowaStatKind kind,
+					   PowaStatDbCallback callback, void *arg);
+static void powa_stat_fetch_parallel(Oid *dbids, int ndbs, PowaStatKind kind,
+						 PowaStatDbCallback callback, void *arg);
+static void powa_stat_db_adapter(Datum *values, bool *nulls, void *arg);
+#if PG_VERSION_NUM >= 90500
+static void powa_stat_worker_send(Datum *values, bool *nulls, void *arg);
+#endif
+static Oid *powa_get_dbids(int *ndbs);
+static const Oid *powa_stat_coltypes(PowaStatKind kind, int *ncols);
+static void powa_stat_fetch_cluster(Oid *dbids, int ndbs, PowaStatKind kind,
+						PowaStatDbCallback callback, void *arg);
+static void powa_stat_func_values(Oid funcid,
+					  PgStat_StatFuncEntry *funcentry,
+					  Datum *values, bool *nulls);
+static void powa_stat_tab_values(Oid relid, PgStat_StatTabEntry *tabentry,
+					 Datum *values, bool *nulls);
+#if PG_VERSION_NUM >= 150000
+static Datum powa_stat_all_rel_stream(FunctionCallInfo fcinfo);
+static Oid *powa_stat_relids(Oid dbid, int *nrelids);
+static bool powa_stat_fetch_rel(Oid dbid, Oid relid,
+					PgStat_StatTabEntry *tabentry);
+static void powa_stat_nodb_adapter(Oid dbid, Datum *values, bool *nulls,
+					   void *arg);
+#else
+static void powa_stat_emit_dbentry(PgStat_StatDBEntry *dbentry,
+					   PowaStatKind kind,
+					   PowaStatCallback callback, void *arg);
+#endif
+static Datum powa_stat_multi_common(FunctionCallInfo fcinfo, PowaStatKind kind,
+					   PowaStatCollection mode);
+static void powa_stat_multi_tuplestore_callback(Oid dbid, Datum *values,
+									bool *nulls, void *arg);
+Datum		powa_stat_all_rel_parallel(PG_FUNCTION_ARGS);
+Datum		powa_stat_user_functions_parallel(PG_FUNCTION_ARGS);
+Datum		powa_stat_all_rel_cluster(PG_FUNCTION_ARGS);
+Datum		powa_stat_user_functions_cluster(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_stat_all_rel_parallel);
+PG_FUNCTION_INFO_V1(powa_stat_user_functions_parallel);
+PG_FUNCTION_INFO_V1(powa_stat_all_rel_cluster);
+PG_FUNCTION_INFO_V1(powa_stat_user_functions_cluster);
 
 PG_FUNCTION_INFO_V1(powa_stat_user_functions);
 PG_FUNCTION_INFO_V1(powa_stat_all_rel);
 
+static Datum powa_remote_fetch_common(FunctionCallInfo fcinfo,
+						 PowaRemoteKind kind);
+static void powa_remote_connect(PowaRemoteServer * srv);
+static char *powa_remote_statements_query(int version);
+static char *powa_remote_relations_query(int version);
+static void powa_remote_send(PowaRemoteServer * srv, PowaRemoteState * state);
+static void powa_remote_advance(PowaRemoteServer * srv,
+					PowaRemoteState * state);
+static void powa_remote_store(PowaRemoteServer * srv,
+				  PowaRemoteState * state);
+static void powa_remote_fail(PowaRemoteServer * srv, const char *reason);
+static void powa_remote_finish(PowaRemoteServer * servers, int nservers);
+Datum		powa_remote_fetch_statements(PG_FUNCTION_ARGS);
+Datum		powa_remote_fetch_relations(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_remote_fetch_statements);
+PG_FUNCTION_INFO_V1(powa_remote_fetch_relations);
+
+Datum		powa_statements_history_mi(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_div(PG_FUNCTION_ARGS);
+Datum		powa_user_functions_history_mi(PG_FUNCTION_ARGS);
+Datum		powa_user_functions_history_div(PG_FUNCTION_ARGS);
+Datum		powa_all_relations_history_mi(PG_FUNCTION_ARGS);
+Datum		powa_all_relations_history_div(PG_FUNCTION_ARGS);
+Datum		powa_kcache_mi(PG_FUNCTION_ARGS);
+Datum		powa_kcache_div(PG_FUNCTION_ARGS);
+Datum		powa_qualstats_history_mi(PG_FUNCTION_ARGS);
+Datum		powa_qualstats_history_div(PG_FUNCTION_ARGS);
+static Datum powa_record_op_common(PG_FUNCTION_ARGS, PowaRecordOpKind kind);
+static PowaRecordOpCache *powa_get_record_op_cache(FunctionCallInfo fcinfo,
+						 HeapTupleHeader rec, PowaRecordOpKind kind);
+static double powa_ts_diff_secs(TimestampTz a, TimestampTz b);
+
+Datum		powa_statements_history_block_in(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_out(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_recv(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_send(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_records(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_unnest(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_count(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_first(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_last(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_agg_trans(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_agg_final(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_agg_combine(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_agg_serialize(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_block_agg_deserialize(PG_FUNCTION_ARGS);
+Datum		powa_records_agg_combine(PG_FUNCTION_ARGS);
+Datum		powa_records_agg_serialize(PG_FUNCTION_ARGS);
+Datum		powa_records_agg_deserialize(PG_FUNCTION_ARGS);
+Datum		powa_statements_history_range(PG_FUNCTION_ARGS);
+static char powa_block_kind(Form_pg_attribute att);
+static PowaBlockColumns *powa_block_columns_init(TupleDesc tupdesc,
+						int capacity);
+static PowaBlockColumns *powa_block_columns_init_kinds(const char *kinds,
+							  int ncols, int capacity);
+static void powa_block_columns_append(PowaBlockColumns * cols,
+						  PowaBlockColumns * other);
+static void powa_block_columns_add(PowaBlockColumns * cols,
+					   HeapTupleHeader rec);
+static HeapTuple powa_block_columns_get(PowaBlockColumns * cols, int i);
+static void powa_block_columns_sort(PowaBlockColumns * cols);
+static PowaHistoryBlock *powa_block_encode(PowaBlockColumns * cols);
+static PowaBlockColumns *powa_block_decode(PowaHistoryBlock * block,
+				  TupleDesc tupdesc);
+static void powa_block_check(PowaHistoryBlock * block);
+static TupleDesc powa_block_rettupdesc(FunctionCallInfo fcinfo);
+static Datum powa_block_record_at(FunctionCallInfo fcinfo, bool last);
+Datum		powa_record_min_trans(PG_FUNCTION_ARGS);
+Datum		powa_record_max_trans(PG_FUNCTION_ARGS);
+Datum		powa_record_extrema_combine(PG_FUNCTION_ARGS);
+Datum		powa_record_extrema_serialize(PG_FUNCTION_ARGS);
+Datum		powa_record_extrema_deserialize(PG_FUNCTION_ARGS);
+Datum		powa_record_extrema_final(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_statements_history_block_in);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_out);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_recv);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_send);
+PG_FUNCTION_INFO_V1(powa_statements_history_block);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_records);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_unnest);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_count);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_first);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_last);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_agg_trans);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_agg_final);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_agg_combine);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_agg_serialize);
+PG_FUNCTION_INFO_V1(powa_statements_history_block_agg_deserialize);
+PG_FUNCTION_INFO_V1(powa_records_agg_combine);
+PG_FUNCTION_INFO_V1(powa_records_agg_serialize);
+PG_FUNCTION_INFO_V1(powa_records_agg_deserialize);
+PG_FUNCTION_INFO_V1(powa_statements_history_range);
+PG_FUNCTION_INFO_V1(powa_record_min_trans);
+PG_FUNCTION_INFO_V1(powa_record_max_trans);
+PG_FUNCTION_INFO_V1(powa_record_extrema_combine);
+PG_FUNCTION_INFO_V1(powa_record_extrema_serialize);
+PG_FUNCTION_INFO_V1(powa_record_extrema_deserialize);
+PG_FUNCTION_INFO_V1(powa_record_extrema_final);
+
+Datum		powa_statements_snapshot_native(PG_FUNCTION_ARGS);
+Datum		powa_kcache_snapshot_native(PG_FUNCTION_ARGS);
+Datum		powa_all_relations_snapshot_native(PG_FUNCTION_ARGS);
+static Oid *powa_get_ignored_users(int *nusers);
+static bool powa_is_ignored_user_oid(Oid userid, Oid *users, int nusers);
+static void powa_ignored_users_assign(const char *newval, void *extra);
+static void powa_ignored_users_syscache_cb(Datum arg, int cacheid,
+							   uint32 hashvalue);
+Datum		powa_is_ignored_user(PG_FUNCTION_ARGS);
+Datum		powa_ignored_users_oids(PG_FUNCTION_ARGS);
+static Relation powa_open_current_table(const char *relname);
+static TupleDesc powa_current_record_tupdesc(Relation rel);
+static void powa_multi_insert(Relation rel, HeapTuple *tuples, int ntuples);
+static HTAB *powa_dbsums_create(void);
+static void powa_dbsums_add(HTAB *dbsums, Oid dbid, TupleDesc recdesc,
+				Datum *values, bool *nulls);
+static void powa_dbsums_store(HTAB *dbsums, const char *relname,
+				  TimestampTz ts, PowaStreamCache * dbstream);
+static uint64 powa_capture_queries(TimestampTz ts, const char *relname,
+					 const char *dbrelname, int firstcounter,
+					 int textattno, PowaQueryKeys * keys,
+					 PowaKnownCache * known, PowaLastCache * last,
+					 PowaTopKCache * topkcache, bool recent,
+					 PowaStreamCache * stream,
+					 PowaStreamCache * dbstream);
+static void powa_known_load(PowaKnownCache * cache);
+static bool powa_known_find(PowaKnownCache * cache, uint64 id,
+				uint64 qualid, Oid dbid, Oid userid);
+static void powa_known_add(PowaKnownCache * cache, uint64 id,
+			   uint64 qualid, Oid dbid, Oid userid);
+static void powa_known_reset(PowaKnownCache * cache);
+static void powa_known_reset_modified(void);
+static void powa_known_relcache_cb(Datum arg, Oid relid);
+static Datum powa_known_check(FunctionCallInfo fcinfo,
+				 PowaKnownCache * cache, uint64 id, uint64 qualid,
+				 Oid dbid, Oid userid);
+Datum		powa_statements_known(PG_FUNCTION_ARGS);
+Datum		powa_qualstats_quals_known(PG_FUNCTION_ARGS);
+static bool powa_sketch_enabled(void);
+static void powa_sketch_reset(bool valid);
+static void powa_sketch_discard(void);
+static int	powa_sketch_item_cmp(const void *a, const void *b, void *arg);
+static Datum powa_sketch_values(PowaSketchEntry * entry, PowaSketchOrder order,
+				   int *idx, Oid elemtype, TupleDesc valdesc);
+Datum		powa_qualstats_sketch_add(PG_FUNCTION_ARGS);
+Datum		powa_qualstats_constvalues_sketch(PG_FUNCTION_ARGS);
+Datum		powa_qualstats_sketch_reset(PG_FUNCTION_ARGS);
+static void powa_statements_store_missing(PowaQueryKeys * keys);
+static void powa_ignored_queries_add(PowaLastKey * key);
+static void powa_statements_capture_missing(Datum ignore_regexp);
+static void powa_last_begin(PowaLastCache * cache);
+static PowaLastAction powa_last_check(PowaLastCache * cache,
+				PowaLastKey * key, TupleDesc recdesc,
+				Datum *values, bool *nulls,
+				Datum *prevvalues, bool *prevnulls);
+static void powa_last_end(PowaLastCache * cache, TimestampTz ts);
+static void powa_last_reset(PowaLastCache * cache);
+static void powa_last_reset_modified(void);
+static void powa_last_register_callbacks(void);
+static void powa_topk_begin(PowaTopK * topk, PowaTopKCache * cache,
+				TupleDesc recdesc, bool relations, int nentries);
+static void powa_topk_add(PowaTopK * topk, int idx, PowaLastKey * key,
+			  Datum *values, bool *nulls);
+static void powa_topk_select(PowaTopK * topk);
+static PowaLastAction powa_topk_check(PowaTopK * topk, int idx, Oid dbid,
+				Datum *values, bool *nulls,
+				Datum *prevvalues, bool *prevnulls);
+static void powa_topk_other_values(PowaTopK * topk, PowaTopKOther * other,
+					   TimestampTz ts, Datum *values, bool *nulls);
+static void powa_topk_end(PowaTopK * topk, TimestampTz ts);
+static void powa_topk_reset(PowaTopKCache * cache);
+static void powa_last_xact_callback(XactEvent event, void *arg);
+static void powa_last_subxact_callback(SubXactEvent event,
+						   SubTransactionId mySubid,
+						   SubTransactionId parentSubid, void *arg);
+static void powa_relations_callback(Oid dbid, Datum *values, bool *nulls,
+						void *arg);
+static void powa_stream_reset(PowaStreamCache * stream, bool valid);
+static void powa_stream_reset_all(bool valid);
+static void powa_stream_reset_modified(void);
+static void powa_stream_written(bool seen);
+static void powa_stream_add(PowaStreamCache * stream, PowaLastKey * key,
+				TupleDesc recdesc, Datum *values, bool *nulls);
+static bool powa_stream_matches(PowaStreamCache * stream, const char *relname);
+static int64 powa_stream_flush(PowaStreamCache * stream, const char *relname,
+				  int nkeys);
+Datum		powa_statements_aggregate_native(PG_FUNCTION_ARGS);
+Datum		powa_statements_stream_reset(PG_FUNCTION_ARGS);
+Datum		powa_statements_stream_invalidate(PG_FUNCTION_ARGS);
+
+#if PG_VERSION_NUM >= 150000
+static void powa_shmem_request(void);
+#endif
+static void powa_shmem_startup(void);
+static void powa_shmem_request_space(void);
+static Size powa_memsize(void);
+Datum		powa_shmem_startup_time(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_shmem_startup_time);
+
+static int	powa_recent_maxentries(void);
+static Size powa_recent_slotsize(void);
+static void powa_recent_store(TimestampTz ts, HTAB *dbsums,
+				  PowaRecentEntry * cands, int ncands);
+static PowaRecentSlot *powa_recent_read_slot(int i);
+static void powa_recent_fill_entry(PowaRecentEntry * entry, TupleDesc recdesc,
+					   Datum *values, bool *nulls);
+static Datum powa_recent_entry_record(PowaRecentEntry * entry,
+						 TimestampTz ts, TupleDesc recdesc);
+static Datum powa_recent_common(FunctionCallInfo fcinfo, bool dbonly);
+Datum		powa_recent_samples(PG_FUNCTION_ARGS);
+Datum		powa_recent_samples_db(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_recent_samples);
+PG_FUNCTION_INFO_V1(powa_recent_samples_db);
+
+static Size powa_sample_slotsize(void);
+static PgBackendStatus *powa_sample_beentry(int i);
+static void powa_sample_take(void);
+static PowaSampleSlot *powa_sample_read_slot(int i);
+Datum		powa_db_samples(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_db_samples);
+
+static void powa_ExecutorEnd(QueryDesc *queryDesc);
+static void powa_collector_xact_callback(XactEvent event, void *arg);
+static void powa_collector_begin(void);
+static void powa_collector_end(const char *phase, const char *function_name);
+Datum		powa_collector_stats_begin(PG_FUNCTION_ARGS);
+Datum		powa_collector_stats_end(PG_FUNCTION_ARGS);
+Datum		powa_collector_stats(PG_FUNCTION_ARGS);
+Datum		powa_collector_stats_reset(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_collector_stats_begin);
+PG_FUNCTION_INFO_V1(powa_collector_stats_end);
+PG_FUNCTION_INFO_V1(powa_collector_stats);
+PG_FUNCTION_INFO_V1(powa_collector_stats_reset);
+
+PG_FUNCTION_INFO_V1(powa_statements_snapshot_native);
+PG_FUNCTION_INFO_V1(powa_kcache_snapshot_native);
+PG_FUNCTION_INFO_V1(powa_all_relations_snapshot_native);
+PG_FUNCTION_INFO_V1(powa_statements_aggregate_native);
+PG_FUNCTION_INFO_V1(powa_statements_stream_reset);
+PG_FUNCTION_INFO_V1(powa_statements_stream_invalidate);
+PG_FUNCTION_INFO_V1(powa_statements_known);
+PG_FUNCTION_INFO_V1(powa_qualstats_quals_known);
+PG_FUNCTION_INFO_V1(powa_qualstats_sketch_add);
+PG_FUNCTION_INFO_V1(powa_qualstats_constvalues_sketch);
+PG_FUNCTION_INFO_V1(powa_qualstats_sketch_reset);
+PG_FUNCTION_INFO_V1(powa_is_ignored_user);
+PG_FUNCTION_INFO_V1(powa_ignored_users_oids);
+
+PG_FUNCTION_INFO_V1(powa_statements_history_mi);
+PG_FUNCTION_INFO_V1(powa_statements_history_div);
+PG_FUNCTION_INFO_V1(powa_user_functions_history_mi);
+PG_FUNCTION_INFO_V1(powa_user_functions_history_div);
+PG_FUNCTION_INFO_V1(powa_all_relations_history_mi);
+PG_FUNCTION_INFO_V1(powa_all_relations_history_div);
+PG_FUNCTION_INFO_V1(powa_kcache_mi);
+PG_FUNCTION_INFO_V1(powa_kcache_div);
+PG_FUNCTION_INFO_V1(powa_qualstats_history_mi);
+PG_FUNCTION_INFO_V1(powa_qualstats_history_div);
+PG_FUNCTION_INFO_V1(powa_functions_changed);
+PG_FUNCTION_INFO_V1(powa_snapshot_steps);
+PG_FUNCTION_INFO_V1(powa_maintenance_steps);
+
 #if (PG_VERSION_NUM >= 90500)
 void powa_main(Datum main_arg) pg_attribute_noreturn();
 #else
 void powa_main(Datum main_arg) __attribute__((noreturn));
 #endif
+void		powa_stat_worker_main(Datum main_arg);
+void		powa_maintenance_main(Datum main_arg);
+void		powa_sampler_main(Datum main_arg);
+
+static void powa_maintenance_request(bool aggregate, bool purge);
+static void powa_maintenance_detach(int code, Datum arg);
 
 static void powa_sighup(SIGNAL_ARGS);
 static void powa_process_sighup(void);
@@ -82,14 +1277,123 @@ static instr_time	last_start;					/* last snapshot start */
 static int			powa_frequency;				/* powa.frequency GUC */
 static instr_time	time_powa_frequency;		/* same in instr_time format */
 static int			powa_retention;				/* powa.retention GUC */
+static int			powa_hourly_retention = 0;	/* powa.hourly_retention GUC */
+static int			powa_daily_retention = 0;	/* powa.daily_retention GUC */
 static int			powa_coalesce;			 	/* powa.coalesce GUC */
+static int			powa_partition_interval = 0;	/* powa.partition_interval GUC */
+static double		powa_backoff_threshold = 0.0;	/* powa.backoff_threshold GUC */
 static char		   *powa_database = NULL;	 	/* powa.database GUC */
 static char 	   *powa_ignored_users = NULL;	/* powa.ignored_users GUC */
 static bool			powa_debug = false;			/* powa.debug GUC */
+static bool			powa_native_snapshot = false;	/* powa.native_snapshot GUC */
+static bool			powa_store_unchanged = true;	/* powa.store_unchanged GUC */
+static bool			powa_collector_stats_history = false;	/* powa.collector_stats_history GUC */
+static bool			powa_unlogged_current = false;	/* powa.unlogged_current GUC */
+static bool			powa_streaming_aggregate = false;	/* powa.streaming_aggregate GUC */
+static bool			powa_lazy_query_text = false;	/* powa.lazy_query_text GUC */
+static bool			powa_maintenance_worker = false;	/* powa.maintenance_worker GUC */
+static int			powa_aggregate_parallel_workers = 0;	/* powa.aggregate_parallel_workers GUC */
+static int			powa_qualstats_sketch_size = 0;	/* powa.qualstats_sketch_size GUC */
+static int			powa_top_k = 0;			/* powa.top_k GUC */
+static int			powa_top_k_metric = POWA_TOP_K_TOTAL_TIME;	/* powa.top_k_metric GUC */
+static double		powa_top_k_threshold = 0.0;	/* powa.top_k_threshold GUC */
+
+/* caches of the last captured counters, for powa.store_unchanged */
+static PowaLastCache powa_last_statements = {"statements", NULL, 0, 0, false};
+static PowaLastCache powa_last_relations = {"relations", NULL, 0, 0, false};
+static bool powa_last_callbacks_registered = false;
+
+/* caches of the previous counters and "other" entries, for powa.top_k */
+static PowaTopKCache powa_topk_statements = {{"top-k statements", NULL, 0, 0, false}, NULL};
+static PowaTopKCache powa_topk_relations = {{"top-k relations", NULL, 0, 0, false}, NULL};
+
+/* keys already stored, to skip the lookups of the snapshots */
+static PowaKnownCache powa_known_statements = {"powa known statements",
+	"powa_statements_base",
+	"SELECT queryid, 0::bigint, dbid, userid FROM powa_statements_base",
+	InvalidOid, NULL, false};
+static PowaKnownCache powa_known_quals = {"powa known quals",
+	"powa_qualstats_quals",
+	"SELECT queryid, qualid, dbid, userid FROM powa_qualstats_quals",
+	InvalidOid, NULL, false};
+static bool powa_known_callback_registered = false;
+
+/* per-qual sketches of the constant values, for powa.qualstats_sketch_size */
+static PowaSketchCache powa_sketch = {NULL, NULL, false, false};
+
+/* is this process the collector background worker? */
+static bool powa_is_collector = false;
+
+/*
+ * running aggregates for powa.streaming_aggregate, unknown until the tables
+ * are emptied
+ */
+static PowaStreamCache powa_stream_statements = {"powa statements stream"};
+static PowaStreamCache powa_stream_statements_db = {"powa statements db stream"};
+
+/* statements known to match the ignore regexp, for powa.lazy_query_text */
+static HTAB *powa_ignored_queries = NULL;
+static uint32 powa_ignored_queries_generation = 0;
+static char *powa_ignored_queries_regexp = NULL;	/* regexp they matched */
+
+/* powa.ignored_users resolved to sorted role oids */
+static Oid *powa_ignored_users_cache = NULL;
+static int	powa_ignored_users_n = 0;
+static bool powa_ignored_users_valid = false;
+static bool powa_ignored_users_callback_registered = false;
+
+static int			powa_stat_collection = POWA_STAT_COLLECTION_PER_DATABASE;	/* powa.stat_collection GUC */
+static int			powa_stat_max_parallel_workers = 4;	/* powa.stat_max_parallel_workers GUC */
+static int			powa_remote_timeout = 30000;	/* powa.remote_timeout GUC */
+
+static int			powa_recent_samples_n = 0;		/* powa.recent_samples GUC */
+static int			powa_recent_top_queries = 20;	/* powa.recent_top_queries GUC */
+static int			powa_recent_max_databases = 64;	/* powa.recent_max_databases GUC */
+static int			powa_high_frequency_samples = 0;	/* powa.high_frequency_samples GUC */
+static int			powa_high_frequency_interval = 1000;	/* powa.high_frequency_interval GUC */
+
+/* per-module snapshot schedule, only used in the bgworker */
+static PowaModuleSchedule *powa_schedule = NULL;
+static int			powa_schedule_n = 0;
+static int			powa_schedule_size = 0;
+static uint64		powa_tick = 0;		/* tick of the current snapshot */
+
+/* functions called by the background workers */
+static PowaDispatchCache powa_dispatch = {NULL, false, InvalidOid, 0, NULL};
+static const char *const powa_dispatch_maintenance_names[] = {
+	"powa_databases_maintain",
+	"powa_partitions_maintain",
+	"powa_aggregate_finish",
+	"powa_purge_finish",
+	"powa_db_samples_store",
+	"powa_collector_stats_store"
+};
+static bool powa_dispatch_callback_registered = false;
+
+/* Links to shared memory state */
+static PowaSharedState *powa_shared = NULL;
+
+/* Saved hook values in case of unload */
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+
+/* collector measures in progress, and rows inserted while measuring */
+static PowaCollectorStart powa_collector_stack[POWA_COLLECTOR_MAX_DEPTH];
+static int			powa_collector_depth = 0;
+static int			powa_collector_base_depth = 0;	/* # of measures
+													 * started outside a
+													 * transaction */
+static int64		powa_collector_rows = 0;
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sighup = false;
 
+/* does the bgworker need to check the *_current tables persistence? */
+static bool powa_check_persistence = true;
+
 bool
 powa_check_frequency_hook(int *newval, void **extra, GucSource source)
 {
@@ -180,6 +1484,13 @@ _PG_init(void)
 							&powa_coalesce,
 							100, 5, INT_MAX, PGC_SUSET, 0, NULL, NULL, NULL);
 
+	DefineCustomRealVariable("powa.backoff_threshold",
+							 "Fraction of a module snapshot interval above which its frequency is automatically reduced",
+							 "0 disables the automatic backoff.",
+							 &powa_backoff_threshold,
+							 0.0, 0.0, 1.0,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("powa.retention",
 							"Automatically purge data older than N minutes",
 							NULL,
@@ -189,8 +1500,35 @@ _PG_init(void)
 							INT_MAX / SECS_PER_MINUTE,
 							PGC_SUSET, GUC_UNIT_MIN, NULL, NULL, NULL);
 
-	DefineCustomStringVariable("powa.database",
-						   "Defines the database of the workload repository",
+	DefineCustomIntVariable("powa.hourly_retention",
+							"Automatically purge the hourly rollups older than N minutes",
+							"0 disables the hourly rollups.",
+							&powa_hourly_retention,
+							0,
+							0,
+							INT_MAX / SECS_PER_MINUTE,
+							PGC_SUSET, GUC_UNIT_MIN, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.daily_retention",
+							"Automatically purge the daily rollups older than N minutes",
+							"0 disables the daily rollups, which also require the hourly rollups.",
+							&powa_daily_retention,
+							0,
+							0,
+							INT_MAX / SECS_PER_MINUTE,
+							PGC_SUSET, GUC_UNIT_MIN, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.partition_interval",
+							"Defines the size of the history tables partitions",
+							"Only used when the extension is created.  0 disables the partitioning.",
+							&powa_partition_interval,
+							0,
+							0,
+							INT_MAX / SECS_PER_MINUTE,
+							PGC_SUSET, GUC_UNIT_MIN, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("powa.database",
+						   "Defines the database of the workload repository",
 							   NULL,
 							   &powa_database,
 							   "powa", PGC_POSTMASTER, 0, NULL, NULL, NULL);
@@ -199,7 +1537,8 @@ _PG_init(void)
 							   "Defines a coma-separated list of users to ignore when taking activity snapshot",
 							   NULL,
 							   &powa_ignored_users,
-							   NULL, PGC_SIGHUP, 0, NULL, NULL, NULL);
+							   NULL, PGC_SIGHUP, 0, NULL,
+							   powa_ignored_users_assign, NULL);
 
 	DefineCustomBoolVariable("powa.debug",
 							   "Provide logs to help troubleshooting issues",
@@ -207,6 +1546,153 @@ _PG_init(void)
 							   &powa_debug,
 							   false, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("powa.native_snapshot",
+							 "Use the native implementation of the snapshot functions when available",
+							 NULL,
+							 &powa_native_snapshot,
+							 false, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("powa.store_unchanged",
+							 "Store a sample even if its counters didn't change since the previous snapshot",
+							 "Only used by the native snapshot.",
+							 &powa_store_unchanged,
+							 true, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("powa.stat_collection",
+							 "Defines how the per-database relations and functions statistics are collected",
+							 NULL,
+							 &powa_stat_collection,
+							 POWA_STAT_COLLECTION_PER_DATABASE,
+							 powa_stat_collection_options,
+							 PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("powa.collector_stats_history",
+							 "Store the collector functions resource usage in powa_collector_stats_history at each snapshot",
+							 NULL,
+							 &powa_collector_stats_history,
+							 false, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("powa.unlogged_current",
+							 "Use unlogged tables for the data waiting to be coalesced",
+							 "Their content is lost after a crash, but they don't generate WAL.",
+							 &powa_unlogged_current,
+							 false, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("powa.lazy_query_text",
+							 "Only read the query texts of the statements not stored yet",
+							 "Only used by the native snapshot.  pg_stat_statements then only reads its query texts file when new statements appear.",
+							 &powa_lazy_query_text,
+							 false, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.top_k",
+							"Only store the given number of entries with the biggest activity at each snapshot",
+							"Only used by the native statements and relations snapshots.  0 stores all the entries.  The activity of the other entries is accumulated in a per-database entry.",
+							&powa_top_k,
+							0, 0, INT_MAX / 2,
+							PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("powa.top_k_metric",
+							 "Defines the counter used to rank the entries for powa.top_k",
+							 "The relations have no timing, so they're ranked by blocks for total_time.",
+							 &powa_top_k_metric,
+							 POWA_TOP_K_TOTAL_TIME,
+							 powa_top_k_metric_options,
+							 PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("powa.top_k_threshold",
+							 "Always store the entries whose powa.top_k_metric increased at least this much",
+							 "0 disables the threshold.",
+							 &powa_top_k_threshold,
+							 0.0, 0.0, DBL_MAX,
+							 PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("powa.maintenance_worker",
+							 "Run the aggregate, rollup and purge functions in a dedicated background worker",
+							 "The snapshots then don't have to wait for them.",
+							 &powa_maintenance_worker,
+							 false, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("powa.streaming_aggregate",
+							 "Aggregate the statements incrementally during the native snapshots",
+							 "The coalesce then only has to flush the running aggregates, at the price of keeping them in the background worker memory.",
+							 &powa_streaming_aggregate,
+							 false, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.aggregate_parallel_workers",
+							"Number of parallel workers the aggregate functions can use",
+							"Only used on PostgreSQL 11 and above, 0 disables the feature.",
+							&powa_aggregate_parallel_workers,
+							0, 0, 1024, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.qualstats_sketch_size",
+							"Number of constant values the collector keeps per qual between two aggregates",
+							"The values are then kept in the background worker memory rather than in powa_qualstats_constvalues_history_current.  Only used by the background worker if powa.maintenance_worker is disabled, 0 disables the feature.",
+							&powa_qualstats_sketch_size,
+							0, 0, 1000, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.stat_max_parallel_workers",
+							"Maximum number of background workers used to collect the statistics in parallel",
+							NULL,
+							&powa_stat_max_parallel_workers,
+							4, 1, POWA_MAX_PARALLEL_WORKERS,
+							PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.remote_timeout",
+							"Maximum time to collect the statements of all the remote servers",
+							"The servers that didn't answer in time are skipped until the next snapshot.",
+							&powa_remote_timeout,
+							30000, 100, INT_MAX,
+							PGC_SUSET, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.recent_samples",
+							"Number of snapshots kept in shared memory",
+							"Only used by the native snapshot, 0 disables the feature.",
+							&powa_recent_samples_n,
+							0, 0, 10000, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.recent_top_queries",
+							"Number of statements per database kept in shared memory for each snapshot",
+							NULL,
+							&powa_recent_top_queries,
+							20, 0, 1000, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.recent_max_databases",
+							"Maximum number of databases kept in shared memory for each snapshot",
+							NULL,
+							&powa_recent_max_databases,
+							64, 1, 10000, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.high_frequency_samples",
+							"Number of high frequency samples kept in shared memory",
+							"They're taken by a dedicated background worker, and also limited to powa.recent_max_databases databases.  0 disables the feature.",
+							&powa_high_frequency_samples,
+							0, 0, 86400, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("powa.high_frequency_interval",
+							"Interval between two high frequency samples",
+							NULL,
+							&powa_high_frequency_interval,
+							1000, 100, MIN_POWA_FREQUENCY,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	/*
+	 * Request additional shared resources.  (These are no-ops if we're not in
+	 * the postmaster process.)  We'll allocate or attach to the shared
+	 * resources in powa_shmem_startup().
+	 */
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = powa_shmem_request;
+#else
+	powa_shmem_request_space();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = powa_shmem_startup;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = powa_ExecutorEnd;
+
+	RegisterXactCallback(powa_collector_xact_callback, NULL);
+
 	/*
 	 * Register the worker processes
 	 */
@@ -227,21 +1713,53 @@ _PG_init(void)
 	worker.bgw_notify_pid = 0;
 #endif
 	RegisterBackgroundWorker(&worker);
+
+	if (powa_maintenance_worker)
+	{
+#if (PG_VERSION_NUM >= 100000)
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "powa_maintenance_main");
+#else
+		worker.bgw_main = powa_maintenance_main;
+#endif
+		snprintf(worker.bgw_name, BGW_MAXLEN, "powa maintenance");
+		RegisterBackgroundWorker(&worker);
+	}
+
+	if (powa_high_frequency_samples > 0)
+	{
+#if (PG_VERSION_NUM >= 100000)
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "powa_sampler_main");
+#else
+		worker.bgw_main = powa_sampler_main;
+#endif
+		snprintf(worker.bgw_name, BGW_MAXLEN, "powa sampler");
+		RegisterBackgroundWorker(&worker);
+	}
 }
 
 
 void
 powa_main(Datum main_arg)
 {
-	char	   *query_snapshot = "SELECT powa_take_snapshot()";
 	static char *query_appname = "SET application_name = 'PoWA collector'";
+	static char *query_due = "SELECT aggregate, purge"
+	" FROM powa_maintenance_due()";
+	static SPIPlanPtr plan_due = NULL;
+	static char *query_check_lost = "SELECT powa_current_check_lost()";
+	static char *query_persistence = "SELECT powa_current_persistence("
+	"current_setting('powa.unlogged_current')::boolean)";
 	int64		us_to_wait; /* Should be uint64 per postgresql's spec, but we
 							   may have negative result, in our tests */
+	MemoryContext stepcxt;
 
 	/* check powa_frequency validity, and if powa is enabled */
 	die_on_too_small_frequency();
 	compute_powa_frequency();
 
+	powa_is_collector = true;
+
 	/*
 	 * Set up signal handler, then unblock signals
 	 */
@@ -264,12 +1782,21 @@ powa_main(Datum main_arg)
 	PushActiveSnapshot(GetTransactionSnapshot());
 	pgstat_report_activity(STATE_RUNNING, query_appname);
 	SPI_execute(query_appname, false, 0);
+	/* the unlogged *_current tables may have been emptied by a crash */
+	pgstat_report_activity(STATE_RUNNING, query_check_lost);
+	SPI_execute(query_check_lost, false, 0);
 	SPI_finish();
 	PopActiveSnapshot();
 	CommitTransactionCommand();
 	pgstat_report_activity(STATE_IDLE, NULL);
 	set_ps_display("idle", false);
 
+	stepcxt = AllocSetContextCreate(TopMemoryContext,
+									"powa snapshot steps",
+									ALLOCSET_DEFAULT_MINSIZE,
+									ALLOCSET_DEFAULT_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+
 	/*------------------
 	 * Main loop of POWA
 	 * We exit from here if:
@@ -278,25 +1805,83 @@ powa_main(Datum main_arg)
 	 */
 	for (;;)
 	{
+		PowaSnapshotStep **steps;
+		bool		isnull;
+		bool		aggregate;
+		bool		purge;
+		int			nsteps;
+		int			i;
+		uint64		next_tick;
+
 		/* Check if a SIGHUP has been received */
 		powa_process_sighup();
 
 		set_ps_display("snapshot", false);
+		powa_collector_begin();
 		SetCurrentStatementStartTimestamp();
 		StartTransactionCommand();
 		SPI_connect();
 		PushActiveSnapshot(GetTransactionSnapshot());
-		pgstat_report_activity(STATE_RUNNING, query_snapshot);
-		SPI_execute(query_snapshot, false, 0);
-		pgstat_report_activity(STATE_RUNNING, query_appname);
-		SPI_execute(query_appname, false, 0);
+
+		if (powa_check_persistence)
+		{
+			pgstat_report_activity(STATE_RUNNING, query_persistence);
+			SPI_execute(query_persistence, false, 0);
+			powa_check_persistence = false;
+		}
+
+		/* Only snapshot the modules that are due */
+		powa_dispatch_load();
+		powa_schedule_refresh();
+
+		pgstat_report_activity(STATE_RUNNING, query_due);
+		if (powa_execute_kept(query_due, &plan_due, false) != SPI_OK_SELECT ||
+			SPI_processed != 1)
+			elog(ERROR, "cannot check if maintenance is due");
+
+		aggregate = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc,
+											   1, &isnull));
+		purge = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+										   SPI_tuptable->tupdesc,
+										   2, &isnull));
+
+		/* the aggregate and purge are left to the maintenance worker */
+		MemoryContextReset(stepcxt);
+		steps = powa_dispatch_steps(true, true, NIL,
+									aggregate && !powa_maintenance_worker,
+									purge && !powa_maintenance_worker,
+									stepcxt, &nsteps);
 		SPI_finish();
 		PopActiveSnapshot();
 		CommitTransactionCommand();
+
+		/*
+		 * Call each function in its own transaction, rather than the whole
+		 * powa_take_snapshot() in a single one, so a long aggregate or purge
+		 * doesn't hold back the xmin horizon or keep the snapshot rows
+		 * uncommitted.
+		 */
+		for (i = 0; i < nsteps; i++)
+			powa_snapshot_run_step(steps[i]);
+
+		if (powa_maintenance_worker && (aggregate || purge))
+			powa_maintenance_request(aggregate, purge);
+
+		powa_schedule_update();
+		powa_collector_end("bgworker", "powa_take_snapshot");
 		pgstat_report_stat(false);
 		pgstat_report_activity(STATE_IDLE, NULL);
 		set_ps_display("idle", false);
 
+		/*
+		 * Skip the ticks where no module is due.  The snapshot reference
+		 * time will be incremented one more time after the sleep loop.
+		 */
+		next_tick = powa_schedule_next_tick();
+		for (; powa_tick + 1 < next_tick; powa_tick++)
+			INSTR_TIME_ADD(last_start, time_powa_frequency);
+
 		/* sleep loop */
 		for (;;)
 		{
@@ -337,71 +1922,437 @@ powa_main(Datum main_arg)
 		 * it's ideal target, not to now, so errors don't add up
 		 */
 		INSTR_TIME_ADD(last_start, time_powa_frequency);
+		powa_tick++;
 	} /* end of snapshot loop */
 }
 
+/*
+ * Synchronize the schedule with the snapshot modules currently enabled in
+ * powa_functions, as loaded in the dispatch cache.  New modules are due
+ * immediately, and an existing module whose frequency was lowered is
+ * rescheduled accordingly.  A module uses the highest frequency of its
+ * snapshot functions.
+ */
+static void
+powa_schedule_refresh(void)
+{
+	int			i;
+	int			j;
+
+	for (j = 0; j < powa_schedule_n; j++)
+		powa_schedule[j].seen = false;
+
+	for (i = 0; i < powa_dispatch.nsteps; i++)
+	{
+		PowaSnapshotStep *step = &powa_dispatch.steps[i];
+		char	   *module = step->module;
+		int			frequency = Max(step->frequency, 1);
+		PowaModuleSchedule *entry = NULL;
+
+		if (module == NULL || strcmp(step->operation, "snapshot") != 0)
+			continue;
+
+		for (j = 0; j < powa_schedule_n; j++)
+		{
+			if (strncmp(powa_schedule[j].module, module, NAMEDATALEN - 1) == 0)
+			{
+				entry = &powa_schedule[j];
+				break;
+			}
+		}
+
+		/* another snapshot function of a module already seen */
+		if (entry != NULL && entry->seen)
+		{
+			if (frequency > entry->frequency)
+			{
+				entry->frequency = frequency;
+				entry->next_tick = Min(entry->next_tick,
+									   powa_tick + frequency * entry->backoff);
+			}
+			continue;
+		}
+
+		if (entry == NULL)
+		{
+			if (powa_schedule_n >= powa_schedule_size)
+			{
+				powa_schedule_size = Max(powa_schedule_size * 2, 8);
+				if (powa_schedule == NULL)
+					powa_schedule = MemoryContextAlloc(TopMemoryContext,
+										sizeof(PowaModuleSchedule) *
+													   powa_schedule_size);
+				else
+					powa_schedule = repalloc(powa_schedule,
+											 sizeof(PowaModuleSchedule) *
+											 powa_schedule_size);
+			}
+
+			entry = &powa_schedule[powa_schedule_n++];
+			strlcpy(entry->module, module, NAMEDATALEN);
+			entry->backoff = 1;
+			entry->next_tick = powa_tick;
+		}
+
+		entry->frequency = frequency;
+		entry->next_tick = Min(entry->next_tick,
+							   powa_tick + frequency * entry->backoff);
+		entry->seen = true;
+	}
+
+	/* forget the modules that were removed or disabled */
+	for (i = 0, j = 0; j < powa_schedule_n; j++)
+	{
+		powa_schedule[j].duration = -1;
+		if (powa_schedule[j].seen)
+			powa_schedule[i++] = powa_schedule[j];
+	}
+	powa_schedule_n = i;
+}
+
+/* Is the given module due at the current tick? */
+static bool
+powa_schedule_is_due(const char *module)
+{
+	int			i;
+
+	for (i = 0; i < powa_schedule_n; i++)
+	{
+		if (strncmp(powa_schedule[i].module, module, NAMEDATALEN - 1) == 0)
+			return powa_schedule[i].next_tick <= powa_tick;
+	}
+
+	return false;
+}
+
+/* Account the duration of a snapshot function of a module that is due */
+static void
+powa_schedule_add_duration(const char *module, double duration)
+{
+	int			j;
+
+	for (j = 0; j < powa_schedule_n; j++)
+	{
+		if (strncmp(powa_schedule[j].module, module, NAMEDATALEN - 1) == 0)
+		{
+			if (powa_schedule[j].duration < 0)
+				powa_schedule[j].duration = 0;
+			powa_schedule[j].duration += duration;
+			break;
+		}
+	}
+}
 
 /*
- * Signal handler for SIGHUP
- *		Set a flag to tell the main loop to reread the config file, do sanity
- *		check, recompute the frequency and set our latch to wake it up.
+ * Reschedule the modules that just ran, according to the durations of their
+ * snapshot functions.  If powa.backoff_threshold is set, a module whose
+ * snapshot took more than this fraction of its interval gets its frequency
+ * halved, up to POWA_MAX_BACKOFF times, and gets it back once it's fast
+ * enough again.
  */
 static void
-powa_sighup(SIGNAL_ARGS)
+powa_schedule_update(void)
 {
-	int			save_errno = errno;
+	int			j;
 
-	got_sighup = true;
+	for (j = 0; j < powa_schedule_n; j++)
+	{
+		PowaModuleSchedule *entry = &powa_schedule[j];
+		double		interval;
 
-	if (MyProc)
-		SetLatch(&MyProc->procLatch);
+		if (entry->next_tick > powa_tick)
+			continue;
 
-	errno = save_errno;
+		/* due but not run, the module probably has just been disabled */
+		if (entry->duration < 0)
+			entry->duration = 0;
+
+		interval = (double) powa_frequency * entry->frequency * entry->backoff;
+
+		if (powa_backoff_threshold <= 0)
+			entry->backoff = 1;
+		else if (entry->duration > interval * powa_backoff_threshold &&
+				 entry->backoff < POWA_MAX_BACKOFF)
+		{
+			entry->backoff *= 2;
+			elog(LOG, "POWA snapshot of module \"%s\" took %.0f ms, running it every %d snapshots",
+				 entry->module, entry->duration,
+				 entry->frequency * entry->backoff);
+		}
+		/* the interval would be halved, so leave some margin */
+		else if (entry->backoff > 1 &&
+				 entry->duration < interval * powa_backoff_threshold / 4)
+		{
+			entry->backoff /= 2;
+			elog(LOG, "POWA snapshot of module \"%s\" took %.0f ms, running it every %d snapshots",
+				 entry->module, entry->duration,
+				 entry->frequency * entry->backoff);
+		}
+
+		entry->next_tick = powa_tick + entry->frequency * entry->backoff;
+	}
 }
 
 /*
- * Do all the needed work if a SIGHUP has been received
- *		- reread the config file
- *		- exit the bgworker if the frequency is invalid
- *		- compute the time_powa_frequency var
+ * Return the earliest tick at which a module is due.
+ */
+static uint64
+powa_schedule_next_tick(void)
+{
+	uint64		next = powa_tick + 1;
+	int			i;
+
+	for (i = 0; i < powa_schedule_n; i++)
+	{
+		if (i == 0 || powa_schedule[i].next_tick < next)
+			next = powa_schedule[i].next_tick;
+	}
+
+	return Max(next, powa_tick + 1);
+}
+
+/*
+ * Execute a query of the background workers, through a plan prepared on its
+ * first use and kept across transactions.  Must be called in an SPI
+ * connection.
+ */
+static int
+powa_execute_kept(const char *query, SPIPlanPtr *plan, bool read_only)
+{
+	if (*plan == NULL)
+	{
+		SPIPlanPtr	newplan = SPI_prepare(query, 0, NULL);
+
+		if (newplan == NULL)
+			elog(ERROR, "could not prepare \"%s\": %s", query,
+				 SPI_result_code_string(SPI_result));
+
+		SPI_keepplan(newplan);
+		*plan = newplan;
+	}
+
+	return SPI_execute_plan(*plan, NULL, NULL, read_only, 0);
+}
+
+/*
+ * Load the functions of powa_functions in the dispatch cache if needed.  Must
+ * be called in an SPI connection, and overwrites SPI_tuptable.
  */
 static void
-powa_process_sighup(void)
+powa_dispatch_load(void)
 {
-	if (got_sighup)
+	MemoryContext oldcxt;
+	int			ret;
+	int			i;
+	uint64		j;
+
+	if (powa_dispatch.valid)
+		return;
+
+	if (!powa_dispatch_callback_registered)
 	{
-		got_sighup = false;
+		CacheRegisterRelcacheCallback(powa_dispatch_relcache_cb, (Datum) 0);
+		powa_dispatch_callback_registered = true;
+	}
 
-		ProcessConfigFile(PGC_SIGHUP);
-		die_on_too_small_frequency();
-		compute_powa_frequency();
+	if (powa_dispatch.cxt == NULL)
+	{
+		powa_dispatch.cxt = AllocSetContextCreate(TopMemoryContext,
+												  "powa dispatch",
+												  ALLOCSET_DEFAULT_MINSIZE,
+												  ALLOCSET_DEFAULT_INITSIZE,
+												  ALLOCSET_DEFAULT_MAXSIZE);
+
+		/* the maintenance functions never change */
+		oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+		for (i = 0; i < POWA_DISPATCH_NB_MAINTENANCE; i++)
+		{
+			PowaSnapshotStep *step = &powa_dispatch.maintenance[i];
+
+			step->operation = pstrdup("maintenance");
+			step->module = NULL;
+			step->function_name = pstrdup(powa_dispatch_maintenance_names[i]);
+			step->query = psprintf("SELECT %s()",
+								   quote_identifier(step->function_name));
+			step->frequency = 1;
+			step->plan = NULL;
+		}
+		MemoryContextSwitchTo(oldcxt);
+	}
+	else
+	{
+		for (i = 0; i < powa_dispatch.nsteps; i++)
+		{
+			if (powa_dispatch.steps[i].plan != NULL)
+				SPI_freeplan(powa_dispatch.steps[i].plan);
+		}
+		MemoryContextReset(powa_dispatch.cxt);
+	}
+	powa_dispatch.steps = NULL;
+	powa_dispatch.nsteps = 0;
+
+	/* an invalidation received while loading the table is kept */
+	powa_dispatch.valid = true;
+	powa_dispatch.relid = RangeVarGetRelid(makeRangeVar(NULL,
+														"powa_functions", -1),
+										   NoLock, false);
+
+	ret = SPI_execute("SELECT operation, module, function_name, frequency"
+					  " FROM powa_functions"
+					  " WHERE enabled AND operation IN"
+					  " ('snapshot', 'aggregate', 'rollup', 'purge')",
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "cannot retrieve the powa functions: error code %d", ret);
+
+	oldcxt = MemoryContextSwitchTo(powa_dispatch.cxt);
+	powa_dispatch.steps = palloc0(sizeof(PowaSnapshotStep) *
+								  Max(SPI_processed, 1));
+
+	for (j = 0; j < SPI_processed; j++)
+	{
+		HeapTuple	tup = SPI_tuptable->vals[j];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		PowaSnapshotStep *step = &powa_dispatch.steps[j];
+		char	   *module = SPI_getvalue(tup, tupdesc, 2);
+		bool		isnull;
+
+		step->operation = pstrdup(SPI_getvalue(tup, tupdesc, 1));
+		step->module = (module == NULL) ? NULL : pstrdup(module);
+		step->function_name = pstrdup(SPI_getvalue(tup, tupdesc, 3));
+		step->query = psprintf("SELECT %s()",
+							   quote_identifier(step->function_name));
+		step->frequency = DatumGetInt32(SPI_getbinval(tup, tupdesc, 4,
+													  &isnull));
+		if (isnull)
+			step->frequency = 1;
+		step->plan = NULL;
 	}
+	powa_dispatch.nsteps = (int) SPI_processed;
+
+	MemoryContextSwitchTo(oldcxt);
+	SPI_freetuptable(SPI_tuptable);
 }
 
-Datum
-powa_stat_user_functions(PG_FUNCTION_ARGS)
+/*
+ * The steps are only reloaded at the beginning of the next snapshot, as the
+ * ones being run are still referenced.
+ */
+static void
+powa_dispatch_relcache_cb(Datum arg, Oid relid)
 {
-	return powa_stat_common(fcinfo, POWA_STAT_FUNCTION);
+	if (!OidIsValid(relid) || relid == powa_dispatch.relid)
+		powa_dispatch.valid = false;
 }
 
-Datum
-powa_stat_all_rel(PG_FUNCTION_ARGS)
+/*
+ * Append the cached functions of the given operation to the steps, only the
+ * ones of the modules that are due if dueonly, or of the given modules if
+ * not NIL.
+ */
+static int
+powa_dispatch_add(PowaSnapshotStep **steps, int n, const char *operation,
+				  bool dueonly, List *modules)
 {
-	return powa_stat_common(fcinfo, POWA_STAT_TABLE);
+	int			i;
+
+	for (i = 0; i < powa_dispatch.nsteps; i++)
+	{
+		PowaSnapshotStep *step = &powa_dispatch.steps[i];
+
+		if (strcmp(step->operation, operation) != 0)
+			continue;
+		if (dueonly && (step->module == NULL ||
+						!powa_schedule_is_due(step->module)))
+			continue;
+		if (modules != NIL)
+		{
+			ListCell   *lc;
+			bool		found = false;
+
+			foreach(lc, modules)
+			{
+				if (step->module != NULL &&
+					strcmp(step->module, (char *) lfirst(lc)) == 0)
+				{
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+				continue;
+		}
+
+		steps[n++] = step;
+	}
+
+	return n;
 }
 
-static Datum
-powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind)
+/*
+ * Get the functions to call, in order: if snapshot is true, the snapshot
+ * functions of the modules selected as in powa_dispatch_add(), then the
+ * aggregate and rollup functions if aggregate, and the purge functions if
+ * purge, along with the "maintenance" bookkeeping functions done around them.
+ * This is the only definition of the steps order, used by the background
+ * workers and by powa_take_snapshot() through powa_snapshot_steps().  The
+ * returned array is allocated in cxt, but the steps belong to the dispatch
+ * cache and are valid until the next powa_dispatch_load().
+ */
+static PowaSnapshotStep **
+powa_dispatch_steps(bool snapshot, bool dueonly, List *modules,
+					bool aggregate, bool purge, MemoryContext cxt,
+					int *nsteps)
+{
+	PowaSnapshotStep **steps;
+	int			n = 0;
+
+	steps = MemoryContextAlloc(cxt, sizeof(PowaSnapshotStep *) *
+							   (powa_dispatch.nsteps +
+								POWA_DISPATCH_NB_MAINTENANCE));
+
+	if (snapshot)
+	{
+		steps[n++] = &powa_dispatch.maintenance[POWA_DISPATCH_DATABASES];
+		n = powa_dispatch_add(steps, n, "snapshot", dueonly, modules);
+	}
+
+	if (aggregate)
+	{
+		steps[n++] = &powa_dispatch.maintenance[POWA_DISPATCH_PARTITIONS];
+		n = powa_dispatch_add(steps, n, "aggregate", false, NIL);
+		steps[n++] = &powa_dispatch.maintenance[POWA_DISPATCH_AGGREGATE_FINISH];
+		n = powa_dispatch_add(steps, n, "rollup", false, NIL);
+	}
+
+	if (purge)
+	{
+		n = powa_dispatch_add(steps, n, "purge", false, NIL);
+		steps[n++] = &powa_dispatch.maintenance[POWA_DISPATCH_PURGE_FINISH];
+	}
+
+	if (snapshot && powa_high_frequency_samples > 0)
+		steps[n++] = &powa_dispatch.maintenance[POWA_DISPATCH_DB_SAMPLES];
+
+	if (snapshot && powa_collector_stats_history)
+		steps[n++] = &powa_dispatch.maintenance[POWA_DISPATCH_COLLECTOR_STATS];
+
+	*nsteps = n;
+
+	return steps;
+}
+
+/* Return the given steps as the (operation, module, function_name) rows */
+static void
+powa_dispatch_materialize(FunctionCallInfo fcinfo, PowaSnapshotStep **steps,
+						  int nsteps)
 {
-	Oid			dbid = PG_GETARG_OID(0);
-	Oid			backend_dbid;
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	MemoryContext per_query_ctx;
 	MemoryContext oldcontext;
 	TupleDesc	tupdesc;
 	Tuplestorestate *tupstore;
-	PgStat_StatDBEntry *dbentry;
-	HASH_SEQ_STATUS hash_seq;
+	int			i;
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -420,6 +2371,8 @@ powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind)
 	/* Build a tuple descriptor for our result type */
 	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
 		elog(ERROR, "return type must be a row type");
+	if (tupdesc->natts != 3)
+		elog(ERROR, "unexpected number of columns");
 
 	tupstore = tuplestore_begin_heap(true, false, work_mem);
 	rsinfo->returnMode = SFRM_Materialize;
@@ -428,28 +2381,853 @@ powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	/* -----------------------------------------------------
-	 * Force deep statistics retrieval of specified database.
-	 *
-	 * Deep means to also include tables and functions HTAB, which is what we
-	 * want here.
-	 *
-	 * The stat collector isn't suppose to act this way, since a backend can't
-	 * access data outside the database it's connected to.  It's not a problem
-	 * here since we only need the identifier that are stored in the pgstats,
-	 * the UI will connect to the database to do the lookup.
-	 *
-	 * So, to ensure we'll have fresh statitics of the wanted database, we have
-	 * to do following (ugly) tricks:
-	 *
-	 * - clear the current statistics cache. If a previous function already
-	 *	 asked for statistics in the same transaction, calling
-	 *	 pgstat_fetch_stat_dbentry would() just return the cache, which would
-	 *	 probably belong to another database. As the powa snapshot works inside
-	 *	 a function, we have the guarantee that this function will be called for
-	 *	 all the databases in a single transaction anyway.
-	 *
-	 * - change the global var MyDatabaseId to the wanted databaseid. pgstat
+	for (i = 0; i < nsteps; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3] = {false, false, false};
+
+		values[0] = CStringGetTextDatum(steps[i]->operation);
+		nulls[1] = (steps[i]->module == NULL);
+		values[1] = nulls[1] ? (Datum) 0 :
+			CStringGetTextDatum(steps[i]->module);
+		values[2] = CStringGetTextDatum(steps[i]->function_name);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+}
+
+/*
+ * Return the functions to call for a snapshot, in powa_dispatch_steps()
+ * order: the snapshot functions of the given modules (all of them if NULL),
+ * then the aggregate and rollup functions or the purge functions if they're
+ * due and _maintenance is true.  powa_take_snapshot() calls all of them in a
+ * single transaction, while the background worker calls each of them in its
+ * own transaction.
+ */
+Datum
+powa_snapshot_steps(PG_FUNCTION_ARGS)
+{
+	MemoryContext callcxt = CurrentMemoryContext;
+	List	   *modules = NIL;
+	bool		maintenance = PG_ARGISNULL(1) ? false : PG_GETARG_BOOL(1);
+	bool		aggregate = false;
+	bool		purge = false;
+	PowaSnapshotStep **steps;
+	int			nsteps;
+
+	if (!PG_ARGISNULL(0))
+	{
+		ArrayType  *arr = PG_GETARG_ARRAYTYPE_P(0);
+		Datum	   *elems;
+		bool	   *elemnulls;
+		int			nelems;
+		int			i;
+
+		deconstruct_array(arr, TEXTOID, -1, false, 'i',
+						  &elems, &elemnulls, &nelems);
+		for (i = 0; i < nelems; i++)
+		{
+			if (!elemnulls[i])
+				modules = lappend(modules, TextDatumGetCString(elems[i]));
+		}
+
+		/* no module at all is wanted */
+		if (modules == NIL)
+			modules = list_make1(pstrdup(""));
+	}
+
+	SPI_connect();
+
+	powa_dispatch_load();
+
+	if (maintenance)
+	{
+		bool		isnull;
+
+		if (SPI_execute("SELECT aggregate, purge FROM powa_maintenance_due()",
+						false, 0) != SPI_OK_SELECT || SPI_processed != 1)
+			elog(ERROR, "cannot check if maintenance is due");
+
+		aggregate = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc,
+											   1, &isnull));
+		purge = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+										   SPI_tuptable->tupdesc,
+										   2, &isnull));
+	}
+
+	steps = powa_dispatch_steps(true, false, modules, aggregate, purge,
+								callcxt, &nsteps);
+
+	SPI_finish();
+
+	powa_dispatch_materialize(fcinfo, steps, nsteps);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the aggregate and rollup functions if _aggregate, and the purge
+ * functions if _purge, in powa_dispatch_steps() order.
+ */
+Datum
+powa_maintenance_steps(PG_FUNCTION_ARGS)
+{
+	bool		aggregate = PG_ARGISNULL(0) ? false : PG_GETARG_BOOL(0);
+	bool		purge = PG_ARGISNULL(1) ? false : PG_GETARG_BOOL(1);
+	PowaSnapshotStep **steps;
+	int			nsteps;
+
+	SPI_connect();
+	powa_dispatch_load();
+	SPI_finish();
+
+	steps = powa_dispatch_steps(false, false, NIL, aggregate, purge,
+								CurrentMemoryContext, &nsteps);
+
+	powa_dispatch_materialize(fcinfo, steps, nsteps);
+
+	return (Datum) 0;
+}
+
+/*
+ * Trigger on powa_functions, signaling the background workers that their
+ * dispatch cache has to be reloaded once the transaction commits.
+ */
+Datum
+powa_functions_changed(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "powa_functions_changed: not called by trigger manager");
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Call the function of a snapshot step in its own transaction.  Like in
+ * powa_take_snapshot(), an error only raises a WARNING, and the next steps
+ * are still run.
+ */
+static void
+powa_snapshot_run_step(PowaSnapshotStep * step)
+{
+	bool		measured = (strcmp(step->operation, "maintenance") != 0);
+	instr_time	start;
+	instr_time	duration;
+
+	set_ps_display(step->function_name, false);
+	INSTR_TIME_SET_CURRENT(start);
+
+	/* started outside the transaction, so it's ended even if it aborts */
+	if (measured)
+		powa_collector_begin();
+
+	PG_TRY();
+	{
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, step->query);
+		powa_execute_kept(step->query, &step->plan, false);
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(TopMemoryContext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		AbortCurrentTransaction();
+
+		ereport(WARNING,
+				(errcode(edata->sqlerrcode),
+				 errmsg("powa_take_snapshot(): function \"%s\" failed: %s",
+						step->function_name, edata->message),
+				 edata->detail ? errdetail_internal("%s", edata->detail) : 0,
+				 edata->hint ? errhint("%s", edata->hint) : 0,
+				 edata->context ? errcontext_msg("%s", edata->context) : 0));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	if (measured)
+		powa_collector_end(step->operation, step->function_name);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	if (step->module != NULL && strcmp(step->operation, "snapshot") == 0)
+		powa_schedule_add_duration(step->module,
+								   INSTR_TIME_GET_MILLISEC(duration));
+
+	pgstat_report_stat(false);
+}
+
+/*
+ * Ask the maintenance worker to run the aggregate and/or purge functions.  If
+ * it isn't running, it will do it as soon as it starts.
+ */
+static void
+powa_maintenance_request(bool aggregate, bool purge)
+{
+	Latch	   *latch;
+
+	if (powa_shared == NULL)
+		return;
+
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+	powa_shared->aggregate_requested |= aggregate;
+	powa_shared->purge_requested |= purge;
+	latch = powa_shared->maintenance_latch;
+	LWLockRelease(powa_shared->lock);
+
+	if (latch != NULL)
+		SetLatch(latch);
+}
+
+static void
+powa_maintenance_detach(int code, Datum arg)
+{
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+	powa_shared->maintenance_latch = NULL;
+	LWLockRelease(powa_shared->lock);
+}
+
+/*
+ * Main loop of the maintenance worker, started if powa.maintenance_worker is
+ * enabled.  It sleeps until the collector asks for an aggregate or a purge,
+ * and then calls the functions returned by powa_maintenance_steps(), each in
+ * its own transaction, so the snapshots never wait for them.
+ */
+void
+powa_maintenance_main(Datum main_arg)
+{
+	static char *query_appname = "SET application_name = 'PoWA maintenance'";
+	MemoryContext stepcxt;
+
+	pqsignal(SIGHUP, powa_sighup);
+
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(powa_database, NULL);
+
+	if (powa_shared == NULL)
+		elog(ERROR, "powa shared memory is not available");
+
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+	powa_shared->maintenance_latch = &MyProc->procLatch;
+	LWLockRelease(powa_shared->lock);
+	before_shmem_exit(powa_maintenance_detach, (Datum) 0);
+
+	set_ps_display("init", false);
+	StartTransactionCommand();
+	SetCurrentStatementStartTimestamp();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, query_appname);
+	SPI_execute(query_appname, false, 0);
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+	set_ps_display("idle", false);
+
+	stepcxt = AllocSetContextCreate(TopMemoryContext,
+									"powa maintenance steps",
+									ALLOCSET_DEFAULT_MINSIZE,
+									ALLOCSET_DEFAULT_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+
+	for (;;)
+	{
+		PowaSnapshotStep **steps;
+		bool		aggregate;
+		bool		purge;
+		int			nsteps;
+		int			i;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+		aggregate = powa_shared->aggregate_requested;
+		purge = powa_shared->purge_requested;
+		powa_shared->aggregate_requested = false;
+		powa_shared->purge_requested = false;
+		LWLockRelease(powa_shared->lock);
+
+		if (!aggregate && !purge)
+		{
+			int			rc;
+
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_POSTMASTER_DEATH, -1L
+#if PG_VERSION_NUM >= 100000
+						   ,PG_WAIT_EXTENSION
+#endif
+						   );
+			ResetLatch(&MyProc->procLatch);
+
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			continue;
+		}
+
+		set_ps_display("maintenance", false);
+		powa_collector_begin();
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		MemoryContextReset(stepcxt);
+		powa_dispatch_load();
+		steps = powa_dispatch_steps(false, false, NIL, aggregate, purge,
+									stepcxt, &nsteps);
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+
+		for (i = 0; i < nsteps; i++)
+			powa_snapshot_run_step(steps[i]);
+
+		powa_collector_end("bgworker", "powa_maintenance");
+		pgstat_report_stat(false);
+		pgstat_report_activity(STATE_IDLE, NULL);
+		set_ps_display("idle", false);
+	}
+}
+
+/*
+ * Main loop of the sampler background worker, taking the high frequency
+ * samples every powa.high_frequency_interval, independently of the snapshots.
+ * If a sample is late, the next ones are scheduled from it rather than trying
+ * to catch up.
+ */
+void
+powa_sampler_main(Datum main_arg)
+{
+	TimestampTz next_sample;
+
+	pqsignal(SIGHUP, powa_sighup);
+
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(powa_database, NULL);
+
+	if (powa_shared == NULL || powa_shared->nsampleslots == 0)
+		elog(ERROR, "powa shared memory is not available");
+
+	set_ps_display("idle", false);
+	next_sample = GetCurrentTimestamp();
+
+	for (;;)
+	{
+		TimestampTz now;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		now = GetCurrentTimestamp();
+		if (next_sample > now)
+		{
+			int			rc;
+
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   Max((next_sample - now) / 1000, 1)
+#if PG_VERSION_NUM >= 100000
+						   ,PG_WAIT_EXTENSION
+#endif
+						   );
+			ResetLatch(&MyProc->procLatch);
+
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			continue;
+		}
+
+		StartTransactionCommand();
+		powa_sample_take();
+		CommitTransactionCommand();
+
+		next_sample += (int64) powa_high_frequency_interval * 1000;
+		if (next_sample <= now)
+			next_sample = now + (int64) powa_high_frequency_interval * 1000;
+	}
+}
+
+
+/*
+ * Signal handler for SIGHUP
+ *		Set a flag to tell the main loop to reread the config file, do sanity
+ *		check, recompute the frequency and set our latch to wake it up.
+ */
+static void
+powa_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+
+	if (MyProc)
+		SetLatch(&MyProc->procLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Do all the needed work if a SIGHUP has been received
+ *		- reread the config file, which also invalidates the resolved
+ *		  powa.ignored_users
+ *		- exit the bgworker if the frequency is invalid
+ *		- compute the time_powa_frequency var
+ *		- ask for a check of the *_current tables persistence
+ */
+static void
+powa_process_sighup(void)
+{
+	if (got_sighup)
+	{
+		got_sighup = false;
+
+		ProcessConfigFile(PGC_SIGHUP);
+		die_on_too_small_frequency();
+		compute_powa_frequency();
+		powa_check_persistence = true;
+	}
+}
+
+Datum
+powa_stat_user_functions(PG_FUNCTION_ARGS)
+{
+	return powa_stat_common(fcinfo, POWA_STAT_FUNCTION);
+}
+
+/*
+ * On PostgreSQL 15 and above, the relations are returned one at a time when
+ * the caller allows it, rather than in a tuplestore, which a database with
+ * many relations could otherwise spill to disk.  The statistics are read in
+ * shared memory for each relation, so only the oids of the relations are
+ * kept in the meantime.
+ */
+Datum
+powa_stat_all_rel(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 150000
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo) &&
+		(rsinfo->allowedModes & SFRM_ValuePerCall))
+		return powa_stat_all_rel_stream(fcinfo);
+#endif
+
+	return powa_stat_common(fcinfo, POWA_STAT_TABLE);
+}
+
+#if PG_VERSION_NUM >= 150000
+static Datum
+powa_stat_all_rel_stream(FunctionCallInfo fcinfo)
+{
+	FuncCallContext *funcctx;
+	PowaStatStream *stream;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* the nulls are zeroed once, see powa_stat_tab_values() */
+		stream = palloc0(sizeof(PowaStatStream));
+		stream->dbid = PG_GETARG_OID(0);
+		stream->relids = powa_stat_relids(stream->dbid, &stream->nrelids);
+		funcctx->user_fctx = stream;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	stream = (PowaStatStream *) funcctx->user_fctx;
+
+	while (stream->next < stream->nrelids)
+	{
+		PgStat_StatTabEntry tabentry;
+		Oid			relid = stream->relids[stream->next++];
+		HeapTuple	tuple;
+
+		/* the relation may have been dropped since the first call */
+		if (!powa_stat_fetch_rel(stream->dbid, relid, &tabentry))
+			continue;
+
+		powa_stat_tab_values(relid, &tabentry, stream->values, stream->nulls);
+		tuple = heap_form_tuple(funcctx->tuple_desc, stream->values,
+								stream->nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/* Get the oid of all the relations of the given database having statistics */
+static Oid *
+powa_stat_relids(Oid dbid, int *nrelids)
+{
+	dshash_seq_status hstat;
+	PgStatShared_HashEntry *p;
+	Oid		   *relids;
+	int			size = 1024;
+
+	*nrelids = 0;
+	relids = palloc(sizeof(Oid) * size);
+
+	dshash_seq_init(&hstat, pgStatLocal.shared_hash, false);
+	while ((p = dshash_seq_next(&hstat)) != NULL)
+	{
+		if (p->dropped || p->key.kind != PGSTAT_KIND_RELATION ||
+			p->key.dboid != dbid)
+			continue;
+
+		if (*nrelids >= size)
+		{
+			size *= 2;
+			relids = repalloc(relids, sizeof(Oid) * size);
+		}
+		relids[(*nrelids)++] = p->key.objoid;
+	}
+	dshash_seq_term(&hstat);
+
+	return relids;
+}
+
+/*
+ * Copy the shared memory statistics of the given relation.  Returns false if
+ * there are none.
+ */
+static bool
+powa_stat_fetch_rel(Oid dbid, Oid relid, PgStat_StatTabEntry *tabentry)
+{
+	PgStat_HashKey key;
+	PgStatShared_HashEntry *p;
+	PgStatShared_Common *shared;
+
+	/* the whole key is hashed, padding included */
+	memset(&key, 0, sizeof(key));
+	key.kind = PGSTAT_KIND_RELATION;
+	key.dboid = dbid;
+	key.objoid = relid;
+
+	p = dshash_find(pgStatLocal.shared_hash, &key, false);
+	if (p == NULL)
+		return false;
+
+	if (p->dropped)
+	{
+		dshash_release_lock(pgStatLocal.shared_hash, p);
+		return false;
+	}
+
+	shared = dsa_get_address(pgStatLocal.dsa, p->body);
+	LWLockAcquire(&shared->lock, LW_SHARED);
+	memcpy(tabentry, &((PgStatShared_Relation *) shared)->stats,
+		   sizeof(PgStat_StatTabEntry));
+	LWLockRelease(&shared->lock);
+
+	dshash_release_lock(pgStatLocal.shared_hash, p);
+
+	return true;
+}
+#endif
+
+static Datum
+powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind)
+{
+	Oid			dbid = PG_GETARG_OID(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PowaStatTuplestore state;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	state.tupstore = tupstore;
+	state.tupdesc = tupdesc;
+	powa_stat_fetch(dbid, kind, powa_stat_tuplestore_callback, &state);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+static void
+powa_stat_tuplestore_callback(Datum *values, bool *nulls, void *arg)
+{
+	PowaStatTuplestore *state = (PowaStatTuplestore *) arg;
+
+	tuplestore_putvalues(state->tupstore, state->tupdesc, values, nulls);
+}
+
+/*
+ * Fill the values of a powa_stat_user_functions() row.  None of them can be
+ * NULL, so the nulls only have to be zeroed once by the caller, and both
+ * arrays can be reused for all the entries.
+ */
+static void
+powa_stat_func_values(Oid funcid, PgStat_StatFuncEntry *funcentry,
+					  Datum *values, bool *nulls)
+{
+	int			i = 0;
+
+	values[i++] = ObjectIdGetDatum(funcid);
+#if PG_VERSION_NUM >= 150000
+	values[i++] = Int64GetDatum(funcentry->numcalls);
+	values[i++] = Float8GetDatum(((double) funcentry->total_time) / 1000.0);
+	values[i++] = Float8GetDatum(((double) funcentry->self_time) / 1000.0);
+#else
+	values[i++] = Int64GetDatum(funcentry->f_numcalls);
+	values[i++] = Float8GetDatum(((double) funcentry->f_total_time) / 1000.0);
+	values[i++] = Float8GetDatum(((double) funcentry->f_self_time) / 1000.0);
+#endif
+
+	Assert(i == POWA_STAT_FUNC_COLS);
+}
+
+/*
+ * Fill the values of a powa_stat_all_rel() row.  Only the timestamps can be
+ * NULL, so only their nulls are set: the caller has to zero the nulls once,
+ * and can then reuse both arrays for all the entries.
+ *
+ * The fields of PgStat_StatTabEntry holding the tuple estimates and the
+ * (auto)vacuum and analyze activity were renamed in PostgreSQL 16.
+ */
+static void
+powa_stat_tab_values(Oid relid, PgStat_StatTabEntry *tabentry,
+					 Datum *values, bool *nulls)
+{
+	int			i = 0;
+#if PG_VERSION_NUM >= 160000
+	int64		live_tuples = tabentry->live_tuples;
+	int64		dead_tuples = tabentry->dead_tuples;
+	int64		mod_since_analyze = tabentry->mod_since_analyze;
+	TimestampTz vacuum_ts = tabentry->last_vacuum_time;
+	TimestampTz autovacuum_ts = tabentry->last_autovacuum_time;
+	TimestampTz analyze_ts = tabentry->last_analyze_time;
+	TimestampTz autoanalyze_ts = tabentry->last_autoanalyze_time;
+	int64		autovacuum_count = tabentry->autovacuum_count;
+	int64		autoanalyze_count = tabentry->autoanalyze_count;
+#else
+	int64		live_tuples = tabentry->n_live_tuples;
+	int64		dead_tuples = tabentry->n_dead_tuples;
+	int64		mod_since_analyze = tabentry->changes_since_analyze;
+	TimestampTz vacuum_ts = tabentry->vacuum_timestamp;
+	TimestampTz autovacuum_ts = tabentry->autovac_vacuum_timestamp;
+	TimestampTz analyze_ts = tabentry->analyze_timestamp;
+	TimestampTz autoanalyze_ts = tabentry->autovac_analyze_timestamp;
+	int64		autovacuum_count = tabentry->autovac_vacuum_count;
+	int64		autoanalyze_count = tabentry->autovac_analyze_count;
+#endif
+
+	/* Oid of the table (or index) */
+	values[i++] = ObjectIdGetDatum(relid);
+
+	values[i++] = Int64GetDatum((int64) tabentry->numscans);
+
+	values[i++] = Int64GetDatum((int64) tabentry->tuples_returned);
+	values[i++] = Int64GetDatum((int64) tabentry->tuples_fetched);
+	values[i++] = Int64GetDatum((int64) tabentry->tuples_inserted);
+	values[i++] = Int64GetDatum((int64) tabentry->tuples_updated);
+	values[i++] = Int64GetDatum((int64) tabentry->tuples_deleted);
+	values[i++] = Int64GetDatum((int64) tabentry->tuples_hot_updated);
+
+	values[i++] = Int64GetDatum(live_tuples);
+	values[i++] = Int64GetDatum(dead_tuples);
+	values[i++] = Int64GetDatum(mod_since_analyze);
+
+	values[i++] = Int64GetDatum((int64) (tabentry->blocks_fetched - tabentry->blocks_hit));
+	values[i++] = Int64GetDatum((int64) tabentry->blocks_hit);
+
+	/* last vacuum */
+	nulls[i] = (vacuum_ts == 0);
+	values[i++] = TimestampTzGetDatum(vacuum_ts);
+	values[i++] = Int64GetDatum((int64) tabentry->vacuum_count);
+
+	/* last_autovacuum */
+	nulls[i] = (autovacuum_ts == 0);
+	values[i++] = TimestampTzGetDatum(autovacuum_ts);
+	values[i++] = Int64GetDatum(autovacuum_count);
+
+	/* last_analyze */
+	nulls[i] = (analyze_ts == 0);
+	values[i++] = TimestampTzGetDatum(analyze_ts);
+	values[i++] = Int64GetDatum((int64) tabentry->analyze_count);
+
+	/* last_autoanalyze */
+	nulls[i] = (autoanalyze_ts == 0);
+	values[i++] = TimestampTzGetDatum(autoanalyze_ts);
+	values[i++] = Int64GetDatum(autoanalyze_count);
+
+	Assert(i == POWA_STAT_TAB_COLS);
+}
+
+#if PG_VERSION_NUM < 150000
+/* Call the callback for each entry of the given kind of a pgstat dbentry */
+static void
+powa_stat_emit_dbentry(PgStat_StatDBEntry *dbentry, PowaStatKind kind,
+					   PowaStatCallback callback, void *arg)
+{
+	HASH_SEQ_STATUS hash_seq;
+
+	if (dbentry == NULL || dbentry->functions == NULL ||
+		dbentry->tables == NULL)
+		return;
+
+	switch (kind)
+	{
+		case POWA_STAT_FUNCTION:
+			{
+				PgStat_StatFuncEntry *funcentry = NULL;
+				Datum		values[POWA_STAT_FUNC_COLS];
+				bool		nulls[POWA_STAT_FUNC_COLS] = {0};
+
+				hash_seq_init(&hash_seq, dbentry->functions);
+				while ((funcentry = hash_seq_search(&hash_seq)) != NULL)
+				{
+					powa_stat_func_values(funcentry->functionid, funcentry,
+										  values, nulls);
+					callback(values, nulls, arg);
+				}
+				break;
+			}
+		case POWA_STAT_TABLE:
+			{
+				PgStat_StatTabEntry *tabentry = NULL;
+				Datum		values[POWA_STAT_TAB_COLS];
+				bool		nulls[POWA_STAT_TAB_COLS] = {0};
+
+				hash_seq_init(&hash_seq, dbentry->tables);
+				while ((tabentry = hash_seq_search(&hash_seq)) != NULL)
+				{
+					powa_stat_tab_values(tabentry->tableid, tabentry,
+										 values, nulls);
+					callback(values, nulls, arg);
+				}
+				break;
+			}
+	}
+}
+#endif
+
+/*
+ * Retrieve the statistics of the given kind for the given database, calling
+ * the callback for each entry with the values and nulls of a row of the
+ * underlying SRF.
+ */
+#if PG_VERSION_NUM >= 150000
+static void
+powa_stat_fetch(Oid dbid, PowaStatKind kind, PowaStatCallback callback,
+				void *arg)
+{
+	PowaStatCallbackArg adapter;
+
+	/*
+	 * The statistics are in shared memory, so there's no need to fool
+	 * pgstat anymore: simply look for the entries of the wanted database.
+	 */
+	adapter.callback = callback;
+	adapter.arg = arg;
+	powa_stat_fetch_cluster(&dbid, 1, kind, powa_stat_nodb_adapter, &adapter);
+}
+
+static void
+powa_stat_nodb_adapter(Oid dbid, Datum *values, bool *nulls, void *arg)
+{
+	PowaStatCallbackArg *adapter = (PowaStatCallbackArg *) arg;
+
+	adapter->callback(values, nulls, adapter->arg);
+}
+#else
+static void
+powa_stat_fetch(Oid dbid, PowaStatKind kind, PowaStatCallback callback,
+				void *arg)
+{
+	Oid			backend_dbid;
+	PgStat_StatDBEntry *dbentry;
+
+	/* -----------------------------------------------------
+	 * Force deep statistics retrieval of specified database.
+	 *
+	 * Deep means to also include tables and functions HTAB, which is what we
+	 * want here.
+	 *
+	 * The stat collector isn't suppose to act this way, since a backend can't
+	 * access data outside the database it's connected to.  It's not a problem
+	 * here since we only need the identifier that are stored in the pgstats,
+	 * the UI will connect to the database to do the lookup.
+	 *
+	 * So, to ensure we'll have fresh statitics of the wanted database, we have
+	 * to do following (ugly) tricks:
+	 *
+	 * - clear the current statistics cache. If a previous function already
+	 *	 asked for statistics in the same transaction, calling
+	 *	 pgstat_fetch_stat_dbentry would() just return the cache, which would
+	 *	 probably belong to another database. As the powa snapshot works inside
+	 *	 a function, we have the guarantee that this function will be called for
+	 *	 all the databases in a single transaction anyway.
+	 *
+	 * - change the global var MyDatabaseId to the wanted databaseid. pgstat
 	 *	 is designed to only retrieve statistics for current database, so we
 	 *	 need to fool it.
 	 *
@@ -462,124 +3240,7390 @@ powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind)
 	 *	 database.
 	 */
 
-	pgstat_clear_snapshot();
+	pgstat_clear_snapshot();
+
+	backend_dbid = MyDatabaseId;
+	MyDatabaseId = dbid;
+
+	dbentry = pgstat_fetch_stat_dbentry(dbid);
+
+	MyDatabaseId = backend_dbid;
+
+	powa_stat_emit_dbentry(dbentry, kind, callback, arg);
+
+	/*
+	 * Make sure any subsequent statistic retrieving will not see the one we
+	 * just fetched
+	 */
+	pgstat_clear_snapshot();
+}
+#endif
+
+
+/*
+ * - and / operators on the history records.
+ *
+ * These are called for every pair of adjacent records by the UI, so they're
+ * implemented in C rather than plpgsql: both records are deformed once
+ * according to a cached layout, and the result is built with a single
+ * heap_form_tuple().  They behave exactly like the former plpgsql versions,
+ * a NULL field giving a NULL result field.
+ */
+Datum
+powa_statements_history_mi(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_MI);
+}
+
+Datum
+powa_statements_history_div(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_DIV);
+}
+
+Datum
+powa_user_functions_history_mi(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_MI);
+}
+
+Datum
+powa_user_functions_history_div(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_DIV);
+}
+
+Datum
+powa_all_relations_history_mi(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_MI);
+}
+
+Datum
+powa_all_relations_history_div(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_DIV);
+}
+
+Datum
+powa_kcache_mi(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_MI);
+}
+
+Datum
+powa_kcache_div(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_DIV);
+}
+
+Datum
+powa_qualstats_history_mi(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_MI);
+}
+
+Datum
+powa_qualstats_history_div(PG_FUNCTION_ARGS)
+{
+	return powa_record_op_common(fcinfo, POWA_RECORD_DIV);
+}
+
+/*
+ * Number of seconds between two timestamps, same as
+ * extract(EPOCH FROM (a - b)).
+ */
+static double
+powa_ts_diff_secs(TimestampTz a, TimestampTz b)
+{
+#if PG_VERSION_NUM >= 100000 || defined(HAVE_INT64_TIMESTAMP)
+	return ((double) (a - b)) / USECS_PER_SEC;
+#else
+	return a - b;
+#endif
+}
+
+/*
+ * Compute (and cache in fn_extra) the layout of the records and of the
+ * result type for the given operator call site.
+ */
+static PowaRecordOpCache *
+powa_get_record_op_cache(FunctionCallInfo fcinfo, HeapTupleHeader rec,
+						 PowaRecordOpKind kind)
+{
+	PowaRecordOpCache *cache = (PowaRecordOpCache *) fcinfo->flinfo->fn_extra;
+	Oid			argtype = HeapTupleHeaderGetTypeId(rec);
+	int32		argtypmod = HeapTupleHeaderGetTypMod(rec);
+	MemoryContext oldcontext;
+	TupleDesc	argdesc;
+	TupleDesc	resdesc;
+	int			natts;
+	int			i;
+
+	if (cache != NULL && cache->argtype == argtype &&
+		cache->argtypmod == argtypmod)
+		return cache;
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	argdesc = lookup_rowtype_tupdesc_copy(argtype, argtypmod);
+	if (get_call_result_type(fcinfo, NULL, &resdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	resdesc = BlessTupleDesc(resdesc);
+
+	natts = argdesc->natts;
+
+	if (natts < 1 || TupleDescAttr(argdesc, 0)->atttypid != TIMESTAMPTZOID)
+		elog(ERROR, "first field of type %s must be a timestamp with time zone",
+			 format_type_be(argtype));
+
+	cache = palloc0(sizeof(PowaRecordOpCache));
+	cache->argtype = argtype;
+	cache->argtypmod = argtypmod;
+	cache->argdesc = argdesc;
+	cache->resdesc = resdesc;
+	cache->attnums = palloc(sizeof(int) * natts);
+	cache->avalues = palloc(sizeof(Datum) * natts);
+	cache->anulls = palloc(sizeof(bool) * natts);
+	cache->bvalues = palloc(sizeof(Datum) * natts);
+	cache->bnulls = palloc(sizeof(bool) * natts);
+	cache->rvalues = palloc(sizeof(Datum) * resdesc->natts);
+	cache->rnulls = palloc(sizeof(bool) * resdesc->natts);
+
+	/* Gather the counters, ignoring the extra timestamps */
+	for (i = 1; i < natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(argdesc, i);
+
+		if (att->attisdropped || att->atttypid == TIMESTAMPTZOID)
+			continue;
+
+		if (att->atttypid != INT8OID && att->atttypid != FLOAT8OID)
+			elog(ERROR, "unexpected type %s for field \"%s\" of type %s",
+				 format_type_be(att->atttypid), NameStr(att->attname),
+				 format_type_be(argtype));
+
+		cache->attnums[cache->nfields++] = i;
+	}
+
+	if (resdesc->natts != cache->nfields + 1)
+		elog(ERROR, "return type has %d fields, %d expected",
+			 resdesc->natts, cache->nfields + 1);
+
+	/* Sanity check the result type */
+	for (i = 0; i < resdesc->natts; i++)
+	{
+		Oid			restype = TupleDescAttr(resdesc, i)->atttypid;
+		Oid			expected;
+
+		if (i == 0)
+			expected = (kind == POWA_RECORD_MI ? INTERVALOID : INT4OID);
+		else if (kind == POWA_RECORD_MI)
+			expected = TupleDescAttr(argdesc, cache->attnums[i - 1])->atttypid;
+		else
+			expected = FLOAT8OID;
+
+		if (restype != expected)
+			elog(ERROR, "field %d of the return type is %s, %s expected",
+				 i + 1, format_type_be(restype), format_type_be(expected));
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (fcinfo->flinfo->fn_extra != NULL)
+		pfree(fcinfo->flinfo->fn_extra);
+	fcinfo->flinfo->fn_extra = cache;
+
+	return cache;
+}
+
+static Datum
+powa_record_op_common(PG_FUNCTION_ARGS, PowaRecordOpKind kind)
+{
+	HeapTupleHeader a = PG_GETARG_HEAPTUPLEHEADER(0);
+	HeapTupleHeader b = PG_GETARG_HEAPTUPLEHEADER(1);
+	PowaRecordOpCache *cache;
+	HeapTupleData tuple;
+	Datum	   *rvalues;
+	bool	   *rnulls;
+	double		sec = 1;
+	int			i;
+
+	cache = powa_get_record_op_cache(fcinfo, a, kind);
+
+	if (HeapTupleHeaderGetTypeId(b) != cache->argtype ||
+		HeapTupleHeaderGetTypMod(b) != cache->argtypmod)
+		elog(ERROR, "both records must be of the same type");
+
+	/* Deform both records, without copying them */
+	tuple.t_len = HeapTupleHeaderGetDatumLength(a);
+	ItemPointerSetInvalid(&(tuple.t_self));
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = a;
+	heap_deform_tuple(&tuple, cache->argdesc, cache->avalues, cache->anulls);
+
+	tuple.t_len = HeapTupleHeaderGetDatumLength(b);
+	tuple.t_data = b;
+	heap_deform_tuple(&tuple, cache->argdesc, cache->bvalues, cache->bnulls);
+
+	rvalues = cache->rvalues;
+	rnulls = cache->rnulls;
+
+	/* First field is the interval, or the number of seconds */
+	rnulls[0] = (cache->anulls[0] || cache->bnulls[0]);
+	if (!rnulls[0])
+	{
+		if (kind == POWA_RECORD_MI)
+			rvalues[0] = DirectFunctionCall2(timestamp_mi,
+											 cache->avalues[0],
+											 cache->bvalues[0]);
+		else
+		{
+			double		epoch;
+
+			epoch = powa_ts_diff_secs(DatumGetTimestampTz(cache->avalues[0]),
+									  DatumGetTimestampTz(cache->bvalues[0]));
+
+			if (isnan(epoch) || epoch < INT_MIN || epoch > INT_MAX)
+				ereport(ERROR,
+						(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+						 errmsg("integer out of range")));
+
+			rvalues[0] = Int32GetDatum((int32) rint(epoch));
+			if (DatumGetInt32(rvalues[0]) != 0)
+				sec = DatumGetInt32(rvalues[0]);
+		}
+	}
+
+	/* Then all the counters */
+	for (i = 0; i < cache->nfields; i++)
+	{
+		int			attnum = cache->attnums[i];
+		bool		isint8;
+
+		/* Without an interval, there can't be any rate */
+		rnulls[i + 1] = (cache->anulls[attnum] || cache->bnulls[attnum] ||
+						 (kind == POWA_RECORD_DIV && rnulls[0]));
+		if (rnulls[i + 1])
+			continue;
+
+		isint8 = (TupleDescAttr(cache->argdesc, attnum)->atttypid == INT8OID);
+
+		if (kind == POWA_RECORD_MI)
+		{
+			if (isint8)
+			{
+				int64		res;
+
+				if (pg_sub_s64_overflow(DatumGetInt64(cache->avalues[attnum]),
+										DatumGetInt64(cache->bvalues[attnum]),
+										&res))
+					ereport(ERROR,
+							(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+							 errmsg("bigint out of range")));
+				rvalues[i + 1] = Int64GetDatum(res);
+			}
+			else
+				rvalues[i + 1] = Float8GetDatum(DatumGetFloat8(cache->avalues[attnum])
+								 - DatumGetFloat8(cache->bvalues[attnum]));
+		}
+		else
+		{
+			double		delta;
+
+			if (isint8)
+				delta = (double) (DatumGetInt64(cache->avalues[attnum])
+								  - DatumGetInt64(cache->bvalues[attnum]));
+			else
+				delta = DatumGetFloat8(cache->avalues[attnum])
+					- DatumGetFloat8(cache->bvalues[attnum]);
+
+			rvalues[i + 1] = Float8GetDatum(delta / sec);
+		}
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(cache->resdesc,
+													  rvalues, rnulls)));
+}
+
+
+/*
+ * Columnar blocks of history records
+ */
+
+/* Append an unsigned varint to the buffer */
+static inline void
+powa_varint_append(StringInfo buf, uint64 v)
+{
+	char		tmp[10];
+	int			len = 0;
+
+	do
+	{
+		tmp[len] = (char) (v & 0x7F);
+		v >>= 7;
+		if (v != 0)
+			tmp[len] |= 0x80;
+		len++;
+	} while (v != 0);
+
+	appendBinaryStringInfo(buf, tmp, len);
+}
+
+/* Read an unsigned varint, complaining if it ends after end */
+static inline uint64
+powa_varint_read(const char **p, const char *end)
+{
+	uint64		v = 0;
+	int			shift = 0;
+
+	for (;;)
+	{
+		uint8		c;
+
+		if (*p >= end || shift > 63)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted history block")));
+
+		c = (uint8) **p;
+		(*p)++;
+		v |= ((uint64) (c & 0x7F)) << shift;
+		if ((c & 0x80) == 0)
+			break;
+		shift += 7;
+	}
+
+	return v;
+}
+
+/* Append the nbits low bits of v to a bit stream */
+static inline void
+powa_bits_append(PowaBitWriter * w, uint64 v, int nbits)
+{
+	while (nbits > 0)
+	{
+		int			n = Min(nbits, 8 - w->nused);
+
+		w->cur |= (uint8) (((v >> (nbits - n)) & ((1 << n) - 1))
+						   << (8 - w->nused - n));
+		w->nused += n;
+		nbits -= n;
+		if (w->nused == 8)
+		{
+			appendStringInfoChar(w->buf, (char) w->cur);
+			w->cur = 0;
+			w->nused = 0;
+		}
+	}
+}
+
+/* Write the last partial byte of a bit stream */
+static inline void
+powa_bits_flush(PowaBitWriter * w)
+{
+	if (w->nused > 0)
+		appendStringInfoChar(w->buf, (char) w->cur);
+	w->cur = 0;
+	w->nused = 0;
+}
+
+/* Read nbits bits of a bit stream, complaining if it ends after end */
+static inline uint64
+powa_bits_read(PowaBitReader * r, int nbits)
+{
+	uint64		v = 0;
+
+	while (nbits > 0)
+	{
+		int			n = Min(nbits, 8 - r->nused);
+		uint8		c;
+
+		if (r->p >= r->end)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted history block")));
+
+		c = (uint8) *r->p;
+		v = (v << n) | ((c >> (8 - r->nused - n)) & ((1 << n) - 1));
+		r->nused += n;
+		nbits -= n;
+		if (r->nused == 8)
+		{
+			r->p++;
+			r->nused = 0;
+		}
+	}
+
+	return v;
+}
+
+/* Number of leading zeros of a non-zero value */
+static inline int
+powa_clz64(uint64 v)
+{
+#ifdef HAVE__BUILTIN_CLZ
+	return __builtin_clzll(v);
+#else
+	int			n = 0;
+
+	while ((v & ((uint64) 1 << 63)) == 0)
+	{
+		v <<= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/* Number of trailing zeros of a non-zero value */
+static inline int
+powa_ctz64(uint64 v)
+{
+#ifdef HAVE__BUILTIN_CTZ
+	return __builtin_ctzll(v);
+#else
+	int			n = 0;
+
+	while ((v & 1) == 0)
+	{
+		v >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/* Append the XOR of a double precision value with the previous one */
+static void
+powa_xor_append(PowaBitWriter * w, uint64 xor)
+{
+	int			lead,
+				trail,
+				len;
+
+	if (xor == 0)
+	{
+		powa_bits_append(w, 0, 1);
+		return;
+	}
+
+	lead = Min(powa_clz64(xor), 31);
+	trail = powa_ctz64(xor);
+	len = 64 - lead - trail;
+
+	/*
+	 * Reuse the previous window if the value fits in it, unless it's so much
+	 * wider that describing a new one is cheaper
+	 */
+	if (w->lead >= 0 && lead >= w->lead && trail >= w->trail &&
+		64 - w->lead - w->trail <= len + 11)
+	{
+		powa_bits_append(w, 2, 2);
+		powa_bits_append(w, xor >> w->trail, 64 - w->lead - w->trail);
+		return;
+	}
+
+	powa_bits_append(w, 3, 2);
+	powa_bits_append(w, lead, 5);
+	powa_bits_append(w, len - 1, 6);
+	powa_bits_append(w, xor >> trail, len);
+	w->lead = lead;
+	w->trail = trail;
+}
+
+/* Read the XOR of a double precision value with the previous one */
+static uint64
+powa_xor_read(PowaBitReader * r)
+{
+	int			lead,
+				len;
+
+	if (powa_bits_read(r, 1) == 0)
+		return 0;
+
+	if (powa_bits_read(r, 1) == 0)
+	{
+		if (r->lead < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted history block")));
+
+		return powa_bits_read(r, 64 - r->lead - r->trail) << r->trail;
+	}
+
+	lead = (int) powa_bits_read(r, 5);
+	len = (int) powa_bits_read(r, 6) + 1;
+	if (lead + len > 64)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("corrupted history block")));
+	r->lead = lead;
+	r->trail = 64 - lead - len;
+
+	return powa_bits_read(r, len) << r->trail;
+}
+
+/* Get the block kind to use for the given record field */
+static char
+powa_block_kind(Form_pg_attribute att)
+{
+	/* dropped fields are stored as an always NULL bigint */
+	if (att->attisdropped)
+		return POWA_BLOCK_KIND_INT8;
+
+	switch (att->atttypid)
+	{
+		case TIMESTAMPTZOID:
+			return POWA_BLOCK_KIND_TS;
+		case INT8OID:
+			return POWA_BLOCK_KIND_INT8;
+		case FLOAT8OID:
+			return POWA_BLOCK_KIND_FLOAT8;
+		default:
+			elog(ERROR, "unsupported type %s for field \"%s\"",
+				 format_type_be(att->atttypid), NameStr(att->attname));
+	}
+
+	return 0;					/* keep compiler quiet */
+}
+
+/* Raw 64 bits representation of a record field */
+static inline uint64
+powa_datum_to_bits(Datum d, char kind)
+{
+	uint64		v;
+
+	switch (kind)
+	{
+		case POWA_BLOCK_KIND_INT8:
+			return (uint64) DatumGetInt64(d);
+		case POWA_BLOCK_KIND_FLOAT8:
+			{
+				float8		f = DatumGetFloat8(d);
+
+				memcpy(&v, &f, sizeof(v));
+				return v;
+			}
+		default:
+			{
+				TimestampTz ts = DatumGetTimestampTz(d);
+
+				StaticAssertStmt(sizeof(TimestampTz) == sizeof(uint64),
+								 "unexpected TimestampTz size");
+				memcpy(&v, &ts, sizeof(v));
+				return v;
+			}
+	}
+}
+
+static inline Datum
+powa_bits_to_datum(uint64 v, char kind)
+{
+	switch (kind)
+	{
+		case POWA_BLOCK_KIND_INT8:
+			return Int64GetDatum((int64) v);
+		case POWA_BLOCK_KIND_FLOAT8:
+			{
+				float8		f;
+
+				memcpy(&f, &v, sizeof(f));
+				return Float8GetDatum(f);
+			}
+		default:
+			{
+				TimestampTz ts;
+
+				memcpy(&ts, &v, sizeof(ts));
+				return TimestampTzGetDatum(ts);
+			}
+	}
+}
+
+/* Is a less than b, as min() and max() would order them? */
+static inline bool
+powa_bits_lt(uint64 a, uint64 b, char kind)
+{
+	if (kind == POWA_BLOCK_KIND_FLOAT8)
+	{
+		float8		fa = DatumGetFloat8(powa_bits_to_datum(a, kind));
+		float8		fb = DatumGetFloat8(powa_bits_to_datum(b, kind));
+
+		/* NaN sorts after any other value */
+		if (isnan(fa))
+			return false;
+		if (isnan(fb))
+			return true;
+		return fa < fb;
+	}
+
+	return (int64) a < (int64) b;
+}
+
+/*
+ * Allocate a PowaBlockColumns for records of the given tupdesc, in the
+ * current memory context.  tupdesc can be NULL if the caller doesn't need to
+ * add or get records.
+ */
+static PowaBlockColumns *
+powa_block_columns_init(TupleDesc tupdesc, int capacity)
+{
+	PowaBlockColumns *cols = palloc0(sizeof(PowaBlockColumns));
+	int			i;
+
+	cols->tupdesc = tupdesc;
+	if (tupdesc != NULL)
+	{
+		cols->ncols = tupdesc->natts;
+		if (cols->ncols < 1 || cols->ncols > UCHAR_MAX)
+			elog(ERROR, "unsupported number of fields: %d", cols->ncols);
+
+		cols->kinds = palloc(cols->ncols);
+		for (i = 0; i < cols->ncols; i++)
+			cols->kinds[i] = powa_block_kind(TupleDescAttr(tupdesc, i));
+
+		if (cols->kinds[0] != POWA_BLOCK_KIND_TS)
+			elog(ERROR, "first field must be a timestamp with time zone");
+
+		cols->workvalues = palloc(sizeof(Datum) * cols->ncols);
+		cols->worknulls = palloc(sizeof(bool) * cols->ncols);
+	}
+
+	cols->capacity = Max(capacity, 1);
+	if (cols->ncols > 0)
+	{
+		cols->values = palloc(sizeof(uint64 *) * cols->ncols);
+		cols->nulls = palloc(sizeof(bool *) * cols->ncols);
+		for (i = 0; i < cols->ncols; i++)
+		{
+			cols->values[i] = palloc(sizeof(uint64) * cols->capacity);
+			cols->nulls[i] = palloc(sizeof(bool) * cols->capacity);
+		}
+	}
+
+	return cols;
+}
+
+/*
+ * Allocate a PowaBlockColumns for raw values of the given kinds, in the
+ * current memory context.  It can't be used to add or get records.
+ */
+static PowaBlockColumns *
+powa_block_columns_init_kinds(const char *kinds, int ncols, int capacity)
+{
+	PowaBlockColumns *cols = powa_block_columns_init(NULL, capacity);
+	int			i;
+
+	cols->ncols = ncols;
+	cols->kinds = palloc(ncols);
+	memcpy(cols->kinds, kinds, ncols);
+	cols->values = palloc(sizeof(uint64 *) * ncols);
+	cols->nulls = palloc(sizeof(bool *) * ncols);
+	for (i = 0; i < ncols; i++)
+	{
+		cols->values[i] = palloc(sizeof(uint64) * cols->capacity);
+		cols->nulls[i] = palloc(sizeof(bool) * cols->capacity);
+	}
+
+	return cols;
+}
+
+/* Add all the values of another PowaBlockColumns to a PowaBlockColumns */
+static void
+powa_block_columns_append(PowaBlockColumns * cols, PowaBlockColumns * other)
+{
+	int			i;
+
+	if (cols->ncols != other->ncols ||
+		memcmp(cols->kinds, other->kinds, cols->ncols) != 0)
+		elog(ERROR, "cannot merge history records of different types");
+
+	if (cols->nsamples + other->nsamples > cols->capacity)
+	{
+		while (cols->nsamples + other->nsamples > cols->capacity)
+			cols->capacity *= 2;
+
+		for (i = 0; i < cols->ncols; i++)
+		{
+			cols->values[i] = repalloc(cols->values[i],
+									   sizeof(uint64) * cols->capacity);
+			cols->nulls[i] = repalloc(cols->nulls[i],
+									  sizeof(bool) * cols->capacity);
+		}
+	}
+
+	for (i = 0; i < cols->ncols; i++)
+	{
+		memcpy(cols->values[i] + cols->nsamples, other->values[i],
+			   sizeof(uint64) * other->nsamples);
+		memcpy(cols->nulls[i] + cols->nsamples, other->nulls[i],
+			   sizeof(bool) * other->nsamples);
+	}
+
+	cols->nsamples += other->nsamples;
+}
+
+/* Add a record to a PowaBlockColumns */
+static void
+powa_block_columns_add(PowaBlockColumns * cols, HeapTupleHeader rec)
+{
+	HeapTupleData tuple;
+	int			i;
+
+	Assert(cols->tupdesc != NULL);
+
+	if (cols->nsamples >= cols->capacity)
+	{
+		cols->capacity *= 2;
+		for (i = 0; i < cols->ncols; i++)
+		{
+			cols->values[i] = repalloc(cols->values[i],
+									   sizeof(uint64) * cols->capacity);
+			cols->nulls[i] = repalloc(cols->nulls[i],
+									  sizeof(bool) * cols->capacity);
+		}
+	}
+
+	tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
+	ItemPointerSetInvalid(&(tuple.t_self));
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = rec;
+	heap_deform_tuple(&tuple, cols->tupdesc, cols->workvalues,
+					  cols->worknulls);
+
+	for (i = 0; i < cols->ncols; i++)
+	{
+		bool		isnull = (cols->worknulls[i] ||
+							  TupleDescAttr(cols->tupdesc, i)->attisdropped);
+
+		cols->nulls[i][cols->nsamples] = isnull;
+		cols->values[i][cols->nsamples] = isnull ? 0 :
+			powa_datum_to_bits(cols->workvalues[i], cols->kinds[i]);
+	}
+
+	cols->nsamples++;
+}
+
+/* Form the i-th record of a PowaBlockColumns */
+static HeapTuple
+powa_block_columns_get(PowaBlockColumns * cols, int i)
+{
+	int			j;
+
+	Assert(cols->tupdesc != NULL && i < cols->nsamples);
+
+	for (j = 0; j < cols->ncols; j++)
+	{
+		cols->worknulls[j] = cols->nulls[j][i];
+		cols->workvalues[j] = cols->worknulls[j] ? (Datum) 0 :
+			powa_bits_to_datum(cols->values[j][i], cols->kinds[j]);
+	}
+
+	return heap_form_tuple(cols->tupdesc, cols->workvalues, cols->worknulls);
+}
+
+typedef struct PowaBlockSortItem
+{
+	TimestampTz ts;
+	bool		isnull;
+	int			idx;
+}	PowaBlockSortItem;
+
+static int
+powa_block_sort_cmp(const void *a, const void *b)
+{
+	const PowaBlockSortItem *ia = (const PowaBlockSortItem *) a;
+	const PowaBlockSortItem *ib = (const PowaBlockSortItem *) b;
+
+	if (ia->isnull || ib->isnull)
+	{
+		if (ia->isnull && ib->isnull)
+			return ia->idx - ib->idx;
+		return ia->isnull ? -1 : 1;
+	}
+
+	if (ia->ts != ib->ts)
+		return (ia->ts < ib->ts) ? -1 : 1;
+
+	/* keep the sort stable */
+	return ia->idx - ib->idx;
+}
+
+/*
+ * Sort the records by timestamp, so the timestamps delta-of-delta encoding
+ * is efficient, and the records are returned in chronological order.
+ */
+static void
+powa_block_columns_sort(PowaBlockColumns * cols)
+{
+	PowaBlockSortItem *items;
+	bool		sorted = true;
+	int			i,
+				j;
+
+	for (i = 1; i < cols->nsamples && sorted; i++)
+	{
+		if (cols->nulls[0][i])
+			sorted = false;
+		else if (!cols->nulls[0][i - 1] &&
+				 DatumGetTimestampTz(powa_bits_to_datum(cols->values[0][i - 1],
+														POWA_BLOCK_KIND_TS)) >
+				 DatumGetTimestampTz(powa_bits_to_datum(cols->values[0][i],
+														POWA_BLOCK_KIND_TS)))
+			sorted = false;
+	}
+
+	if (sorted)
+		return;
+
+	items = palloc(sizeof(PowaBlockSortItem) * cols->nsamples);
+	for (i = 0; i < cols->nsamples; i++)
+	{
+		items[i].isnull = cols->nulls[0][i];
+		items[i].ts = items[i].isnull ? 0 :
+			DatumGetTimestampTz(powa_bits_to_datum(cols->values[0][i],
+												   POWA_BLOCK_KIND_TS));
+		items[i].idx = i;
+	}
+
+	qsort(items, cols->nsamples, sizeof(PowaBlockSortItem),
+		  powa_block_sort_cmp);
+
+	for (j = 0; j < cols->ncols; j++)
+	{
+		uint64	   *values = palloc(sizeof(uint64) * cols->capacity);
+		bool	   *nulls = palloc(sizeof(bool) * cols->capacity);
+
+		for (i = 0; i < cols->nsamples; i++)
+		{
+			values[i] = cols->values[j][items[i].idx];
+			nulls[i] = cols->nulls[j][items[i].idx];
+		}
+
+		pfree(cols->values[j]);
+		pfree(cols->nulls[j]);
+		cols->values[j] = values;
+		cols->nulls[j] = nulls;
+	}
+
+	pfree(items);
+}
+
+/* Build a block from a PowaBlockColumns, in the current memory context */
+static PowaHistoryBlock *
+powa_block_encode(PowaBlockColumns * cols)
+{
+	StringInfoData buf;
+	PowaHistoryBlock header;
+	int			i,
+				j;
+
+	initStringInfo(&buf);
+
+	memset(&header, 0, sizeof(header));
+	header.version = POWA_BLOCK_VERSION;
+	header.ncols = (uint8) cols->ncols;
+	header.nsamples = cols->nsamples;
+	appendBinaryStringInfo(&buf, (char *) &header, sizeof(header));
+	appendBinaryStringInfo(&buf, cols->kinds, cols->ncols);
+
+	for (j = 0; j < cols->ncols; j++)
+	{
+		char		kind = cols->kinds[j];
+		bool		hasnulls = false;
+		uint64		prev = 0;
+		uint64		prevdelta = 0;
+		PowaBitWriter bits;
+		uint32		len;
+		int			lenpos;
+		int			k = 0;
+
+		bits.buf = &buf;
+		bits.cur = 0;
+		bits.nused = 0;
+		bits.lead = -1;
+		bits.trail = 0;
+
+		/* placeholder for the stream length */
+		lenpos = buf.len;
+		appendBinaryStringInfo(&buf, (char *) &k, sizeof(uint32));
+
+		for (i = 0; i < cols->nsamples && !hasnulls; i++)
+			hasnulls = cols->nulls[j][i];
+
+		appendStringInfoChar(&buf, hasnulls ? POWA_BLOCK_HAS_NULLS : 0);
+		if (hasnulls)
+		{
+			for (i = 0; i < cols->nsamples; i += 8)
+			{
+				uint8		bits = 0;
+				int			b;
+
+				for (b = 0; b < 8 && i + b < cols->nsamples; b++)
+				{
+					if (cols->nulls[j][i + b])
+						bits |= (1 << b);
+				}
+				appendStringInfoChar(&buf, (char) bits);
+			}
+		}
+
+		for (i = 0; i < cols->nsamples; i++)
+		{
+			uint64		v = cols->values[j][i];
+			uint64		delta;
+
+			if (cols->nulls[j][i])
+				continue;
+
+			switch (kind)
+			{
+				case POWA_BLOCK_KIND_TS:
+					delta = v - prev;
+					if (k < 2)
+						powa_varint_append(&buf, POWA_ZIGZAG(delta));
+					else
+						powa_varint_append(&buf, POWA_ZIGZAG(delta - prevdelta));
+					prevdelta = delta;
+					break;
+				case POWA_BLOCK_KIND_INT8:
+					powa_varint_append(&buf, POWA_ZIGZAG(v - prev));
+					break;
+				default:
+					powa_xor_append(&bits, v ^ prev);
+					break;
+			}
+
+			prev = v;
+			k++;
+		}
+		powa_bits_flush(&bits);
+
+		len = buf.len - lenpos - sizeof(uint32);
+		memcpy(buf.data + lenpos, &len, sizeof(uint32));
+	}
+
+	SET_VARSIZE(buf.data, buf.len);
+
+	return (PowaHistoryBlock *) buf.data;
+}
+
+/*
+ * Decode a block.  If tupdesc is provided, the block has to match it, and
+ * the result can be used to form records.
+ */
+static PowaBlockColumns *
+powa_block_decode(PowaHistoryBlock * block, TupleDesc tupdesc)
+{
+	PowaBlockColumns *cols;
+	const char *p = POWA_BLOCK_DATA(block);
+	const char *end = ((char *) block) + VARSIZE(block);
+	const char *kinds;
+	int			i,
+				j;
+
+	if (VARSIZE(block) < sizeof(PowaHistoryBlock) ||
+		block->version != POWA_BLOCK_VERSION ||
+		block->ncols == 0 || block->nsamples < 0 ||
+		end - p < block->ncols)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("corrupted history block")));
+
+	kinds = p;
+	p += block->ncols;
+
+	if (tupdesc != NULL)
+	{
+		cols = powa_block_columns_init(tupdesc, block->nsamples);
+		if (cols->ncols != block->ncols ||
+			memcmp(cols->kinds, kinds, cols->ncols) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("history block doesn't match type %s",
+							format_type_be(tupdesc->tdtypeid))));
+	}
+	else
+		cols = powa_block_columns_init_kinds(kinds, block->ncols,
+											 block->nsamples);
+	cols->nsamples = block->nsamples;
+
+	for (j = 0; j < cols->ncols; j++)
+	{
+		char		kind = cols->kinds[j];
+		const char *colend;
+		uint64		prev = 0;
+		uint64		prevdelta = 0;
+		PowaBitReader bits;
+		uint32		len;
+		uint8		flags;
+		int			k = 0;
+
+		if (kind != POWA_BLOCK_KIND_TS && kind != POWA_BLOCK_KIND_INT8 &&
+			kind != POWA_BLOCK_KIND_FLOAT8)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted history block")));
+
+		if (end - p < sizeof(uint32) + 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted history block")));
+		memcpy(&len, p, sizeof(uint32));
+		p += sizeof(uint32);
+		if (len < 1 || len > end - p)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted history block")));
+		colend = p + len;
+
+		flags = (uint8) *p++;
+		if (flags & POWA_BLOCK_HAS_NULLS)
+		{
+			if (colend - p < (cols->nsamples + 7) / 8)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("corrupted history block")));
+
+			for (i = 0; i < cols->nsamples; i++)
+				cols->nulls[j][i] = ((((uint8) p[i / 8]) >> (i % 8)) & 1) != 0;
+			p += (cols->nsamples + 7) / 8;
+		}
+		else
+			memset(cols->nulls[j], 0, sizeof(bool) * cols->nsamples);
+
+		bits.p = p;
+		bits.end = colend;
+		bits.nused = 0;
+		bits.lead = -1;
+		bits.trail = 0;
+
+		for (i = 0; i < cols->nsamples; i++)
+		{
+			uint64		v;
+
+			if (cols->nulls[j][i])
+			{
+				cols->values[j][i] = 0;
+				continue;
+			}
+
+			switch (kind)
+			{
+				case POWA_BLOCK_KIND_TS:
+					v = powa_varint_read(&p, colend);
+					if (k < 2)
+						prevdelta = POWA_UNZIGZAG(v);
+					else
+						prevdelta += POWA_UNZIGZAG(v);
+					prev += prevdelta;
+					break;
+				case POWA_BLOCK_KIND_INT8:
+					v = powa_varint_read(&p, colend);
+					prev += POWA_UNZIGZAG(v);
+					break;
+				default:
+					prev ^= powa_xor_read(&bits);
+					break;
+			}
+
+			cols->values[j][i] = prev;
+			k++;
+		}
+
+		/* skip the padding of the last byte of the bit stream */
+		if (kind == POWA_BLOCK_KIND_FLOAT8)
+			p = bits.p + (bits.nused > 0 ? 1 : 0);
+
+		if (p != colend)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted history block")));
+	}
+
+	if (p != end)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("corrupted history block")));
+
+	return cols;
+}
+
+/* Make sure that a block coming from the outside world is sane */
+static void
+powa_block_check(PowaHistoryBlock * block)
+{
+	PowaBlockColumns *cols = powa_block_decode(block, NULL);
+	int			j;
+
+	if (cols->kinds[0] != POWA_BLOCK_KIND_TS)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("corrupted history block")));
+
+	for (j = 0; j < cols->ncols; j++)
+	{
+		pfree(cols->values[j]);
+		pfree(cols->nulls[j]);
+	}
+	pfree(cols->values);
+	pfree(cols->nulls);
+	pfree(cols->kinds);
+	pfree(cols);
+}
+
+/*
+ * Get the composite type returned by the calling function, which is either
+ * the record type or an array of it.
+ */
+static TupleDesc
+powa_block_rettupdesc(FunctionCallInfo fcinfo)
+{
+	Oid			rettype = get_func_rettype(fcinfo->flinfo->fn_oid);
+	Oid			elemtype = get_element_type(rettype);
+
+	if (OidIsValid(elemtype))
+		rettype = elemtype;
+
+	return lookup_rowtype_tupdesc_copy(rettype, -1);
+}
+
+/*
+ * The text and binary representations of a block are the ones of a bytea
+ * holding its content.
+ */
+Datum
+powa_statements_history_block_in(PG_FUNCTION_ARGS)
+{
+	Datum		raw = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+
+	powa_block_check((PowaHistoryBlock *) DatumGetPointer(raw));
+
+	PG_RETURN_DATUM(raw);
+}
+
+Datum
+powa_statements_history_block_out(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_DATUM(DirectFunctionCall1(byteaout,
+						PointerGetDatum(PG_GETARG_POWA_BLOCK_P(0))));
+}
+
+Datum
+powa_statements_history_block_recv(PG_FUNCTION_ARGS)
+{
+	Datum		raw = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+
+	powa_block_check((PowaHistoryBlock *) DatumGetPointer(raw));
+
+	PG_RETURN_DATUM(raw);
+}
+
+Datum
+powa_statements_history_block_send(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_DATUM(DirectFunctionCall1(byteasend,
+						PointerGetDatum(PG_GETARG_POWA_BLOCK_P(0))));
+}
+
+/* Build a block from an array of records */
+Datum
+powa_statements_history_block(PG_FUNCTION_ARGS)
+{
+	ArrayType  *arr = PG_GETARG_ARRAYTYPE_P(0);
+	Oid			elemtype = ARR_ELEMTYPE(arr);
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	Datum	   *elems;
+	bool	   *elemnulls;
+	int			nelems;
+	TupleDesc	tupdesc;
+	PowaBlockColumns *cols;
+	int			i;
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(arr, elemtype, typlen, typbyval, typalign,
+					  &elems, &elemnulls, &nelems);
+
+	tupdesc = lookup_rowtype_tupdesc_copy(elemtype, -1);
+	cols = powa_block_columns_init(tupdesc, nelems);
+
+	for (i = 0; i < nelems; i++)
+	{
+		if (elemnulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("history records can't be NULL")));
+
+		powa_block_columns_add(cols, DatumGetHeapTupleHeader(elems[i]));
+	}
+
+	powa_block_columns_sort(cols);
+
+	PG_RETURN_POINTER(powa_block_encode(cols));
+}
+
+/* Get the content of a block as an array of records */
+Datum
+powa_statements_history_block_records(PG_FUNCTION_ARGS)
+{
+	PowaHistoryBlock *block = PG_GETARG_POWA_BLOCK_P(0);
+	TupleDesc	tupdesc = powa_block_rettupdesc(fcinfo);
+	PowaBlockColumns *cols = powa_block_decode(block, tupdesc);
+	Datum	   *elems;
+	int			i;
+
+	elems = palloc(sizeof(Datum) * Max(cols->nsamples, 1));
+	for (i = 0; i < cols->nsamples; i++)
+		elems[i] = HeapTupleGetDatum(powa_block_columns_get(cols, i));
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, cols->nsamples,
+										  tupdesc->tdtypeid, -1, false, 'd'));
+}
+
+/* SRF returning all the records of a block */
+Datum
+powa_statements_history_block_unnest(PG_FUNCTION_ARGS)
+{
+	PowaHistoryBlock *block = PG_GETARG_POWA_BLOCK_P(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PowaBlockColumns *cols;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = powa_block_rettupdesc(fcinfo);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	cols = powa_block_decode(block, tupdesc);
+	for (i = 0; i < cols->nsamples; i++)
+	{
+		int			j;
+
+		for (j = 0; j < cols->ncols; j++)
+		{
+			cols->worknulls[j] = cols->nulls[j][i];
+			cols->workvalues[j] = cols->worknulls[j] ? (Datum) 0 :
+				powa_bits_to_datum(cols->values[j][i], cols->kinds[j]);
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, cols->workvalues,
+							 cols->worknulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/* Number of records in a block, only reading the header */
+Datum
+powa_statements_history_block_count(PG_FUNCTION_ARGS)
+{
+	PowaHistoryBlock *block;
+
+	block = (PowaHistoryBlock *) PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), 0,
+													sizeof(PowaHistoryBlock));
+
+	if (VARSIZE_ANY(block) < sizeof(PowaHistoryBlock))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("corrupted history block")));
+
+	PG_RETURN_INT32(block->nsamples);
+}
+
+/* First or last record of a block */
+static Datum
+powa_block_record_at(FunctionCallInfo fcinfo, bool last)
+{
+	PowaHistoryBlock *block = PG_GETARG_POWA_BLOCK_P(0);
+	TupleDesc	tupdesc = powa_block_rettupdesc(fcinfo);
+	PowaBlockColumns *cols = powa_block_decode(block, tupdesc);
+
+	if (cols->nsamples == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(powa_block_columns_get(cols,
+									last ? cols->nsamples - 1 : 0)));
+}
+
+Datum
+powa_statements_history_block_first(PG_FUNCTION_ARGS)
+{
+	return powa_block_record_at(fcinfo, false);
+}
+
+Datum
+powa_statements_history_block_last(PG_FUNCTION_ARGS)
+{
+	return powa_block_record_at(fcinfo, true);
+}
+
+/*
+ * Aggregate building a block from a set of records, replacing array_agg()
+ * in the aggregate functions.
+ */
+Datum
+powa_statements_history_block_agg_trans(PG_FUNCTION_ARGS)
+{
+	PowaBlockColumns *cols;
+	MemoryContext aggcontext;
+	MemoryContext oldcontext;
+	HeapTupleHeader rec;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "powa_statements_history_block_agg_trans called in non-aggregate context");
+
+	cols = PG_ARGISNULL(0) ? NULL : (PowaBlockColumns *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("history records can't be NULL")));
+
+	rec = PG_GETARG_HEAPTUPLEHEADER(1);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+	if (cols == NULL)
+		cols = powa_block_columns_init(
+				lookup_rowtype_tupdesc_copy(HeapTupleHeaderGetTypeId(rec),
+											HeapTupleHeaderGetTypMod(rec)),
+									   64);
+	powa_block_columns_add(cols, rec);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(cols);
+}
+
+Datum
+powa_statements_history_block_agg_final(PG_FUNCTION_ARGS)
+{
+	PowaBlockColumns *cols;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	cols = (PowaBlockColumns *) PG_GETARG_POINTER(0);
+
+	powa_block_columns_sort(cols);
+
+	PG_RETURN_POINTER(powa_block_encode(cols));
+}
+
+/*
+ * Combine, serialize and deserialize functions, so the block aggregate can
+ * run in parallel.  The transition states are exchanged as (unsorted)
+ * blocks, and only their raw values are needed to merge them.
+ */
+Datum
+powa_statements_history_block_agg_combine(PG_FUNCTION_ARGS)
+{
+	PowaBlockColumns *state1;
+	PowaBlockColumns *state2;
+	MemoryContext aggcontext;
+	MemoryContext oldcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "powa_statements_history_block_agg_combine called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (PowaBlockColumns *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (PowaBlockColumns *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+	{
+		if (state1 == NULL)
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(state1);
+	}
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+	if (state1 == NULL)
+		state1 = powa_block_columns_init_kinds(state2->kinds, state2->ncols,
+											   state2->nsamples);
+	powa_block_columns_append(state1, state2);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state1);
+}
+
+Datum
+powa_statements_history_block_agg_serialize(PG_FUNCTION_ARGS)
+{
+	PowaBlockColumns *state = (PowaBlockColumns *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_POINTER(powa_block_encode(state));
+}
+
+Datum
+powa_statements_history_block_agg_deserialize(PG_FUNCTION_ARGS)
+{
+	PowaHistoryBlock *block = PG_GETARG_POWA_BLOCK_P(0);
+
+	PG_RETURN_POINTER(powa_block_decode(block, NULL));
+}
+
+/*
+ * Combine, serialize and deserialize functions of powa_records_agg(), which
+ * otherwise relies on the array_agg() transition and final functions.  The
+ * states are exchanged as the binary representation of the array built so
+ * far, prefixed by its element type.
+ */
+Datum
+powa_records_agg_combine(PG_FUNCTION_ARGS)
+{
+	ArrayBuildState *state1;
+	ArrayBuildState *state2;
+	MemoryContext aggcontext;
+	int			i;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "powa_records_agg_combine called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (ArrayBuildState *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (ArrayBuildState *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+	{
+		if (state1 == NULL)
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(state1);
+	}
+
+	for (i = 0; i < state2->nelems; i++)
+		state1 = accumArrayResult(state1, state2->dvalues[i],
+								  state2->dnulls[i], state2->element_type,
+								  aggcontext);
+
+	PG_RETURN_POINTER(state1);
+}
+
+Datum
+powa_records_agg_serialize(PG_FUNCTION_ARGS)
+{
+	ArrayBuildState *state = (ArrayBuildState *) PG_GETARG_POINTER(0);
+	Oid			arraytype = get_array_type(state->element_type);
+	Oid			typsend;
+	bool		typisvarlena;
+	int			dims[1];
+	int			lbs[1];
+	Datum		array;
+	bytea	   *sarray;
+	bytea	   *result;
+	int			len;
+
+	if (!OidIsValid(arraytype))
+		elog(ERROR, "could not find array type for data type %s",
+			 format_type_be(state->element_type));
+
+	dims[0] = state->nelems;
+	lbs[0] = 1;
+	array = makeMdArrayResult(state, 1, dims, lbs, CurrentMemoryContext,
+							  false);
+
+	getTypeBinaryOutputInfo(arraytype, &typsend, &typisvarlena);
+	sarray = OidSendFunctionCall(typsend, array);
+	len = VARSIZE(sarray) - VARHDRSZ;
+
+	result = palloc(VARHDRSZ + sizeof(Oid) + len);
+	SET_VARSIZE(result, VARHDRSZ + sizeof(Oid) + len);
+	memcpy(VARDATA(result), &state->element_type, sizeof(Oid));
+	memcpy(VARDATA(result) + sizeof(Oid), VARDATA(sarray), len);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+powa_records_agg_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea	   *sstate = PG_GETARG_BYTEA_PP(0);
+	ArrayBuildState *state = NULL;
+	StringInfoData buf;
+	Oid			elemtype;
+	Oid			arraytype;
+	Oid			typreceive;
+	Oid			typioparam;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	ArrayType  *array;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			i;
+
+	if (VARSIZE_ANY_EXHDR(sstate) < sizeof(Oid))
+		elog(ERROR, "unexpected serialized state size: %d",
+			 (int) VARSIZE_ANY_EXHDR(sstate));
+
+	memcpy(&elemtype, VARDATA_ANY(sstate), sizeof(Oid));
+	arraytype = get_array_type(elemtype);
+	if (!OidIsValid(arraytype))
+		elog(ERROR, "could not find array type for data type %s",
+			 format_type_be(elemtype));
+
+	/* the receive functions want a null-terminated StringInfo */
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(sstate) + sizeof(Oid),
+						   VARSIZE_ANY_EXHDR(sstate) - sizeof(Oid));
+
+	getTypeBinaryInputInfo(arraytype, &typreceive, &typioparam);
+	array = DatumGetArrayTypeP(OidReceiveFunctionCall(typreceive, &buf,
+													  typioparam, -1));
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(array, elemtype, typlen, typbyval, typalign,
+					  &elems, &nulls, &nelems);
+
+	for (i = 0; i < nelems; i++)
+		state = accumArrayResult(state, elems[i], nulls[i], elemtype,
+								 CurrentMemoryContext);
+
+	PG_RETURN_POINTER(state);
+}
+
+
+/*
+ * Bucketed rates of many statements over a time window
+ *
+ * powa_statements_history_range() gathers the samples of all the requested
+ * queryids inside the window, from both the coalesced blocks and the
+ * *_current table, and returns for each statement and each bucket of the
+ * window the rates between the last sample of the bucket and the last sample
+ * of the previous bucket, like the / operator would.  The first bucket of a
+ * statement is computed from its first sample instead.  Only the samples
+ * inside the window are ever formed, the blocks being decoded column-wise.
+ */
+typedef struct PowaRangeEntry
+{
+	PowaLastKey key;			/* hash key, must be first */
+	int			nsamples;
+	int			capacity;
+	uint64	   *values;			/* values[sample * natts + field] */
+	bool	   *nulls;
+}	PowaRangeEntry;
+
+typedef struct PowaRangeState
+{
+	MemoryContext cxt;			/* context of the samples */
+	HTAB	   *htab;			/* PowaRangeEntry of each statement */
+	TupleDesc	recdesc;
+	char	   *kinds;			/* POWA_BLOCK_KIND_* of each record field */
+	int		   *attnums;		/* counters of the records */
+	int			nfields;
+	TypeCacheEntry *typcache;	/* of the window range type */
+	RangeType  *range;
+	TimestampTz origin;			/* start of the first bucket */
+	Interval   *bucket;
+	double		bucket_secs;
+}	PowaRangeState;
+
+typedef struct PowaRangeSort
+{
+	uint64	   *values;			/* samples of a PowaRangeEntry */
+	int			natts;
+}	PowaRangeSort;
+
+/* Remember a sample if it's inside the window */
+static void
+powa_range_add(PowaRangeState * state, PowaLastKey * key, uint64 *values,
+			   bool *nulls)
+{
+	PowaRangeEntry *entry;
+	int			natts = state->recdesc->natts;
+	bool		found;
+
+	if (nulls[0] ||
+		!range_contains_elem_internal(state->typcache, state->range,
+									  powa_bits_to_datum(values[0],
+														 POWA_BLOCK_KIND_TS)))
+		return;
+
+	entry = (PowaRangeEntry *) hash_search(state->htab, key, HASH_ENTER,
+										   &found);
+	if (!found)
+	{
+		entry->nsamples = 0;
+		entry->capacity = 16;
+		entry->values = MemoryContextAlloc(state->cxt,
+										   sizeof(uint64) * natts *
+										   entry->capacity);
+		entry->nulls = MemoryContextAlloc(state->cxt,
+										  sizeof(bool) * natts *
+										  entry->capacity);
+	}
+	else if (entry->nsamples >= entry->capacity)
+	{
+		entry->capacity *= 2;
+		entry->values = repalloc(entry->values,
+								 sizeof(uint64) * natts * entry->capacity);
+		entry->nulls = repalloc(entry->nulls,
+								sizeof(bool) * natts * entry->capacity);
+	}
+
+	memcpy(&entry->values[entry->nsamples * natts], values,
+		   sizeof(uint64) * natts);
+	memcpy(&entry->nulls[entry->nsamples * natts], nulls,
+		   sizeof(bool) * natts);
+	entry->nsamples++;
+}
+
+/* order the samples of an entry by timestamp */
+static int
+powa_range_sample_cmp(const void *a, const void *b, void *arg)
+{
+	PowaRangeSort *sort = (PowaRangeSort *) arg;
+	TimestampTz ta;
+	TimestampTz tb;
+
+	ta = DatumGetTimestampTz(powa_bits_to_datum(sort->values[*((const int *) a) *
+															 sort->natts],
+												POWA_BLOCK_KIND_TS));
+	tb = DatumGetTimestampTz(powa_bits_to_datum(sort->values[*((const int *) b) *
+															 sort->natts],
+												POWA_BLOCK_KIND_TS));
+
+	if (ta == tb)
+		return 0;
+	return (ta < tb) ? -1 : 1;
+}
+
+static int64
+powa_range_bucket(PowaRangeState * state, uint64 tsbits)
+{
+	TimestampTz ts;
+
+	ts = DatumGetTimestampTz(powa_bits_to_datum(tsbits, POWA_BLOCK_KIND_TS));
+
+	return (int64) floor(powa_ts_diff_secs(ts, state->origin) /
+						 state->bucket_secs);
+}
+
+/* Emit the bucketed rates of a statement */
+static void
+powa_range_emit(PowaRangeState * state, PowaRangeEntry * entry,
+				Tuplestorestate *tupstore, TupleDesc tupdesc,
+				TupleDesc ratedesc)
+{
+	int			natts = state->recdesc->natts;
+	Datum	   *ratevalues;
+	bool	   *ratenulls;
+	PowaRangeSort sort;
+	int		   *order;
+	int			base = -1;
+	int			i;
+
+	order = palloc(sizeof(int) * entry->nsamples);
+	for (i = 0; i < entry->nsamples; i++)
+		order[i] = i;
+
+	sort.values = entry->values;
+	sort.natts = natts;
+	qsort_arg(order, entry->nsamples, sizeof(int), powa_range_sample_cmp,
+			  &sort);
+
+	ratevalues = palloc(sizeof(Datum) * ratedesc->natts);
+	ratenulls = palloc(sizeof(bool) * ratedesc->natts);
+
+	i = 0;
+	while (i < entry->nsamples)
+	{
+		int64		b = powa_range_bucket(state,
+										  entry->values[order[i] * natts]);
+		int			last = i;
+		uint64	   *cur;
+		bool	   *curnulls;
+		uint64	   *prev;
+		bool	   *prevnulls;
+		double		epoch;
+		double		sec = 1;
+		Datum		values[5];
+		bool		nulls[5] = {false, false, false, false, false};
+		int			j;
+
+		while (last + 1 < entry->nsamples &&
+			   powa_range_bucket(state,
+								 entry->values[order[last + 1] * natts]) == b)
+			last++;
+
+		if (base < 0)
+			base = i;
+
+		if (base == last)
+		{
+			i = last + 1;
+			continue;
+		}
+
+		cur = &entry->values[order[last] * natts];
+		curnulls = &entry->nulls[order[last] * natts];
+		prev = &entry->values[order[base] * natts];
+		prevnulls = &entry->nulls[order[base] * natts];
+
+		epoch = powa_ts_diff_secs(DatumGetTimestampTz(powa_bits_to_datum(cur[0],
+															POWA_BLOCK_KIND_TS)),
+								  DatumGetTimestampTz(powa_bits_to_datum(prev[0],
+															POWA_BLOCK_KIND_TS)));
+		if (isnan(epoch) || epoch < INT_MIN || epoch > INT_MAX)
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("integer out of range")));
+
+		ratevalues[0] = Int32GetDatum((int32) rint(epoch));
+		ratenulls[0] = false;
+		if (DatumGetInt32(ratevalues[0]) != 0)
+			sec = DatumGetInt32(ratevalues[0]);
+
+		for (j = 0; j < state->nfields; j++)
+		{
+			int			attnum = state->attnums[j];
+			char		kind = state->kinds[attnum];
+			double		delta;
+
+			ratenulls[j + 1] = (curnulls[attnum] || prevnulls[attnum]);
+			if (ratenulls[j + 1])
+				continue;
+
+			if (kind == POWA_BLOCK_KIND_INT8)
+				delta = (double) ((int64) cur[attnum] - (int64) prev[attnum]);
+			else
+				delta = DatumGetFloat8(powa_bits_to_datum(cur[attnum], kind))
+					- DatumGetFloat8(powa_bits_to_datum(prev[attnum], kind));
+
+			ratevalues[j + 1] = Float8GetDatum(delta / sec);
+		}
+
+		values[0] = Int64GetDatum((int64) entry->key.id);
+		values[1] = ObjectIdGetDatum(entry->key.dbid);
+		values[2] = ObjectIdGetDatum(entry->key.userid);
+		values[3] = DirectFunctionCall2(timestamptz_pl_interval,
+										TimestampTzGetDatum(state->origin),
+										DirectFunctionCall2(interval_mul,
+											IntervalPGetDatum(state->bucket),
+											Float8GetDatum((double) b)));
+		values[4] = HeapTupleGetDatum(heap_form_tuple(ratedesc, ratevalues,
+													  ratenulls));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		base = last;
+		i = last + 1;
+	}
+
+	pfree(order);
+	pfree(ratevalues);
+	pfree(ratenulls);
+}
+
+Datum
+powa_statements_history_range(PG_FUNCTION_ARGS)
+{
+	static const char *query_current =
+	"SELECT c.queryid, c.dbid, c.userid, c.record"
+	" FROM powa_statements_history_current c"
+	" WHERE c.queryid = ANY ($1)"
+	" AND (c.record).ts <@ $2";
+
+	/*
+	 * Look up each queryid separately, so the index is used.  The explicit
+	 * bound predicate is for the brin layout of powa_history_index_layout().
+	 */
+	static const char *query_history =
+	"SELECT h.queryid, h.dbid, h.userid, h.records"
+	" FROM (SELECT DISTINCT unnest($1)) AS q(queryid)"
+	" JOIN powa_statements_history h ON h.queryid = q.queryid"
+	" WHERE h.coalesce_range && $2"
+	" AND upper(h.coalesce_range) >= lower($2)";
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	RangeType  *range = PG_GETARG_RANGE_P(1);
+	PowaRangeState state;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	TupleDesc	ratedesc;
+	Tuplestorestate *tupstore;
+	RangeBound	lower;
+	RangeBound	upper;
+	bool		empty;
+	HASHCTL		info;
+	HASH_SEQ_STATUS hash_seq;
+	PowaRangeEntry *entry;
+	Oid			argtypes[2];
+	Datum		args[2];
+	Datum	   *recvalues;
+	uint64	   *values;
+	bool	   *nulls;
+	uint64		i;
+	int			j;
+	int			ret;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	memset(&state, 0, sizeof(state));
+	state.cxt = CurrentMemoryContext;
+	state.range = range;
+	state.bucket = PG_GETARG_INTERVAL_P(2);
+	state.typcache = range_get_typcache(fcinfo, RangeTypeGetOid(range));
+
+	if (state.bucket->month != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("bucket interval can't contain months or years")));
+
+#if PG_VERSION_NUM >= 100000 || defined(HAVE_INT64_TIMESTAMP)
+	state.bucket_secs = ((double) state.bucket->time) / USECS_PER_SEC;
+#else
+	state.bucket_secs = state.bucket->time;
+#endif
+	state.bucket_secs += ((double) state.bucket->day) * SECS_PER_DAY;
+
+	if (state.bucket_secs <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("bucket interval must be positive")));
+
+	range_deserialize(state.typcache, range, &lower, &upper, &empty);
+	if (!empty && lower.infinite)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("range must have a lower bound")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* the rates are always the last column */
+	ratedesc = lookup_rowtype_tupdesc_copy(
+						TupleDescAttr(tupdesc, tupdesc->natts - 1)->atttypid,
+										   -1);
+	if (tupdesc->natts != 5)
+		elog(ERROR, "unexpected return type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (empty)
+	{
+		tuplestore_donestoring(tupstore);
+		return (Datum) 0;
+	}
+
+	state.origin = DatumGetTimestampTz(lower.val);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PowaLastKey);
+	info.entrysize = sizeof(PowaRangeEntry);
+	info.hcxt = state.cxt;
+#if PG_VERSION_NUM >= 90500
+	state.htab = hash_create("powa statements history range", 1024, &info,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+#else
+	info.hash = tag_hash;
+	state.htab = hash_create("powa statements history range", 1024, &info,
+							 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+#endif
+
+	SPI_connect();
+
+	argtypes[0] = INT8ARRAYOID;
+	args[0] = PG_GETARG_DATUM(0);
+	argtypes[1] = RangeTypeGetOid(range);
+	args[1] = RangeTypePGetDatum(range);
+
+	/* the samples not coalesced yet, which also gives the records layout */
+	ret = SPI_execute_with_args(query_current, 2, argtypes, args, NULL,
+								true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read powa_statements_history_current: %s",
+			 SPI_result_code_string(ret));
+
+	state.recdesc = lookup_rowtype_tupdesc_copy(SPI_gettypeid(SPI_tuptable->tupdesc,
+															  4), -1);
+	state.kinds = palloc(state.recdesc->natts);
+	state.attnums = palloc(sizeof(int) * state.recdesc->natts);
+	for (j = 0; j < state.recdesc->natts; j++)
+	{
+		Form_pg_attribute att = TupleDescAttr(state.recdesc, j);
+
+		state.kinds[j] = powa_block_kind(att);
+		if (j > 0 && !att->attisdropped &&
+			state.kinds[j] != POWA_BLOCK_KIND_TS)
+			state.attnums[state.nfields++] = j;
+	}
+
+	if (state.kinds[0] != POWA_BLOCK_KIND_TS ||
+		ratedesc->natts != state.nfields + 1)
+		elog(ERROR, "unexpected rate type");
+
+	recvalues = palloc(sizeof(Datum) * state.recdesc->natts);
+	values = palloc(sizeof(uint64) * state.recdesc->natts);
+	nulls = palloc(sizeof(bool) * state.recdesc->natts);
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	spitup = SPI_tuptable->vals[i];
+		HeapTupleHeader rec;
+		HeapTupleData tuple;
+		PowaLastKey key;
+		bool		isnull;
+
+		key.id = (uint64) DatumGetInt64(SPI_getbinval(spitup,
+								SPI_tuptable->tupdesc, 1, &isnull));
+		key.dbid = DatumGetObjectId(SPI_getbinval(spitup,
+								SPI_tuptable->tupdesc, 2, &isnull));
+		key.userid = DatumGetObjectId(SPI_getbinval(spitup,
+								SPI_tuptable->tupdesc, 3, &isnull));
+		rec = DatumGetHeapTupleHeader(SPI_getbinval(spitup,
+								SPI_tuptable->tupdesc, 4, &isnull));
+
+		tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
+		ItemPointerSetInvalid(&(tuple.t_self));
+		tuple.t_tableOid = InvalidOid;
+		tuple.t_data = rec;
+		heap_deform_tuple(&tuple, state.recdesc, recvalues, nulls);
+
+		for (j = 0; j < state.recdesc->natts; j++)
+			values[j] = nulls[j] ? 0 :
+				powa_datum_to_bits(recvalues[j], state.kinds[j]);
+
+		powa_range_add(&state, &key, values, nulls);
+	}
+
+	/* and the coalesced ones */
+	ret = SPI_execute_with_args(query_history, 2, argtypes, args, NULL,
+								true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read powa_statements_history: %s",
+			 SPI_result_code_string(ret));
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	spitup = SPI_tuptable->vals[i];
+		PowaBlockColumns *cols;
+		PowaLastKey key;
+		bool		isnull;
+		int			k;
+
+		key.id = (uint64) DatumGetInt64(SPI_getbinval(spitup,
+								SPI_tuptable->tupdesc, 1, &isnull));
+		key.dbid = DatumGetObjectId(SPI_getbinval(spitup,
+								SPI_tuptable->tupdesc, 2, &isnull));
+		key.userid = DatumGetObjectId(SPI_getbinval(spitup,
+								SPI_tuptable->tupdesc, 3, &isnull));
+		cols = powa_block_decode((PowaHistoryBlock *)
+								 PG_DETOAST_DATUM(SPI_getbinval(spitup,
+												  SPI_tuptable->tupdesc, 4,
+																&isnull)),
+								 state.recdesc);
+
+		for (k = 0; k < cols->nsamples; k++)
+		{
+			for (j = 0; j < cols->ncols; j++)
+			{
+				values[j] = cols->values[j][k];
+				nulls[j] = cols->nulls[j][k];
+			}
+
+			powa_range_add(&state, &key, values, nulls);
+		}
+	}
+
+	hash_seq_init(&hash_seq, state.htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		powa_range_emit(&state, entry, tupstore, tupdesc, ratedesc);
+
+	SPI_finish();
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+
+/*
+ * Field-wise min() and max() aggregates of history records
+ *
+ * They compute the mins_in_range and maxs_in_range records deforming each
+ * record only once, instead of a min() or max() call per field.  The state
+ * has a fixed size, so it can be serialized as is for parallel aggregation.
+ */
+
+/* Create the state of an extrema aggregate for records like rec */
+static PowaRecordExtrema *
+powa_record_extrema_init(HeapTupleHeader rec, bool ismax,
+						 MemoryContext aggcontext)
+{
+	PowaRecordExtrema *state;
+	TupleDesc	tupdesc;
+	MemoryContext oldcontext;
+	int			i;
+
+	tupdesc = lookup_rowtype_tupdesc(HeapTupleHeaderGetTypeId(rec),
+									 HeapTupleHeaderGetTypMod(rec));
+
+	if (tupdesc->natts > POWA_EXTREMA_MAX_FIELDS)
+		elog(ERROR, "unsupported number of fields: %d", tupdesc->natts);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+	state = palloc0(sizeof(PowaRecordExtrema));
+	state->typid = tupdesc->tdtypeid;
+	state->typmod = tupdesc->tdtypmod;
+	state->ismax = ismax;
+	state->natts = tupdesc->natts;
+	for (i = 0; i < tupdesc->natts; i++)
+		state->kinds[i] = powa_block_kind(TupleDescAttr(tupdesc, i));
+	state->tupdesc = CreateTupleDescCopy(tupdesc);
+	MemoryContextSwitchTo(oldcontext);
+
+	ReleaseTupleDesc(tupdesc);
+
+	return state;
+}
+
+/* Merge a field value in the state */
+static inline void
+powa_record_extrema_merge(PowaRecordExtrema * state, int i, uint64 v)
+{
+	if (!(state->hasvalue & ((uint32) 1 << i)))
+	{
+		state->values[i] = v;
+		state->hasvalue |= ((uint32) 1 << i);
+	}
+	else if (state->ismax ?
+			 powa_bits_lt(state->values[i], v, state->kinds[i]) :
+			 powa_bits_lt(v, state->values[i], state->kinds[i]))
+		state->values[i] = v;
+}
+
+static Datum
+powa_record_extrema_trans(FunctionCallInfo fcinfo, bool ismax)
+{
+	PowaRecordExtrema *state;
+	MemoryContext aggcontext;
+	HeapTupleHeader rec;
+	HeapTupleData tuple;
+	Datum		values[POWA_EXTREMA_MAX_FIELDS];
+	bool		nulls[POWA_EXTREMA_MAX_FIELDS];
+	int			i;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "powa_record_extrema_trans called in non-aggregate context");
+
+	state = PG_ARGISNULL(0) ? NULL : (PowaRecordExtrema *) PG_GETARG_POINTER(0);
+
+	/* like min() and max(), ignore NULL values */
+	if (PG_ARGISNULL(1))
+	{
+		if (state == NULL)
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(state);
+	}
+
+	rec = PG_GETARG_HEAPTUPLEHEADER(1);
+
+	if (state == NULL)
+		state = powa_record_extrema_init(rec, ismax, aggcontext);
+	else if (state->tupdesc == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		state->tupdesc = lookup_rowtype_tupdesc_copy(state->typid,
+													 state->typmod);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
+	ItemPointerSetInvalid(&(tuple.t_self));
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = rec;
+	heap_deform_tuple(&tuple, state->tupdesc, values, nulls);
+
+	for (i = 0; i < state->natts; i++)
+	{
+		if (nulls[i] || TupleDescAttr(state->tupdesc, i)->attisdropped)
+			continue;
+
+		powa_record_extrema_merge(state, i,
+								  powa_datum_to_bits(values[i],
+													 state->kinds[i]));
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+powa_record_min_trans(PG_FUNCTION_ARGS)
+{
+	return powa_record_extrema_trans(fcinfo, false);
+}
+
+Datum
+powa_record_max_trans(PG_FUNCTION_ARGS)
+{
+	return powa_record_extrema_trans(fcinfo, true);
+}
+
+Datum
+powa_record_extrema_combine(PG_FUNCTION_ARGS)
+{
+	PowaRecordExtrema *state1;
+	PowaRecordExtrema *state2;
+	MemoryContext aggcontext;
+	int			i;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "powa_record_extrema_combine called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (PowaRecordExtrema *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (PowaRecordExtrema *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+	{
+		if (state1 == NULL)
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(state1);
+	}
+
+	if (state1 == NULL)
+	{
+		state1 = MemoryContextAlloc(aggcontext, sizeof(PowaRecordExtrema));
+		memcpy(state1, state2, sizeof(PowaRecordExtrema));
+		state1->tupdesc = NULL;
+		PG_RETURN_POINTER(state1);
+	}
+
+	for (i = 0; i < state1->natts; i++)
+	{
+		if (state2->hasvalue & ((uint32) 1 << i))
+			powa_record_extrema_merge(state1, i, state2->values[i]);
+	}
+
+	PG_RETURN_POINTER(state1);
+}
+
+Datum
+powa_record_extrema_serialize(PG_FUNCTION_ARGS)
+{
+	PowaRecordExtrema *state = (PowaRecordExtrema *) PG_GETARG_POINTER(0);
+	bytea	   *result;
+
+	result = palloc(VARHDRSZ + POWA_EXTREMA_SERIALIZED_SIZE);
+	SET_VARSIZE(result, VARHDRSZ + POWA_EXTREMA_SERIALIZED_SIZE);
+	memcpy(VARDATA(result), state, POWA_EXTREMA_SERIALIZED_SIZE);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+powa_record_extrema_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea	   *sstate = PG_GETARG_BYTEA_PP(0);
+	PowaRecordExtrema *state;
+
+	if (VARSIZE_ANY_EXHDR(sstate) != POWA_EXTREMA_SERIALIZED_SIZE)
+		elog(ERROR, "unexpected serialized state size: %d",
+			 (int) VARSIZE_ANY_EXHDR(sstate));
+
+	state = palloc(sizeof(PowaRecordExtrema));
+	memcpy(state, VARDATA_ANY(sstate), POWA_EXTREMA_SERIALIZED_SIZE);
+	state->tupdesc = NULL;
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+powa_record_extrema_final(PG_FUNCTION_ARGS)
+{
+	PowaRecordExtrema *state;
+	TupleDesc	tupdesc;
+	Datum		values[POWA_EXTREMA_MAX_FIELDS];
+	bool		nulls[POWA_EXTREMA_MAX_FIELDS];
+	int			i;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (PowaRecordExtrema *) PG_GETARG_POINTER(0);
+
+	tupdesc = lookup_rowtype_tupdesc_copy(state->typid, state->typmod);
+	for (i = 0; i < state->natts; i++)
+	{
+		nulls[i] = !(state->hasvalue & ((uint32) 1 << i));
+		values[i] = nulls[i] ? (Datum) 0 :
+			powa_bits_to_datum(state->values[i], state->kinds[i]);
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values,
+													   nulls)));
+}
+
+
+/*
+ * Native snapshot functions
+ *
+ * Those are called by the plpgsql snapshot functions when powa.native_snapshot
+ * is enabled.  They read the source only once, filter the data in C and
+ * bulk-insert the result in the *_current tables, avoiding the per-row
+ * executor overhead of the INSERT ... SELECT.
+ */
+
+static int
+powa_oid_cmp(const void *a, const void *b)
+{
+	Oid			oa = *((const Oid *) a);
+	Oid			ob = *((const Oid *) b);
+
+	if (oa == ob)
+		return 0;
+	return (oa < ob) ? -1 : 1;
+}
+
+/*
+ * Resolve powa.ignored_users to a sorted array of role oids.  The list is
+ * split on comas without any trimming or case folding, like the plpgsql
+ * snapshot functions used to do.  Unknown roles are ignored.
+ *
+ * The array is cached in TopMemoryContext and only resolved again after the
+ * GUC is changed, which happens in powa_process_sighup() for the bgworker, or
+ * after any change in pg_authid, as a role listed in the GUC could have been
+ * created, renamed or dropped.  The caller must not free the result, and
+ * must be in a transaction.
+ */
+static Oid *
+powa_get_ignored_users(int *nusers)
+{
+	MemoryContext oldcxt;
+	char	   *rawstring;
+	char	   *name;
+	char	   *next;
+	int			size = 8;
+
+	if (powa_ignored_users_valid)
+	{
+		*nusers = powa_ignored_users_n;
+		return powa_ignored_users_cache;
+	}
+
+	if (!powa_ignored_users_callback_registered)
+	{
+		CacheRegisterSyscacheCallback(AUTHOID, powa_ignored_users_syscache_cb,
+									  (Datum) 0);
+		powa_ignored_users_callback_registered = true;
+	}
+
+	if (powa_ignored_users_cache != NULL)
+		pfree(powa_ignored_users_cache);
+	powa_ignored_users_cache = NULL;
+	powa_ignored_users_n = 0;
+
+	if (powa_ignored_users == NULL || powa_ignored_users[0] == '\0')
+	{
+		powa_ignored_users_valid = true;
+		*nusers = 0;
+		return NULL;
+	}
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	powa_ignored_users_cache = palloc(sizeof(Oid) * size);
+	MemoryContextSwitchTo(oldcxt);
+
+	rawstring = pstrdup(powa_ignored_users);
+
+	for (name = rawstring; name != NULL; name = next)
+	{
+		Oid			roleid;
+
+		next = strchr(name, ',');
+		if (next != NULL)
+			*next++ = '\0';
+
+		roleid = get_role_oid(name, true);
+		if (!OidIsValid(roleid))
+			continue;
+
+		if (powa_ignored_users_n >= size)
+		{
+			size *= 2;
+			powa_ignored_users_cache = repalloc(powa_ignored_users_cache,
+											   sizeof(Oid) * size);
+		}
+		powa_ignored_users_cache[powa_ignored_users_n++] = roleid;
+	}
+
+	pfree(rawstring);
+
+	qsort(powa_ignored_users_cache, powa_ignored_users_n, sizeof(Oid),
+		  powa_oid_cmp);
+
+	/*
+	 * Only mark the cache as valid now, so an error while resolving the list
+	 * doesn't leave a partial array behind.
+	 */
+	powa_ignored_users_valid = true;
+	*nusers = powa_ignored_users_n;
+
+	return powa_ignored_users_cache;
+}
+
+static bool
+powa_is_ignored_user_oid(Oid userid, Oid *users, int nusers)
+{
+	if (nusers == 0)
+		return false;
+
+	return bsearch(&userid, users, nusers, sizeof(Oid), powa_oid_cmp) != NULL;
+}
+
+static void
+powa_ignored_users_assign(const char *newval, void *extra)
+{
+	powa_ignored_users_valid = false;
+}
+
+static void
+powa_ignored_users_syscache_cb(Datum arg, int cacheid, uint32 hashvalue)
+{
+	powa_ignored_users_valid = false;
+}
+
+/*
+ * SQL wrapper around the cached powa.ignored_users array, so that the
+ * plpgsql snapshot functions can filter the ignored roles with a binary
+ * search rather than joining pg_roles and splitting the GUC for every row.
+ */
+Datum
+powa_is_ignored_user(PG_FUNCTION_ARGS)
+{
+	Oid			userid = PG_GETARG_OID(0);
+	Oid		   *users;
+	int			nusers;
+
+	users = powa_get_ignored_users(&nusers);
+
+	PG_RETURN_BOOL(powa_is_ignored_user_oid(userid, users, nusers));
+}
+
+/*
+ * Return the oids of the roles currently ignored, in ascending order.
+ */
+Datum
+powa_ignored_users_oids(PG_FUNCTION_ARGS)
+{
+	Datum	   *elems;
+	Oid		   *users;
+	int			nusers;
+	int			i;
+
+	users = powa_get_ignored_users(&nusers);
+
+	elems = palloc(sizeof(Datum) * (nusers > 0 ? nusers : 1));
+	for (i = 0; i < nusers; i++)
+		elems[i] = ObjectIdGetDatum(users[i]);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, nusers, OIDOID,
+										  sizeof(Oid), true, 'i'));
+}
+
+/*
+ * Open one of the *_current tables for bulk insertion, checking that it's
+ * safe to bypass the executor.
+ */
+static Relation
+powa_open_current_table(const char *relname)
+{
+	Oid			relid;
+	Relation	rel;
+	AclResult	aclresult;
+
+	relid = RangeVarGetRelid(makeRangeVar(NULL, (char *) relname, -1),
+							 RowExclusiveLock, false);
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_INSERT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, POWA_ACL_KIND_CLASS, relname);
+
+	rel = table_open(relid, NoLock);
+
+	/*
+	 * heap_multi_insert() doesn't maintain any index or fire any trigger, so
+	 * refuse to work if someone added any on the table.
+	 */
+	if (rel->rd_rel->relkind != RELKIND_RELATION ||
+		rel->rd_rel->relhasindex || rel->trigdesc != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("table \"%s\" can't be used for native snapshot",
+						relname),
+				 errdetail("Native snapshot requires a plain table without any index or trigger."),
+				 errhint("Set powa.native_snapshot to off.")));
+
+	return rel;
+}
+
+/* Get the tupdesc of the record type stored in the last column of a table */
+static TupleDesc
+powa_current_record_tupdesc(Relation rel)
+{
+	TupleDesc	reldesc = RelationGetDescr(rel);
+	Form_pg_attribute att = TupleDescAttr(reldesc, reldesc->natts - 1);
+
+	return lookup_rowtype_tupdesc_copy(att->atttypid, att->atttypmod);
+}
+
+/* Bulk-insert the given tuples in the relation */
+static void
+powa_multi_insert(Relation rel, HeapTuple *tuples, int ntuples)
+{
+	CommandId	mycid = GetCurrentCommandId(true);
+	BulkInsertState bistate;
+
+	if (ntuples == 0)
+		return;
+
+	bistate = GetBulkInsertState();
+
+#if PG_VERSION_NUM >= 120000
+	{
+		TupleTableSlot **slots;
+		int			i;
+
+		slots = palloc(sizeof(TupleTableSlot *) * ntuples);
+		for (i = 0; i < ntuples; i++)
+		{
+			slots[i] = MakeSingleTupleTableSlot(RelationGetDescr(rel),
+												&TTSOpsHeapTuple);
+			ExecStoreHeapTuple(tuples[i], slots[i], false);
+		}
+
+		table_multi_insert(rel, slots, ntuples, mycid, 0, bistate);
+
+		for (i = 0; i < ntuples; i++)
+			ExecDropSingleTupleTableSlot(slots[i]);
+		pfree(slots);
+	}
+#else
+	heap_multi_insert(rel, tuples, ntuples, mycid, 0, bistate);
+#endif
+
+	FreeBulkInsertState(bistate);
+
+	powa_collector_rows += ntuples;
+}
+
+/* Create an HTAB to accumulate per-database sums */
+static HTAB *
+powa_dbsums_create(void)
+{
+	HASHCTL		info;
+	int			flags = HASH_ELEM | HASH_CONTEXT;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(PowaDbSumsEntry);
+	info.hcxt = CurrentMemoryContext;
+#if PG_VERSION_NUM >= 90500
+	flags |= HASH_BLOBS;
+#else
+	info.hash = oid_hash;
+	flags |= HASH_FUNCTION;
+#endif
+
+	return hash_create("powa per-database sums", 64, &info, flags);
+}
+
+/*
+ * Add the counters of a record to the sums of its database.  values and nulls
+ * are the deformed record, whose first field is the timestamp.  Like sum(),
+ * NULL values are ignored.
+ */
+static void
+powa_dbsums_add(HTAB *dbsums, Oid dbid, TupleDesc recdesc,
+				Datum *values, bool *nulls)
+{
+	PowaDbSumsEntry *entry;
+	bool		found;
+	int			i;
+
+	Assert(recdesc->natts - 1 <= POWA_DBSUMS_MAX_COUNTERS);
+
+	entry = (PowaDbSumsEntry *) hash_search(dbsums, &dbid, HASH_ENTER, &found);
+	if (!found)
+	{
+		memset(entry->counters, 0, sizeof(entry->counters));
+		memset(entry->hasvalue, 0, sizeof(entry->hasvalue));
+	}
+
+	for (i = 1; i < recdesc->natts; i++)
+	{
+		if (nulls[i])
+			continue;
+
+		if (TupleDescAttr(recdesc, i)->atttypid == FLOAT8OID)
+			entry->counters[i - 1].f += DatumGetFloat8(values[i]);
+		else
+			entry->counters[i - 1].i += DatumGetInt64(values[i]);
+		entry->hasvalue[i - 1] = true;
+	}
+}
+
+/*
+ * Store the per-database sums in the given (dbid, record) *_current table, and
+ * in dbstream if not NULL.
+ */
+static void
+powa_dbsums_store(HTAB *dbsums, const char *relname, TimestampTz ts,
+				  PowaStreamCache * dbstream)
+{
+	Relation	rel;
+	TupleDesc	reldesc;
+	TupleDesc	recdesc;
+	HeapTuple  *tuples;
+	HASH_SEQ_STATUS hash_seq;
+	PowaDbSumsEntry *entry;
+	Datum		recvalues[POWA_DBSUMS_MAX_COUNTERS + 1];
+	bool		recnulls[POWA_DBSUMS_MAX_COUNTERS + 1];
+	int			ntuples = 0;
+
+	rel = powa_open_current_table(relname);
+	reldesc = RelationGetDescr(rel);
+	recdesc = powa_current_record_tupdesc(rel);
+
+	if (reldesc->natts != 2 || recdesc->natts > POWA_DBSUMS_MAX_COUNTERS + 1)
+		elog(ERROR, "unexpected layout for %s", relname);
+
+	tuples = palloc(sizeof(HeapTuple) * Max(hash_get_num_entries(dbsums), 1));
+
+	hash_seq_init(&hash_seq, dbsums);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+		int			i;
+
+		recvalues[0] = TimestampTzGetDatum(ts);
+		recnulls[0] = false;
+		for (i = 1; i < recdesc->natts; i++)
+		{
+			recnulls[i] = !entry->hasvalue[i - 1];
+			if (TupleDescAttr(recdesc, i)->atttypid == FLOAT8OID)
+				recvalues[i] = Float8GetDatum(entry->counters[i - 1].f);
+			else
+				recvalues[i] = Int64GetDatum(entry->counters[i - 1].i);
+		}
+
+		values[0] = ObjectIdGetDatum(entry->dbid);
+		values[1] = HeapTupleGetDatum(heap_form_tuple(recdesc, recvalues,
+													  recnulls));
+
+		tuples[ntuples++] = heap_form_tuple(reldesc, values, nulls);
+
+		if (dbstream != NULL)
+		{
+			PowaLastKey key;
+
+			key.id = 0;
+			key.dbid = entry->dbid;
+			key.userid = InvalidOid;
+			powa_stream_add(dbstream, &key, recdesc, recvalues, recnulls);
+		}
+	}
+
+	powa_multi_insert(rel, tuples, ntuples);
+	table_close(rel, NoLock);
+}
+
+/*
+ * Store the rows of SPI_tuptable in the given (queryid, dbid, userid, record)
+ * *_current table, and their per-database sums in the (dbid, record) one, in
+ * a single pass.
+ *
+ * The rows must start with the userid, dbid and queryid, and have the
+ * counters of the record from attno firstcounter onwards.  Rows of ignored
+ * users are skipped.  If textattno isn't 0, rows with a NULL value at this
+ * attno are also skipped, and keys->queries is filled with the values.  The
+ * keys of the stored rows are returned in keys if not NULL.  If known isn't
+ * NULL, the keys it contains aren't returned in keys, or if keys is NULL,
+ * the rows whose key it doesn't contain are skipped.  If last isn't
+ * NULL, it's used to skip the unchanged rows, which are still accounted in
+ * the per-database sums.  If recent is true, the snapshot is also saved in
+ * the shared memory ring, which expects powa_statements_history_record
+ * counters.  The stored records are also appended to stream and dbstream if
+ * they're not NULL.
+ *
+ * Must be called in an SPI connection.  Returns the number of stored rows.
+ */
+static uint64
+powa_capture_queries(TimestampTz ts, const char *relname,
+					 const char *dbrelname, int firstcounter, int textattno,
+					 PowaQueryKeys * keys, PowaKnownCache * known,
+					 PowaLastCache * last, PowaTopKCache * topkcache,
+					 bool recent, PowaStreamCache * stream,
+					 PowaStreamCache * dbstream)
+{
+	TupleDesc	spidesc = SPI_tuptable->tupdesc;
+	uint64		nrows = SPI_processed;
+	Oid		   *ignored;
+	int			nignored;
+	Relation	rel;
+	TupleDesc	recdesc;
+	TupleDesc	reldesc;
+	HeapTuple  *tuples;
+	HTAB	   *dbsums;
+	Datum	   *recvalues;
+	bool	   *recnulls;
+	Datum	   *prevvalues;
+	bool	   *prevnulls;
+	PowaRecentEntry *cands = NULL;
+	PowaTopK	topk;
+	int			ncands = 0;
+	int			ncounters;
+	int			ntuples = 0;
+	int			pass;
+	uint64		i;
+	int			j;
+
+	ignored = powa_get_ignored_users(&nignored);
+
+	rel = powa_open_current_table(relname);
+	reldesc = RelationGetDescr(rel);
+	recdesc = powa_current_record_tupdesc(rel);
+	ncounters = recdesc->natts - 1;
+
+	if (reldesc->natts != 4 ||
+		firstcounter - 1 + ncounters != spidesc->natts)
+		elog(ERROR, "unexpected layout for %s", relname);
+
+	for (j = 1; j <= ncounters; j++)
+	{
+		if (SPI_gettypeid(spidesc, firstcounter + j - 1) !=
+			TupleDescAttr(recdesc, j)->atttypid)
+			elog(ERROR, "unexpected type for field \"%s\" of %s",
+				 NameStr(TupleDescAttr(recdesc, j)->attname), relname);
+	}
+
+	/* each row can require to store its previous sample too */
+	tuples = palloc(sizeof(HeapTuple) * Max(nrows, 1) *
+					((last || topkcache) ? 2 : 1));
+	recvalues = palloc(sizeof(Datum) * recdesc->natts);
+	recnulls = palloc(sizeof(bool) * recdesc->natts);
+	prevvalues = palloc(sizeof(Datum) * recdesc->natts);
+	prevnulls = palloc(sizeof(bool) * recdesc->natts);
+	dbsums = powa_dbsums_create();
+
+	if (last != NULL)
+		powa_last_begin(last);
+
+	if (topkcache != NULL)
+		powa_topk_begin(&topk, topkcache, recdesc, false, (int) nrows);
+
+	if (recent && powa_shared != NULL && powa_shared->nslots > 0)
+		cands = palloc(sizeof(PowaRecentEntry) * Max(nrows, 1));
+
+	if (keys != NULL)
+	{
+		keys->nkeys = 0;
+		keys->queryids = palloc(sizeof(Datum) * Max(nrows, 1));
+		keys->dbids = palloc(sizeof(Datum) * Max(nrows, 1));
+		keys->userids = palloc(sizeof(Datum) * Max(nrows, 1));
+		keys->queries = (textattno == 0) ? NULL :
+			palloc(sizeof(Datum) * Max(nrows, 1));
+	}
+
+	/*
+	 * With powa.top_k, a first pass over the rows computes the increase of
+	 * each entry to select the ones to store.
+	 */
+	for (pass = (topkcache != NULL) ? 0 : 1; pass < 2; pass++)
+	{
+		for (i = 0; i < nrows; i++)
+		{
+			HeapTuple	spitup = SPI_tuptable->vals[i];
+			Datum		values[4];
+			bool		nulls[4] = {false, false, false, false};
+			bool		isnull;
+			Datum		query = (Datum) 0;
+			PowaLastKey key;
+			PowaLastAction action = POWA_LAST_STORE;
+
+			values[2] = SPI_getbinval(spitup, spidesc, 1, &isnull);
+			if (isnull || powa_is_ignored_user_oid(DatumGetObjectId(values[2]),
+												   ignored, nignored))
+				continue;
+
+			values[1] = SPI_getbinval(spitup, spidesc, 2, &isnull);
+			if (isnull)
+				continue;
+			values[0] = SPI_getbinval(spitup, spidesc, 3, &isnull);
+			if (isnull)
+				continue;
+
+			if (textattno != 0)
+			{
+				query = SPI_getbinval(spitup, spidesc, textattno, &isnull);
+				if (isnull)
+					continue;
+			}
+
+			recvalues[0] = TimestampTzGetDatum(ts);
+			recnulls[0] = false;
+			for (j = 1; j <= ncounters; j++)
+				recvalues[j] = SPI_getbinval(spitup, spidesc,
+											 firstcounter + j - 1,
+											 &recnulls[j]);
+
+			key.id = (uint64) DatumGetInt64(values[0]);
+			key.dbid = DatumGetObjectId(values[1]);
+			key.userid = DatumGetObjectId(values[2]);
+
+			if (known != NULL && keys == NULL &&
+				!powa_known_find(known, key.id, 0, key.dbid, key.userid))
+				continue;
+
+			if (pass == 0)
+			{
+				powa_topk_add(&topk, (int) i, &key, recvalues, recnulls);
+				continue;
+			}
+
+			powa_dbsums_add(dbsums, DatumGetObjectId(values[1]), recdesc,
+							recvalues, recnulls);
+
+			if (cands != NULL)
+			{
+				PowaRecentEntry *cand = &cands[ncands++];
+
+				cand->dbid = DatumGetObjectId(values[1]);
+				cand->userid = DatumGetObjectId(values[2]);
+				cand->queryid = DatumGetInt64(values[0]);
+				cand->isdb = false;
+				powa_recent_fill_entry(cand, recdesc, recvalues, recnulls);
+			}
+
+			if (topkcache != NULL)
+				action = powa_topk_check(&topk, (int) i, key.dbid,
+										 recvalues, recnulls,
+										 prevvalues, prevnulls);
+			else if (last != NULL)
+				action = powa_last_check(last, &key, recdesc,
+										 recvalues, recnulls,
+										 prevvalues, prevnulls);
+
+			if (action == POWA_LAST_SKIP)
+				continue;
+
+			if (action == POWA_LAST_STORE_PREV)
+			{
+				values[3] = HeapTupleGetDatum(heap_form_tuple(recdesc,
+															  prevvalues,
+															  prevnulls));
+				tuples[ntuples++] = heap_form_tuple(reldesc, values, nulls);
+				if (stream != NULL)
+					powa_stream_add(stream, &key, recdesc, prevvalues,
+									prevnulls);
+			}
+
+			values[3] = HeapTupleGetDatum(heap_form_tuple(recdesc, recvalues,
+														  recnulls));
+			tuples[ntuples++] = heap_form_tuple(reldesc, values, nulls);
+			if (stream != NULL)
+				powa_stream_add(stream, &key, recdesc, recvalues, recnulls);
+
+			if (keys != NULL &&
+				(known == NULL ||
+				 !powa_known_find(known, key.id, 0, key.dbid, key.userid)))
+			{
+				keys->queryids[keys->nkeys] = values[0];
+				keys->dbids[keys->nkeys] = values[1];
+				keys->userids[keys->nkeys] = values[2];
+				if (keys->queries != NULL)
+					keys->queries[keys->nkeys] = query;
+				keys->nkeys++;
+			}
+		}
+
+		if (pass == 0)
+			powa_topk_select(&topk);
+	}
+
+	/* and the "other" entry of each database */
+	if (topkcache != NULL)
+	{
+		HASH_SEQ_STATUS hash_seq;
+		PowaTopKOther *other;
+
+		tuples = repalloc(tuples, sizeof(HeapTuple) *
+						  (ntuples + hash_get_num_entries(topkcache->others) + 1));
+
+		hash_seq_init(&hash_seq, topkcache->others);
+		while ((other = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Datum		values[4];
+			bool		nulls[4] = {false, false, false, false};
+			PowaLastKey key;
+
+			key.id = 0;
+			key.dbid = other->dbid;
+			key.userid = InvalidOid;
+
+			values[0] = Int64GetDatum(0);
+			values[1] = ObjectIdGetDatum(other->dbid);
+			values[2] = ObjectIdGetDatum(InvalidOid);
+
+			powa_topk_other_values(&topk, other, ts, recvalues, recnulls);
+			values[3] = HeapTupleGetDatum(heap_form_tuple(recdesc, recvalues,
+														  recnulls));
+			tuples[ntuples++] = heap_form_tuple(reldesc, values, nulls);
+			if (stream != NULL)
+				powa_stream_add(stream, &key, recdesc, recvalues, recnulls);
+		}
+
+		powa_topk_end(&topk, ts);
+	}
+
+	powa_multi_insert(rel, tuples, ntuples);
+	table_close(rel, NoLock);
+
+	powa_dbsums_store(dbsums, dbrelname, ts, dbstream);
+
+	if (last != NULL)
+		powa_last_end(last, ts);
+
+	if (cands != NULL)
+		powa_recent_store(ts, dbsums, cands, ncands);
+
+	return (uint64) ntuples;
+}
+
+/*
+ * Load a cache of known keys if needed.  Must be called in an SPI connection,
+ * and overwrites SPI_tuptable.
+ */
+static void
+powa_known_load(PowaKnownCache * cache)
+{
+	HASHCTL		info;
+	int			flags = HASH_ELEM;
+	uint64		i;
+	int			ret;
+
+	if (cache->htab != NULL)
+		return;
+
+	powa_last_register_callbacks();
+	if (!powa_known_callback_registered)
+	{
+		CacheRegisterRelcacheCallback(powa_known_relcache_cb, (Datum) 0);
+		powa_known_callback_registered = true;
+	}
+
+	cache->relid = RangeVarGetRelid(makeRangeVar(NULL,
+												 (char *) cache->relname, -1),
+									NoLock, false);
+
+	ret = SPI_execute(cache->query, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read %s: %s", cache->relname,
+			 SPI_result_code_string(ret));
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PowaKnownKey);
+	info.entrysize = sizeof(PowaKnownKey);
+#if PG_VERSION_NUM >= 90500
+	flags |= HASH_BLOBS;
+#else
+	info.hash = tag_hash;
+	flags |= HASH_FUNCTION;
+#endif
+
+	cache->htab = hash_create(cache->name, Max(SPI_processed * 2, 1024),
+							  &info, flags);
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	spitup = SPI_tuptable->vals[i];
+		TupleDesc	spidesc = SPI_tuptable->tupdesc;
+		Datum		values[4];
+		bool		isnull;
+		int			j;
+
+		for (j = 0; j < 4; j++)
+		{
+			values[j] = SPI_getbinval(spitup, spidesc, j + 1, &isnull);
+			if (isnull)
+				break;
+		}
+		if (j < 4)
+			continue;
+
+		powa_known_add(cache, (uint64) DatumGetInt64(values[0]),
+					   (uint64) DatumGetInt64(values[1]),
+					   DatumGetObjectId(values[2]),
+					   DatumGetObjectId(values[3]));
+	}
+
+	SPI_freetuptable(SPI_tuptable);
+}
+
+static bool
+powa_known_find(PowaKnownCache * cache, uint64 id, uint64 qualid, Oid dbid,
+				Oid userid)
+{
+	PowaKnownKey key;
+
+	if (cache->htab == NULL)
+		return false;
+
+	memset(&key, 0, sizeof(key));
+	key.id = id;
+	key.qualid = qualid;
+	key.dbid = dbid;
+	key.userid = userid;
+
+	return hash_search(cache->htab, &key, HASH_FIND, NULL) != NULL;
+}
+
+/*
+ * Remember a stored key.  It's only valid once the current transaction
+ * commits, but the cache is reset if it aborts.
+ */
+static void
+powa_known_add(PowaKnownCache * cache, uint64 id, uint64 qualid, Oid dbid,
+			   Oid userid)
+{
+	PowaKnownKey key;
+
+	if (cache->htab == NULL)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.id = id;
+	key.qualid = qualid;
+	key.dbid = dbid;
+	key.userid = userid;
+
+	hash_search(cache->htab, &key, HASH_ENTER, NULL);
+	cache->modified = true;
+}
+
+static void
+powa_known_reset(PowaKnownCache * cache)
+{
+	if (cache->htab != NULL)
+		hash_destroy(cache->htab);
+	cache->htab = NULL;
+}
+
+/* Discard the caches updated by an aborted (sub)transaction */
+static void
+powa_known_reset_modified(void)
+{
+	if (powa_known_statements.modified)
+		powa_known_reset(&powa_known_statements);
+	if (powa_known_quals.modified)
+		powa_known_reset(&powa_known_quals);
+}
+
+/* The tables are only emptied with a TRUNCATE, which invalidates them */
+static void
+powa_known_relcache_cb(Datum arg, Oid relid)
+{
+	if (!OidIsValid(relid) || relid == powa_known_statements.relid)
+		powa_known_reset(&powa_known_statements);
+	if (!OidIsValid(relid) || relid == powa_known_quals.relid)
+		powa_known_reset(&powa_known_quals);
+}
+
+/*
+ * Tell whether the given key is known to be stored.  If it isn't, it's
+ * remembered, as the caller is expected to store it in the same transaction.
+ */
+static Datum
+powa_known_check(FunctionCallInfo fcinfo, PowaKnownCache * cache, uint64 id,
+				 uint64 qualid, Oid dbid, Oid userid)
+{
+	if (cache->htab == NULL)
+	{
+		SPI_connect();
+		powa_known_load(cache);
+		SPI_finish();
+	}
+
+	if (powa_known_find(cache, id, qualid, dbid, userid))
+		PG_RETURN_BOOL(true);
+
+	powa_known_add(cache, id, qualid, dbid, userid);
+
+	PG_RETURN_BOOL(false);
+}
+
+/*
+ * SQL wrappers around the caches of known keys, so that the plpgsql snapshot
+ * functions only look up the keys they don't know yet in the tables.
+ */
+Datum
+powa_statements_known(PG_FUNCTION_ARGS)
+{
+	return powa_known_check(fcinfo, &powa_known_statements,
+							(uint64) PG_GETARG_INT64(0), 0,
+							PG_GETARG_OID(1), PG_GETARG_OID(2));
+}
+
+Datum
+powa_qualstats_quals_known(PG_FUNCTION_ARGS)
+{
+	return powa_known_check(fcinfo, &powa_known_quals,
+							(uint64) PG_GETARG_INT64(1),
+							(uint64) PG_GETARG_INT64(0),
+							PG_GETARG_OID(2), PG_GETARG_OID(3));
+}
+
+/*
+ * The sketches are only used by the collector, which also runs the
+ * aggregates, so the values can't be missed by an aggregate run by another
+ * process.
+ */
+static bool
+powa_sketch_enabled(void)
+{
+	return powa_qualstats_sketch_size > 0 && powa_is_collector &&
+		!powa_maintenance_worker && powa_sketch.valid;
+}
+
+static void
+powa_sketch_reset(bool valid)
+{
+	if (powa_sketch.cxt != NULL)
+		MemoryContextDelete(powa_sketch.cxt);
+	powa_sketch.cxt = NULL;
+	powa_sketch.htab = NULL;
+	powa_sketch.valid = valid;
+}
+
+/*
+ * Discard the sketches updated by an aborted (sub)transaction.  The constant
+ * values they absorbed aren't stored anywhere else, so warn about the loss.
+ */
+static void
+powa_sketch_discard(void)
+{
+	if (powa_sketch.valid && powa_sketch.htab != NULL &&
+		hash_get_num_entries(powa_sketch.htab) > 0)
+		elog(WARNING, "POWA discarding the qualstats constant values sketches after an error, the values captured since the last aggregate are lost");
+
+	powa_sketch_reset(false);
+}
+
+/* Order the values of a sketch, using the ORDER BY of each list */
+static int
+powa_sketch_item_cmp(const void *a, const void *b, void *arg)
+{
+	PowaSketchEntry *entry = (PowaSketchEntry *) ((void **) arg)[0];
+	PowaSketchOrder order = *((PowaSketchOrder *) ((void **) arg)[1]);
+	PowaSketchItem *ia = &entry->items[*((const int *) a)];
+	PowaSketchItem *ib = &entry->items[*((const int *) b)];
+	double		va;
+	double		vb;
+
+	switch (order)
+	{
+		case POWA_SKETCH_MOST_USED:
+			va = (double) ia->occurences;
+			vb = (double) ib->occurences;
+			break;
+		case POWA_SKETCH_MOST_FILTERING:
+		case POWA_SKETCH_LEAST_FILTERING:
+			va = (ia->execution_count == 0) ? 0 :
+				(double) ia->nbfiltered / ia->execution_count;
+			vb = (ib->execution_count == 0) ? 0 :
+				(double) ib->nbfiltered / ib->execution_count;
+			break;
+		case POWA_SKETCH_MOST_EXECUTED:
+		default:
+			va = (double) ia->execution_count;
+			vb = (double) ib->execution_count;
+			break;
+	}
+
+	if (va == vb)
+		return 0;
+
+	/* only the least filtering values are in ascending order */
+	if (order == POWA_SKETCH_LEAST_FILTERING)
+		return (va < vb) ? -1 : 1;
+	return (va > vb) ? -1 : 1;
+}
+
+/* Build one of the qual_values[] lists of a sketch */
+static Datum
+powa_sketch_values(PowaSketchEntry * entry, PowaSketchOrder order, int *idx,
+				   Oid elemtype, TupleDesc valdesc)
+{
+	void	   *arg[2];
+	Datum	   *elems;
+	int			nelems = Min(entry->nitems, POWA_SKETCH_TOP_VALUES);
+	int			i;
+
+	for (i = 0; i < entry->nitems; i++)
+		idx[i] = i;
+
+	arg[0] = entry;
+	arg[1] = &order;
+	qsort_arg(idx, entry->nitems, sizeof(int), powa_sketch_item_cmp, arg);
+
+	elems = palloc(sizeof(Datum) * nelems);
+	for (i = 0; i < nelems; i++)
+	{
+		PowaSketchItem *item = &entry->items[idx[i]];
+		Datum		values[4];
+		bool		nulls[4] = {false, false, false, false};
+
+		values[0] = PointerGetDatum(item->constvalues);
+		values[1] = Int64GetDatum(item->occurences);
+		values[2] = Int64GetDatum(item->execution_count);
+		values[3] = Int64GetDatum(item->nbfiltered);
+
+		elems[i] = HeapTupleGetDatum(heap_form_tuple(valdesc, values, nulls));
+	}
+
+	return PointerGetDatum(construct_array(elems, nelems, elemtype, -1, false,
+										   'd'));
+}
+
+/*
+ * Add a row captured by powa_qualstats_snapshot() to the sketch of its qual.
+ * Returns true if the row was absorbed, in which case the caller must not
+ * store it in powa_qualstats_constvalues_history_current.
+ */
+Datum
+powa_qualstats_sketch_add(PG_FUNCTION_ARGS)
+{
+	PowaSketchEntry *entry;
+	PowaSketchItem *item = NULL;
+	PowaKnownKey key;
+	ArrayType  *constvalues;
+	TimestampTz ts = GetCurrentTransactionStartTimestamp();
+	uint32		hash;
+	bool		found;
+	int			i;
+
+	if (!powa_sketch_enabled())
+		PG_RETURN_BOOL(false);
+
+	/* let the caller store the rows we couldn't compare */
+	for (i = 0; i < 8; i++)
+	{
+		if (PG_ARGISNULL(i))
+			PG_RETURN_BOOL(false);
+	}
+
+	if (powa_sketch.htab == NULL)
+	{
+		HASHCTL		info;
+		int			flags = HASH_ELEM | HASH_CONTEXT;
+
+		powa_last_register_callbacks();
+
+		powa_sketch.cxt = AllocSetContextCreate(TopMemoryContext,
+												"powa qualstats sketch",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(PowaKnownKey);
+		info.entrysize = sizeof(PowaSketchEntry);
+		info.hcxt = powa_sketch.cxt;
+#if PG_VERSION_NUM >= 90500
+		flags |= HASH_BLOBS;
+#else
+		info.hash = tag_hash;
+		flags |= HASH_FUNCTION;
+#endif
+
+		powa_sketch.htab = hash_create("powa qualstats sketch", 1024, &info,
+									   flags);
+	}
+
+	powa_sketch.modified = true;
+
+	memset(&key, 0, sizeof(key));
+	key.qualid = (uint64) PG_GETARG_INT64(0);
+	key.id = (uint64) PG_GETARG_INT64(1);
+	key.dbid = PG_GETARG_OID(2);
+	key.userid = PG_GETARG_OID(3);
+	constvalues = PG_GETARG_ARRAYTYPE_P(4);
+	hash = DatumGetUInt32(hash_any((unsigned char *) constvalues,
+								   VARSIZE(constvalues)));
+
+	entry = hash_search(powa_sketch.htab, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->mints = entry->maxts = ts;
+		entry->nitems = 0;
+		entry->capacity = powa_qualstats_sketch_size;
+		entry->items = MemoryContextAlloc(powa_sketch.cxt,
+										  sizeof(PowaSketchItem) *
+										  entry->capacity);
+	}
+	entry->mints = Min(entry->mints, ts);
+	entry->maxts = Max(entry->maxts, ts);
+
+	for (i = 0; i < entry->nitems; i++)
+	{
+		PowaSketchItem *cur = &entry->items[i];
+
+		if (cur->hash == hash &&
+			VARSIZE(cur->constvalues) == VARSIZE(constvalues) &&
+			memcmp(cur->constvalues, constvalues, VARSIZE(constvalues)) == 0)
+		{
+			item = cur;
+			break;
+		}
+	}
+
+	if (item != NULL)
+	{
+		item->occurences += PG_GETARG_INT64(5);
+		item->execution_count += PG_GETARG_INT64(6);
+		item->nbfiltered += PG_GETARG_INT64(7);
+
+		PG_RETURN_BOOL(true);
+	}
+
+	if (entry->nitems < entry->capacity)
+	{
+		item = &entry->items[entry->nitems++];
+		item->occurences = 0;
+	}
+	else
+	{
+		/* evict the least used value, keeping its occurences */
+		item = &entry->items[0];
+		for (i = 1; i < entry->nitems; i++)
+		{
+			if (entry->items[i].occurences < item->occurences)
+				item = &entry->items[i];
+		}
+		pfree(item->constvalues);
+	}
+
+	item->hash = hash;
+	item->constvalues = MemoryContextAlloc(powa_sketch.cxt,
+										   VARSIZE(constvalues));
+	memcpy(item->constvalues, constvalues, VARSIZE(constvalues));
+	item->occurences += PG_GETARG_INT64(5);
+	item->execution_count = PG_GETARG_INT64(6);
+	item->nbfiltered = PG_GETARG_INT64(7);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Return the powa_qualstats_constvalues_history rows of the sketches, in the
+ * same form as powa_qualstats_aggregate_constvalues_current.
+ */
+Datum
+powa_qualstats_constvalues_sketch(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	TupleDesc	valdesc;
+	Tuplestorestate *tupstore;
+	TypeCacheEntry *typcache;
+	HASH_SEQ_STATUS hash_seq;
+	PowaSketchEntry *entry;
+	Oid			elemtype;
+	int		   *idx;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (powa_sketch.htab == NULL)
+		return (Datum) 0;
+
+	/* the lists are qual_values[] */
+	elemtype = get_element_type(TupleDescAttr(tupdesc, 5)->atttypid);
+	if (!OidIsValid(elemtype))
+		elog(ERROR, "return type must have array columns");
+	valdesc = lookup_rowtype_tupdesc_copy(elemtype, -1);
+	typcache = lookup_type_cache(TSTZRANGEOID, TYPECACHE_RANGE_INFO);
+
+	hash_seq_init(&hash_seq, powa_sketch.htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[9];
+		bool		nulls[9];
+		RangeBound	lower;
+		RangeBound	upper;
+
+		if (entry->nitems == 0)
+			continue;
+
+		idx = palloc(sizeof(int) * entry->nitems);
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int64GetDatum((int64) entry->key.qualid);
+		values[1] = Int64GetDatum((int64) entry->key.id);
+		values[2] = ObjectIdGetDatum(entry->key.dbid);
+		values[3] = ObjectIdGetDatum(entry->key.userid);
+
+		lower.val = TimestampTzGetDatum(entry->mints);
+		lower.infinite = false;
+		lower.inclusive = true;
+		lower.lower = true;
+		upper.val = TimestampTzGetDatum(entry->maxts);
+		upper.infinite = false;
+		upper.inclusive = true;
+		upper.lower = false;
+#if PG_VERSION_NUM >= 160000
+		values[4] = RangeTypePGetDatum(make_range(typcache, &lower, &upper,
+												  false, NULL));
+#else
+		values[4] = RangeTypePGetDatum(make_range(typcache, &lower, &upper,
+												  false));
+#endif
+
+		values[5] = powa_sketch_values(entry, POWA_SKETCH_MOST_USED, idx,
+									   elemtype, valdesc);
+		values[6] = powa_sketch_values(entry, POWA_SKETCH_MOST_FILTERING, idx,
+									   elemtype, valdesc);
+		values[7] = powa_sketch_values(entry, POWA_SKETCH_LEAST_FILTERING, idx,
+									   elemtype, valdesc);
+		values[8] = powa_sketch_values(entry, POWA_SKETCH_MOST_EXECUTED, idx,
+									   elemtype, valdesc);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		pfree(idx);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Start new sketches, once powa_qualstats_aggregate() emptied
+ * powa_qualstats_constvalues_history_current.
+ */
+Datum
+powa_qualstats_sketch_reset(PG_FUNCTION_ARGS)
+{
+	powa_last_register_callbacks();
+
+	powa_sketch_reset(true);
+	powa_sketch.modified = true;
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Store the given statements if they're not known yet, storing each distinct
+ * query text only once.  Must be called in an SPI connection.
+ */
+static void
+powa_statements_store_missing(PowaQueryKeys * keys)
+{
+	static const char *query_missing =
+	"WITH s AS ("
+	"  SELECT s.queryid, s.dbid, s.userid, s.query,"
+	"   md5(s.query)::uuid AS query_md5"
+	"  FROM unnest($1::bigint[], $2::oid[], $3::oid[], $4::text[])"
+	"   AS s(queryid, dbid, userid, query)"
+	"  WHERE NOT EXISTS (SELECT 1"
+	"   FROM powa_statements_base ps"
+	"   WHERE ps.queryid = s.queryid"
+	"   AND ps.dbid = s.dbid"
+	"   AND ps.userid = s.userid)"
+	" ),"
+	" t AS ("
+	"  INSERT INTO powa_statements_texts (query_md5, query)"
+	"  SELECT DISTINCT s.query_md5, s.query"
+	"  FROM s"
+	"  WHERE NOT EXISTS (SELECT 1"
+	"   FROM powa_statements_texts pt"
+	"   WHERE pt.query_md5 = s.query_md5)"
+	" )"
+	" INSERT INTO powa_statements_base (queryid, dbid, userid, query_md5)"
+	" SELECT s.queryid, s.dbid, s.userid, s.query_md5"
+	" FROM s";
+	Oid			argtypes[4];
+	Datum		args[4];
+	int			ret;
+	int			i;
+
+	if (keys->nkeys == 0)
+		return;
+
+	argtypes[0] = INT8ARRAYOID;
+	args[0] = PointerGetDatum(construct_array(keys->queryids, keys->nkeys,
+											  INT8OID, sizeof(int64),
+											  FLOAT8PASSBYVAL, 'd'));
+	argtypes[1] = OIDARRAYOID;
+	args[1] = PointerGetDatum(construct_array(keys->dbids, keys->nkeys,
+											  OIDOID, sizeof(Oid),
+											  true, 'i'));
+	argtypes[2] = OIDARRAYOID;
+	args[2] = PointerGetDatum(construct_array(keys->userids, keys->nkeys,
+											  OIDOID, sizeof(Oid),
+											  true, 'i'));
+	argtypes[3] = TEXTARRAYOID;
+	args[3] = PointerGetDatum(construct_array(keys->queries, keys->nkeys,
+											  TEXTOID, -1, false, 'i'));
+
+	ret = SPI_execute_with_args(query_missing, 4, argtypes, args, NULL,
+								false, 0);
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "could not insert missing statements: %s",
+			 SPI_result_code_string(ret));
+
+	/* they're all stored now */
+	for (i = 0; i < keys->nkeys; i++)
+		powa_known_add(&powa_known_statements,
+					   (uint64) DatumGetInt64(keys->queryids[i]), 0,
+					   DatumGetObjectId(keys->dbids[i]),
+					   DatumGetObjectId(keys->userids[i]));
+}
+
+/*
+ * Remember a statement whose text matches the ignore regexp, so its text
+ * isn't fetched again.
+ */
+static void
+powa_ignored_queries_add(PowaLastKey * key)
+{
+	PowaIgnoredQuery *entry;
+
+	if (powa_ignored_queries == NULL)
+	{
+		HASHCTL		info;
+		int			flags = HASH_ELEM;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(PowaLastKey);
+		info.entrysize = sizeof(PowaIgnoredQuery);
+#if PG_VERSION_NUM >= 90500
+		flags |= HASH_BLOBS;
+#else
+		info.hash = tag_hash;
+		flags |= HASH_FUNCTION;
+#endif
+
+		powa_ignored_queries = hash_create("powa ignored queries", 64, &info,
+										   flags);
+	}
+
+	entry = (PowaIgnoredQuery *) hash_search(powa_ignored_queries, key,
+											 HASH_ENTER, NULL);
+	entry->generation = powa_ignored_queries_generation;
+}
+
+/*
+ * With powa.lazy_query_text, store the statements not known yet.  The key of
+ * the pg_stat_statements entries are first read without their text, and the
+ * texts are only read if some of the unknown entries aren't already known to
+ * be ignored.  Must be called in an SPI connection, with the known statements
+ * cache loaded.
+ */
+static void
+powa_statements_capture_missing(Datum ignore_regexp)
+{
+	static const char *query_keys =
+	"SELECT pgss.userid, pgss.dbid, pgss.queryid"
+	" FROM pg_stat_statements(false) pgss";
+	static const char *query_texts =
+	"SELECT pgss.userid, pgss.dbid, pgss.queryid, pgss.query,"
+	" pgss.query ~* $4"
+	" FROM pg_stat_statements(true) pgss"
+	" JOIN unnest($1::bigint[], $2::oid[], $3::oid[])"
+	"  AS k(queryid, dbid, userid)"
+	"  ON k.queryid = pgss.queryid"
+	"  AND k.dbid = pgss.dbid"
+	"  AND k.userid = pgss.userid";
+	PowaQueryKeys keys;
+	Oid		   *ignored;
+	int			nignored;
+	Oid			argtypes[4];
+	Datum		args[4];
+	uint64		nrows;
+	uint64		i;
+	int			ret;
+	char	   *regexp = TextDatumGetCString(ignore_regexp);
+
+	/* the ignored statements are only valid for the regexp they matched */
+	if (powa_ignored_queries_regexp == NULL ||
+		strcmp(powa_ignored_queries_regexp, regexp) != 0)
+	{
+		if (powa_ignored_queries != NULL)
+			hash_destroy(powa_ignored_queries);
+		powa_ignored_queries = NULL;
+
+		if (powa_ignored_queries_regexp != NULL)
+			pfree(powa_ignored_queries_regexp);
+		powa_ignored_queries_regexp = MemoryContextStrdup(TopMemoryContext,
+														  regexp);
+	}
+
+	ret = SPI_execute(query_keys, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read pg_stat_statements: %s",
+			 SPI_result_code_string(ret));
+
+	ignored = powa_get_ignored_users(&nignored);
+	nrows = SPI_processed;
+	keys.nkeys = 0;
+	keys.queryids = palloc(sizeof(Datum) * Max(nrows, 1));
+	keys.dbids = palloc(sizeof(Datum) * Max(nrows, 1));
+	keys.userids = palloc(sizeof(Datum) * Max(nrows, 1));
+	keys.queries = palloc(sizeof(Datum) * Max(nrows, 1));
+
+	powa_ignored_queries_generation++;
+
+	for (i = 0; i < nrows; i++)
+	{
+		HeapTuple	spitup = SPI_tuptable->vals[i];
+		TupleDesc	spidesc = SPI_tuptable->tupdesc;
+		PowaLastKey key;
+		Datum		userid,
+					dbid,
+					queryid;
+		bool		isnull1,
+					isnull2,
+					isnull3;
+
+		userid = SPI_getbinval(spitup, spidesc, 1, &isnull1);
+		dbid = SPI_getbinval(spitup, spidesc, 2, &isnull2);
+		queryid = SPI_getbinval(spitup, spidesc, 3, &isnull3);
+		if (isnull1 || isnull2 || isnull3 ||
+			powa_is_ignored_user_oid(DatumGetObjectId(userid), ignored,
+									 nignored))
+			continue;
+
+		key.id = (uint64) DatumGetInt64(queryid);
+		key.dbid = DatumGetObjectId(dbid);
+		key.userid = DatumGetObjectId(userid);
+
+		if (powa_ignored_queries != NULL)
+		{
+			PowaIgnoredQuery *entry;
+
+			entry = (PowaIgnoredQuery *) hash_search(powa_ignored_queries,
+													 &key, HASH_FIND, NULL);
+			if (entry != NULL)
+			{
+				entry->generation = powa_ignored_queries_generation;
+				continue;
+			}
+		}
+
+		if (powa_known_find(&powa_known_statements, key.id, 0, key.dbid,
+							key.userid))
+			continue;
+
+		keys.queryids[keys.nkeys] = queryid;
+		keys.dbids[keys.nkeys] = dbid;
+		keys.userids[keys.nkeys] = userid;
+		keys.nkeys++;
+	}
+
+	/* forget about the ignored statements that were evicted */
+	if (powa_ignored_queries != NULL)
+	{
+		HASH_SEQ_STATUS hash_seq;
+		PowaIgnoredQuery *entry;
+
+		hash_seq_init(&hash_seq, powa_ignored_queries);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (entry->generation != powa_ignored_queries_generation)
+				hash_search(powa_ignored_queries, &entry->key, HASH_REMOVE,
+							NULL);
+		}
+	}
+
+	if (keys.nkeys == 0)
+		return;
+
+	argtypes[0] = INT8ARRAYOID;
+	args[0] = PointerGetDatum(construct_array(keys.queryids, keys.nkeys,
+											  INT8OID, sizeof(int64),
+											  FLOAT8PASSBYVAL, 'd'));
+	argtypes[1] = OIDARRAYOID;
+	args[1] = PointerGetDatum(construct_array(keys.dbids, keys.nkeys,
+											  OIDOID, sizeof(Oid),
+											  true, 'i'));
+	argtypes[2] = OIDARRAYOID;
+	args[2] = PointerGetDatum(construct_array(keys.userids, keys.nkeys,
+											  OIDOID, sizeof(Oid),
+											  true, 'i'));
+	argtypes[3] = TEXTOID;
+	args[3] = ignore_regexp;
+
+	ret = SPI_execute_with_args(query_texts, 4, argtypes, args, NULL, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read pg_stat_statements: %s",
+			 SPI_result_code_string(ret));
+
+	keys.nkeys = 0;
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	spitup = SPI_tuptable->vals[i];
+		TupleDesc	spidesc = SPI_tuptable->tupdesc;
+		Datum		query;
+		bool		isnull;
+
+		query = SPI_getbinval(spitup, spidesc, 4, &isnull);
+		if (isnull)
+			continue;
+
+		if (DatumGetBool(SPI_getbinval(spitup, spidesc, 5, &isnull)))
+		{
+			PowaLastKey key;
+
+			key.id = (uint64) DatumGetInt64(SPI_getbinval(spitup, spidesc, 3,
+														  &isnull));
+			key.dbid = DatumGetObjectId(SPI_getbinval(spitup, spidesc, 2,
+													  &isnull));
+			key.userid = DatumGetObjectId(SPI_getbinval(spitup, spidesc, 1,
+														&isnull));
+			powa_ignored_queries_add(&key);
+			continue;
+		}
+
+		keys.userids[keys.nkeys] = SPI_getbinval(spitup, spidesc, 1, &isnull);
+		keys.dbids[keys.nkeys] = SPI_getbinval(spitup, spidesc, 2, &isnull);
+		keys.queryids[keys.nkeys] = SPI_getbinval(spitup, spidesc, 3, &isnull);
+		keys.queries[keys.nkeys] = query;
+		keys.nkeys++;
+	}
+
+	powa_statements_store_missing(&keys);
+}
+
+/*
+ * Native version of powa_statements_snapshot().  Returns the number of
+ * captured statements.
+ */
+Datum
+powa_statements_snapshot_native(PG_FUNCTION_ARGS)
+{
+	static const char *query_capture =
+	"SELECT pgss.userid, pgss.dbid, pgss.queryid, pgss.query,"
+	" pgss.calls, pgss.total_time, pgss.rows,"
+	" pgss.shared_blks_hit, pgss.shared_blks_read,"
+	" pgss.shared_blks_dirtied, pgss.shared_blks_written,"
+	" pgss.local_blks_hit, pgss.local_blks_read,"
+	" pgss.local_blks_dirtied, pgss.local_blks_written,"
+	" pgss.temp_blks_read, pgss.temp_blks_written,"
+	" pgss.blk_read_time, pgss.blk_write_time"
+	" FROM pg_stat_statements pgss"
+	" WHERE pgss.query !~* $1";
+
+	/*
+	 * With powa.lazy_query_text, only the statements already stored are
+	 * captured, which skips the ones matching the ignore regexp without
+	 * reading their text.  The unknown ones are skipped using the known
+	 * statements cache.
+	 */
+	static const char *query_capture_known =
+	"SELECT pgss.userid, pgss.dbid, pgss.queryid, NULL::text,"
+	" pgss.calls, pgss.total_time, pgss.rows,"
+	" pgss.shared_blks_hit, pgss.shared_blks_read,"
+	" pgss.shared_blks_dirtied, pgss.shared_blks_written,"
+	" pgss.local_blks_hit, pgss.local_blks_read,"
+	" pgss.local_blks_dirtied, pgss.local_blks_written,"
+	" pgss.temp_blks_read, pgss.temp_blks_written,"
+	" pgss.blk_read_time, pgss.blk_write_time"
+	" FROM pg_stat_statements(false) pgss";
+	TimestampTz ts = GetCurrentTransactionStartTimestamp();
+	PowaQueryKeys keys;
+	Oid			argtypes[1];
+	Datum		args[1];
+	uint64		nrows;
+	int			ret;
+
+	/* the top-K selection has its own cache of the previous counters */
+	if (powa_store_unchanged || powa_top_k > 0)
+		powa_last_reset(&powa_last_statements);
+	if (powa_top_k == 0)
+		powa_topk_reset(&powa_topk_statements);
+
+	/*
+	 * the running aggregates would miss those records, and they can't be
+	 * flushed by the maintenance worker
+	 */
+	if (!powa_streaming_aggregate || powa_maintenance_worker)
+		powa_stream_reset_all(false);
+
+	SPI_connect();
+
+	powa_known_load(&powa_known_statements);
+
+	if (powa_lazy_query_text)
+	{
+		powa_statements_capture_missing(PG_GETARG_DATUM(0));
+
+		/*
+		 * not read-only, so that a new snapshot is taken and the statements
+		 * just stored get their first sample
+		 */
+		ret = SPI_execute(query_capture_known, false, 0);
+	}
+	else
+	{
+		argtypes[0] = TEXTOID;
+		args[0] = PG_GETARG_DATUM(0);
+		ret = SPI_execute_with_args(query_capture, 1, argtypes, args, NULL,
+									true, 0);
+	}
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read pg_stat_statements: %s",
+			 SPI_result_code_string(ret));
+
+	keys.nkeys = 0;
+	nrows = powa_capture_queries(ts, "powa_statements_history_current",
+								 "powa_statements_history_current_db",
+								 5, powa_lazy_query_text ? 0 : 4,
+								 powa_lazy_query_text ? NULL : &keys,
+								 &powa_known_statements,
+								 (powa_store_unchanged || powa_top_k > 0) ?
+								 NULL : &powa_last_statements,
+								 (powa_top_k > 0) ? &powa_topk_statements : NULL,
+								 true, &powa_stream_statements,
+								 &powa_stream_statements_db);
+	powa_stream_written(true);
+
+	/* add the statements we didn't know yet */
+	powa_statements_store_missing(&keys);
+
+	SPI_finish();
+
+	PG_RETURN_INT64((int64) nrows);
+}
+
+/*
+ * Native version of powa_kcache_snapshot().  Returns the number of captured
+ * entries.
+ */
+Datum
+powa_kcache_snapshot_native(PG_FUNCTION_ARGS)
+{
+	static const char *query_capture =
+	"SELECT k.userid, k.dbid, k.queryid,"
+	" k.reads, k.writes, k.user_time, k.system_time"
+	" FROM pg_stat_kcache() k";
+	TimestampTz ts = GetCurrentTransactionStartTimestamp();
+	uint64		nrows;
+	int			ret;
+
+	SPI_connect();
+
+	ret = SPI_execute(query_capture, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read pg_stat_kcache: %s",
+			 SPI_result_code_string(ret));
+
+	nrows = powa_capture_queries(ts, "powa_kcache_metrics_current",
+								 "powa_kcache_metrics_current_db",
+								 4, 0, NULL, NULL, NULL, NULL, false, NULL,
+								 NULL);
+
+	SPI_finish();
+
+	PG_RETURN_INT64((int64) nrows);
+}
+
+/* Start a new snapshot generation for the given cache */
+static void
+powa_last_begin(PowaLastCache * cache)
+{
+	powa_last_register_callbacks();
+
+	if (cache->htab == NULL)
+	{
+		HASHCTL		info;
+		int			flags = HASH_ELEM;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(PowaLastKey);
+		info.entrysize = sizeof(PowaLastEntry);
+#if PG_VERSION_NUM >= 90500
+		flags |= HASH_BLOBS;
+#else
+		info.hash = tag_hash;
+		flags |= HASH_FUNCTION;
+#endif
+
+		cache->htab = hash_create(cache->name, 1024, &info, flags);
+		cache->last_ts = 0;
+	}
+
+	cache->generation++;
+	cache->modified = true;
+}
+
+/*
+ * Check whether a sample has to be stored, and remember its counters.  If
+ * POWA_LAST_STORE_PREV is returned, prevvalues and prevnulls contain the
+ * previous sample, that has to be stored before the new one.
+ */
+static PowaLastAction
+powa_last_check(PowaLastCache * cache, PowaLastKey * key, TupleDesc recdesc,
+				Datum *values, bool *nulls, Datum *prevvalues, bool *prevnulls)
+{
+	PowaLastEntry *entry;
+	PowaLastAction action;
+	bool		found;
+	bool		changed = false;
+	int			i;
+
+	Assert(recdesc->natts - 1 <= POWA_LAST_MAX_FIELDS);
+
+	entry = (PowaLastEntry *) hash_search(cache->htab, key, HASH_ENTER, &found);
+
+	for (i = 1; i < recdesc->natts && found && !changed; i++)
+	{
+		if (nulls[i] != entry->nulls[i - 1])
+			changed = true;
+		else if (!nulls[i] &&
+				 powa_datum_to_bits(values[i],
+									powa_block_kind(TupleDescAttr(recdesc, i)))
+				 != entry->values[i - 1])
+			changed = true;
+	}
+
+	/*
+	 * An entry not seen at the previous snapshot may have been reset, so
+	 * always store it.
+	 */
+	if (found && entry->generation != cache->generation - 1)
+		changed = true;
+
+	if (found && !changed)
+	{
+		entry->generation = cache->generation;
+		entry->skipped = true;
+		return POWA_LAST_SKIP;
+	}
+
+	action = POWA_LAST_STORE;
+	if (found && entry->skipped && entry->generation == cache->generation - 1)
+	{
+		prevvalues[0] = TimestampTzGetDatum(cache->last_ts);
+		prevnulls[0] = false;
+		for (i = 1; i < recdesc->natts; i++)
+		{
+			prevnulls[i] = entry->nulls[i - 1];
+			prevvalues[i] = prevnulls[i] ? (Datum) 0 :
+				powa_bits_to_datum(entry->values[i - 1],
+								   powa_block_kind(TupleDescAttr(recdesc, i)));
+		}
+		action = POWA_LAST_STORE_PREV;
+	}
+
+	for (i = 1; i < recdesc->natts; i++)
+	{
+		entry->nulls[i - 1] = nulls[i];
+		entry->values[i - 1] = nulls[i] ? 0 :
+			powa_datum_to_bits(values[i],
+							   powa_block_kind(TupleDescAttr(recdesc, i)));
+	}
+	entry->generation = cache->generation;
+	entry->skipped = false;
+
+	return action;
+}
+
+/* End a snapshot generation, forgetting about the entries not seen */
+static void
+powa_last_end(PowaLastCache * cache, TimestampTz ts)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PowaLastEntry *entry;
+
+	hash_seq_init(&hash_seq, cache->htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->generation != cache->generation)
+			hash_search(cache->htab, &entry->key, HASH_REMOVE, NULL);
+	}
+
+	cache->last_ts = ts;
+}
+
+static void
+powa_last_reset(PowaLastCache * cache)
+{
+	if (cache->htab != NULL)
+		hash_destroy(cache->htab);
+	cache->htab = NULL;
+}
+
+/*
+ * Discard the caches updated by an aborted (sub)transaction.  The top-K
+ * caches are always updated along their previous counters.
+ */
+static void
+powa_last_reset_modified(void)
+{
+	if (powa_last_statements.modified)
+		powa_last_reset(&powa_last_statements);
+	if (powa_last_relations.modified)
+		powa_last_reset(&powa_last_relations);
+	if (powa_topk_statements.last.modified)
+		powa_topk_reset(&powa_topk_statements);
+	if (powa_topk_relations.last.modified)
+		powa_topk_reset(&powa_topk_relations);
+}
+
+/*
+ * Discard the process local caches updated by a transaction or
+ * subtransaction that aborts, as they could otherwise describe records that
+ * were never stored.  The caches the transaction didn't touch are kept.
+ */
+static void
+powa_last_register_callbacks(void)
+{
+	if (powa_last_callbacks_registered)
+		return;
+
+	RegisterXactCallback(powa_last_xact_callback, NULL);
+	RegisterSubXactCallback(powa_last_subxact_callback, NULL);
+	powa_last_callbacks_registered = true;
+}
+
+static void
+powa_last_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT)
+	{
+		powa_last_reset_modified();
+		powa_stream_reset_modified();
+		powa_known_reset_modified();
+		if (powa_sketch.modified)
+			powa_sketch_discard();
+	}
+
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT)
+	{
+		powa_last_statements.modified = false;
+		powa_last_relations.modified = false;
+		powa_topk_statements.last.modified = false;
+		powa_topk_relations.last.modified = false;
+		powa_known_statements.modified = false;
+		powa_known_quals.modified = false;
+		powa_stream_statements.modified = false;
+		powa_stream_statements_db.modified = false;
+		powa_sketch.modified = false;
+	}
+}
+
+static void
+powa_last_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						   SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		powa_last_reset_modified();
+		powa_stream_reset_modified();
+		powa_known_reset_modified();
+		if (powa_sketch.modified)
+			powa_sketch_discard();
+	}
+}
+
+/* Value of a field of a PowaLastEntry, for the top-K metric */
+static inline double
+powa_topk_bits_value(uint64 v, char kind)
+{
+	if (kind == POWA_BLOCK_KIND_FLOAT8)
+		return DatumGetFloat8(powa_bits_to_datum(v, kind));
+
+	return (double) (int64) v;
+}
+
+/*
+ * Start the top-K selection of a snapshot of at most nentries entries, whose
+ * records are described by recdesc.
+ */
+static void
+powa_topk_begin(PowaTopK * topk, PowaTopKCache * cache, TupleDesc recdesc,
+				bool relations, int nentries)
+{
+	const char *names[2];
+	int			nnames = 0;
+	int			i;
+	int			j;
+
+	powa_last_begin(&cache->last);
+
+	if (cache->others == NULL)
+	{
+		HASHCTL		info;
+		int			flags = HASH_ELEM;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(Oid);
+		info.entrysize = sizeof(PowaTopKOther);
+#if PG_VERSION_NUM >= 90500
+		flags |= HASH_BLOBS;
+#else
+		info.hash = oid_hash;
+		flags |= HASH_FUNCTION;
+#endif
+
+		cache->others = hash_create("powa top-k others", 64, &info, flags);
+	}
+
+	switch (powa_top_k_metric)
+	{
+		case POWA_TOP_K_CALLS:
+			names[nnames++] = relations ? "numscan" : "calls";
+			break;
+		case POWA_TOP_K_TOTAL_TIME:
+			if (!relations)
+			{
+				names[nnames++] = "total_time";
+				break;
+			}
+			/* FALLTHROUGH */
+		case POWA_TOP_K_BLOCKS:
+			names[nnames++] = relations ? "blks_read" : "shared_blks_read";
+			names[nnames++] = relations ? "blks_hit" : "shared_blks_hit";
+			break;
+	}
+
+	topk->cache = cache;
+	topk->recdesc = recdesc;
+	topk->nmetric = 0;
+	for (j = 0; j < nnames; j++)
+	{
+		for (i = 1; i < recdesc->natts; i++)
+		{
+			Form_pg_attribute att = TupleDescAttr(recdesc, i);
+
+			if (!att->attisdropped && strcmp(NameStr(att->attname),
+											 names[j]) == 0)
+				break;
+		}
+		if (i >= recdesc->natts)
+			elog(ERROR, "no field \"%s\" for powa.top_k_metric", names[j]);
+		topk->metric[topk->nmetric++] = i;
+	}
+
+	topk->nentries = nentries;
+	topk->entries = palloc0(sizeof(PowaLastEntry *) * Max(nentries, 1));
+	topk->deltas = palloc0(sizeof(double) * Max(nentries, 1));
+	topk->hasprev = palloc0(sizeof(bool) * Max(nentries, 1));
+	topk->kept = palloc0(sizeof(bool) * Max(nentries, 1));
+	topk->heap = palloc(sizeof(PowaTopKCand) * Max(Min(nentries, powa_top_k), 1));
+	topk->nheap = 0;
+}
+
+/*
+ * Compute the increase of the metric of the entry idx of the snapshot since
+ * the previous one, and add it to the heap of the biggest increases.
+ */
+static void
+powa_topk_add(PowaTopK * topk, int idx, PowaLastKey * key, Datum *values,
+			  bool *nulls)
+{
+	PowaLastCache *last = &topk->cache->last;
+	PowaLastEntry *entry;
+	PowaTopKCand cand;
+	bool		found;
+	double		cur = 0;
+	double		prev = 0;
+	int			i;
+
+	entry = (PowaLastEntry *) hash_search(last->htab, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->skipped = false;
+		memset(entry->nulls, true, sizeof(entry->nulls));
+	}
+
+	for (i = 0; i < topk->nmetric; i++)
+	{
+		int			attno = topk->metric[i];
+		char		kind = powa_block_kind(TupleDescAttr(topk->recdesc, attno));
+
+		if (!nulls[attno])
+			cur += powa_topk_bits_value(powa_datum_to_bits(values[attno], kind),
+										kind);
+		if (!entry->nulls[attno - 1])
+			prev += powa_topk_bits_value(entry->values[attno - 1], kind);
+	}
+
+	/*
+	 * An entry not seen at the previous snapshot, or whose counters went
+	 * backward, has been reset since, so all its activity is new.
+	 */
+	topk->hasprev[idx] = (found && entry->generation == last->generation - 1 &&
+						  cur >= prev);
+	entry->generation = last->generation;
+
+	topk->entries[idx] = entry;
+	topk->deltas[idx] = topk->hasprev[idx] ? cur - prev : cur;
+
+	cand.delta = topk->deltas[idx];
+	cand.idx = idx;
+
+	if (topk->nheap < powa_top_k)
+	{
+		/* sift up the new candidate */
+		i = topk->nheap++;
+		while (i > 0 && topk->heap[(i - 1) / 2].delta > cand.delta)
+		{
+			topk->heap[i] = topk->heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		topk->heap[i] = cand;
+	}
+	else if (cand.delta > topk->heap[0].delta)
+	{
+		/* replace the smallest increase, and sift it down */
+		i = 0;
+		for (;;)
+		{
+			int			child = 2 * i + 1;
+
+			if (child >= topk->nheap)
+				break;
+			if (child + 1 < topk->nheap &&
+				topk->heap[child + 1].delta < topk->heap[child].delta)
+				child++;
+			if (topk->heap[child].delta >= cand.delta)
+				break;
+			topk->heap[i] = topk->heap[child];
+			i = child;
+		}
+		topk->heap[i] = cand;
+	}
+}
+
+/*
+ * Choose the entries to store, once all of them have been added: the ones in
+ * the heap that had some activity, and the ones reaching the threshold.
+ */
+static void
+powa_topk_select(PowaTopK * topk)
+{
+	int			i;
+
+	for (i = 0; i < topk->nheap; i++)
+	{
+		if (topk->heap[i].delta > 0)
+			topk->kept[topk->heap[i].idx] = true;
+	}
+
+	if (powa_top_k_threshold > 0)
+	{
+		for (i = 0; i < topk->nentries; i++)
+		{
+			if (topk->entries[i] != NULL &&
+				topk->deltas[i] >= powa_top_k_threshold)
+				topk->kept[i] = true;
+		}
+	}
+}
+
+/*
+ * Check whether the entry idx of the snapshot has to be stored, and remember
+ * its counters.  values and nulls must be the same as given to
+ * powa_topk_add().  The increase of the entries not stored is added to the
+ * "other" entry of their database.  Returns the same actions as
+ * powa_last_check().
+ */
+static PowaLastAction
+powa_topk_check(PowaTopK * topk, int idx, Oid dbid, Datum *values,
+				bool *nulls, Datum *prevvalues, bool *prevnulls)
+{
+	TupleDesc	recdesc = topk->recdesc;
+	PowaLastEntry *entry = topk->entries[idx];
+	bool		hasprev = topk->hasprev[idx];
+	PowaLastAction action = POWA_LAST_STORE;
+	int			i;
+
+	Assert(entry != NULL);
+	Assert(recdesc->natts - 1 <= POWA_LAST_MAX_FIELDS);
+
+	if (!topk->kept[idx])
+	{
+		PowaTopKOther *other;
+		bool		found;
+
+		other = (PowaTopKOther *) hash_search(topk->cache->others, &dbid,
+											  HASH_ENTER, &found);
+		if (!found)
+		{
+			memset(other->values, 0, sizeof(other->values));
+			memset(other->hasvalue, 0, sizeof(other->hasvalue));
+		}
+
+		/* the timestamps can't be accumulated, and are left NULL */
+		for (i = 1; i < recdesc->natts; i++)
+		{
+			char		kind = powa_block_kind(TupleDescAttr(recdesc, i));
+			uint64		cur;
+
+			if (nulls[i] || kind == POWA_BLOCK_KIND_TS)
+				continue;
+
+			cur = powa_datum_to_bits(values[i], kind);
+			if (kind == POWA_BLOCK_KIND_FLOAT8)
+			{
+				float8		acc = powa_topk_bits_value(other->values[i - 1],
+													   kind);
+
+				acc += powa_topk_bits_value(cur, kind);
+				if (hasprev && !entry->nulls[i - 1])
+					acc -= powa_topk_bits_value(entry->values[i - 1], kind);
+				other->values[i - 1] = powa_datum_to_bits(Float8GetDatum(acc),
+														  kind);
+			}
+			else
+			{
+				int64		acc = (int64) other->values[i - 1];
+
+				acc += (int64) cur;
+				if (hasprev && !entry->nulls[i - 1])
+					acc -= (int64) entry->values[i - 1];
+				other->values[i - 1] = (uint64) acc;
+			}
+			other->hasvalue[i - 1] = true;
+		}
+
+		action = POWA_LAST_SKIP;
+	}
+	else if (hasprev && entry->skipped)
+	{
+		prevvalues[0] = TimestampTzGetDatum(topk->cache->last.last_ts);
+		prevnulls[0] = false;
+		for (i = 1; i < recdesc->natts; i++)
+		{
+			prevnulls[i] = entry->nulls[i - 1];
+			prevvalues[i] = prevnulls[i] ? (Datum) 0 :
+				powa_bits_to_datum(entry->values[i - 1],
+								   powa_block_kind(TupleDescAttr(recdesc, i)));
+		}
+		action = POWA_LAST_STORE_PREV;
+	}
+
+	for (i = 1; i < recdesc->natts; i++)
+	{
+		entry->nulls[i - 1] = nulls[i];
+		entry->values[i - 1] = nulls[i] ? 0 :
+			powa_datum_to_bits(values[i],
+							   powa_block_kind(TupleDescAttr(recdesc, i)));
+	}
+	entry->skipped = (action == POWA_LAST_SKIP);
+
+	return action;
+}
+
+/* Build the record of an "other" entry */
+static void
+powa_topk_other_values(PowaTopK * topk, PowaTopKOther * other,
+					   TimestampTz ts, Datum *values, bool *nulls)
+{
+	TupleDesc	recdesc = topk->recdesc;
+	int			i;
+
+	values[0] = TimestampTzGetDatum(ts);
+	nulls[0] = false;
+	for (i = 1; i < recdesc->natts; i++)
+	{
+		nulls[i] = !other->hasvalue[i - 1];
+		values[i] = nulls[i] ? (Datum) 0 :
+			powa_bits_to_datum(other->values[i - 1],
+							   powa_block_kind(TupleDescAttr(recdesc, i)));
+	}
+}
+
+/* End the top-K selection, forgetting about the entries not seen */
+static void
+powa_topk_end(PowaTopK * topk, TimestampTz ts)
+{
+	powa_last_end(&topk->cache->last, ts);
+}
+
+static void
+powa_topk_reset(PowaTopKCache * cache)
+{
+	powa_last_reset(&cache->last);
+	if (cache->others != NULL)
+		hash_destroy(cache->others);
+	cache->others = NULL;
+}
+
+/* Forget the content of a stream, and whether it can be relied on */
+static void
+powa_stream_reset(PowaStreamCache * stream, bool valid)
+{
+	if (stream->cxt != NULL)
+		MemoryContextDelete(stream->cxt);
+	stream->cxt = NULL;
+	stream->htab = NULL;
+	stream->valid = valid;
+	stream->natts = 0;
+	stream->writes = 0;
+	/* a new stream is only valid if the table really was emptied */
+	if (valid)
+	{
+		stream->modified = true;
+		if (powa_shared != NULL)
+		{
+			LWLockAcquire(powa_shared->lock, LW_SHARED);
+			stream->writes = powa_shared->current_writes;
+			LWLockRelease(powa_shared->lock);
+		}
+	}
+}
+
+static void
+powa_stream_reset_all(bool valid)
+{
+	powa_stream_reset(&powa_stream_statements, valid);
+	powa_stream_reset(&powa_stream_statements_db, valid);
+}
+
+/*
+ * Invalidate the streams updated by an aborted (sub)transaction, the next
+ * aggregate then groups the *_current tables.
+ */
+static void
+powa_stream_reset_modified(void)
+{
+	PowaStreamCache *streams[] = {&powa_stream_statements,
+	&powa_stream_statements_db};
+	int			i;
+
+	for (i = 0; i < lengthof(streams); i++)
+	{
+		if (!streams[i]->modified || !streams[i]->valid)
+			continue;
+
+		elog(LOG, "POWA discarding the %s after an error, the next aggregate won't use it",
+			 streams[i]->name);
+		powa_stream_reset(streams[i], false);
+	}
+}
+
+/*
+ * Append a record to the stream of the given key.  Each record is stored as
+ * a bitmap of its NULL fields, followed by the delta of each other field with
+ * its previous value, using the same per-kind encoding as the blocks.
+ */
+static void
+powa_stream_add(PowaStreamCache * stream, PowaLastKey * key,
+				TupleDesc recdesc, Datum *values, bool *nulls)
+{
+	PowaStreamEntry *entry;
+	uint32		nullbits = 0;
+	bool		found;
+	int			i;
+
+	if (!stream->valid)
+		return;
+
+	if (stream->htab == NULL)
+	{
+		HASHCTL		info;
+		int			flags = HASH_ELEM | HASH_CONTEXT;
+
+		if (recdesc->natts > POWA_STREAM_MAX_FIELDS)
+		{
+			powa_stream_reset(stream, false);
+			return;
+		}
+
+		powa_last_register_callbacks();
+
+		stream->cxt = AllocSetContextCreate(TopMemoryContext,
+											stream->name,
+											ALLOCSET_DEFAULT_MINSIZE,
+											ALLOCSET_DEFAULT_INITSIZE,
+											ALLOCSET_DEFAULT_MAXSIZE);
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(PowaLastKey);
+		info.entrysize = sizeof(PowaStreamEntry);
+		info.hcxt = stream->cxt;
+#if PG_VERSION_NUM >= 90500
+		flags |= HASH_BLOBS;
+#else
+		info.hash = tag_hash;
+		flags |= HASH_FUNCTION;
+#endif
+
+		stream->htab = hash_create(stream->name, 1024, &info, flags);
+		stream->natts = recdesc->natts;
+		for (i = 0; i < recdesc->natts; i++)
+			stream->kinds[i] = powa_block_kind(TupleDescAttr(recdesc, i));
+	}
+	else if (recdesc->natts != stream->natts)
+	{
+		powa_stream_reset(stream, false);
+		return;
+	}
+
+	entry = (PowaStreamEntry *) hash_search(stream->htab, key, HASH_ENTER,
+											&found);
+	if (!found)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(stream->cxt);
+
+		initStringInfo(&entry->buf);
+		MemoryContextSwitchTo(oldcxt);
+
+		entry->nsamples = 0;
+		entry->hasvalue = 0;
+		memset(entry->prev, 0, sizeof(entry->prev));
+	}
+
+	for (i = 0; i < stream->natts; i++)
+	{
+		if (nulls[i] || TupleDescAttr(recdesc, i)->attisdropped)
+			nullbits |= ((uint32) 1 << i);
+	}
+	powa_varint_append(&entry->buf, nullbits);
+
+	for (i = 0; i < stream->natts; i++)
+	{
+		char		kind = stream->kinds[i];
+		uint64		v;
+
+		if (nullbits & ((uint32) 1 << i))
+			continue;
+
+		v = powa_datum_to_bits(values[i], kind);
+		if (kind == POWA_BLOCK_KIND_FLOAT8)
+			powa_varint_append(&entry->buf, v ^ entry->prev[i]);
+		else
+			powa_varint_append(&entry->buf, POWA_ZIGZAG(v - entry->prev[i]));
+		entry->prev[i] = v;
+
+		if (!(entry->hasvalue & ((uint32) 1 << i)))
+		{
+			entry->mins[i] = entry->maxs[i] = v;
+			entry->hasvalue |= ((uint32) 1 << i);
+		}
+		else if (powa_bits_lt(v, entry->mins[i], kind))
+			entry->mins[i] = v;
+		else if (powa_bits_lt(entry->maxs[i], v, kind))
+			entry->maxs[i] = v;
+	}
+	entry->nsamples++;
+	stream->modified = true;
+}
+
+/*
+ * Account a write to the statements *_current tables, once the records are
+ * inserted so that the tables are locked until the end of the transaction.
+ * If seen is true, the records were also appended to the streams of this
+ * process, which then stay in sync if they were.
+ */
+static void
+powa_stream_written(bool seen)
+{
+	PowaStreamCache *streams[] = {&powa_stream_statements,
+	&powa_stream_statements_db};
+	int			i;
+
+	if (powa_shared == NULL)
+		return;
+
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < lengthof(streams); i++)
+	{
+		if (seen && streams[i]->valid &&
+			streams[i]->writes == powa_shared->current_writes)
+			streams[i]->writes++;
+	}
+	powa_shared->current_writes++;
+	LWLockRelease(powa_shared->lock);
+}
+
+/*
+ * Check that a stream saw all the records currently stored in the given
+ * *_current table.  The table is first locked until the end of the
+ * transaction, so that the writers still in progress are accounted and no
+ * record can be added before it's emptied.  Must be called in an SPI
+ * connection.
+ */
+static bool
+powa_stream_matches(PowaStreamCache * stream, const char *relname)
+{
+	StringInfoData buf;
+	bool		matches;
+	int			ret;
+
+	if (!stream->valid || powa_shared == NULL)
+		return false;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "LOCK TABLE %s IN SHARE MODE",
+					 quote_identifier(relname));
+	ret = SPI_execute(buf.data, false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "could not lock %s: %s", relname,
+			 SPI_result_code_string(ret));
+	pfree(buf.data);
+
+	LWLockAcquire(powa_shared->lock, LW_SHARED);
+	matches = (stream->writes == powa_shared->current_writes);
+	LWLockRelease(powa_shared->lock);
+
+	return matches;
+}
+
+/*
+ * Insert the content of a stream in the given history table, whose columns
+ * are the nkeys keys of the stream (queryid, dbid and userid, or dbid),
+ * coalesce_range, records, mins_in_range and maxs_in_range.  The rows go
+ * through the executor, as history tables have indexes and can be
+ * partitioned.  Must be called in an SPI connection.  Returns the number of
+ * inserted rows.
+ */
+static int64
+powa_stream_flush(PowaStreamCache * stream, const char *relname, int nkeys)
+{
+	Relation	rel;
+	Oid			reltype;
+	TupleDesc	reldesc;
+	TupleDesc	recdesc;
+	TypeCacheEntry *typcache;
+	MemoryContext tmpcxt;
+	HASH_SEQ_STATUS hash_seq;
+	PowaStreamEntry *entry;
+	StringInfoData cols;
+	StringInfoData fields;
+	StringInfoData query;
+	Datum	   *rows;
+	Datum	   *values;
+	bool	   *nulls;
+	Oid			argtype;
+	Datum		arg;
+	int			nrows = 0;
+	int			ret;
+	int			i;
+
+	if (stream->htab == NULL || hash_get_num_entries(stream->htab) == 0)
+		return 0;
+
+	rel = table_open(RangeVarGetRelid(makeRangeVar(NULL, (char *) relname, -1),
+									  AccessShareLock, false),
+					 NoLock);
+	reltype = rel->rd_rel->reltype;
+	reldesc = RelationGetDescr(rel);
+
+	/* generated columns, like the partitioning key, are computed on insert */
+	initStringInfo(&cols);
+	initStringInfo(&fields);
+	for (i = 0; i < reldesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(reldesc, i);
+		const char *attname = quote_identifier(NameStr(att->attname));
+
+		if (att->attisdropped)
+			continue;
+#if PG_VERSION_NUM >= 120000
+		if (att->attgenerated)
+			continue;
+#endif
+		appendStringInfo(&cols, "%s%s", cols.len > 0 ? ", " : "", attname);
+		appendStringInfo(&fields, "%sh.%s", fields.len > 0 ? ", " : "",
+						 attname);
+	}
+
+	reldesc = CreateTupleDescCopy(reldesc);
+	table_close(rel, NoLock);
+
+	if (reldesc->natts < nkeys + 4 ||
+		TupleDescAttr(reldesc, nkeys)->atttypid != TSTZRANGEOID)
+		elog(ERROR, "unexpected layout for %s", relname);
+
+	recdesc = lookup_rowtype_tupdesc_copy(TupleDescAttr(reldesc, nkeys + 2)->atttypid,
+										  TupleDescAttr(reldesc, nkeys + 2)->atttypmod);
+	if (recdesc->natts != stream->natts)
+		elog(ERROR, "unexpected layout for %s", relname);
+	for (i = 0; i < recdesc->natts; i++)
+	{
+		if (powa_block_kind(TupleDescAttr(recdesc, i)) != stream->kinds[i])
+			elog(ERROR, "unexpected type for field \"%s\" of %s",
+				 NameStr(TupleDescAttr(recdesc, i)->attname), relname);
+	}
+
+	typcache = lookup_type_cache(TSTZRANGEOID, TYPECACHE_RANGE_INFO);
+	rows = palloc(sizeof(Datum) * hash_get_num_entries(stream->htab));
+	values = palloc(sizeof(Datum) * reldesc->natts);
+	nulls = palloc(sizeof(bool) * reldesc->natts);
+	tmpcxt = AllocSetContextCreate(CurrentMemoryContext,
+								   "powa stream flush",
+								   ALLOCSET_DEFAULT_MINSIZE,
+								   ALLOCSET_DEFAULT_INITSIZE,
+								   ALLOCSET_DEFAULT_MAXSIZE);
+
+	hash_seq_init(&hash_seq, stream->htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		PowaBlockColumns *block;
+		MemoryContext oldcxt;
+		RangeBound	lower;
+		RangeBound	upper;
+		Datum		minvalues[POWA_STREAM_MAX_FIELDS];
+		bool		minnulls[POWA_STREAM_MAX_FIELDS];
+		Datum		maxvalues[POWA_STREAM_MAX_FIELDS];
+		bool		maxnulls[POWA_STREAM_MAX_FIELDS];
+		uint64		prev[POWA_STREAM_MAX_FIELDS];
+		const char *p = entry->buf.data;
+		const char *end = entry->buf.data + entry->buf.len;
+		int			s;
+		int			j;
+
+		oldcxt = MemoryContextSwitchTo(tmpcxt);
+
+		block = powa_block_columns_init(recdesc, entry->nsamples);
+		memset(prev, 0, sizeof(prev));
+		for (s = 0; s < entry->nsamples; s++)
+		{
+			uint64		nullbits = powa_varint_read(&p, end);
+
+			for (j = 0; j < block->ncols; j++)
+			{
+				block->nulls[j][s] = (nullbits & ((uint32) 1 << j)) != 0;
+				if (block->nulls[j][s])
+				{
+					block->values[j][s] = 0;
+					continue;
+				}
+
+				if (block->kinds[j] == POWA_BLOCK_KIND_FLOAT8)
+					prev[j] ^= powa_varint_read(&p, end);
+				else
+					prev[j] += POWA_UNZIGZAG(powa_varint_read(&p, end));
+				block->values[j][s] = prev[j];
+			}
+		}
+		block->nsamples = entry->nsamples;
+
+		for (j = 0; j < recdesc->natts; j++)
+		{
+			minnulls[j] = maxnulls[j] = !(entry->hasvalue & ((uint32) 1 << j));
+			minvalues[j] = minnulls[j] ? (Datum) 0 :
+				powa_bits_to_datum(entry->mins[j], stream->kinds[j]);
+			maxvalues[j] = maxnulls[j] ? (Datum) 0 :
+				powa_bits_to_datum(entry->maxs[j], stream->kinds[j]);
+		}
+
+		memset(nulls, true, sizeof(bool) * reldesc->natts);
+		if (nkeys == 3)
+		{
+			values[0] = Int64GetDatum((int64) entry->key.id);
+			values[1] = ObjectIdGetDatum(entry->key.dbid);
+			values[2] = ObjectIdGetDatum(entry->key.userid);
+		}
+		else
+			values[0] = ObjectIdGetDatum(entry->key.dbid);
+
+		/* the timestamp is never NULL */
+		lower.val = minvalues[0];
+		lower.infinite = false;
+		lower.inclusive = true;
+		lower.lower = true;
+		upper.val = maxvalues[0];
+		upper.infinite = false;
+		upper.inclusive = true;
+		upper.lower = false;
+#if PG_VERSION_NUM >= 160000
+		values[nkeys] = RangeTypePGetDatum(make_range(typcache, &lower, &upper,
+													  false, NULL));
+#else
+		values[nkeys] = RangeTypePGetDatum(make_range(typcache, &lower, &upper,
+													  false));
+#endif
+		values[nkeys + 1] = PointerGetDatum(powa_block_encode(block));
+		values[nkeys + 2] = HeapTupleGetDatum(heap_form_tuple(recdesc,
+															  minvalues,
+															  minnulls));
+		values[nkeys + 3] = HeapTupleGetDatum(heap_form_tuple(recdesc,
+															  maxvalues,
+															  maxnulls));
+		for (j = 0; j < nkeys + 4; j++)
+			nulls[j] = false;
+
+		MemoryContextSwitchTo(oldcxt);
+
+		rows[nrows++] = HeapTupleGetDatum(heap_form_tuple(reldesc, values,
+														  nulls));
+		MemoryContextReset(tmpcxt);
+	}
+
+	MemoryContextDelete(tmpcxt);
+
+	argtype = get_array_type(reltype);
+	arg = PointerGetDatum(construct_array(rows, nrows, reltype, -1, false,
+										  'd'));
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "INSERT INTO %s (%s) SELECT %s FROM unnest($1) h",
+					 quote_identifier(relname), cols.data, fields.data);
+	ret = SPI_execute_with_args(query.data, 1, &argtype, &arg, NULL, false, 0);
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "could not insert in %s: %s", relname,
+			 SPI_result_code_string(ret));
+
+	return (int64) SPI_processed;
+}
+
+/*
+ * Flush the running aggregates of the native statements snapshot in the
+ * history tables, and empty the *_current tables.  Returns the number of
+ * inserted rows, or -1 if the running aggregates can't be used and the caller
+ * has to aggregate the *_current tables itself.
+ */
+Datum
+powa_statements_aggregate_native(PG_FUNCTION_ARGS)
+{
+	int64		nrows;
+	int			ret;
+
+	/* the maintenance worker doesn't have the collector's running aggregates */
+	if (!powa_streaming_aggregate || powa_maintenance_worker)
+		PG_RETURN_INT64(-1);
+
+	SPI_connect();
+
+	if (!powa_stream_matches(&powa_stream_statements,
+							 "powa_statements_history_current") ||
+		!powa_stream_matches(&powa_stream_statements_db,
+							 "powa_statements_history_current_db"))
+	{
+		SPI_finish();
+		powa_stream_reset_all(false);
+		PG_RETURN_INT64(-1);
+	}
+
+	nrows = powa_stream_flush(&powa_stream_statements,
+							  "powa_statements_history", 3);
+	nrows += powa_stream_flush(&powa_stream_statements_db,
+							   "powa_statements_history_db", 1);
+
+	ret = SPI_execute("TRUNCATE powa_statements_history_current", false, 0);
+	if (ret == SPI_OK_UTILITY)
+		ret = SPI_execute("TRUNCATE powa_statements_history_current_db",
+						  false, 0);
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "could not empty the statements *_current tables: %s",
+			 SPI_result_code_string(ret));
+
+	SPI_finish();
+
+	powa_stream_reset_all(true);
+
+	PG_RETURN_INT64(nrows);
+}
+
+/*
+ * Start new running aggregates, once powa_statements_aggregate() emptied the
+ * statements *_current tables.
+ */
+Datum
+powa_statements_stream_reset(PG_FUNCTION_ARGS)
+{
+	powa_stream_reset_all(true);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Tell the running aggregates of all the processes that the statements
+ * *_current tables were modified without them.
+ */
+Datum
+powa_statements_stream_invalidate(PG_FUNCTION_ARGS)
+{
+	powa_stream_written(false);
+
+	PG_RETURN_VOID();
+}
+
+/* state of the native relations snapshot */
+typedef struct PowaRelationsState
+{
+	Oid			dbid;			/* database being processed */
+	TimestampTz ts;
+	TupleDesc	reldesc;
+	TupleDesc	recdesc;
+	HeapTuple  *tuples;
+	int			ntuples;
+	int			capacity;
+	PowaLastCache *last;
+	PowaTopKCache *topkcache;
+	/* records buffered for the top-K selection */
+	Oid		   *dbids;
+	Oid		   *relids;
+	HeapTuple  *records;
+	int			nrecords;
+	int			reccapacity;
+	Datum		recvalues[POWA_STAT_TAB_COLS];
+	bool		recnulls[POWA_STAT_TAB_COLS];
+	Datum		prevvalues[POWA_STAT_TAB_COLS];
+	bool		prevnulls[POWA_STAT_TAB_COLS];
+}	PowaRelationsState;
+
+static void
+powa_relations_callback(Oid dbid, Datum *values, bool *nulls, void *arg)
+{
+	PowaRelationsState *state = (PowaRelationsState *) arg;
+	Datum		relvalues[3];
+	bool		relnulls[3] = {false, false, false};
+	int			i;
+
+	state->dbid = dbid;
+
+	/* values[0] is the relid, the counters follow as in the record */
+	state->recvalues[0] = TimestampTzGetDatum(state->ts);
+	state->recnulls[0] = false;
+	for (i = 1; i < POWA_STAT_TAB_COLS; i++)
+	{
+		state->recvalues[i] = values[i];
+		state->recnulls[i] = nulls[i];
+	}
+
+	if (state->topkcache != NULL)
+	{
+		if (state->nrecords >= state->reccapacity)
+		{
+			state->reccapacity *= 2;
+			state->dbids = repalloc(state->dbids,
+									sizeof(Oid) * state->reccapacity);
+			state->relids = repalloc(state->relids,
+									 sizeof(Oid) * state->reccapacity);
+			state->records = repalloc(state->records,
+									  sizeof(HeapTuple) * state->reccapacity);
+		}
+		state->dbids[state->nrecords] = dbid;
+		state->relids[state->nrecords] = DatumGetObjectId(values[0]);
+		state->records[state->nrecords] = heap_form_tuple(state->recdesc,
+														  state->recvalues,
+														  state->recnulls);
+		state->nrecords++;
+		return;
+	}
+
+	if (state->ntuples + 2 > state->capacity)
+	{
+		state->capacity *= 2;
+		state->tuples = repalloc(state->tuples,
+								 sizeof(HeapTuple) * state->capacity);
+	}
+
+	relvalues[0] = ObjectIdGetDatum(state->dbid);
+	relvalues[1] = values[0];
+
+	if (state->last != NULL)
+	{
+		PowaLastKey key;
+
+		key.id = (uint64) DatumGetObjectId(values[0]);
+		key.dbid = state->dbid;
+		key.userid = InvalidOid;
+
+		switch (powa_last_check(state->last, &key, state->recdesc,
+								state->recvalues, state->recnulls,
+								state->prevvalues, state->prevnulls))
+		{
+			case POWA_LAST_SKIP:
+				return;
+			case POWA_LAST_STORE_PREV:
+				relvalues[2] = HeapTupleGetDatum(heap_form_tuple(state->recdesc,
+														   state->prevvalues,
+														   state->prevnulls));
+				state->tuples[state->ntuples++] = heap_form_tuple(state->reldesc,
+															  relvalues,
+															  relnulls);
+				break;
+			case POWA_LAST_STORE:
+				break;
+		}
+	}
+
+	relvalues[2] = HeapTupleGetDatum(heap_form_tuple(state->recdesc,
+													 state->recvalues,
+													 state->recnulls));
+	state->tuples[state->ntuples++] = heap_form_tuple(state->reldesc,
+													  relvalues, relnulls);
+}
+
+/*
+ * Store the relations buffered by powa_relations_callback() for powa.top_k,
+ * folding the ones not in the top K in the "other" entry of their database.
+ */
+static void
+powa_relations_topk_store(PowaRelationsState * state)
+{
+	PowaTopK	topk;
+	HASH_SEQ_STATUS hash_seq;
+	PowaTopKOther *other;
+	Datum		relvalues[3];
+	bool		relnulls[3] = {false, false, false};
+	int			pass;
+	int			i;
+
+	powa_topk_begin(&topk, state->topkcache, state->recdesc, true,
+					state->nrecords);
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (i = 0; i < state->nrecords; i++)
+		{
+			PowaLastKey key;
+
+			heap_deform_tuple(state->records[i], state->recdesc,
+							  state->recvalues, state->recnulls);
+
+			key.id = (uint64) state->relids[i];
+			key.dbid = state->dbids[i];
+			key.userid = InvalidOid;
+
+			if (pass == 0)
+			{
+				powa_topk_add(&topk, i, &key, state->recvalues,
+							  state->recnulls);
+				continue;
+			}
+
+			relvalues[0] = ObjectIdGetDatum(state->dbids[i]);
+			relvalues[1] = ObjectIdGetDatum(state->relids[i]);
+
+			switch (powa_topk_check(&topk, i, key.dbid, state->recvalues,
+									state->recnulls, state->prevvalues,
+									state->prevnulls))
+			{
+				case POWA_LAST_SKIP:
+					continue;
+				case POWA_LAST_STORE_PREV:
+					relvalues[2] = HeapTupleGetDatum(heap_form_tuple(state->recdesc,
+															   state->prevvalues,
+															   state->prevnulls));
+					state->tuples[state->ntuples++] = heap_form_tuple(state->reldesc,
+																  relvalues,
+																  relnulls);
+					break;
+				case POWA_LAST_STORE:
+					break;
+			}
+
+			relvalues[2] = HeapTupleGetDatum(state->records[i]);
+			state->tuples[state->ntuples++] = heap_form_tuple(state->reldesc,
+															  relvalues,
+															  relnulls);
+		}
+
+		if (pass == 0)
+		{
+			powa_topk_select(&topk);
+
+			/* each relation can require its previous sample too */
+			state->capacity = state->ntuples + 2 * state->nrecords +
+				hash_get_num_entries(state->topkcache->others) + 1;
+			state->tuples = repalloc(state->tuples,
+									 sizeof(HeapTuple) * state->capacity);
+		}
+	}
+
+	hash_seq_init(&hash_seq, state->topkcache->others);
+	while ((other = hash_seq_search(&hash_seq)) != NULL)
+	{
+		/* the "other" bucket may have appeared during the second pass */
+		if (state->ntuples >= state->capacity)
+		{
+			state->capacity *= 2;
+			state->tuples = repalloc(state->tuples,
+									 sizeof(HeapTuple) * state->capacity);
+		}
+
+		relvalues[0] = ObjectIdGetDatum(other->dbid);
+		relvalues[1] = ObjectIdGetDatum(InvalidOid);
+		powa_topk_other_values(&topk, other, state->ts, state->recvalues,
+							   state->recnulls);
+		relvalues[2] = HeapTupleGetDatum(heap_form_tuple(state->recdesc,
+														 state->recvalues,
+														 state->recnulls));
+		state->tuples[state->ntuples++] = heap_form_tuple(state->reldesc,
+														  relvalues, relnulls);
+	}
+
+	powa_topk_end(&topk, state->ts);
+}
+
+/*
+ * Native version of powa_all_relations_snapshot().  Returns the number of
+ * stored rows.
+ */
+Datum
+powa_all_relations_snapshot_native(PG_FUNCTION_ARGS)
+{
+	PowaRelationsState state;
+	Relation	rel;
+	Oid		   *dbids;
+	int			ndbs;
+
+	/* the top-K selection has its own cache of the previous counters */
+	if (powa_store_unchanged || powa_top_k > 0)
+		powa_last_reset(&powa_last_relations);
+	if (powa_top_k == 0)
+		powa_topk_reset(&powa_topk_relations);
+
+	SPI_connect();
+
+	dbids = powa_get_dbids(&ndbs);
+
+	rel = powa_open_current_table("powa_all_relations_history_current");
+
+	memset(&state, 0, sizeof(state));
+	state.ts = GetCurrentTransactionStartTimestamp();
+	state.reldesc = RelationGetDescr(rel);
+	state.recdesc = powa_current_record_tupdesc(rel);
+	state.capacity = 1024;
+	state.tuples = palloc(sizeof(HeapTuple) * state.capacity);
+	state.last = (powa_store_unchanged || powa_top_k > 0) ? NULL :
+		&powa_last_relations;
+	state.topkcache = (powa_top_k > 0) ? &powa_topk_relations : NULL;
+	if (state.topkcache != NULL)
+	{
+		state.reccapacity = 1024;
+		state.dbids = palloc(sizeof(Oid) * state.reccapacity);
+		state.relids = palloc(sizeof(Oid) * state.reccapacity);
+		state.records = palloc(sizeof(HeapTuple) * state.reccapacity);
+	}
+
+	if (state.reldesc->natts != 3 ||
+		state.recdesc->natts != POWA_STAT_TAB_COLS)
+		elog(ERROR, "unexpected layout for powa_all_relations_history_current");
+
+	if (state.last != NULL)
+		powa_last_begin(state.last);
+
+	powa_stat_fetch_all(dbids, ndbs, POWA_STAT_TABLE, powa_relations_callback,
+						&state);
+
+	if (state.topkcache != NULL)
+		powa_relations_topk_store(&state);
+
+	powa_multi_insert(rel, state.tuples, state.ntuples);
+	table_close(rel, NoLock);
+
+	if (state.last != NULL)
+		powa_last_end(state.last, state.ts);
+
+	SPI_finish();
+
+	PG_RETURN_INT64((int64) state.ntuples);
+}
+
+/*
+ * Shared memory handling
+ */
+
+#if PG_VERSION_NUM >= 150000
+static void
+powa_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	powa_shmem_request_space();
+}
+#endif
+
+static void
+powa_shmem_request_space(void)
+{
+	RequestAddinShmemSpace(powa_memsize());
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("powa", 1);
+#else
+	RequestAddinLWLocks(1);
+#endif
+}
+
+static int
+powa_recent_maxentries(void)
+{
+	return powa_recent_max_databases * (1 + powa_recent_top_queries);
+}
+
+static Size
+powa_recent_slotsize(void)
+{
+	return MAXALIGN(add_size(offsetof(PowaRecentSlot, entries),
+							 mul_size(sizeof(PowaRecentEntry),
+									  powa_recent_maxentries())));
+}
+
+static Size
+powa_sample_slotsize(void)
+{
+	return MAXALIGN(add_size(offsetof(PowaSampleSlot, entries),
+							 mul_size(sizeof(PowaSampleEntry),
+									  powa_recent_max_databases)));
+}
+
+static Size
+powa_memsize(void)
+{
+	Size		size;
+
+	size = add_size(MAXALIGN(sizeof(PowaSharedState)),
+					mul_size(powa_recent_slotsize(), powa_recent_samples_n));
+
+	return add_size(size, mul_size(powa_sample_slotsize(),
+								   powa_high_frequency_samples));
+}
+
+static void
+powa_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	/* reset in case this is a restart within the postmaster */
+	powa_shared = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	powa_shared = ShmemInitStruct("powa", powa_memsize(), &found);
+
+	if (!found)
+	{
+#if PG_VERSION_NUM >= 90600
+		powa_shared->lock = &(GetNamedLWLockTranche("powa"))->lock;
+#else
+		powa_shared->lock = LWLockAssign();
+#endif
+		powa_shared->nslots = powa_recent_samples_n;
+		powa_shared->maxentries = powa_recent_maxentries();
+		powa_shared->slotsize = powa_recent_slotsize();
+		powa_shared->head = -1;
+		powa_shared->ncollector = 0;
+		powa_shared->aggregate_requested = false;
+		powa_shared->purge_requested = false;
+		powa_shared->maintenance_latch = NULL;
+		powa_shared->nsampleslots = powa_high_frequency_samples;
+		powa_shared->sampleslotsize = powa_sample_slotsize();
+		powa_shared->samplehead = -1;
+		powa_shared->current_writes = 0;
+		powa_shared->startup_ts = GetCurrentTimestamp();
+
+		for (i = 0; i < powa_shared->nslots; i++)
+		{
+			PowaRecentSlot *slot = POWA_RECENT_SLOT(powa_shared, i);
+
+			slot->seq = 0;
+			slot->ts = 0;
+			slot->nentries = 0;
+		}
+
+		for (i = 0; i < powa_shared->nsampleslots; i++)
+		{
+			PowaSampleSlot *slot = POWA_SAMPLE_SLOT(powa_shared, i);
+
+			slot->seq = 0;
+			slot->ts = 0;
+			slot->nentries = 0;
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Return when powa's shared memory was initialized, or NULL if powa isn't in
+ * shared_preload_libraries.  Unlike pg_postmaster_start_time(), it changes
+ * when the shared memory is reinitialized after a backend crash, which also
+ * resets the unlogged tables.
+ */
+Datum
+powa_shmem_startup_time(PG_FUNCTION_ARGS)
+{
+	if (powa_shared == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_TIMESTAMPTZ(powa_shared->startup_ts);
+}
+
+/* Save the counters of a deformed record in a ring entry */
+static void
+powa_recent_fill_entry(PowaRecentEntry * entry, TupleDesc recdesc,
+					   Datum *values, bool *nulls)
+{
+	int			i;
+
+	Assert(recdesc->natts - 1 <= POWA_STATEMENTS_COUNTERS);
+
+	entry->nulls = 0;
+	memset(entry->counters, 0, sizeof(entry->counters));
+	for (i = 1; i < recdesc->natts; i++)
+	{
+		if (nulls[i])
+			entry->nulls |= (1 << (i - 1));
+		else if (TupleDescAttr(recdesc, i)->atttypid == FLOAT8OID)
+			entry->counters[i - 1].f = DatumGetFloat8(values[i]);
+		else
+			entry->counters[i - 1].i = DatumGetInt64(values[i]);
+	}
+}
+
+/* order the candidates by database, and then by descending total_time */
+static int
+powa_recent_cand_cmp(const void *a, const void *b)
+{
+	const PowaRecentEntry *ea = (const PowaRecentEntry *) a;
+	const PowaRecentEntry *eb = (const PowaRecentEntry *) b;
+	bool		anull = (ea->nulls & (1 << 1)) != 0;
+	bool		bnull = (eb->nulls & (1 << 1)) != 0;
+
+	if (ea->dbid != eb->dbid)
+		return (ea->dbid < eb->dbid) ? -1 : 1;
+
+	/* total_time is the 2nd counter, NULLs last */
+	if (anull || bnull)
+		return (anull == bnull) ? 0 : (anull ? 1 : -1);
+	if (ea->counters[1].f != eb->counters[1].f)
+		return (ea->counters[1].f > eb->counters[1].f) ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Save a snapshot in the shared memory ring: the per-database sums, and the
+ * top statements of each database among the candidates.
+ */
+static void
+powa_recent_store(TimestampTz ts, HTAB *dbsums, PowaRecentEntry * cands,
+				  int ncands)
+{
+	PowaRecentEntry *entries;
+	PowaRecentSlot *slot;
+	int			nentries = 0;
+	int			ndbs = 0;
+	int			idx;
+	int			i = 0;
+
+	Assert(powa_shared != NULL);
+
+	/* build the whole slot content locally, to keep the slot busy shortly */
+	entries = palloc(sizeof(PowaRecentEntry) * powa_shared->maxentries);
+
+	qsort(cands, ncands, sizeof(PowaRecentEntry), powa_recent_cand_cmp);
+
+	while (i < ncands && ndbs < powa_recent_max_databases)
+	{
+		Oid			dbid = cands[i].dbid;
+		PowaDbSumsEntry *dbentry;
+		PowaRecentEntry *entry;
+		int			k;
+
+		dbentry = (PowaDbSumsEntry *) hash_search(dbsums, &dbid, HASH_FIND,
+												  NULL);
+		Assert(dbentry != NULL);
+
+		entry = &entries[nentries++];
+		entry->dbid = dbid;
+		entry->userid = InvalidOid;
+		entry->queryid = 0;
+		entry->isdb = true;
+		entry->nulls = 0;
+		for (k = 0; k < POWA_STATEMENTS_COUNTERS; k++)
+		{
+			entry->counters[k] = dbentry->counters[k];
+			if (!dbentry->hasvalue[k])
+				entry->nulls |= (1 << k);
+		}
+		ndbs++;
+
+		for (k = 0; i < ncands && cands[i].dbid == dbid; i++, k++)
+		{
+			if (k < powa_recent_top_queries)
+				entries[nentries++] = cands[i];
+		}
+	}
+
+	Assert(nentries <= powa_shared->maxentries);
+
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+
+	idx = (powa_shared->head + 1) % powa_shared->nslots;
+	slot = POWA_RECENT_SLOT(powa_shared, idx);
+
+	slot->seq++;
+	pg_write_barrier();
+
+	slot->ts = ts;
+	slot->nentries = nentries;
+	memcpy(slot->entries, entries, sizeof(PowaRecentEntry) * nentries);
+
+	pg_write_barrier();
+	slot->seq++;
+
+	pg_write_barrier();
+	powa_shared->head = idx;
+
+	LWLockRelease(powa_shared->lock);
+
+	pfree(entries);
+}
+
+/*
+ * Get a consistent copy of the i-th most recent slot of the ring, or NULL if
+ * there's no such slot.
+ */
+static PowaRecentSlot *
+powa_recent_read_slot(int i)
+{
+	PowaSharedState *state = powa_shared;
+	PowaRecentSlot *copy;
+	int			head;
+
+	head = ((volatile PowaSharedState *) state)->head;
+	pg_read_barrier();
+
+	if (head < 0 || i >= state->nslots)
+		return NULL;
+
+	copy = palloc(state->slotsize);
+
+	for (;;)
+	{
+		volatile PowaRecentSlot *slot;
+		uint32		before;
+		uint32		after;
+
+		slot = POWA_RECENT_SLOT(state, (head - i + state->nslots) % state->nslots);
+
+		before = slot->seq;
+		pg_read_barrier();
+
+		if ((before & 1) == 0)
+		{
+			int			nentries = slot->nentries;
+
+			if (nentries < 0 || nentries > state->maxentries)
+				nentries = 0;
+
+			copy->ts = slot->ts;
+			copy->nentries = nentries;
+			memcpy(copy->entries, (PowaRecentEntry *) slot->entries,
+				   sizeof(PowaRecentEntry) * nentries);
+
+			pg_read_barrier();
+			after = slot->seq;
+
+			if (before == after)
+				break;
+		}
+
+		/* the slot is being written, try again */
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	if (copy->ts == 0)
+	{
+		pfree(copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+/* Form a powa_statements_history_record from a ring entry */
+static Datum
+powa_recent_entry_record(PowaRecentEntry * entry, TimestampTz ts,
+						 TupleDesc recdesc)
+{
+	Datum		values[POWA_STATEMENTS_COUNTERS + 1];
+	bool		nulls[POWA_STATEMENTS_COUNTERS + 1];
+	int			i;
+
+	values[0] = TimestampTzGetDatum(ts);
+	nulls[0] = false;
+	for (i = 1; i < recdesc->natts; i++)
+	{
+		nulls[i] = (entry->nulls & (1 << (i - 1))) != 0;
+		if (TupleDescAttr(recdesc, i)->atttypid == FLOAT8OID)
+			values[i] = Float8GetDatum(entry->counters[i - 1].f);
+		else
+			values[i] = Int64GetDatum(entry->counters[i - 1].i);
+	}
+
+	return HeapTupleGetDatum(heap_form_tuple(recdesc, values, nulls));
+}
+
+static Datum
+powa_recent_common(FunctionCallInfo fcinfo, bool dbonly)
+{
+	Oid			dbid = dbonly ? InvalidOid : PG_GETARG_OID(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	TupleDesc	recdesc;
+	Tuplestorestate *tupstore;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (powa_shared == NULL || powa_shared->nslots == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recent samples are not available"),
+				 errhint("Set powa.recent_samples to a positive value and restart the server.")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* the record is always the last column */
+	recdesc = lookup_rowtype_tupdesc_copy(
+						TupleDescAttr(tupdesc, tupdesc->natts - 1)->atttypid,
+										  -1);
+	if (recdesc->natts != POWA_STATEMENTS_COUNTERS + 1)
+		elog(ERROR, "unexpected record type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* return the samples in chronological order */
+	for (i = powa_shared->nslots - 1; i >= 0; i--)
+	{
+		PowaRecentSlot *slot = powa_recent_read_slot(i);
+		int			j;
+
+		if (slot == NULL)
+			continue;
+
+		for (j = 0; j < slot->nentries; j++)
+		{
+			PowaRecentEntry *entry = &slot->entries[j];
+			Datum		values[3];
+			bool		nulls[3] = {false, false, false};
+
+			if (dbonly)
+			{
+				if (!entry->isdb)
+					continue;
+
+				values[0] = ObjectIdGetDatum(entry->dbid);
+				values[1] = powa_recent_entry_record(entry, slot->ts, recdesc);
+			}
+			else
+			{
+				if (entry->dbid != dbid)
+					continue;
+
+				/* database totals have NULL queryid and userid */
+				if (entry->isdb)
+					nulls[0] = nulls[1] = true;
+				else
+				{
+					values[0] = Int64GetDatum(entry->queryid);
+					values[1] = ObjectIdGetDatum(entry->userid);
+				}
+				values[2] = powa_recent_entry_record(entry, slot->ts, recdesc);
+			}
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+
+		pfree(slot);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the recent samples of the given database kept in shared memory: the
+ * database totals, with NULL queryid and userid, and the top statements.
+ */
+Datum
+powa_recent_samples(PG_FUNCTION_ARGS)
+{
+	return powa_recent_common(fcinfo, false);
+}
+
+/* Return the recent per-database totals kept in shared memory */
+Datum
+powa_recent_samples_db(PG_FUNCTION_ARGS)
+{
+	return powa_recent_common(fcinfo, true);
+}
+
+/*
+ * High frequency samples
+ */
+
+/* Get the status of the i-th backend, starting at 1, or NULL */
+static PgBackendStatus *
+powa_sample_beentry(int i)
+{
+#if PG_VERSION_NUM >= 160000
+	LocalPgBackendStatus *local = pgstat_get_local_beentry_by_index(i);
+
+	return (local == NULL) ? NULL : &local->backendStatus;
+#elif PG_VERSION_NUM >= 90500
+	LocalPgBackendStatus *local = pgstat_fetch_stat_local_beentry(i);
+
+	return (local == NULL) ? NULL : &local->backendStatus;
+#else
+	return pgstat_fetch_stat_beentry(i);
+#endif
+}
+
+/*
+ * Take a high frequency sample and save it in the shared memory ring.  Must
+ * be called in a transaction.
+ */
+static void
+powa_sample_take(void)
+{
+	PowaSampleEntry *entries;
+	PowaSampleSlot *slot;
+	TimestampTz ts = GetCurrentTimestamp();
+	int			nentries = 0;
+	int			nbackends;
+	int			idx;
+	int			i;
+
+	Assert(powa_shared != NULL && powa_shared->nsampleslots > 0);
+
+	/* build the whole slot content locally, to keep the slot busy shortly */
+	entries = palloc0(sizeof(PowaSampleEntry) * powa_recent_max_databases);
+
+	pgstat_clear_snapshot();
+
+	nbackends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= nbackends; i++)
+	{
+		PgBackendStatus *beentry = powa_sample_beentry(i);
+		PowaSampleEntry *entry = NULL;
+		int			j;
+
+		/* only count the backends connected to a database, but ourself */
+		if (beentry == NULL || !OidIsValid(beentry->st_databaseid) ||
+			beentry->st_procpid == MyProcPid)
+			continue;
+
+		for (j = 0; j < nentries; j++)
+		{
+			if (entries[j].dbid == beentry->st_databaseid)
+			{
+				entry = &entries[j];
+				break;
+			}
+		}
+
+		if (entry == NULL)
+		{
+			if (nentries >= powa_recent_max_databases)
+				continue;
+
+			entry = &entries[nentries++];
+			entry->dbid = beentry->st_databaseid;
+		}
+
+		entry->backends++;
+		if (beentry->st_state == STATE_RUNNING)
+		{
+#if PG_VERSION_NUM >= 90600
+			PGPROC	   *proc = BackendPidGetProc(beentry->st_procpid);
+
+			if (proc != NULL && proc->wait_event_info != 0)
+				entry->waiting++;
+#endif
+			entry->active++;
+		}
+		else if (beentry->st_state == STATE_IDLEINTRANSACTION ||
+				 beentry->st_state == STATE_IDLEINTRANSACTION_ABORTED)
+			entry->idle_in_xact++;
+	}
+
+#if PG_VERSION_NUM >= 150000
+	/* the statistics are in shared memory, so they're cheap to read */
+	for (i = 0; i < nentries; i++)
+	{
+		PgStat_StatDBEntry *dbentry;
+		int64	   *counters = entries[i].counters;
+
+		dbentry = pgstat_fetch_stat_dbentry(entries[i].dbid);
+		if (dbentry == NULL)
+			continue;
+
+		entries[i].hascounters = true;
+		counters[0] = dbentry->xact_commit;
+		counters[1] = dbentry->xact_rollback;
+		counters[2] = dbentry->blocks_fetched - dbentry->blocks_hit;
+		counters[3] = dbentry->blocks_hit;
+		counters[4] = dbentry->tuples_returned;
+		counters[5] = dbentry->tuples_fetched;
+		counters[6] = dbentry->tuples_inserted;
+		counters[7] = dbentry->tuples_updated;
+		counters[8] = dbentry->tuples_deleted;
+	}
+#endif
+
+	pgstat_clear_snapshot();
+
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+
+	idx = (powa_shared->samplehead + 1) % powa_shared->nsampleslots;
+	slot = POWA_SAMPLE_SLOT(powa_shared, idx);
+
+	slot->seq++;
+	pg_write_barrier();
+
+	slot->ts = ts;
+	slot->nentries = nentries;
+	memcpy(slot->entries, entries, sizeof(PowaSampleEntry) * nentries);
+
+	pg_write_barrier();
+	slot->seq++;
+
+	pg_write_barrier();
+	powa_shared->samplehead = idx;
+
+	LWLockRelease(powa_shared->lock);
+
+	pfree(entries);
+}
+
+/*
+ * Get a consistent copy of the i-th most recent slot of the high frequency
+ * samples ring, or NULL if there's no such slot.
+ */
+static PowaSampleSlot *
+powa_sample_read_slot(int i)
+{
+	PowaSharedState *state = powa_shared;
+	PowaSampleSlot *copy;
+	int			head;
+
+	head = ((volatile PowaSharedState *) state)->samplehead;
+	pg_read_barrier();
+
+	if (head < 0 || i >= state->nsampleslots)
+		return NULL;
+
+	copy = palloc(state->sampleslotsize);
+
+	for (;;)
+	{
+		volatile PowaSampleSlot *slot;
+		uint32		before;
+		uint32		after;
+
+		slot = POWA_SAMPLE_SLOT(state, (head - i + state->nsampleslots) %
+								state->nsampleslots);
+
+		before = slot->seq;
+		pg_read_barrier();
+
+		if ((before & 1) == 0)
+		{
+			int			nentries = slot->nentries;
+
+			if (nentries < 0 || nentries > powa_recent_max_databases)
+				nentries = 0;
+
+			copy->ts = slot->ts;
+			copy->nentries = nentries;
+			memcpy(copy->entries, (PowaSampleEntry *) slot->entries,
+				   sizeof(PowaSampleEntry) * nentries);
+
+			pg_read_barrier();
+			after = slot->seq;
+
+			if (before == after)
+				break;
+		}
+
+		/* the slot is being written, try again */
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	if (copy->ts == 0)
+	{
+		pfree(copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+/*
+ * Return the high frequency samples kept in shared memory, in chronological
+ * order.  The database counters are NULL before PostgreSQL 15.
+ */
+Datum
+powa_db_samples(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (powa_shared == NULL || powa_shared->nsampleslots == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("high frequency samples are not available"),
+				 errhint("Set powa.high_frequency_samples to a positive value and restart the server.")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = powa_shared->nsampleslots - 1; i >= 0; i--)
+	{
+		PowaSampleSlot *slot = powa_sample_read_slot(i);
+		int			j;
+
+		if (slot == NULL)
+			continue;
+
+		for (j = 0; j < slot->nentries; j++)
+		{
+			PowaSampleEntry *entry = &slot->entries[j];
+			Datum		values[6 + POWA_SAMPLE_COUNTERS];
+			bool		nulls[6 + POWA_SAMPLE_COUNTERS];
+			int			k;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[0] = TimestampTzGetDatum(slot->ts);
+			values[1] = ObjectIdGetDatum(entry->dbid);
+			values[2] = Int32GetDatum(entry->backends);
+			values[3] = Int32GetDatum(entry->active);
+			values[4] = Int32GetDatum(entry->idle_in_xact);
+			values[5] = Int32GetDatum(entry->waiting);
+#if PG_VERSION_NUM < 90600
+			nulls[5] = true;
+#endif
+			for (k = 0; k < POWA_SAMPLE_COUNTERS; k++)
+			{
+				values[6 + k] = Int64GetDatum(entry->counters[k]);
+				nulls[6 + k] = !entry->hascounters;
+			}
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+
+		pfree(slot);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Collector instrumentation
+ */
+
+/* Count the rows inserted by the collector functions being measured */
+static void
+powa_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (powa_collector_depth > 0 && queryDesc->operation == CMD_INSERT)
+		powa_collector_rows += queryDesc->estate->es_processed;
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+static void
+powa_collector_xact_callback(XactEvent event, void *arg)
+{
+	/* the measures of the aborted transaction will never be ended */
+	if (event == XACT_EVENT_ABORT)
+		powa_collector_depth = powa_collector_base_depth;
+}
+
+/* Start measuring the resources used by a collector function */
+static void
+powa_collector_begin(void)
+{
+	PowaCollectorStart *start;
+
+	if (powa_collector_depth >= POWA_COLLECTOR_MAX_DEPTH)
+		elog(ERROR, "too many nested collector measures");
+
+	start = &powa_collector_stack[powa_collector_depth++];
+
+	/* a measure started outside a transaction survives its abort */
+	if (!IsTransactionState())
+		powa_collector_base_depth = powa_collector_depth;
+
+	INSTR_TIME_SET_CURRENT(start->start);
+	pg_rusage_init(&start->rusage);
+	start->bufusage = pgBufferUsage;
+#if PG_VERSION_NUM >= 130000
+	start->walusage = pgWalUsage;
+#endif
+	start->rows = powa_collector_rows;
+}
+
+/*
+ * Stop the last started measure, and accumulate the resources used since its
+ * beginning in the shared memory entry of the given phase and function.
+ */
+static void
+powa_collector_end(const char *phase, const char *function_name)
+{
+	PowaCollectorStart *start;
+	PowaCollectorEntry *entry = NULL;
+	instr_time	duration;
+	PGRUsage	rusage;
+	double		elapsed;
+	int			i;
+
+	if (powa_collector_depth == 0)
+		elog(ERROR, "no collector measure in progress");
+
+	start = &powa_collector_stack[--powa_collector_depth];
+	if (powa_collector_base_depth > powa_collector_depth)
+		powa_collector_base_depth = powa_collector_depth;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start->start);
+	elapsed = INSTR_TIME_GET_MILLISEC(duration);
+	pg_rusage_init(&rusage);
+
+	if (powa_shared == NULL)
+		return;
+
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < powa_shared->ncollector; i++)
+	{
+		if (strncmp(powa_shared->collector[i].phase, phase,
+					NAMEDATALEN - 1) == 0 &&
+			strncmp(powa_shared->collector[i].function_name, function_name,
+					NAMEDATALEN - 1) == 0)
+		{
+			entry = &powa_shared->collector[i];
+			break;
+		}
+	}
+
+	if (entry == NULL && powa_shared->ncollector < POWA_COLLECTOR_MAX_ENTRIES)
+	{
+		entry = &powa_shared->collector[powa_shared->ncollector++];
+		memset(entry, 0, sizeof(PowaCollectorEntry));
+		strlcpy(entry->phase, phase, NAMEDATALEN);
+		strlcpy(entry->function_name, function_name, NAMEDATALEN);
+	}
+
+	if (entry == NULL)
+	{
+		LWLockRelease(powa_shared->lock);
+		elog(DEBUG1, "no more room to track collector function %s %s",
+			 phase, function_name);
+		return;
+	}
+
+	entry->calls++;
+	entry->total_time += elapsed;
+	entry->last_time = elapsed;
+	entry->user_time +=
+		(rusage.ru.ru_utime.tv_sec - start->rusage.ru.ru_utime.tv_sec) * 1000.0 +
+		(rusage.ru.ru_utime.tv_usec - start->rusage.ru.ru_utime.tv_usec) / 1000.0;
+	entry->system_time +=
+		(rusage.ru.ru_stime.tv_sec - start->rusage.ru.ru_stime.tv_sec) * 1000.0 +
+		(rusage.ru.ru_stime.tv_usec - start->rusage.ru.ru_stime.tv_usec) / 1000.0;
+	entry->rows += powa_collector_rows - start->rows;
+	entry->shared_blks_hit +=
+		pgBufferUsage.shared_blks_hit - start->bufusage.shared_blks_hit;
+	entry->shared_blks_read +=
+		pgBufferUsage.shared_blks_read - start->bufusage.shared_blks_read;
+	entry->shared_blks_dirtied +=
+		pgBufferUsage.shared_blks_dirtied - start->bufusage.shared_blks_dirtied;
+	entry->shared_blks_written +=
+		pgBufferUsage.shared_blks_written - start->bufusage.shared_blks_written;
+#if PG_VERSION_NUM >= 130000
+	entry->wal_records += pgWalUsage.wal_records - start->walusage.wal_records;
+	entry->wal_bytes += pgWalUsage.wal_bytes - start->walusage.wal_bytes;
+#endif
+	entry->last_run = GetCurrentTimestamp();
+
+	LWLockRelease(powa_shared->lock);
+}
+
+/*
+ * SQL wrappers of powa_collector_begin() and powa_collector_end(), used by
+ * powa_take_snapshot() around each function it calls.
+ */
+Datum
+powa_collector_stats_begin(PG_FUNCTION_ARGS)
+{
+	powa_collector_begin();
+
+	PG_RETURN_VOID();
+}
+
+Datum
+powa_collector_stats_end(PG_FUNCTION_ARGS)
+{
+	char	   *phase = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *function_name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	powa_collector_end(phase, function_name);
+
+	PG_RETURN_VOID();
+}
+
+/* Return the cumulated resource usage of the collector functions */
+Datum
+powa_collector_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PowaCollectorEntry *entries;
+	int			nentries;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (powa_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("powa must be loaded via shared_preload_libraries")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* copy the entries, so the lock isn't held while building the tuples */
+	entries = palloc(sizeof(PowaCollectorEntry) * POWA_COLLECTOR_MAX_ENTRIES);
+	LWLockAcquire(powa_shared->lock, LW_SHARED);
+	nentries = powa_shared->ncollector;
+	memcpy(entries, powa_shared->collector,
+		   sizeof(PowaCollectorEntry) * nentries);
+	LWLockRelease(powa_shared->lock);
+
+	for (i = 0; i < nentries; i++)
+	{
+		PowaCollectorEntry *entry = &entries[i];
+		Datum		values[POWA_COLLECTOR_COLS];
+		bool		nulls[POWA_COLLECTOR_COLS];
+		int			j = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = CStringGetTextDatum(entry->phase);
+		values[j++] = CStringGetTextDatum(entry->function_name);
+		values[j++] = Int64GetDatum(entry->calls);
+		values[j++] = Float8GetDatum(entry->total_time);
+		values[j++] = Float8GetDatum(entry->last_time);
+		values[j++] = Float8GetDatum(entry->user_time);
+		values[j++] = Float8GetDatum(entry->system_time);
+		values[j++] = Int64GetDatum(entry->rows);
+		values[j++] = Int64GetDatum(entry->shared_blks_hit);
+		values[j++] = Int64GetDatum(entry->shared_blks_read);
+		values[j++] = Int64GetDatum(entry->shared_blks_dirtied);
+		values[j++] = Int64GetDatum(entry->shared_blks_written);
+#if PG_VERSION_NUM >= 130000
+		values[j++] = Int64GetDatum(entry->wal_records);
+		values[j++] = Int64GetDatum(entry->wal_bytes);
+#else
+		nulls[j++] = true;
+		nulls[j++] = true;
+#endif
+		values[j++] = TimestampTzGetDatum(entry->last_run);
+
+		Assert(j == POWA_COLLECTOR_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(entries);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/* Forget the resource usage of all the collector functions */
+Datum
+powa_collector_stats_reset(PG_FUNCTION_ARGS)
+{
+	if (powa_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("powa must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(powa_shared->lock, LW_EXCLUSIVE);
+	powa_shared->ncollector = 0;
+	LWLockRelease(powa_shared->lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Stats collection for all the databases
+ */
+
+/*
+ * Same as powa_stat_all_rel() and powa_stat_user_functions(), for all the
+ * databases at once, using parallel background workers.
+ */
+Datum
+powa_stat_all_rel_parallel(PG_FUNCTION_ARGS)
+{
+	return powa_stat_multi_common(fcinfo, POWA_STAT_TABLE,
+								  POWA_STAT_COLLECTION_PARALLEL);
+}
+
+Datum
+powa_stat_user_functions_parallel(PG_FUNCTION_ARGS)
+{
+	return powa_stat_multi_common(fcinfo, POWA_STAT_FUNCTION,
+								  POWA_STAT_COLLECTION_PARALLEL);
+}
+
+/*
+ * Same as powa_stat_all_rel() and powa_stat_user_functions(), for all the
+ * databases at once, loading the statistics only once.
+ */
+Datum
+powa_stat_all_rel_cluster(PG_FUNCTION_ARGS)
+{
+	return powa_stat_multi_common(fcinfo, POWA_STAT_TABLE,
+								  POWA_STAT_COLLECTION_CLUSTER);
+}
+
+Datum
+powa_stat_user_functions_cluster(PG_FUNCTION_ARGS)
+{
+	return powa_stat_multi_common(fcinfo, POWA_STAT_FUNCTION,
+								  POWA_STAT_COLLECTION_CLUSTER);
+}
+
+static void
+powa_stat_multi_tuplestore_callback(Oid dbid, Datum *values, bool *nulls,
+									void *arg)
+{
+	PowaStatTuplestore *state = (PowaStatTuplestore *) arg;
+	Datum		dbvalues[POWA_STAT_TAB_COLS + 1];
+	bool		dbnulls[POWA_STAT_TAB_COLS + 1];
+	int			natts = state->tupdesc->natts;
+
+	Assert(natts <= POWA_STAT_TAB_COLS + 1);
+
+	/* the dbid is the first column */
+	dbvalues[0] = ObjectIdGetDatum(dbid);
+	dbnulls[0] = false;
+	memcpy(&dbvalues[1], values, sizeof(Datum) * (natts - 1));
+	memcpy(&dbnulls[1], nulls, sizeof(bool) * (natts - 1));
+
+	tuplestore_putvalues(state->tupstore, state->tupdesc, dbvalues, dbnulls);
+}
+
+static Datum
+powa_stat_multi_common(FunctionCallInfo fcinfo, PowaStatKind kind,
+					   PowaStatCollection mode)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PowaStatTuplestore state;
+	Oid		   *dbids;
+	int			ndbs;
+	int			ncols;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	(void) powa_stat_coltypes(kind, &ncols);
+	if (tupdesc->natts != ncols + 1)
+		elog(ERROR, "unexpected number of columns");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	state.tupstore = tupstore;
+	state.tupdesc = tupdesc;
+
+	SPI_connect();
+
+	dbids = powa_get_dbids(&ndbs);
+
+	switch (mode)
+	{
+		case POWA_STAT_COLLECTION_PARALLEL:
+			powa_stat_fetch_parallel(dbids, ndbs, kind,
+									 powa_stat_multi_tuplestore_callback,
+									 &state);
+			break;
+		case POWA_STAT_COLLECTION_CLUSTER:
+			powa_stat_fetch_cluster(dbids, ndbs, kind,
+									powa_stat_multi_tuplestore_callback,
+									&state);
+			break;
+		default:
+			powa_stat_fetch_serial(dbids, ndbs, kind,
+								   powa_stat_multi_tuplestore_callback,
+								   &state);
+			break;
+	}
+
+	SPI_finish();
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/* Get the oids of all the databases.  Must be called in an SPI connection. */
+static Oid *
+powa_get_dbids(int *ndbs)
+{
+	Oid		   *dbids;
+	uint64		i;
+	int			ret;
+
+	ret = SPI_execute("SELECT oid FROM pg_database", true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read pg_database: %s",
+			 SPI_result_code_string(ret));
+
+	dbids = palloc(sizeof(Oid) * Max(SPI_processed, 1));
+	for (i = 0; i < SPI_processed; i++)
+	{
+		bool		isnull;
+
+		dbids[i] = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+												  SPI_tuptable->tupdesc,
+												  1, &isnull));
+	}
+	*ndbs = (int) SPI_processed;
+
+	return dbids;
+}
+
+/* Types of the columns of powa_stat_user_functions() and powa_stat_all_rel() */
+static const Oid *
+powa_stat_coltypes(PowaStatKind kind, int *ncols)
+{
+	static const Oid func_coltypes[POWA_STAT_FUNC_COLS] = {
+		OIDOID, INT8OID, FLOAT8OID, FLOAT8OID
+	};
+	static const Oid tab_coltypes[POWA_STAT_TAB_COLS] = {
+		OIDOID,
+		INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID,
+		INT8OID, INT8OID, INT8OID,
+		INT8OID, INT8OID,
+		TIMESTAMPTZOID, INT8OID, TIMESTAMPTZOID, INT8OID,
+		TIMESTAMPTZOID, INT8OID, TIMESTAMPTZOID, INT8OID
+	};
+
+	if (kind == POWA_STAT_FUNCTION)
+	{
+		*ncols = POWA_STAT_FUNC_COLS;
+		return func_coltypes;
+	}
+
+	*ncols = POWA_STAT_TAB_COLS;
+	return tab_coltypes;
+}
+
+/*
+ * Retrieve the statistics of the given kind for all the given databases,
+ * according to powa.stat_collection.
+ */
+static void
+powa_stat_fetch_all(Oid *dbids, int ndbs, PowaStatKind kind,
+					PowaStatDbCallback callback, void *arg)
+{
+	switch (powa_stat_collection)
+	{
+		case POWA_STAT_COLLECTION_PARALLEL:
+			powa_stat_fetch_parallel(dbids, ndbs, kind, callback, arg);
+			break;
+		case POWA_STAT_COLLECTION_CLUSTER:
+			powa_stat_fetch_cluster(dbids, ndbs, kind, callback, arg);
+			break;
+		default:
+			powa_stat_fetch_serial(dbids, ndbs, kind, callback, arg);
+			break;
+	}
+}
+
+static void
+powa_stat_db_adapter(Datum *values, bool *nulls, void *arg)
+{
+	PowaStatDbCallbackArg *adapter = (PowaStatDbCallbackArg *) arg;
+
+	adapter->callback(adapter->dbid, values, nulls, adapter->arg);
+}
+
+static void
+powa_stat_fetch_serial(Oid *dbids, int ndbs, PowaStatKind kind,
+					   PowaStatDbCallback callback, void *arg)
+{
+	PowaStatDbCallbackArg adapter;
+	int			i;
+
+	adapter.callback = callback;
+	adapter.arg = arg;
+
+	for (i = 0; i < ndbs; i++)
+	{
+		adapter.dbid = dbids[i];
+		powa_stat_fetch(dbids[i], kind, powa_stat_db_adapter, &adapter);
+	}
+}
+
+#if PG_VERSION_NUM >= 90500
+/* Retrieve the statistics using up to powa.stat_max_parallel_workers */
+static void
+powa_stat_fetch_parallel(Oid *dbids, int ndbs, PowaStatKind kind,
+						 PowaStatDbCallback callback, void *arg)
+{
+	int			nworkers = Min(powa_stat_max_parallel_workers, ndbs);
+	BackgroundWorkerHandle **handles;
+	shm_mq_handle **mqh;
+	bool	   *active;
+	int			nactive = 0;
+	const Oid  *coltypes;
+	int			ncols;
+	shm_toc_estimator e;
+	Size		headersize;
+	Size		segsize;
+	dsm_segment *seg;
+	shm_toc    *toc;
+	PowaStatParallelHeader *header;
+	int			i;
+
+	if (nworkers <= 1)
+	{
+		powa_stat_fetch_serial(dbids, ndbs, kind, callback, arg);
+		return;
+	}
+
+	coltypes = powa_stat_coltypes(kind, &ncols);
+
+	/* Set up the DSM segment */
+	headersize = add_size(offsetof(PowaStatParallelHeader, dbids),
+						  mul_size(sizeof(Oid), ndbs));
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, headersize);
+	for (i = 0; i < nworkers; i++)
+		shm_toc_estimate_chunk(&e, (Size) POWA_STAT_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, 1 + nworkers);
+	segsize = shm_toc_estimate(&e);
+
+	seg = dsm_create(segsize, 0);
+	toc = shm_toc_create(POWA_STAT_MQ_MAGIC, dsm_segment_address(seg),
+						 segsize);
+
+	header = shm_toc_allocate(toc, headersize);
+	SpinLockInit(&header->mutex);
+	header->leader_dbid = MyDatabaseId;
+	header->kind = kind;
+	header->nextdb = 0;
+	memset(header->done, 0, sizeof(header->done));
+	header->ndbs = ndbs;
+	memcpy(header->dbids, dbids, sizeof(Oid) * ndbs);
+	shm_toc_insert(toc, 0, header);
+
+	handles = palloc0(sizeof(BackgroundWorkerHandle *) * nworkers);
+	mqh = palloc0(sizeof(shm_mq_handle *) * nworkers);
+	active = palloc0(sizeof(bool) * nworkers);
+
+	for (i = 0; i < nworkers; i++)
+	{
+		shm_mq	   *mq;
+		BackgroundWorker worker;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, (Size) POWA_STAT_QUEUE_SIZE),
+						   (Size) POWA_STAT_QUEUE_SIZE);
+		shm_toc_insert(toc, i + 1, mq);
+		shm_mq_set_receiver(mq, MyProc);
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "powa");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "powa_stat_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "powa stats worker %d", i);
+#if PG_VERSION_NUM >= 110000
+		snprintf(worker.bgw_type, BGW_MAXLEN, "powa stats worker");
+#endif
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		worker.bgw_notify_pid = MyProcPid;
+		memcpy(worker.bgw_extra, &i, sizeof(int));
+
+		if (RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+		{
+			active[i] = true;
+			nactive++;
+		}
+		else
+			handles[i] = NULL;
+
+		/* the handle lets shm_mq notice a worker that failed to start */
+		if (active[i])
+			mqh[i] = shm_mq_attach(mq, seg, handles[i]);
+	}
+
+	/*
+	 * Process the results as they come.  If no worker could be launched, the
+	 * remaining databases are processed below.
+	 */
+	while (nactive > 0)
+	{
+		bool		gotmsg = false;
+
+		for (i = 0; i < nworkers; i++)
+		{
+			shm_mq_result res;
+			Size		len;
+			void	   *data;
+
+			if (!active[i])
+				continue;
+
+			res = shm_mq_receive(mqh[i], &len, &data, true);
+
+			if (res == SHM_MQ_SUCCESS)
+			{
+				PowaStatMsg *msg = (PowaStatMsg *) data;
+				Datum		values[POWA_STAT_TAB_COLS];
+				int			j;
+
+				if (len != sizeof(PowaStatMsg))
+					elog(ERROR, "unexpected message size %d", (int) len);
+
+				for (j = 0; j < ncols; j++)
+				{
+					if (msg->nulls[j])
+						values[j] = (Datum) 0;
+					else if (coltypes[j] == OIDOID)
+						values[j] = ObjectIdGetDatum((Oid) msg->values[j]);
+					else
+						values[j] = powa_bits_to_datum(msg->values[j],
+								coltypes[j] == FLOAT8OID ? POWA_BLOCK_KIND_FLOAT8 :
+								coltypes[j] == INT8OID ? POWA_BLOCK_KIND_INT8 :
+													   POWA_BLOCK_KIND_TS);
+				}
+
+				callback(msg->dbid, values, msg->nulls, arg);
+				gotmsg = true;
+			}
+			else if (res == SHM_MQ_DETACHED)
+			{
+				bool		done;
+
+				SpinLockAcquire(&header->mutex);
+				done = header->done[i];
+				SpinLockRelease(&header->mutex);
+
+				if (!done)
+					ereport(ERROR,
+							(errcode(ERRCODE_INTERNAL_ERROR),
+							 errmsg("powa stats worker %d exited prematurely",
+									i)));
+
+				active[i] = false;
+				nactive--;
+			}
+		}
+
+		if (!gotmsg && nactive > 0)
+		{
+			WaitLatch(&MyProc->procLatch,
+					  WL_LATCH_SET | WL_POSTMASTER_DEATH,
+					  0
+#if PG_VERSION_NUM >= 100000
+					  ,PG_WAIT_EXTENSION
+#endif
+					  );
+			ResetLatch(&MyProc->procLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	/* process any database left, if some workers couldn't be launched */
+	for (;;)
+	{
+		Oid			dbid;
+
+		SpinLockAcquire(&header->mutex);
+		if (header->nextdb >= header->ndbs)
+		{
+			SpinLockRelease(&header->mutex);
+			break;
+		}
+		dbid = header->dbids[header->nextdb++];
+		SpinLockRelease(&header->mutex);
+
+		powa_stat_fetch_serial(&dbid, 1, kind, callback, arg);
+	}
+
+	dsm_detach(seg);
+}
+
+/* Send an entry to the leader */
+static void
+powa_stat_worker_send(Datum *values, bool *nulls, void *arg)
+{
+	PowaStatWorkerState *state = (PowaStatWorkerState *) arg;
+	shm_mq_result res;
+	int			i;
+
+	for (i = 0; i < state->ncols; i++)
+	{
+		state->msg.nulls[i] = nulls[i];
+		if (nulls[i])
+			state->msg.values[i] = 0;
+		else if (state->coltypes[i] == OIDOID)
+			state->msg.values[i] = (uint64) DatumGetObjectId(values[i]);
+		else
+			state->msg.values[i] = powa_datum_to_bits(values[i],
+								state->coltypes[i] == FLOAT8OID ? POWA_BLOCK_KIND_FLOAT8 :
+								state->coltypes[i] == INT8OID ? POWA_BLOCK_KIND_INT8 :
+														 POWA_BLOCK_KIND_TS);
+	}
+
+#if PG_VERSION_NUM >= 150000
+	res = shm_mq_send(state->mqh, sizeof(PowaStatMsg), &state->msg, false,
+					  true);
+#else
+	res = shm_mq_send(state->mqh, sizeof(PowaStatMsg), &state->msg, false);
+#endif
+
+	/* the leader went away, no need to continue */
+	if (res != SHM_MQ_SUCCESS)
+		proc_exit(1);
+}
+
+/*
+ * Main function of the dynamic background workers collecting the stats in
+ * parallel.
+ */
+void
+powa_stat_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	PowaStatParallelHeader *header;
+	shm_mq	   *mq;
+	PowaStatWorkerState state;
+	int			myidx;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(&myidx, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+
+	toc = shm_toc_attach(POWA_STAT_MQ_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("bad magic number in dynamic shared memory segment")));
+
+#if PG_VERSION_NUM >= 100000
+	header = shm_toc_lookup(toc, 0, false);
+	mq = shm_toc_lookup(toc, myidx + 1, false);
+#else
+	header = shm_toc_lookup(toc, 0);
+	mq = shm_toc_lookup(toc, myidx + 1);
+#endif
+
+	shm_mq_set_sender(mq, MyProc);
+	state.mqh = shm_mq_attach(mq, seg, NULL);
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(header->leader_dbid, InvalidOid,
+											  0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(header->leader_dbid, InvalidOid);
+#endif
+
+	state.coltypes = powa_stat_coltypes(header->kind, &state.ncols);
+	memset(&state.msg, 0, sizeof(state.msg));
+
+	StartTransactionCommand();
 
-	backend_dbid = MyDatabaseId;
-	MyDatabaseId = dbid;
+	for (;;)
+	{
+		int			dbidx;
 
-	dbentry = pgstat_fetch_stat_dbentry(dbid);
+		CHECK_FOR_INTERRUPTS();
 
-	MyDatabaseId = backend_dbid;
+		SpinLockAcquire(&header->mutex);
+		dbidx = header->nextdb;
+		if (dbidx < header->ndbs)
+			header->nextdb++;
+		SpinLockRelease(&header->mutex);
+
+		if (dbidx >= header->ndbs)
+			break;
+
+		state.msg.dbid = header->dbids[dbidx];
+		powa_stat_fetch(state.msg.dbid, header->kind, powa_stat_worker_send,
+						&state);
+	}
+
+	CommitTransactionCommand();
+
+	SpinLockAcquire(&header->mutex);
+	header->done[myidx] = true;
+	SpinLockRelease(&header->mutex);
+
+	dsm_detach(seg);
+	proc_exit(0);
+}
+#else
+static void
+powa_stat_fetch_parallel(Oid *dbids, int ndbs, PowaStatKind kind,
+						 PowaStatDbCallback callback, void *arg)
+{
+	/* dynamic background workers support is too limited before 9.5 */
+	powa_stat_fetch_serial(dbids, ndbs, kind, callback, arg);
+}
+
+void
+powa_stat_worker_main(Datum main_arg)
+{
+	elog(ERROR, "parallel stats collection requires PostgreSQL 9.5 or above");
+}
+#endif
 
-	if (dbentry != NULL && dbentry->functions != NULL &&
-		dbentry->tables != NULL)
+#if PG_VERSION_NUM >= 150000
+/* an entry copied from the shared memory statistics */
+typedef struct PowaStatClusterEntry
+{
+	Oid			dbid;
+	Oid			objid;
+	union
 	{
-		switch (kind)
-		{
-			case POWA_STAT_FUNCTION:
-				{
-					PgStat_StatFuncEntry *funcentry = NULL;
+		PgStat_StatTabEntry tab;
+		PgStat_StatFuncEntry func;
+	}			stats;
+}	PowaStatClusterEntry;
+
+/*
+ * Retrieve the statistics of the given kind for all the given databases in a
+ * single pass over the shared memory statistics.
+ *
+ * The entries are first copied locally, so that no lock is held while the
+ * callback is running.
+ */
+static void
+powa_stat_fetch_cluster(Oid *dbids, int ndbs, PowaStatKind kind,
+						PowaStatDbCallback callback, void *arg)
+{
+	PgStat_Kind pgkind = (kind == POWA_STAT_TABLE) ? PGSTAT_KIND_RELATION :
+	PGSTAT_KIND_FUNCTION;
+	PowaStatClusterEntry *entries;
+	int			nentries = 0;
+	int			size = 1024;
+	Oid		   *sorted;
+	dshash_seq_status hstat;
+	PgStatShared_HashEntry *p;
+	Datum		values[POWA_STAT_TAB_COLS];
+	bool		nulls[POWA_STAT_TAB_COLS] = {0};
+	int			i;
 
-					hash_seq_init(&hash_seq, dbentry->functions);
-					while ((funcentry = hash_seq_search(&hash_seq)) != NULL)
-					{
-						Datum		values[POWA_STAT_FUNC_COLS];
-						bool		nulls[POWA_STAT_FUNC_COLS];
-						int			i = 0;
+	sorted = palloc(sizeof(Oid) * Max(ndbs, 1));
+	memcpy(sorted, dbids, sizeof(Oid) * ndbs);
+	qsort(sorted, ndbs, sizeof(Oid), powa_oid_cmp);
 
-						memset(values, 0, sizeof(values));
-						memset(nulls, 0, sizeof(nulls));
+	entries = palloc(sizeof(PowaStatClusterEntry) * size);
 
-						values[i++] = ObjectIdGetDatum(funcentry->functionid);
-						values[i++] = Int64GetDatum(funcentry->f_numcalls);
-						values[i++] = Float8GetDatum(((double) funcentry->f_total_time) / 1000.0);
-						values[i++] = Float8GetDatum(((double) funcentry->f_self_time) / 1000.0);
+	dshash_seq_init(&hstat, pgStatLocal.shared_hash, false);
+	while ((p = dshash_seq_next(&hstat)) != NULL)
+	{
+		PgStatShared_Common *shared;
 
-						Assert(i == POWA_STAT_FUNC_COLS);
+		if (p->dropped || p->key.kind != pgkind)
+			continue;
 
-						tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-					}
-					break;
-				}
-			case POWA_STAT_TABLE:
-				{
-					PgStat_StatTabEntry *tabentry = NULL;
-
-					hash_seq_init(&hash_seq, dbentry->tables);
-					while ((tabentry = hash_seq_search(&hash_seq)) != NULL)
-					{
-						Datum		values[POWA_STAT_TAB_COLS];
-						bool		nulls[POWA_STAT_TAB_COLS];
-						int			i = 0;
-
-						memset(values, 0, sizeof(values));
-						memset(nulls, 0, sizeof(nulls));
-
-						/* Oid of the table (or index) */
-						values[i++] = ObjectIdGetDatum(tabentry->tableid);
-
-						values[i++] = Int64GetDatum((int64) tabentry->numscans);
-
-						values[i++] = Int64GetDatum((int64) tabentry->tuples_returned);
-						values[i++] = Int64GetDatum((int64) tabentry->tuples_fetched);
-						values[i++] = Int64GetDatum((int64) tabentry->tuples_inserted);
-						values[i++] = Int64GetDatum((int64) tabentry->tuples_updated);
-						values[i++] = Int64GetDatum((int64) tabentry->tuples_deleted);
-						values[i++] = Int64GetDatum((int64) tabentry->tuples_hot_updated);
-
-						values[i++] = Int64GetDatum((int64) tabentry->n_live_tuples);
-						values[i++] = Int64GetDatum((int64) tabentry->n_dead_tuples);
-						values[i++] = Int64GetDatum((int64) tabentry->changes_since_analyze);
-
-						values[i++] = Int64GetDatum((int64) (tabentry->blocks_fetched - tabentry->blocks_hit));
-						values[i++] = Int64GetDatum((int64) tabentry->blocks_hit);
-
-						/* last vacuum */
-						if (tabentry->vacuum_timestamp == 0)
-							nulls[i++] = true;
-						else
-							values[i++] = TimestampTzGetDatum(tabentry->vacuum_timestamp);
-						values[i++] = Int64GetDatum((int64) tabentry->vacuum_count);
-
-						/* last_autovacuum */
-						if (tabentry->autovac_vacuum_timestamp == 0)
-							nulls[i++] = true;
-						else
-							values[i++] = TimestampTzGetDatum(tabentry->autovac_vacuum_timestamp);
-						values[i++] = Int64GetDatum((int64) tabentry->autovac_vacuum_count);
-
-						/* last_analyze */
-						if (tabentry->analyze_timestamp == 0)
-							nulls[i++] = true;
-						else
-							values[i++] = TimestampTzGetDatum(tabentry->analyze_timestamp);
-						values[i++] = Int64GetDatum((int64) tabentry->analyze_count);
-
-						/* last_autoanalyze */
-						if (tabentry->autovac_analyze_timestamp == 0)
-							nulls[i++] = true;
-						else
-							values[i++] = TimestampTzGetDatum(tabentry->autovac_analyze_timestamp);
-						values[i++] = Int64GetDatum((int64) tabentry->autovac_analyze_count);
-
-						Assert(i == POWA_STAT_TAB_COLS);
-
-						tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-					}
-					break;
-				}
+		if (bsearch(&p->key.dboid, sorted, ndbs, sizeof(Oid),
+					powa_oid_cmp) == NULL)
+			continue;
+
+		if (nentries >= size)
+		{
+			size *= 2;
+			entries = repalloc(entries, sizeof(PowaStatClusterEntry) * size);
 		}
+
+		entries[nentries].dbid = p->key.dboid;
+		entries[nentries].objid = p->key.objoid;
+
+		shared = dsa_get_address(pgStatLocal.dsa, p->body);
+		LWLockAcquire(&shared->lock, LW_SHARED);
+		if (kind == POWA_STAT_TABLE)
+			memcpy(&entries[nentries].stats.tab,
+				   &((PgStatShared_Relation *) shared)->stats,
+				   sizeof(PgStat_StatTabEntry));
+		else
+			memcpy(&entries[nentries].stats.func,
+				   &((PgStatShared_Function *) shared)->stats,
+				   sizeof(PgStat_StatFuncEntry));
+		LWLockRelease(&shared->lock);
+
+		nentries++;
 	}
+	dshash_seq_term(&hstat);
 
-	/*
-	 * Make sure any subsequent statistic retrieving will not see the one we
-	 * just fetched
-	 */
-	pgstat_clear_snapshot();
+	for (i = 0; i < nentries; i++)
+	{
+		if (kind == POWA_STAT_TABLE)
+			powa_stat_tab_values(entries[i].objid, &entries[i].stats.tab,
+								 values, nulls);
+		else
+			powa_stat_func_values(entries[i].objid, &entries[i].stats.func,
+								  values, nulls);
+
+		callback(entries[i].dbid, values, nulls, arg);
+	}
+
+	pfree(entries);
+	pfree(sorted);
+}
+#else
+/*
+ * Before PostgreSQL 15, the collector only writes the statistics file of the
+ * databases a backend asked for, so loading the statistics of all the
+ * databases at once would give stale values for all but the current one.
+ */
+static void
+powa_stat_fetch_cluster(Oid *dbids, int ndbs, PowaStatKind kind,
+						PowaStatDbCallback callback, void *arg)
+{
+	elog(ERROR, "cluster stats collection requires PostgreSQL 15 or above");
+}
+#endif
+
+/*
+ * Remote collection
+ */
+
+/*
+ * Fetch the pg_stat_statements entries of all the enabled servers of
+ * powa_servers, tagged with their server id.  The connections are opened and
+ * the queries are run concurrently, so the collection lasts as long as the
+ * slowest server rather than the sum of all of them, and is bounded by
+ * powa.remote_timeout.  A server that can't be collected only raises a
+ * WARNING, and will be tried again at the next snapshot.
+ */
+Datum
+powa_remote_fetch_statements(PG_FUNCTION_ARGS)
+{
+	return powa_remote_fetch_common(fcinfo, POWA_REMOTE_STATEMENTS);
+}
+
+/*
+ * Same as powa_remote_fetch_statements(), for the relations statistics of
+ * the powa_servers.relations_dbnames databases.  The relations statistics
+ * are per database, so each database needs its own connection.  They're read
+ * with the pg_stat_get_* functions, so powa isn't needed on the remote
+ * servers.
+ */
+Datum
+powa_remote_fetch_relations(PG_FUNCTION_ARGS)
+{
+	return powa_remote_fetch_common(fcinfo, POWA_REMOTE_RELATIONS);
+}
+
+static Datum
+powa_remote_fetch_common(FunctionCallInfo fcinfo, PowaRemoteKind kind)
+{
+#ifndef WIN32
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext callcxt = CurrentMemoryContext;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	PowaRemoteState state;
+	PowaRemoteServer *servers;
+	int			nservers;
+	struct pollfd *fds;
+	int		   *fdsrv;
+	TimestampTz deadline;
+	int			ret;
+	int			i;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to collect the remote servers")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	state.attinmeta = TupleDescGetAttInMetadata(tupdesc);
+	state.tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = state.tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	state.rowcxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "powa remote row",
+										 ALLOCSET_DEFAULT_MINSIZE,
+										 ALLOCSET_DEFAULT_INITSIZE,
+										 ALLOCSET_DEFAULT_MAXSIZE);
+	state.kind = kind;
+	state.ignore_regexp = (kind == POWA_REMOTE_STATEMENTS) ?
+		text_to_cstring(PG_GETARG_TEXT_PP(0)) : NULL;
+	state.ignored_users = (powa_ignored_users != NULL) ?
+		powa_ignored_users : "";
+
+	SPI_connect();
+
+	if (kind == POWA_REMOTE_STATEMENTS)
+		ret = SPI_execute("SELECT id, hostname, port, username, dbname,"
+						  " service, passfile"
+						  " FROM powa_servers"
+						  " WHERE enabled"
+						  " ORDER BY id", true, 0);
+	else
+		ret = SPI_execute("SELECT s.id, s.hostname, s.port, s.username,"
+						  " d.dbname, s.service, s.passfile"
+						  " FROM powa_servers s,"
+						  " unnest(s.relations_dbnames) d(dbname)"
+						  " WHERE s.enabled"
+						  " ORDER BY s.id, d.dbname", true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read powa_servers: %s",
+			 SPI_result_code_string(ret));
+
+	nservers = (int) SPI_processed;
+	servers = MemoryContextAllocZero(callcxt,
+									 sizeof(PowaRemoteServer) *
+									 Max(nservers, 1));
+
+	for (i = 0; i < nservers; i++)
+	{
+		HeapTuple	tup = SPI_tuptable->vals[i];
+		TupleDesc	desc = SPI_tuptable->tupdesc;
+		char	   *service = SPI_getvalue(tup, desc, 6);
+		char	   *passfile = SPI_getvalue(tup, desc, 7);
+
+		servers[i].srvid = atoi(SPI_getvalue(tup, desc, 1));
+		servers[i].hostname = MemoryContextStrdup(callcxt,
+												  SPI_getvalue(tup, desc, 2));
+		servers[i].port = MemoryContextStrdup(callcxt,
+											  SPI_getvalue(tup, desc, 3));
+		servers[i].username = MemoryContextStrdup(callcxt,
+												  SPI_getvalue(tup, desc, 4));
+		servers[i].dbname = MemoryContextStrdup(callcxt,
+												SPI_getvalue(tup, desc, 5));
+		servers[i].service = (service == NULL) ? NULL :
+			MemoryContextStrdup(callcxt, service);
+		servers[i].passfile = (passfile == NULL) ? NULL :
+			MemoryContextStrdup(callcxt, passfile);
+		servers[i].status = POWA_REMOTE_DONE;
+	}
+
+	SPI_finish();
+
+	fds = palloc(sizeof(struct pollfd) * Max(nservers, 1));
+	fdsrv = palloc(sizeof(int) * Max(nservers, 1));
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										   powa_remote_timeout);
+
+	/* the connections are malloc'd by libpq, make sure we close them */
+	PG_TRY();
+	{
+		for (i = 0; i < nservers; i++)
+			powa_remote_connect(&servers[i]);
+
+		for (;;)
+		{
+			long		secs;
+			int			usecs;
+			int			nfds = 0;
+
+			for (i = 0; i < nservers; i++)
+			{
+				PowaRemoteServer *srv = &servers[i];
 
+				if (srv->status == POWA_REMOTE_DONE)
+					continue;
+
+				fds[nfds].fd = PQsocket(srv->conn);
+				if (srv->status == POWA_REMOTE_CONNECTING)
+					fds[nfds].events =
+						(srv->polling == PGRES_POLLING_READING) ?
+						POLLIN : POLLOUT;
+				else
+					fds[nfds].events = srv->flushing ?
+						(POLLIN | POLLOUT) : POLLIN;
+				fds[nfds].revents = 0;
+				fdsrv[nfds] = i;
+				nfds++;
+			}
+
+			if (nfds == 0)
+				break;
+
+			TimestampDifference(GetCurrentTimestamp(), deadline, &secs,
+								&usecs);
+			if (secs == 0 && usecs == 0)
+			{
+				for (i = 0; i < nfds; i++)
+					powa_remote_fail(&servers[fdsrv[i]],
+									 "powa.remote_timeout expired");
+				break;
+			}
+
+			/* wake up at least every second to process the interrupts */
+			ret = poll(fds, nfds, (secs > 0) ? 1000 : Max(usecs / 1000, 1));
+			if (ret < 0 && errno != EINTR)
+				ereport(ERROR,
+						(errcode_for_socket_access(),
+						 errmsg("could not wait for the remote servers: %m")));
+
+			CHECK_FOR_INTERRUPTS();
+
+			for (i = 0; ret > 0 && i < nfds; i++)
+			{
+				if (fds[i].revents != 0)
+					powa_remote_advance(&servers[fdsrv[i]], &state);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		powa_remote_finish(servers, nservers);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	powa_remote_finish(servers, nservers);
+	MemoryContextDelete(state.rowcxt);
 
 	/* clean up and return the tuplestore */
-	tuplestore_donestoring(tupstore);
+	tuplestore_donestoring(state.tupstore);
+
+	return (Datum) 0;
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("remote collection is not supported on this platform")));
 
 	return (Datum) 0;
+#endif
+}
+
+/*
+ * Start connecting to a remote server, without waiting.  No password is
+ * stored in powa_servers: libpq looks it up in the server's password file,
+ * or in the given passfile, and the service can hold any other parameter.
+ */
+static void
+powa_remote_connect(PowaRemoteServer * srv)
+{
+	const char *keywords[10];
+	const char *values[10];
+	int			n = 0;
+
+	keywords[n] = "host";
+	values[n++] = srv->hostname;
+	keywords[n] = "port";
+	values[n++] = srv->port;
+	keywords[n] = "user";
+	values[n++] = srv->username;
+	keywords[n] = "dbname";
+	values[n++] = srv->dbname;
+	if (srv->service != NULL)
+	{
+		keywords[n] = "service";
+		values[n++] = srv->service;
+	}
+	if (srv->passfile != NULL)
+	{
+#if PG_VERSION_NUM >= 100000
+		keywords[n] = "passfile";
+		values[n++] = srv->passfile;
+#else
+		elog(WARNING, "powa_servers.passfile of server %d ignored, it requires PostgreSQL 10 or above",
+			 srv->srvid);
+#endif
+	}
+	keywords[n] = "application_name";
+	values[n++] = "powa remote collector";
+	/* get the query texts in the encoding of the repository */
+	keywords[n] = "client_encoding";
+	values[n++] = GetDatabaseEncodingName();
+	keywords[n] = NULL;
+	values[n] = NULL;
+
+	srv->status = POWA_REMOTE_CONNECTING;
+	/* PQconnectStartParams() behaves as if PGRES_POLLING_WRITING was returned */
+	srv->polling = PGRES_POLLING_WRITING;
+	srv->flushing = false;
+	srv->res = NULL;
+
+	srv->conn = PQconnectStartParams(keywords, values, false);
+	if (srv->conn == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+
+	if (PQstatus(srv->conn) == CONNECTION_BAD)
+		powa_remote_fail(srv, PQerrorMessage(srv->conn));
+}
+
+/*
+ * Build the pg_stat_statements query, filtering the ignored statements and
+ * users on the remote server so they aren't transferred.  The column names
+ * depend on the version of pg_stat_statements, which is assumed to be the
+ * one shipped with the remote server.
+ */
+static char *
+powa_remote_statements_query(int version)
+{
+	const char *total_time;
+	const char *blk_time;
+
+	if (version >= 130000)
+		total_time = "pgss.total_plan_time + pgss.total_exec_time";
+	else
+		total_time = "pgss.total_time";
+
+	if (version >= 170000)
+		blk_time = "pgss.shared_blk_read_time + pgss.local_blk_read_time,"
+			" pgss.shared_blk_write_time + pgss.local_blk_write_time";
+	else
+		blk_time = "pgss.blk_read_time, pgss.blk_write_time";
+
+	return psprintf("SELECT pgss.userid, pgss.dbid, pgss.queryid, pgss.query,"
+					 " pgss.calls, %s, pgss.rows,"
+					 " pgss.shared_blks_hit, pgss.shared_blks_read,"
+					 " pgss.shared_blks_dirtied, pgss.shared_blks_written,"
+					 " pgss.local_blks_hit, pgss.local_blks_read,"
+					 " pgss.local_blks_dirtied, pgss.local_blks_written,"
+					 " pgss.temp_blks_read, pgss.temp_blks_written,"
+					 " %s"
+					 " FROM pg_stat_statements pgss"
+					 " JOIN pg_roles r ON r.oid = pgss.userid"
+					 " WHERE pgss.queryid IS NOT NULL"
+					 " AND pgss.query !~* $1"
+					 " AND r.rolname::text <> ALL (string_to_array($2, ','))",
+					 total_time, blk_time);
+}
+
+/*
+ * Build the query reading the statistics of all the relations of the
+ * connected database, with the same columns as powa_stat_all_rel() preceded
+ * by the database oid.
+ */
+static char *
+powa_remote_relations_query(int version)
+{
+	const char *mod_since_analyze;
+
+	if (version >= 90400)
+		mod_since_analyze = "pg_stat_get_mod_since_analyze(c.oid)";
+	else
+		mod_since_analyze = "NULL::bigint";
+
+	return psprintf("SELECT d.oid, c.oid,"
+					" pg_stat_get_numscans(c.oid),"
+					" pg_stat_get_tuples_returned(c.oid),"
+					" pg_stat_get_tuples_fetched(c.oid),"
+					" pg_stat_get_tuples_inserted(c.oid),"
+					" pg_stat_get_tuples_updated(c.oid),"
+					" pg_stat_get_tuples_deleted(c.oid),"
+					" pg_stat_get_tuples_hot_updated(c.oid),"
+					" pg_stat_get_live_tuples(c.oid),"
+					" pg_stat_get_dead_tuples(c.oid),"
+					" %s,"
+					" pg_stat_get_blocks_fetched(c.oid)"
+					"  - pg_stat_get_blocks_hit(c.oid),"
+					" pg_stat_get_blocks_hit(c.oid),"
+					" pg_stat_get_last_vacuum_time(c.oid),"
+					" pg_stat_get_vacuum_count(c.oid),"
+					" pg_stat_get_last_autovacuum_time(c.oid),"
+					" pg_stat_get_autovacuum_count(c.oid),"
+					" pg_stat_get_last_analyze_time(c.oid),"
+					" pg_stat_get_analyze_count(c.oid),"
+					" pg_stat_get_last_autoanalyze_time(c.oid),"
+					" pg_stat_get_autoanalyze_count(c.oid)"
+					" FROM pg_class c, pg_database d"
+					" WHERE d.datname = current_database()"
+					" AND c.relkind IN ('r', 'i', 'm', 't')",
+					mod_since_analyze);
+}
+
+/* Send the query of the collection to a connected remote server */
+static void
+powa_remote_send(PowaRemoteServer * srv, PowaRemoteState * state)
+{
+	const char *params[2];
+	char	   *query;
+	int			nparams;
+	int			version = PQserverVersion(srv->conn);
+	int			ret;
+
+	if (state->kind == POWA_REMOTE_STATEMENTS)
+	{
+		query = powa_remote_statements_query(version);
+		params[0] = state->ignore_regexp;
+		params[1] = state->ignored_users;
+		nparams = 2;
+	}
+	else
+	{
+		query = powa_remote_relations_query(version);
+		nparams = 0;
+	}
+
+	if (PQsetnonblocking(srv->conn, 1) != 0 ||
+		!PQsendQueryParams(srv->conn, query, nparams, NULL,
+						   (nparams > 0) ? params : NULL, NULL, NULL, 0))
+	{
+		pfree(query);
+		powa_remote_fail(srv, PQerrorMessage(srv->conn));
+		return;
+	}
+	pfree(query);
+
+	ret = PQflush(srv->conn);
+	if (ret < 0)
+	{
+		powa_remote_fail(srv, PQerrorMessage(srv->conn));
+		return;
+	}
+
+	srv->status = POWA_REMOTE_QUERYING;
+	srv->flushing = (ret > 0);
+}
+
+/* Make progress on a remote server whose socket is ready */
+static void
+powa_remote_advance(PowaRemoteServer * srv, PowaRemoteState * state)
+{
+	if (srv->status == POWA_REMOTE_CONNECTING)
+	{
+		srv->polling = PQconnectPoll(srv->conn);
+
+		if (srv->polling == PGRES_POLLING_FAILED)
+			powa_remote_fail(srv, PQerrorMessage(srv->conn));
+		else if (srv->polling == PGRES_POLLING_OK)
+			powa_remote_send(srv, state);
+
+		return;
+	}
+
+	Assert(srv->status == POWA_REMOTE_QUERYING);
+
+	if (srv->flushing)
+	{
+		int			ret = PQflush(srv->conn);
+
+		if (ret < 0)
+		{
+			powa_remote_fail(srv, PQerrorMessage(srv->conn));
+			return;
+		}
+		srv->flushing = (ret > 0);
+	}
+
+	if (!PQconsumeInput(srv->conn))
+	{
+		powa_remote_fail(srv, PQerrorMessage(srv->conn));
+		return;
+	}
+
+	while (!PQisBusy(srv->conn))
+	{
+		srv->res = PQgetResult(srv->conn);
+
+		/* all the results were received */
+		if (srv->res == NULL)
+		{
+			PQfinish(srv->conn);
+			srv->conn = NULL;
+			srv->status = POWA_REMOTE_DONE;
+			return;
+		}
+
+		if (PQresultStatus(srv->res) != PGRES_TUPLES_OK)
+		{
+			powa_remote_fail(srv, PQresultErrorMessage(srv->res));
+			return;
+		}
+
+		powa_remote_store(srv, state);
+	}
+}
+
+/* Store the rows of a remote server result in the tuplestore */
+static void
+powa_remote_store(PowaRemoteServer * srv, PowaRemoteState * state)
+{
+	PGresult   *res = srv->res;
+	int			natts = state->attinmeta->tupdesc->natts;
+	int			ntuples = PQntuples(res);
+	char		srvid[12];
+	char	  **values;
+	int			i;
+	int			j;
+
+	/* the server id is the first column */
+	if (PQnfields(res) != natts - 1)
+	{
+		powa_remote_fail(srv, "unexpected number of columns");
+		return;
+	}
+
+	snprintf(srvid, sizeof(srvid), "%d", srv->srvid);
+	values = palloc(sizeof(char *) * natts);
+	values[0] = srvid;
+
+	for (i = 0; i < ntuples; i++)
+	{
+		MemoryContext oldcxt;
+
+		for (j = 1; j < natts; j++)
+			values[j] = PQgetisnull(res, i, j - 1) ? NULL :
+				PQgetvalue(res, i, j - 1);
+
+		oldcxt = MemoryContextSwitchTo(state->rowcxt);
+		tuplestore_puttuple(state->tupstore,
+							BuildTupleFromCStrings(state->attinmeta, values));
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(state->rowcxt);
+	}
+
+	pfree(values);
+	PQclear(res);
+	srv->res = NULL;
+}
+
+/*
+ * Give up on a remote server, after reporting why.  reason can point to
+ * memory owned by the connection or the result.
+ */
+static void
+powa_remote_fail(PowaRemoteServer * srv, const char *reason)
+{
+	ereport(WARNING,
+			(errmsg("could not collect remote server %d (%s:%s, database %s)",
+					srv->srvid, srv->hostname, srv->port, srv->dbname),
+			 errdetail_internal("%s", reason)));
+
+	if (srv->res != NULL)
+		PQclear(srv->res);
+	srv->res = NULL;
+	if (srv->conn != NULL)
+		PQfinish(srv->conn);
+	srv->conn = NULL;
+	srv->status = POWA_REMOTE_DONE;
+}
+
+/* Release the libpq resources of all the remote servers */
+static void
+powa_remote_finish(PowaRemoteServer * servers, int nservers)
+{
+	int			i;
+
+	for (i = 0; i < nservers; i++)
+	{
+		if (servers[i].res != NULL)
+			PQclear(servers[i].res);
+		servers[i].res = NULL;
+		if (servers[i].conn != NULL)
+			PQfinish(servers[i].conn);
+		servers[i].conn = NULL;
+		servers[i].status = POWA_REMOTE_DONE;
+	}
 }
@@ -0,0 +1,80 @@
+# Check that powa_current_check_lost() notices the unlogged *_current tables
+# emptied by a crash restart, which doesn't change pg_postmaster_start_time(),
+# and not only by a full restart.
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf('postgresql.conf', q{
+shared_preload_libraries = 'pg_stat_statements, powa'
+powa.frequency = -1
+powa.coalesce = 100
+powa.unlogged_current = on
+restart_after_crash = on
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION powa CASCADE');
+
+# take a few snapshots, so that the coalesce window is started
+$node->safe_psql('postgres', 'SELECT powa_take_snapshot()') for (1 .. 3);
+
+is($node->safe_psql('postgres',
+		'SELECT count(*) > 0 FROM powa_statements_history_current_db'),
+	't', 'the current tables have records');
+is($node->safe_psql('postgres', 'SELECT powa_current_check_lost()'),
+	'f', 'nothing lost before the crash');
+
+my $start_time = $node->safe_psql('postgres',
+	'SELECT pg_postmaster_start_time()');
+my $shmem_time = $node->safe_psql('postgres',
+	'SELECT powa_shmem_startup_time()');
+
+# kill a child process, so the postmaster reinitializes the shared memory
+my $pid = $node->safe_psql('postgres',
+	"SELECT pid FROM pg_stat_activity WHERE backend_type = 'checkpointer'");
+kill 'KILL', $pid;
+
+$node->poll_query_until('postgres', 'SELECT pg_is_in_recovery()', 'f')
+  or die 'timed out waiting for the crash restart';
+
+is($node->safe_psql('postgres', 'SELECT pg_postmaster_start_time()'),
+	$start_time, 'the postmaster was not restarted');
+isnt($node->safe_psql('postgres', 'SELECT powa_shmem_startup_time()'),
+	$shmem_time, 'the shared memory was reinitialized');
+is($node->safe_psql('postgres',
+		'SELECT count(*) FROM powa_statements_history_current_db'),
+	'0', 'the current tables were emptied');
+
+is($node->safe_psql('postgres', 'SELECT powa_current_check_lost()'),
+	't', 'the loss is detected after a crash restart');
+is($node->safe_psql('postgres',
+		"SELECT nextval('powa_coalesce_sequence')"
+		  . " % current_setting('powa.coalesce')::bigint"),
+	'1', 'a new coalesce window is started');
+is($node->safe_psql('postgres', 'SELECT powa_current_check_lost()'),
+	'f', 'the loss is only reported once');
+
+# a clean restart keeps the unlogged tables
+$node->safe_psql('postgres', 'SELECT powa_take_snapshot()') for (1 .. 3);
+$node->restart;
+
+is($node->safe_psql('postgres', 'SELECT powa_current_check_lost()'),
+	'f', 'nothing lost after a clean restart');
+
+# but not an immediate shutdown, followed by a full restart
+$node->stop('immediate');
+$node->start;
+
+is($node->safe_psql('postgres', 'SELECT powa_current_check_lost()'),
+	't', 'the loss is detected after a full restart');
+
+$node->stop;
+
+done_testing();
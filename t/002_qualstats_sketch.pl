@@ -0,0 +1,110 @@
+# Check that the constant values kept by the collector sketches, for
+# powa.qualstats_sketch_size, are aggregated with the most filtering values
+# in decreasing filter ratio order and the least filtering ones in increasing
+# order, like powa_qualstats_aggregate_constvalues_current does.  The
+# sketches only exist in the collector, so they can't be tested from
+# pg_regress.
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+
+if (!-e $node->config_data('--sharedir') . '/extension/pg_qualstats.control')
+{
+	plan skip_all => 'pg_qualstats is not installed';
+}
+
+$node->init;
+$node->append_conf('postgresql.conf', q{
+shared_preload_libraries = 'pg_stat_statements, pg_qualstats, powa'
+pg_qualstats.sample_rate = 1
+powa.frequency = 5s
+powa.coalesce = 5
+powa.qualstats_sketch_size = 10
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE DATABASE powa');
+$node->safe_psql('powa', 'CREATE EXTENSION pg_qualstats');
+$node->safe_psql('powa', 'CREATE EXTENSION powa CASCADE');
+
+# the value v is there 100 * v times, so each value filters a different ratio
+# of the rows
+$node->safe_psql('powa', q{
+CREATE TABLE sketch_data AS
+SELECT v AS val
+FROM generate_series(1, 10) v, generate_series(1, 100 * v);
+});
+
+# restart to start the collector, now that the repository exists
+$node->restart;
+
+# The sketches are used once a first aggregate emptied the current table, so
+# keep the workload running until a second aggregate stored their values.
+my $workload = join(';',
+	map { "SELECT count(*) FROM sketch_data WHERE val = $_" } (1 .. 10));
+my $sketched = 0;
+my $done = 0;
+
+for (my $i = 0; $i < $PostgreSQL::Test::Utils::timeout_default; $i++)
+{
+	$node->safe_psql('powa', $workload);
+
+	# the sketch is used if the quals are captured but not their values
+	$sketched = 1 if $node->safe_psql('powa', q{
+		SELECT count(*) > 0
+		FROM powa_qualstats_constvalues_history
+		WHERE EXISTS (SELECT 1 FROM powa_qualstats_quals_history_current)
+		AND NOT EXISTS (SELECT 1 FROM powa_qualstats_constvalues_history_current)
+	}) eq 't';
+
+	if ($sketched
+		&& $node->safe_psql('powa',
+			'SELECT count(DISTINCT coalesce_range) >= 2'
+			  . ' FROM powa_qualstats_constvalues_history') eq 't')
+	{
+		$done = 1;
+		last;
+	}
+
+	sleep(1);
+}
+
+ok($sketched, 'the values were kept in the sketches');
+ok($done, 'the sketches were aggregated');
+
+is($node->safe_psql('powa', q{
+	SELECT count(*) > 0
+	FROM powa_qualstats_constvalues_history
+	WHERE array_length(most_filtering, 1) >= 2
+	AND array_length(least_filtering, 1) >= 2
+}), 't', 'the lists have several values');
+
+foreach my $test (['most_filtering', '>', 'decreasing'],
+	['least_filtering', '<', 'increasing'])
+{
+	my ($list, $op, $order) = @$test;
+
+	is($node->safe_psql('powa', qq{
+		SELECT count(*)
+		FROM powa_qualstats_constvalues_history h,
+		LATERAL unnest(h.$list) WITH ORDINALITY
+			AS a(constants, occurences, execution_count, nbfiltered, i),
+		LATERAL unnest(h.$list) WITH ORDINALITY
+			AS b(constants, occurences, execution_count, nbfiltered, i)
+		WHERE b.i = a.i + 1
+		AND CASE WHEN b.execution_count = 0 THEN 0
+			ELSE b.nbfiltered / b.execution_count::numeric END
+			$op CASE WHEN a.execution_count = 0 THEN 0
+			ELSE a.nbfiltered / a.execution_count::numeric END
+	}), '0', "$list is in $order filter ratio order");
+}
+
+$node->stop;
+
+done_testing();
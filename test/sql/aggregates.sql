@@ -0,0 +1,88 @@
+-- The min, max, records and block aggregates must give the same results
+-- whether they run in parallel or not.
+SET client_min_messages = warning;
+CREATE EXTENSION IF NOT EXISTS powa CASCADE;
+RESET client_min_messages;
+SET timezone = 'UTC';
+
+-- not temporary, so the parallel workers can read it
+CREATE TABLE agg_recs AS
+SELECT i AS id, ROW(
+    '2020-01-01 00:00:00+00'::timestamptz + i * interval '1 minute',
+    (i * 7919) % 10007,
+    ((i * 104729) % 100003) / 8.0,
+    CASE WHEN i % 100 = 0 THEN NULL ELSE -i END,
+    NULL,
+    i % 17, 0, 1, 0, 0, 0, 0,
+    CASE WHEN i < 5000 THEN i END,
+    (i * 31) % 1000 - 500,
+    CASE WHEN i % 2 = 0 THEN -i * 0.5 END,
+    NULL
+)::powa_statements_history_record AS r
+FROM generate_series(1, 10000) i;
+
+ANALYZE agg_recs;
+
+SET max_parallel_workers_per_gather = 0;
+
+CREATE TEMPORARY TABLE agg_expected AS
+SELECT ROW(min((r).ts), min((r).calls), min((r).total_time), min((r).rows),
+        min((r).shared_blks_hit), min((r).shared_blks_read),
+        min((r).shared_blks_dirtied), min((r).shared_blks_written),
+        min((r).local_blks_hit), min((r).local_blks_read),
+        min((r).local_blks_dirtied), min((r).local_blks_written),
+        min((r).temp_blks_read), min((r).temp_blks_written),
+        min((r).blk_read_time), min((r).blk_write_time)
+    )::powa_statements_history_record AS mins,
+    ROW(max((r).ts), max((r).calls), max((r).total_time), max((r).rows),
+        max((r).shared_blks_hit), max((r).shared_blks_read),
+        max((r).shared_blks_dirtied), max((r).shared_blks_written),
+        max((r).local_blks_hit), max((r).local_blks_read),
+        max((r).local_blks_dirtied), max((r).local_blks_written),
+        max((r).temp_blks_read), max((r).temp_blks_written),
+        max((r).blk_read_time), max((r).blk_write_time)
+    )::powa_statements_history_record AS maxs,
+    array_agg(r ORDER BY (r).ts) AS recs
+FROM agg_recs;
+
+SELECT s.mins::text = e.mins::text AS min,
+    s.maxs::text = e.maxs::text AS max,
+    (SELECT array_agg(x ORDER BY (x).ts) FROM unnest(s.recs) x)::text
+        = e.recs::text AS records,
+    s.block::powa_statements_history_record[]::text = e.recs::text AS block
+FROM (SELECT powa_statements_history_record_min(r) AS mins,
+        powa_statements_history_record_max(r) AS maxs,
+        powa_records_agg(r) AS recs,
+        powa_statements_history_block_agg(r) AS block
+    FROM agg_recs) s, agg_expected e;
+
+-- force a parallel plan
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+EXPLAIN (COSTS OFF)
+SELECT powa_statements_history_record_min(r),
+    powa_statements_history_record_max(r),
+    powa_records_agg(r),
+    powa_statements_history_block_agg(r)
+FROM agg_recs;
+
+SELECT s.mins::text = e.mins::text AS min,
+    s.maxs::text = e.maxs::text AS max,
+    (SELECT array_agg(x ORDER BY (x).ts) FROM unnest(s.recs) x)::text
+        = e.recs::text AS records,
+    s.block::powa_statements_history_record[]::text = e.recs::text AS block
+FROM (SELECT powa_statements_history_record_min(r) AS mins,
+        powa_statements_history_record_max(r) AS maxs,
+        powa_records_agg(r) AS recs,
+        powa_statements_history_block_agg(r) AS block
+    FROM agg_recs) s, agg_expected e;
+
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+
+DROP TABLE agg_recs;
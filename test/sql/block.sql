@@ -0,0 +1,74 @@
+-- The columnar history blocks must give back exactly the records they were
+-- built from, sorted by timestamp.
+SET client_min_messages = warning;
+CREATE EXTENSION IF NOT EXISTS powa CASCADE;
+RESET client_min_messages;
+SET timezone = 'UTC';
+SET datestyle = 'ISO, YMD';
+
+-- an irregular series, with NULLs and special float values
+CREATE TEMPORARY TABLE recs AS
+SELECT i, ROW(
+    '2020-01-01 00:00:00+00'::timestamptz + i * interval '5 minutes'
+        + CASE WHEN i % 7 = 0 THEN interval '1.5 seconds' ELSE interval '0' END,
+    i * 10,
+    CASE WHEN i = 40 THEN 'NaN'::float8
+        WHEN i = 60 THEN '-0'::float8
+        ELSE i * 0.125 END,
+    CASE WHEN i % 10 = 3 THEN NULL ELSE i * i END,
+    9223372036854775807 - i,
+    -1000 * i,
+    0,
+    NULL,
+    i % 3, 0, 0, 0,
+    (i * 7919) % 1000,
+    -9223372036854775807 + i * i,
+    CASE WHEN i % 2 = 0 THEN -1.5 * i ELSE 1e300 END,
+    CASE WHEN i = 50 THEN NULL
+        WHEN i > 90 THEN '-Infinity'::float8
+        ELSE 0.1 * i END
+)::powa_statements_history_record AS r
+FROM generate_series(0, 99) i;
+
+CREATE TEMPORARY TABLE blocks AS
+SELECT powa_statements_history_block(array_agg(r ORDER BY i DESC)) AS b,
+    array_agg(r ORDER BY i) AS a
+FROM recs;
+
+SELECT b::powa_statements_history_record[]::text = a::text AS round_trip
+FROM blocks;
+
+SELECT powa_statements_history_block_count(b) AS count,
+    powa_statements_history_block_first(b)::text = a[1]::text AS first,
+    powa_statements_history_block_last(b)::text = a[100]::text AS last
+FROM blocks;
+
+SELECT (SELECT array_agg(u)::text FROM unnest(b) u) = a::text AS unnest
+FROM blocks;
+
+SELECT b::text::powa_statements_history_block::powa_statements_history_record[]::text
+    = a::text AS text_round_trip
+FROM blocks;
+
+SELECT r.ts, r.calls, r.total_time, r.rows, r.blk_read_time, r.blk_write_time
+FROM blocks, unnest(b) r
+WHERE r.ts < '2020-01-01 00:20:00+00' OR r.ts > '2020-01-01 08:10:00+00'
+    OR r.total_time = 'NaN' OR r.blk_write_time IS NULL
+ORDER BY r.ts;
+
+-- a regular series is much smaller than the array
+SELECT pg_column_size(powa_statements_history_block(a)) * 4 < pg_column_size(a) AS smaller
+FROM (SELECT array_agg(ROW(
+        '2020-01-01 00:00:00+00'::timestamptz + i * interval '5 minutes',
+        i * 10, i * 1.5, i * 20, i * 100, i, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    )::powa_statements_history_record ORDER BY i) AS a
+    FROM generate_series(0, 99) i) s;
+
+SELECT powa_statements_history_block_count(b) AS count,
+    powa_statements_history_block_first(b) IS NULL AS first,
+    b::powa_statements_history_record[] AS records
+FROM (SELECT '{}'::powa_statements_history_record[]::powa_statements_history_block AS b) s;
+
+SELECT powa_statements_history_block(ARRAY[NULL]::powa_statements_history_record[]);
+
+SELECT '\x00'::text::powa_statements_history_block;
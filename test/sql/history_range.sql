@@ -0,0 +1,76 @@
+-- powa_statements_history_range() must compute the rates of each bucket from
+-- both the coalesced blocks and the samples not coalesced yet.
+SET client_min_messages = warning;
+CREATE EXTENSION IF NOT EXISTS powa CASCADE;
+RESET client_min_messages;
+SET timezone = 'UTC';
+SET datestyle = 'ISO, YMD';
+
+-- a sample per minute, with a constant rate of calls and runtime
+CREATE TEMPORARY TABLE range_recs AS
+SELECT k, ROW(
+    '2020-01-01 00:00:00+00'::timestamptz + k * interval '1 minute',
+    60 * k, 90 * k, 60 * k * k, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+)::powa_statements_history_record AS r
+FROM generate_series(0, 9) k;
+
+-- the first five coalesced, the others still in the current table
+INSERT INTO powa_statements_history
+SELECT 4242, 1, 10, tstzrange(min((r).ts), max((r).ts), '[]'),
+    powa_statements_history_block(array_agg(r)),
+    powa_statements_history_record_min(r),
+    powa_statements_history_record_max(r)
+FROM range_recs
+WHERE k < 5;
+
+INSERT INTO powa_statements_history_current
+SELECT 4242, 1, 10, r
+FROM range_recs
+WHERE k >= 5;
+
+INSERT INTO powa_statements_history_current
+SELECT 4343, 1, 10, r
+FROM range_recs;
+
+SELECT queryid, ts, (rate).sec, (rate).calls_per_sec,
+    (rate).runtime_per_sec, (rate).rows_per_sec
+FROM powa_statements_history_range(ARRAY[4242, 4343],
+    '[2020-01-01 00:00:00+00, 2020-01-01 00:10:00+00)', '5 minutes')
+ORDER BY queryid, ts;
+
+SELECT queryid, ts, (rate).sec, (rate).calls_per_sec,
+    (rate).runtime_per_sec, (rate).rows_per_sec
+FROM powa_statements_history_range(ARRAY[4242],
+    '[2020-01-01 00:02:00+00, 2020-01-01 00:08:00+00)', '2 minutes')
+ORDER BY queryid, ts;
+
+SELECT queryid, ts, (rate).sec, (rate).calls_per_sec,
+    (rate).runtime_per_sec, (rate).rows_per_sec
+FROM powa_statements_history_range(ARRAY[4242],
+    '[2020-01-01 00:04:00+00,)', '5 minutes')
+ORDER BY queryid, ts;
+
+-- a single sample gives no rate
+SELECT queryid, ts, (rate).sec, (rate).calls_per_sec,
+    (rate).runtime_per_sec, (rate).rows_per_sec
+FROM powa_statements_history_range(ARRAY[4242],
+    '[2020-01-01 00:09:00+00, 2020-01-01 00:20:00+00)', '1 minute')
+ORDER BY queryid, ts;
+
+SELECT count(*)
+FROM powa_statements_history_range(ARRAY[4242], 'empty', '1 minute');
+
+SELECT *
+FROM powa_statements_history_range(ARRAY[4242],
+    '[2020-01-01 00:00:00+00, 2020-01-02 00:00:00+00)', '1 month');
+
+SELECT *
+FROM powa_statements_history_range(ARRAY[4242],
+    '[2020-01-01 00:00:00+00, 2020-01-02 00:00:00+00)', '-5 minutes');
+
+SELECT *
+FROM powa_statements_history_range(ARRAY[4242],
+    '(, 2020-01-02 00:00:00+00)', '5 minutes');
+
+DELETE FROM powa_statements_history WHERE queryid = 4242;
+DELETE FROM powa_statements_history_current WHERE queryid IN (4242, 4343);
@@ -0,0 +1,118 @@
+-- The native - and / operators of the statements records must give the same
+-- results as the plpgsql versions they replaced.
+SET client_min_messages = warning;
+CREATE EXTENSION IF NOT EXISTS powa CASCADE;
+RESET client_min_messages;
+SET timezone = 'UTC';
+
+-- the plpgsql versions of powa 3.1.1
+CREATE FUNCTION pg_temp.sql_mi(
+    a powa_statements_history_record,
+    b powa_statements_history_record)
+RETURNS powa_statements_history_diff AS
+$_$
+DECLARE
+    res powa_statements_history_diff;
+BEGIN
+    res.intvl = a.ts - b.ts;
+    res.calls = a.calls - b.calls;
+    res.total_time = a.total_time - b.total_time;
+    res.rows = a.rows - b.rows;
+    res.shared_blks_hit = a.shared_blks_hit - b.shared_blks_hit;
+    res.shared_blks_read = a.shared_blks_read - b.shared_blks_read;
+    res.shared_blks_dirtied = a.shared_blks_dirtied - b.shared_blks_dirtied;
+    res.shared_blks_written = a.shared_blks_written - b.shared_blks_written;
+    res.local_blks_hit = a.local_blks_hit - b.local_blks_hit;
+    res.local_blks_read = a.local_blks_read - b.local_blks_read;
+    res.local_blks_dirtied = a.local_blks_dirtied - b.local_blks_dirtied;
+    res.local_blks_written = a.local_blks_written - b.local_blks_written;
+    res.temp_blks_read = a.temp_blks_read - b.temp_blks_read;
+    res.temp_blks_written = a.temp_blks_written - b.temp_blks_written;
+    res.blk_read_time = a.blk_read_time - b.blk_read_time;
+    res.blk_write_time = a.blk_write_time - b.blk_write_time;
+
+    return res;
+END;
+$_$
+LANGUAGE plpgsql IMMUTABLE STRICT;
+
+CREATE FUNCTION pg_temp.sql_div(
+    a powa_statements_history_record,
+    b powa_statements_history_record)
+RETURNS powa_statements_history_rate AS
+$_$
+DECLARE
+    res powa_statements_history_rate;
+    sec integer;
+BEGIN
+    res.sec = extract(EPOCH FROM (a.ts - b.ts));
+    IF res.sec = 0 THEN
+        sec = 1;
+    ELSE
+        sec = res.sec;
+    END IF;
+    res.calls_per_sec = (a.calls - b.calls)::double precision / sec;
+    res.runtime_per_sec = (a.total_time - b.total_time)::double precision / sec;
+    res.rows_per_sec = (a.rows - b.rows)::double precision / sec;
+    res.shared_blks_hit_per_sec = (a.shared_blks_hit - b.shared_blks_hit)::double precision / sec;
+    res.shared_blks_read_per_sec = (a.shared_blks_read - b.shared_blks_read)::double precision / sec;
+    res.shared_blks_dirtied_per_sec = (a.shared_blks_dirtied - b.shared_blks_dirtied)::double precision / sec;
+    res.shared_blks_written_per_sec = (a.shared_blks_written - b.shared_blks_written)::double precision / sec;
+    res.local_blks_hit_per_sec = (a.local_blks_hit - b.local_blks_hit)::double precision / sec;
+    res.local_blks_read_per_sec = (a.local_blks_read - b.local_blks_read)::double precision / sec;
+    res.local_blks_dirtied_per_sec = (a.local_blks_dirtied - b.local_blks_dirtied)::double precision / sec;
+    res.local_blks_written_per_sec = (a.local_blks_written - b.local_blks_written)::double precision / sec;
+    res.temp_blks_read_per_sec = (a.temp_blks_read - b.temp_blks_read)::double precision / sec;
+    res.temp_blks_written_per_sec = (a.temp_blks_written - b.temp_blks_written)::double precision / sec;
+    res.blk_read_time_per_sec = (a.blk_read_time - b.blk_read_time)::double precision / sec;
+    res.blk_write_time_per_sec = (a.blk_write_time - b.blk_write_time)::double precision / sec;
+
+    return res;
+END;
+$_$
+LANGUAGE plpgsql IMMUTABLE STRICT;
+
+CREATE TEMPORARY TABLE samples (
+    name text,
+    a powa_statements_history_record,
+    b powa_statements_history_record
+);
+
+INSERT INTO samples VALUES
+    ('increase',
+     ('2020-01-01 00:10:00+00', 100, 62.5, 1000, 50, 20, 3, 2, 1, 2, 3, 4, 5, 6, 1.25, 0.5),
+     ('2020-01-01 00:00:00+00', 40, 2.5, 100, 10, 5, 1, 0, 0, 0, 0, 0, 1, 1, 0.25, 0.25)),
+    ('decrease',
+     ('2020-01-01 00:00:00+00', 40, 2.5, 100, 10, 5, 1, 0, 0, 0, 0, 0, 1, 1, 0.25, 0.25),
+     ('2020-01-01 00:10:00+00', 100, 62.5, 1000, 50, 20, 3, 2, 1, 2, 3, 4, 5, 6, 1.25, 0.5)),
+    ('same ts',
+     ('2020-01-01 00:10:00+00', 100, 62.5, 1000, 50, 20, 3, 2, 1, 2, 3, 4, 5, 6, 1.25, 0.5),
+     ('2020-01-01 00:10:00+00', 100, 62.5, 1000, 50, 20, 3, 2, 1, 2, 3, 4, 5, 6, 1.25, 0.5)),
+    ('fraction',
+     ('2020-01-01 00:00:02.4+00', 46, 3.5, 130, 10, 5, 1, 0, 0, 0, 0, 0, 1, 1, 0.25, 0.25),
+     ('2020-01-01 00:00:00+00', 40, 2.5, 100, 10, 5, 1, 0, 0, 0, 0, 0, 1, 1, 0.25, 0.25)),
+    ('long interval',
+     ('2020-01-02 02:00:30+00', 93670, 187262.5, 100, 10, 5, 1, 0, 0, 0, 0, 0, 1, 1, 0.25, 0.25),
+     ('2020-01-01 00:00:00+00', 40, 2.5, 100, 10, 5, 1, 0, 0, 0, 0, 0, 1, 1, 0.25, 0.25)),
+    ('nulls',
+     ('2020-01-01 00:10:00+00', 100, NULL, 1000, 50, 20, 3, 2, 1, 2, 3, 4, 5, 6, NULL, 0.5),
+     ('2020-01-01 00:00:00+00', 40, 2.5, NULL, 10, 5, 1, 0, 0, 0, 0, 0, 1, 1, 0.25, 0.25));
+
+SELECT name,
+    (a - b) IS NOT DISTINCT FROM pg_temp.sql_mi(a, b) AS mi,
+    (a / b) IS NOT DISTINCT FROM pg_temp.sql_div(a, b) AS div
+FROM samples
+ORDER BY name;
+
+SELECT name, (a - b).intvl, (a - b).calls, (a - b).total_time, (a - b).rows
+FROM samples
+ORDER BY name;
+
+SELECT name, (a / b).sec, (a / b).calls_per_sec, (a / b).runtime_per_sec,
+    (a / b).rows_per_sec
+FROM samples
+ORDER BY name;
+
+-- the bigint counters can't silently wrap around
+SELECT (('2020-01-01 00:10:00+00', 9223372036854775807, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)::powa_statements_history_record
+    - ('2020-01-01 00:00:00+00', -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)::powa_statements_history_record).calls;
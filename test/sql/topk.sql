@@ -0,0 +1,65 @@
+-- With powa.top_k, the stored statements and the "other" entry of their
+-- database must still account for the whole activity of the database.
+SET client_min_messages = warning;
+CREATE EXTENSION IF NOT EXISTS powa CASCADE;
+RESET client_min_messages;
+
+SET powa.native_snapshot = on;
+SET powa.top_k = 1;
+
+-- each in its own transaction, so the snapshots get different timestamps
+DO $$ BEGIN PERFORM powa_statements_snapshot(); END $$;
+SELECT count(*) FROM generate_series(1, 100);
+DO $$ BEGIN PERFORM powa_statements_snapshot(); END $$;
+
+CREATE TEMPORARY TABLE topk_ts AS
+SELECT d.oid AS dbid, min((c.record).ts) AS t1, max((c.record).ts) AS t2,
+    count(DISTINCT (c.record).ts) AS nb
+FROM pg_database d
+JOIN powa_statements_history_current_db c ON c.dbid = d.oid
+WHERE d.datname = current_database()
+GROUP BY d.oid;
+
+SELECT nb FROM topk_ts;
+
+-- the "other" entry of the database
+SELECT count(*) AS other
+FROM topk_ts t
+JOIN powa_statements_history_current c ON c.dbid = t.dbid
+WHERE c.queryid = 0 AND c.userid = 0 AND (c.record).ts = t.t2;
+
+SELECT count(*) <= 1 AS kept
+FROM topk_ts t
+JOIN powa_statements_history_current c ON c.dbid = t.dbid
+WHERE c.queryid <> 0 AND (c.record).ts = t.t2;
+
+-- the increase of the stored entries, including the previous samples stored
+-- for the entries entering the top K, is the increase of the database
+WITH db AS (
+    SELECT (c2.record).calls - (c1.record).calls AS calls,
+        (c2.record).rows - (c1.record).rows AS rows,
+        (c2.record).shared_blks_hit - (c1.record).shared_blks_hit AS shared_blks_hit
+    FROM topk_ts t
+    JOIN powa_statements_history_current_db c1
+        ON c1.dbid = t.dbid AND (c1.record).ts = t.t1
+    JOIN powa_statements_history_current_db c2
+        ON c2.dbid = t.dbid AND (c2.record).ts = t.t2
+), entries AS (
+    SELECT sum((c2.record).calls - coalesce((c1.record).calls, 0)) AS calls,
+        sum((c2.record).rows - coalesce((c1.record).rows, 0)) AS rows,
+        sum((c2.record).shared_blks_hit
+            - coalesce((c1.record).shared_blks_hit, 0)) AS shared_blks_hit
+    FROM topk_ts t
+    JOIN powa_statements_history_current c2
+        ON c2.dbid = t.dbid AND (c2.record).ts = t.t2
+    LEFT JOIN powa_statements_history_current c1
+        ON c1.queryid = c2.queryid AND c1.dbid = c2.dbid
+        AND c1.userid = c2.userid AND (c1.record).ts = t.t1
+)
+SELECT db.calls = entries.calls AS calls,
+    db.rows = entries.rows AS rows,
+    db.shared_blks_hit = entries.shared_blks_hit AS shared_blks_hit
+FROM db, entries;
+
+RESET powa.top_k;
+RESET powa.native_snapshot;